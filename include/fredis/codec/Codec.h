@@ -0,0 +1,232 @@
+#pragma once
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <folly/Conv.h>
+#include <folly/ExceptionWrapper.h>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include <folly/Varint.h>
+#include <folly/dynamic.h>
+#include <folly/json.h>
+#include <folly/futures/Try.h>
+#include "fredis/FredisError.h"
+#include "fredis/macros.h"
+
+namespace fredis { namespace codec {
+
+FREDIS_DECLARE_EXCEPTION(CodecError, FredisError);
+
+// how a T is stored as bytes by the typed client APIs. specialize it
+// for your own types:
+//
+//   template<> struct Codec<MyType> {
+//     // append the encoding of `value` to `out`.
+//     static void encode(const MyType &value, folly::fbstring &out);
+//     // `bytes` points into the reply; copy out whatever you keep.
+//     static folly::Try<MyType> decode(folly::StringPiece bytes);
+//   };
+template<typename T, typename Enable = void>
+struct Codec {};
+
+template<typename T>
+class HasCodec {
+  template<typename U>
+  static auto check(int) -> decltype(
+    Codec<U>::encode(std::declval<const U&>(), std::declval<folly::fbstring&>()),
+    Codec<U>::decode(std::declval<folly::StringPiece>()),
+    std::true_type {}
+  );
+
+  template<typename U>
+  static std::false_type check(...);
+ public:
+  static constexpr bool value = decltype(check<T>(0))::value;
+};
+
+namespace detail {
+
+template<typename T>
+folly::Try<T> decodeError(folly::StringPiece what, folly::StringPiece bytes) {
+  return folly::Try<T> {folly::make_exception_wrapper<CodecError>(
+    folly::to<std::string>("couldn't decode ", what, " from ",
+      bytes.size(), " bytes")
+  )};
+}
+
+// appends the encoding of `value` prefixed by its varint length. the value
+// is encoded into `scratch` first so the length can go out ahead of it;
+// reuse one scratch across the elements of a container.
+template<typename T>
+void appendLengthPrefixed(const T &value, folly::fbstring &out,
+    folly::fbstring &scratch) {
+  scratch.clear();
+  Codec<T>::encode(value, scratch);
+  uint8_t varint[folly::kMaxVarintLength64];
+  size_t varintLen = folly::encodeVarint(scratch.size(), varint);
+  out.append((const char*) varint, varintLen);
+  out.append(scratch);
+}
+
+// reads one length-prefixed field off the front of `bytes`.
+inline bool takeLengthPrefixed(folly::StringPiece &bytes,
+    folly::StringPiece &field) {
+  folly::ByteRange range {
+    (const uint8_t*) bytes.data(), bytes.size()
+  };
+  uint64_t length = 0;
+  try {
+    length = folly::decodeVarint(range);
+  } catch (const std::exception&) {
+    return false;
+  }
+  if (length > range.size()) {
+    return false;
+  }
+  field = folly::StringPiece {(const char*) range.data(), (size_t) length};
+  bytes = folly::StringPiece {
+    (const char*) range.data() + length, range.size() - length
+  };
+  return true;
+}
+
+} // detail
+
+// integers and floating point numbers are stored as decimal text, the
+// same way redis stores them, so INCRBY and friends keep working.
+template<typename T>
+struct Codec<T, typename std::enable_if<
+    std::is_arithmetic<T>::value &&
+    !std::is_same<T, bool>::value &&
+    !std::is_same<T, char>::value>::type> {
+  static void encode(const T &value, folly::fbstring &out) {
+    folly::toAppend(value, &out);
+  }
+  static folly::Try<T> decode(folly::StringPiece bytes) {
+    try {
+      return folly::Try<T> {folly::to<T>(bytes)};
+    } catch (const std::exception&) {
+      return detail::decodeError<T>("a number", bytes);
+    }
+  }
+};
+
+template<>
+struct Codec<bool> {
+  static void encode(const bool &value, folly::fbstring &out) {
+    out.push_back(value ? '1' : '0');
+  }
+  static folly::Try<bool> decode(folly::StringPiece bytes) {
+    if (bytes == "1") {
+      return folly::Try<bool> {true};
+    }
+    if (bytes == "0") {
+      return folly::Try<bool> {false};
+    }
+    return detail::decodeError<bool>("a bool", bytes);
+  }
+};
+
+template<>
+struct Codec<folly::fbstring> {
+  static void encode(const folly::fbstring &value, folly::fbstring &out) {
+    out.append(value);
+  }
+  static folly::Try<folly::fbstring> decode(folly::StringPiece bytes) {
+    return folly::Try<folly::fbstring> {bytes.fbstr()};
+  }
+};
+
+template<>
+struct Codec<std::string> {
+  static void encode(const std::string &value, folly::fbstring &out) {
+    out.append(value.data(), value.size());
+  }
+  static folly::Try<std::string> decode(folly::StringPiece bytes) {
+    return folly::Try<std::string> {bytes.str()};
+  }
+};
+
+// stored as JSON.
+template<>
+struct Codec<folly::dynamic> {
+  static void encode(const folly::dynamic &value, folly::fbstring &out) {
+    auto json = folly::toJson(value);
+    out.append(json.data(), json.size());
+  }
+  static folly::Try<folly::dynamic> decode(folly::StringPiece bytes) {
+    try {
+      return folly::Try<folly::dynamic> {folly::parseJson(bytes)};
+    } catch (const std::exception&) {
+      return detail::decodeError<folly::dynamic>("JSON", bytes);
+    }
+  }
+};
+
+// a varint element count, then each element with a varint length prefix.
+template<typename T>
+struct Codec<std::vector<T>,
+    typename std::enable_if<HasCodec<T>::value>::type> {
+  static void encode(const std::vector<T> &values, folly::fbstring &out) {
+    uint8_t varint[folly::kMaxVarintLength64];
+    size_t varintLen = folly::encodeVarint(values.size(), varint);
+    out.append((const char*) varint, varintLen);
+    folly::fbstring scratch;
+    for (const auto &value: values) {
+      detail::appendLengthPrefixed(value, out, scratch);
+    }
+  }
+  static folly::Try<std::vector<T>> decode(folly::StringPiece bytes) {
+    folly::ByteRange range {(const uint8_t*) bytes.data(), bytes.size()};
+    uint64_t count = 0;
+    try {
+      count = folly::decodeVarint(range);
+    } catch (const std::exception&) {
+      return detail::decodeError<std::vector<T>>("a list", bytes);
+    }
+    folly::StringPiece rest {(const char*) range.data(), range.size()};
+    std::vector<T> values;
+    values.reserve(std::min((size_t) count, rest.size()));
+    for (uint64_t i = 0; i < count; i++) {
+      folly::StringPiece field;
+      if (!detail::takeLengthPrefixed(rest, field)) {
+        return detail::decodeError<std::vector<T>>("a list", bytes);
+      }
+      auto decoded = Codec<T>::decode(field);
+      if (decoded.hasException()) {
+        return folly::Try<std::vector<T>> {decoded.exception()};
+      }
+      values.push_back(std::move(decoded.value()));
+    }
+    return folly::Try<std::vector<T>> {std::move(values)};
+  }
+};
+
+// stores a trivially copyable T as its raw bytes. cheap, but the layout
+// and byte order are the writer's, so only use it between identical builds.
+template<typename T>
+struct Flat {
+  static_assert(std::is_trivially_copyable<T>::value,
+    "Flat<T> needs a trivially copyable T");
+  T value;
+};
+
+template<typename T>
+struct Codec<Flat<T>> {
+  static void encode(const Flat<T> &flat, folly::fbstring &out) {
+    out.append((const char*) &flat.value, sizeof(T));
+  }
+  static folly::Try<Flat<T>> decode(folly::StringPiece bytes) {
+    if (bytes.size() != sizeof(T)) {
+      return detail::decodeError<Flat<T>>("a flat struct", bytes);
+    }
+    Flat<T> flat;
+    memcpy(&flat.value, bytes.data(), sizeof(T));
+    return folly::Try<Flat<T>> {flat};
+  }
+};
+
+}} // fredis::codec
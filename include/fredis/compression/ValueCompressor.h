@@ -0,0 +1,147 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include <folly/futures/Try.h>
+#include <folly/io/Compression.h>
+#include "fredis/FredisError.h"
+#include "fredis/macros.h"
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace fredis { namespace compression {
+
+FREDIS_DECLARE_EXCEPTION(CompressionError, FredisError);
+
+// ids written into the value header; never renumber these.
+enum class ValueCodec : uint8_t {
+  NONE = 0, LZ4 = 1, ZSTD = 2, ZSTD_DICT = 3
+};
+
+// a zstd dictionary, digested once for compression and decompression.
+// `id` is written into every value compressed with it, so a dictionary
+// must keep its id for as long as values using it are stored.
+class ZstdDictionary {
+ protected:
+  uint32_t id_ {0};
+  folly::fbstring bytes_;
+  ZSTD_CDict_s *cdict_ {nullptr};
+  ZSTD_DDict_s *ddict_ {nullptr};
+  ZstdDictionary(uint32_t id, folly::fbstring &&bytes, int level);
+  ZstdDictionary(const ZstdDictionary&) = delete;
+  ZstdDictionary& operator=(const ZstdDictionary&) = delete;
+ public:
+  ~ZstdDictionary();
+  static std::shared_ptr<ZstdDictionary> createShared(uint32_t id,
+    folly::fbstring bytes, int level = 3);
+
+  // builds a dictionary of at most `capacity` bytes from sample values;
+  // meant to be run offline against values sampled from production.
+  static folly::Try<folly::fbstring> train(
+    const std::vector<folly::fbstring> &samples, size_t capacity = 112640);
+
+  uint32_t getId() const;
+  const folly::fbstring& getBytes() const;
+  ZSTD_CDict_s* getCompressionDict() const;
+  ZSTD_DDict_s* getDecompressionDict() const;
+};
+
+// how values under one key prefix are compressed.
+class CompressionRule {
+ public:
+  folly::fbstring keyPrefix;
+  ValueCodec codec {ValueCodec::LZ4};
+  int level {folly::io::COMPRESSION_LEVEL_DEFAULT};
+
+  // values shorter than this are stored as-is.
+  size_t minValueBytes {256};
+
+  // required for ZSTD_DICT.
+  std::shared_ptr<ZstdDictionary> dictionary;
+
+  static CompressionRule none(folly::fbstring keyPrefix);
+};
+
+struct CompressionStats {
+  uint64_t valuesCompressed {0};
+  uint64_t valuesStoredRaw {0};
+  uint64_t bytesBeforeCompression {0};
+  uint64_t bytesAfterCompression {0};
+  uint64_t compressMicros {0};
+  uint64_t valuesDecompressed {0};
+  uint64_t decompressMicros {0};
+  uint64_t decodeErrors {0};
+
+  // compressed size over original size, for the values that were compressed.
+  double getRatio() const;
+  folly::fbstring toString() const;
+};
+
+// compresses values on the way into a client and decompresses them on the
+// way out. compressed values start with a short header naming the codec,
+// the original length and (for ZSTD_DICT) the dictionary id, so readers
+// need no configuration beyond the dictionaries. rules and dictionaries
+// should be set up before the compressor is shared between threads.
+class ValueCompressor {
+ public:
+  // redis' own limit on a single string value.
+  static const size_t kDefaultMaxValueBytes = 512 * 1024 * 1024;
+ protected:
+  // keyed by prefix; the longest matching prefix wins.
+  std::map<folly::fbstring, CompressionRule> rules_;
+  CompressionRule defaultRule_;
+  std::map<uint32_t, std::shared_ptr<ZstdDictionary>> dictionaries_;
+  size_t maxValueBytes_ {kDefaultMaxValueBytes};
+
+  std::atomic<uint64_t> valuesCompressed_ {0};
+  std::atomic<uint64_t> valuesStoredRaw_ {0};
+  std::atomic<uint64_t> bytesBeforeCompression_ {0};
+  std::atomic<uint64_t> bytesAfterCompression_ {0};
+  std::atomic<uint64_t> compressMicros_ {0};
+  std::atomic<uint64_t> valuesDecompressed_ {0};
+  std::atomic<uint64_t> decompressMicros_ {0};
+  std::atomic<uint64_t> decodeErrors_ {0};
+
+  ValueCompressor();
+  const CompressionRule& ruleForKey(folly::StringPiece key) const;
+  folly::fbstring storeRaw(folly::StringPiece value);
+ public:
+  static std::shared_ptr<ValueCompressor> createShared();
+
+  // applies to keys with no more specific rule; defaults to no compression.
+  void setDefaultRule(const CompressionRule &rule);
+  void addRule(const CompressionRule &rule);
+
+  // dictionaries used by rules are registered automatically; readers that
+  // never write with a dictionary still need it added to decode.
+  void addDictionary(std::shared_ptr<ZstdDictionary> dictionary);
+
+  // decode() refuses values whose header claims a larger original size,
+  // since the header comes from whatever is stored in the cache.
+  void setMaxValueBytes(size_t maxValueBytes);
+  size_t getMaxValueBytes() const;
+
+  // the bytes to store for `value` under `key`.
+  folly::fbstring encode(folly::StringPiece key, folly::StringPiece value);
+
+  // true if `stored` carries a header and has to go through decode().
+  bool isEncoded(folly::StringPiece stored) const;
+
+  // the original value; `stored` values without a header come back as-is.
+  folly::Try<folly::fbstring> decode(folly::StringPiece stored);
+
+  CompressionStats getStats() const;
+};
+
+namespace detail {
+folly::io::CodecType follyCodecTypeOf(ValueCodec codec);
+const char* stringOfValueCodec(ValueCodec codec);
+}
+
+}} // fredis::compression
@@ -0,0 +1,58 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include "fredis/memcached/MemcachedConfig.h"
+
+namespace fredis { namespace memcached {
+
+struct HotKeyStats {
+  size_t listedKeys {0};
+  size_t detectedKeys {0};
+  // gets sent to a copy other than the one on the key's own server.
+  uint64_t replicaReads {0};
+  // of those, the ones that missed and went to the key's own server.
+  uint64_t replicaMisses {0};
+  // copies refilled after a replica miss.
+  uint64_t repairs {0};
+  // copies deleted because a write only went to the key's own server, a
+  // replicated write failed, or the key stopped being hot.
+  uint64_t invalidations {0};
+};
+
+// decides which keys are hot, per a HotKeyOptions: the listed ones, plus
+// any read often enough in the current window. not thread-safe.
+class HotKeyTracker {
+ public:
+  using time_point = std::chrono::steady_clock::time_point;
+ protected:
+  HotKeyOptions options_;
+  std::unordered_set<folly::StringPiece, folly::StringPieceHash> listed_;
+  std::unordered_set<folly::fbstring> detected_;
+  // sampled reads of each key in the current window.
+  std::unordered_map<folly::fbstring, uint32_t> counts_;
+  time_point windowStart_;
+  uint64_t reads_ {0};
+
+  void closeWindow(time_point now, std::vector<folly::fbstring> &cooled);
+ public:
+  explicit HotKeyTracker(const HotKeyOptions &options);
+  HotKeyTracker(const HotKeyTracker&) = delete;
+  HotKeyTracker& operator=(const HotKeyTracker&) = delete;
+
+  bool isHot(folly::StringPiece key) const;
+
+  // counts a read of `key`. if that ends a window, the detected keys that
+  // weren't read enough in it stop being hot and are added to `cooled`.
+  void recordRead(folly::StringPiece key, time_point now,
+    std::vector<folly::fbstring> &cooled);
+
+  size_t getListedCount() const;
+  size_t getDetectedCount() const;
+};
+
+}} // fredis::memcached
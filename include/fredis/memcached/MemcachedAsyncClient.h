@@ -0,0 +1,229 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/Unit.h>
+#include <folly/io/async/EventBase.h>
+#include "fredis/memcached/MemcachedConfig.h"
+#include "fredis/memcached/MemcachedConnection.h"
+#include "fredis/memcached/HotKeyTracker.h"
+#include "fredis/stats/StatsRegistry.h"
+#include "fredis/compression/ValueCompressor.h"
+
+namespace fredis { namespace memcached {
+
+// the futures counterpart of MemcachedSyncClient: one pipelined connection
+// per configured server, all on one EventBase, so commands to different
+// servers overlap instead of queueing behind each other. keys go to the same
+// servers libmemcached's default distribution would pick, so the two
+// clients can share a cluster. hot keys in the config's HotKeyOptions are
+// replicated: reads of them go to a random copy (falling back to the key's
+// own server on a miss), set() and touch() go to every copy, and other
+// writes go to the key's own server and delete the rest. gets(), cas
+// tokens, multiGet() and the meta commands only use the key's own server.
+// every client writing to the cluster must use the same HotKeyOptions.
+// a key only one client detected hot still has its copies deleted by
+// other clients' writes, since with detection on every write to a key
+// deletes its copies; a copy can then only be stale when a read's refill
+// races a write, and for at most repairTtl.
+// use it on its EventBase thread only.
+class MemcachedAsyncClient:
+    public std::enable_shared_from_this<MemcachedAsyncClient> {
+ protected:
+  folly::EventBase *base_ {nullptr};
+  MemcachedConfig config_;
+  std::vector<std::unique_ptr<MemcachedConnection>> connections_;
+  std::shared_ptr<stats::StatsRegistry> stats_;
+  std::shared_ptr<compression::ValueCompressor> compressor_;
+
+  bool replicateHotKeys_ {false};
+  HotKeyTracker hotKeys_;
+  std::mt19937 replicaEngine_;
+  HotKeyStats hotKeyStats_;
+
+  MemcachedAsyncClient(folly::EventBase *base, const MemcachedConfig &config);
+  MemcachedAsyncClient(const MemcachedAsyncClient&) = delete;
+  MemcachedAsyncClient& operator=(const MemcachedAsyncClient&) = delete;
+
+  MemcachedConnection& connectionForKey(folly::StringPiece key);
+
+  // sends `encoded` to the server that owns `key` and records the command
+  // into the stats registry once its reply arrives.
+  folly::Future<MemcachedReply> send(folly::StringPiece command,
+    folly::StringPiece key, folly::fbstring &&encoded, ReplyShape shape);
+  folly::Future<MemcachedReply> sendTo(MemcachedConnection &conn,
+    folly::StringPiece command, folly::fbstring &&encoded, ReplyShape shape,
+    MemcachedConnection::value_callback_t onValue);
+
+  // hot-key replication. copy 0 is on the key's own server.
+  size_t replicaCount() const;
+  bool isHotKey(folly::StringPiece key) const;
+  // true if any client sharing the config could have copies of `key`;
+  // writes to such keys delete the copies they don't update.
+  bool mayBeReplicated(folly::StringPiece key) const;
+  MemcachedConnection& replicaConnection(folly::StringPiece key,
+    size_t replica);
+  // counts a read toward hot-key detection.
+  void noteRead(folly::StringPiece key);
+  folly::Future<folly::Optional<folly::fbstring>> getFrom(
+    MemcachedConnection &conn, folly::StringPiece key);
+  folly::Future<folly::Optional<folly::fbstring>> getReplicated(
+    folly::StringPiece key);
+  // deletes every copy but the one on the key's own server, without
+  // waiting for the replies.
+  void invalidateReplicas(folly::StringPiece key);
+
+  folly::fbstring encodeStore(folly::StringPiece command,
+    folly::StringPiece key, folly::StringPiece value, time_t ttl,
+    uint64_t casToken, bool compress);
+
+  // set, add, replace, append or cas; a zero `casToken` is left off.
+  folly::Future<MemcachedReply> store(folly::StringPiece command,
+    folly::StringPiece key, folly::StringPiece value, time_t ttl,
+    uint64_t casToken, bool compress);
+
+  // incr or decr; none if the key doesn't exist.
+  folly::Future<folly::Optional<uint64_t>> arithmetic(bool increment,
+    folly::StringPiece key, uint64_t delta);
+  folly::Future<uint64_t> counter(bool increment, folly::StringPiece key,
+    uint64_t delta, uint64_t initial, time_t ttl);
+
+  // the most keys sent in a single get command.
+  static const size_t kMaxKeysPerGet = 100;
+ public:
+  static std::shared_ptr<MemcachedAsyncClient> createShared(
+    folly::EventBase *base, const MemcachedConfig &config);
+
+  const MemcachedConfig& getConfig() const;
+  folly::EventBase* getEventBase() const;
+
+  // connects to every server. commands sent before this resolves (or
+  // without calling it at all) wait for their server's connection.
+  // of the config's behaviors only connectTimeout and pollTimeout apply
+  // here: a server with requests waiting that sends nothing back for
+  // pollTimeout is disconnected, failing them with RequestTimeout.
+  // connecting fails if the distribution isn't modula.
+  folly::Future<folly::Unit> connect();
+
+  void setStatsRegistry(std::shared_ptr<stats::StatsRegistry>);
+  std::shared_ptr<stats::StatsRegistry> getStatsRegistry() const;
+  stats::StatsSnapshot getStats();
+  HotKeyStats getHotKeyStats() const;
+
+  // as in MemcachedSyncClient.
+  void setValueCompressor(std::shared_ptr<compression::ValueCompressor>);
+  std::shared_ptr<compression::ValueCompressor> getValueCompressor() const;
+
+  // resolves to none on a miss.
+  folly::Future<folly::Optional<folly::fbstring>> get(folly::StringPiece key);
+  folly::Future<folly::Unit> set(folly::StringPiece key,
+    folly::StringPiece value, time_t ttl = 0);
+
+  // resolves to false if the key didn't exist.
+  folly::Future<bool> del(folly::StringPiece key);
+
+  // as get(), along with the cas token to pass to cas().
+  folly::Future<folly::Optional<MemcachedValue>> gets(folly::StringPiece key);
+
+  // stores `value` only if the item hasn't changed since `casToken` was
+  // read with gets().
+  folly::Future<CasResult> cas(folly::StringPiece key,
+    folly::StringPiece value, uint64_t casToken, time_t ttl = 0);
+
+  // add stores only if the key is missing, replace only if it exists, and
+  // append only if it exists; each resolves to false when it didn't store.
+  // append fails with ConfigurationError when the client has a compressor,
+  // since raw bytes after a compressed value would corrupt it.
+  folly::Future<bool> add(folly::StringPiece key, folly::StringPiece value,
+    time_t ttl = 0);
+  folly::Future<bool> replace(folly::StringPiece key,
+    folly::StringPiece value, time_t ttl = 0);
+  folly::Future<bool> append(folly::StringPiece key,
+    folly::StringPiece value);
+
+  // atomic counters, stored as decimal strings and never compressed. these
+  // resolve to the new value, or none if the counter doesn't exist. decr
+  // stops at zero.
+  folly::Future<folly::Optional<uint64_t>> incr(folly::StringPiece key,
+    uint64_t delta);
+  folly::Future<folly::Optional<uint64_t>> decr(folly::StringPiece key,
+    uint64_t delta);
+
+  // as above, but a missing counter is created at `initial`, expiring after
+  // `ttl`; the ttl of an existing counter is left alone. the text protocol
+  // has no incr-or-create, so a miss costs a second round trip for an add.
+  folly::Future<uint64_t> incr(folly::StringPiece key, uint64_t delta,
+    uint64_t initial, time_t ttl);
+  folly::Future<uint64_t> decr(folly::StringPiece key, uint64_t delta,
+    uint64_t initial, time_t ttl);
+
+  // resolves to false if the key doesn't exist.
+  folly::Future<bool> touch(folly::StringPiece key, time_t ttl);
+
+  struct CounterUpdate {
+    folly::fbstring key;
+    // negative deltas decrement.
+    int64_t delta {0};
+    uint64_t initial {0};
+    time_t ttl {0};
+  };
+
+  // applies many counter updates at once: every update to a server goes out
+  // in the same write, and all servers are written to at once. resolves to
+  // the new values, in order.
+  folly::Future<std::vector<uint64_t>> applyCounters(
+    const std::vector<CounterUpdate> &updates);
+
+  // as applyCounters(), but sent with noreply so the server doesn't answer
+  // each one. missing counters aren't created (there's no reply to say
+  // they're missing) and errors go unreported. resolves once every server
+  // involved has read its updates.
+  folly::Future<folly::Unit> applyCountersNoReply(
+    const std::vector<CounterUpdate> &updates);
+
+  // fetches many keys with one round trip per server, all servers at once.
+  // resolves to the keys that were found, or fails if any server does.
+  using multi_get_map_t = std::unordered_map<folly::fbstring, folly::fbstring>;
+  folly::Future<multi_get_map_t> multiGet(
+    const std::vector<folly::StringPiece> &keys);
+
+  template<typename TKeys>
+  folly::Future<multi_get_map_t> multiGet(const TKeys &keys) {
+    return multiGet(std::vector<folly::StringPiece> {
+      std::begin(keys), std::end(keys)
+    });
+  }
+
+  // as multiGet(), but each hit goes to `onHit` as soon as its server's
+  // reply has it, so work can start before the slowest server answers.
+  // resolves once every server has finished. if a value can't be decoded
+  // or `onHit` throws, later hits are dropped and the future fails with
+  // that error once every server has finished.
+  using hit_callback_t = std::function<void (folly::StringPiece key,
+    folly::fbstring &&value)>;
+  folly::Future<folly::Unit> multiGetEach(
+    const std::vector<folly::StringPiece> &keys, hit_callback_t onHit);
+};
+
+namespace detail {
+
+// libmemcached's default: the one-at-a-time hash of the key, modulo the
+// number of servers.
+size_t serverIndexForKey(folly::StringPiece key, size_t nServers);
+
+// where copy `replica` of a hot key lives: the servers after its own.
+size_t replicaServerForKey(folly::StringPiece key, size_t replica,
+  size_t nServers);
+
+// keys are at most 250 bytes, with no spaces or control characters.
+bool isValidMemcachedKey(folly::StringPiece key);
+
+} // detail
+
+}} // fredis::memcached
@@ -0,0 +1,120 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/ThreadLocal.h>
+#include <folly/futures/Try.h>
+#include "fredis/memcached/MemcachedConfig.h"
+#include "fredis/memcached/MemcachedSyncClient.h"
+#include "fredis/stats/StatsRegistry.h"
+#include "fredis/compression/ValueCompressor.h"
+
+namespace fredis { namespace memcached {
+
+class MemcachedPoolOptions {
+ public:
+  // clients are created as they're needed, up to maxSize.
+  size_t maxSize {8};
+
+  // connected up front by createShared().
+  size_t initialSize {1};
+
+  // how long acquire() waits for a client once all maxSize are in use.
+  std::chrono::milliseconds acquireTimeout {100};
+};
+
+struct MemcachedPoolStats {
+  size_t size {0};
+  size_t inUse {0};
+  uint64_t acquired {0};
+  // acquisitions that got the same client as the thread's previous one.
+  uint64_t affinityHits {0};
+  uint64_t waits {0};
+  uint64_t timeouts {0};
+};
+
+// shares a bounded set of MemcachedSyncClients between any number of
+// threads. acquiring first tries the client this thread used last, then
+// any idle one, both with a single compare-and-swap and no lock; a mutex
+// is only taken to wait when every client is busy. all clients record into
+// one StatsRegistry and share the pool's compressor.
+class MemcachedClientPool {
+ protected:
+  enum SlotState: int {
+    EMPTY,
+    CONNECTING,
+    IDLE,
+    BUSY
+  };
+  struct Slot {
+    std::atomic<int> state {EMPTY};
+    std::unique_ptr<MemcachedSyncClient> client;
+  };
+  MemcachedConfig config_;
+  MemcachedPoolOptions options_;
+  std::unique_ptr<Slot[]> slots_;
+  std::shared_ptr<stats::StatsRegistry> stats_;
+  std::shared_ptr<compression::ValueCompressor> compressor_;
+
+  // index of the slot each thread last released, if any.
+  folly::ThreadLocal<size_t> lastSlot_;
+
+  std::mutex waitMutex_;
+  std::condition_variable released_;
+  std::atomic<size_t> waiters_ {0};
+
+  std::atomic<uint64_t> acquired_ {0};
+  std::atomic<uint64_t> affinityHits_ {0};
+  std::atomic<uint64_t> waits_ {0};
+  std::atomic<uint64_t> timeouts_ {0};
+
+  MemcachedClientPool(const MemcachedConfig &config,
+    const MemcachedPoolOptions &options);
+
+  bool tryClaim(size_t index, int from);
+  Slot* tryAcquire();
+  folly::Try<Slot*> grow();
+  void release(Slot *slot);
+ public:
+  // a client checked out of the pool; goes back when destroyed.
+  class Lease {
+   protected:
+    MemcachedClientPool *pool_ {nullptr};
+    Slot *slot_ {nullptr};
+   public:
+    Lease(MemcachedClientPool *pool, Slot *slot);
+    Lease(Lease &&other);
+    Lease& operator=(Lease &&other);
+    Lease(const Lease&) = delete;
+    Lease& operator=(const Lease&) = delete;
+    ~Lease();
+    MemcachedSyncClient& operator*() const;
+    MemcachedSyncClient* operator->() const;
+  };
+
+  // fails if the initial clients can't connect.
+  static folly::Try<std::shared_ptr<MemcachedClientPool>> createShared(
+    const MemcachedConfig &config,
+    const MemcachedPoolOptions &options = MemcachedPoolOptions {},
+    std::shared_ptr<compression::ValueCompressor> compressor = nullptr);
+
+  // fails with PoolTimeout if no client frees up within acquireTimeout,
+  // or with the connection error if a new client can't connect.
+  folly::Try<Lease> acquire();
+
+  std::shared_ptr<stats::StatsRegistry> getStatsRegistry() const;
+  MemcachedPoolStats getPoolStats() const;
+
+  // one-shot helpers that lease a client for the length of the call.
+  MemcachedSyncClient::get_result_t get(const folly::fbstring &key);
+  MemcachedSyncClient::set_result_t set(const folly::fbstring &key,
+    const folly::fbstring &value, time_t ttl = 0);
+  MemcachedSyncClient::multi_get_result_t multiGet(
+    const std::vector<folly::fbstring> &keys);
+};
+
+}} // fredis::memcached
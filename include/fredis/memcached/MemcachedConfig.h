@@ -1,18 +1,104 @@
 #pragma once
+#include <chrono>
 #include <initializer_list>
 #include <folly/futures/Try.h>
 #include <folly/futures/Unit.h>
 #include <folly/FBVector.h>
 #include <folly/FBString.h>
+#include <folly/Range.h>
 #include <folly/SocketAddress.h>
 
+struct memcached_st;
 
 namespace fredis { namespace memcached {
 
+enum class KeyDistribution {
+  // hash % number of servers; libmemcached's default.
+  MODULA,
+  // consistent hashing, so adding or removing a server moves few keys.
+  KETAMA,
+  // ketama, with each server's share of the ring set by its weight.
+  KETAMA_WEIGHTED
+};
+
+// libmemcached behaviors, applied with memcached_behavior_set() when a
+// client connects. the defaults leave libmemcached's own defaults alone;
+// zero timeouts and limits mean "don't set".
+class MemcachedBehaviors {
+ public:
+  bool binaryProtocol {false};
+  bool tcpNoDelay {false};
+  bool nonBlocking {false};
+
+  // writes are queued until a read or the buffer fills; set() returns
+  // before the server has seen them.
+  bool bufferRequests {false};
+
+  // writes don't wait for the server's reply, so failures go unreported.
+  bool noReply {false};
+
+  KeyDistribution distribution {KeyDistribution::MODULA};
+  std::chrono::milliseconds connectTimeout {0};
+  std::chrono::milliseconds pollTimeout {0};
+
+  // consecutive failures before a server is marked dead, and how long
+  // before a dead server is tried again.
+  uint32_t serverFailureLimit {0};
+  std::chrono::seconds retryTimeout {0};
+
+  // short timeouts, Nagle off and quick failover, for request/response
+  // traffic where each call's latency matters.
+  static MemcachedBehaviors lowLatency();
+
+  // buffered noreply writes with Nagle left on, for loading lots of
+  // values when throughput matters and individual results don't.
+  static MemcachedBehaviors bulkWrite();
+
+  // "default", "low-latency" or "bulk-write".
+  static folly::Try<MemcachedBehaviors> preset(folly::StringPiece name);
+};
+
+// keys copied onto several servers so their reads spread across the
+// cluster instead of all landing on the one server the distribution picks.
+// a hot key lives on `replicas` consecutive servers starting at its own;
+// writes go to every copy, and each read goes to a random one. keys in
+// `keys` are always hot; with a detectThreshold, so is any key read that
+// often within a detectWindow, until a window passes with fewer reads.
+// only MemcachedAsyncClient replicates; MemcachedSyncClient won't connect
+// with hot keys enabled.
+class HotKeyOptions {
+ public:
+  // capped at the number of servers; 1 turns replication off.
+  size_t replicas {3};
+  folly::fbvector<folly::fbstring> keys;
+
+  // 0 to only replicate the listed keys. detection is per client, so
+  // with it on every write deletes the written key's extra copies,
+  // whether or not this client has seen the key as hot.
+  uint32_t detectThreshold {0};
+  std::chrono::milliseconds detectWindow {1000};
+  // count one read in this many, scaling the counts back up, so
+  // detection costs less than a map update per get.
+  uint32_t sampleRate {1};
+  // the most keys detected hot at once, and the most counted per window.
+  size_t maxDetected {64};
+  size_t maxTracked {4096};
+
+  // a copy that a read finds missing is refilled from the key's own
+  // server with this ttl, since the original's isn't known. it also
+  // bounds how long a refill racing a write can leave a copy stale.
+  time_t repairTtl {60};
+
+  bool isEnabled() const;
+};
 
 class MemcachedConfig {
  protected:
   folly::fbvector<folly::SocketAddress> serverHosts_;
+  // parallel to serverHosts_; 0 leaves the weight unset.
+  folly::fbvector<uint32_t> serverWeights_;
+  MemcachedBehaviors behaviors_;
+  HotKeyOptions hotKeys_;
  public:
   using server_init_list = std::initializer_list<folly::SocketAddress>;
   MemcachedConfig();
@@ -29,16 +115,30 @@ class MemcachedConfig {
   template<typename TCollection>
   void addServers(const TCollection &servers) {
     for (const folly::SocketAddress &sock: servers) {
-      serverHosts_.push_back(sock);
+      addServer(sock);
     }
   }
 
+  // weights only matter with KeyDistribution::KETAMA_WEIGHTED.
+  void addServer(const folly::SocketAddress &server, uint32_t weight = 0);
+
+  MemcachedBehaviors& getBehaviors();
+  const MemcachedBehaviors& getBehaviors() const;
+  void setBehaviors(const MemcachedBehaviors &behaviors);
+
+  HotKeyOptions& getHotKeys();
+  const HotKeyOptions& getHotKeys() const;
+  void setHotKeys(const HotKeyOptions &hotKeys);
+
   bool hasAnyServers() const;
+  const folly::fbvector<folly::SocketAddress>& getServers() const;
   folly::Try<folly::fbstring> toConfigString();
 };
 
 namespace detail {
 folly::Try<folly::fbstring> validateMemcachedConfigStr(const folly::fbstring&);
+folly::Try<folly::Unit> applyMemcachedBehaviors(
+  const MemcachedBehaviors &behaviors, memcached_st *handle);
 }
 
 }} // fredis::memcached
@@ -0,0 +1,171 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <folly/ExceptionWrapper.h>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include <folly/SocketAddress.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/Unit.h>
+#include <folly/io/async/AsyncSocket.h>
+#include <folly/io/async/AsyncTimeout.h>
+#include <folly/io/async/EventBase.h>
+#include "fredis/memcached/MemcachedValue.h"
+
+namespace fredis { namespace memcached {
+
+struct MemcachedReply {
+  // the final line, without its \r\n: END, STORED, NOT_FOUND, a number, ...
+  folly::fbstring line;
+  std::vector<MemcachedValue> values;
+
+  // total size of the values received, including any that were streamed
+  // to a value callback rather than kept in `values`.
+  size_t valueBytes {0};
+
+  // ERROR, CLIENT_ERROR ... or SERVER_ERROR ...
+  bool isError() const;
+};
+
+// how the server ends its reply to a command.
+enum class ReplyShape {
+  // a single line: storage commands, delete, incr/decr, touch, version.
+  LINE,
+  // zero or more VALUE blocks, then END: get and gets.
+  VALUES,
+  // a meta command's header line (VA, HD, EN, NF, ...), followed by a data
+  // block when it's VA.
+  META
+};
+
+// a single text-protocol connection to one memcached server, owned and used
+// on one EventBase thread. requests are pipelined: every command sent during
+// a loop iteration goes out in one write, and replies are matched up with
+// requests in order. connects lazily, and again after a failure. with a
+// readTimeout, a connection that has requests waiting and reads nothing for
+// that long is dropped and its requests fail with RequestTimeout.
+class MemcachedConnection: public folly::AsyncSocket::ConnectCallback,
+                           public folly::AsyncSocket::ReadCallback,
+                           public folly::AsyncWriter::WriteCallback {
+ public:
+  using value_callback_t = std::function<void (MemcachedValue &value)>;
+  enum class State {
+    DISCONNECTED,
+    CONNECTING,
+    CONNECTED
+  };
+ protected:
+  struct Request {
+    ReplyShape shape;
+    folly::Promise<MemcachedReply> promise;
+    // the reply so far; a VALUES reply can span many reads.
+    MemcachedReply reply;
+    value_callback_t onValue;
+  };
+  class ReplyTimeout: public folly::AsyncTimeout {
+   protected:
+    MemcachedConnection *parent_;
+   public:
+    ReplyTimeout(folly::EventBase *base, MemcachedConnection *parent);
+    void timeoutExpired() noexcept override;
+  };
+  folly::EventBase *base_ {nullptr};
+  folly::SocketAddress address_;
+  std::chrono::milliseconds connectTimeout_ {0};
+  std::chrono::milliseconds readTimeout_ {0};
+  ReplyTimeout replyTimeout_;
+  folly::AsyncSocket::UniquePtr socket_;
+  State state_ {State::DISCONNECTED};
+
+  // requests whose replies haven't arrived, in the order they were sent.
+  std::deque<Request> inFlight_;
+  std::vector<folly::Promise<folly::Unit>> connectPromises_;
+
+  // commands waiting for the end of the loop (or a connection).
+  folly::fbstring writeBuffer_;
+  bool flushScheduled_ {false};
+  size_t writesInFlight_ {0};
+
+  folly::fbstring input_;
+  char readChunk_[16 * 1024];
+
+  // reset on destruction, so that deferred flushes can tell we're gone.
+  std::shared_ptr<bool> aliveToken_;
+
+  void startConnecting();
+  void scheduleFlush();
+  void flush();
+  void parseReplies();
+  // (re)starts the reply timeout while requests are waiting, or stops it.
+  void updateReplyTimeout();
+  void fail(const folly::exception_wrapper &error);
+ public:
+  // a zero connectTimeout waits as long as the OS does; a zero
+  // readTimeout waits for replies indefinitely.
+  MemcachedConnection(folly::EventBase *base,
+    const folly::SocketAddress &address,
+    std::chrono::milliseconds connectTimeout = std::chrono::milliseconds {0},
+    std::chrono::milliseconds readTimeout = std::chrono::milliseconds {0});
+  MemcachedConnection(const MemcachedConnection&) = delete;
+  MemcachedConnection& operator=(const MemcachedConnection&) = delete;
+  ~MemcachedConnection();
+
+  folly::Future<folly::Unit> connect();
+  State getState() const;
+  const folly::SocketAddress& getAddress() const;
+  size_t getInFlightCount() const;
+
+  // `encoded` is a complete command, including its data block and \r\n.
+  folly::Future<MemcachedReply> send(folly::StringPiece encoded,
+    ReplyShape shape);
+
+  // as above, but each VALUE block goes to `onValue` as soon as it has been
+  // read, instead of into the reply.
+  folly::Future<MemcachedReply> send(folly::StringPiece encoded,
+    ReplyShape shape, value_callback_t onValue);
+
+  // for commands sent with `noreply`: nothing is expected back, so nothing
+  // reports whether they worked, and they're dropped if the connection
+  // fails before they're written.
+  void sendNoReply(folly::StringPiece encoded);
+
+  void connectSuccess() noexcept override;
+  void connectErr(const folly::AsyncSocketException &ex) noexcept override;
+
+  void getReadBuffer(void **bufReturn, size_t *lenReturn) override;
+  void readDataAvailable(size_t len) noexcept override;
+  void readEOF() noexcept override;
+  void readErr(const folly::AsyncSocketException &ex) noexcept override;
+
+  void writeSuccess() noexcept override;
+  void writeErr(size_t bytesWritten,
+    const folly::AsyncSocketException &ex) noexcept override;
+};
+
+namespace detail {
+
+enum class ReplyStep {
+  // nothing complete yet.
+  INCOMPLETE,
+  // a VALUE block, appended to reply.values.
+  VALUE,
+  // the final line, in reply.line.
+  DONE
+};
+
+// parses the next complete piece of a reply off the front of `input`,
+// setting `consumed` to the bytes it took.
+ReplyStep parseMemcachedReplyStep(folly::StringPiece input, ReplyShape shape,
+  MemcachedReply &reply, size_t &consumed);
+
+// bytes of `input` taken by one complete reply of the given shape, parsed
+// into `reply`; 0 if the reply hasn't fully arrived yet.
+size_t parseMemcachedReply(folly::StringPiece input, ReplyShape shape,
+  MemcachedReply &reply);
+
+} // detail
+
+}} // fredis::memcached
@@ -11,7 +11,11 @@ FREDIS_DECLARE_EXCEPTION(MemcachedError, fredis::FredisError);
 FREDIS_DECLARE_EXCEPTION(ConfigurationError, MemcachedError);
 FREDIS_DECLARE_EXCEPTION(ConnectionError, MemcachedError);
 FREDIS_DECLARE_EXCEPTION(AlreadyConnected, ConnectionError);
+FREDIS_DECLARE_EXCEPTION(RequestTimeout, ConnectionError);
 FREDIS_DECLARE_EXCEPTION(ProtocolError, MemcachedError);
+FREDIS_DECLARE_EXCEPTION(InvalidKey, MemcachedError);
+FREDIS_DECLARE_EXCEPTION(PoolTimeout, MemcachedError);
+FREDIS_DECLARE_EXCEPTION(BufferTooSmall, MemcachedError);
 
 
 }} // fredis::memcached
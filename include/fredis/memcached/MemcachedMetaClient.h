@@ -0,0 +1,172 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/futures/Future.h>
+#include <folly/io/async/EventBase.h>
+#include "fredis/memcached/MemcachedAsyncClient.h"
+#include "fredis/memcached/MemcachedConfig.h"
+
+namespace fredis { namespace memcached {
+
+struct MetaGetOptions {
+  bool value {true};
+  bool ttl {false};
+  bool cas {false};
+  bool flags {false};
+
+  // on a miss, creates an empty placeholder that lives this long and wins
+  // the caller the right to fill it in; 0 to just miss.
+  time_t vivifyTtl {0};
+
+  // once the item has fewer than this many seconds left, the next fetch
+  // wins the right to refresh it early; 0 to turn off.
+  time_t recacheTtl {0};
+
+  // resets the item's ttl.
+  folly::Optional<time_t> touchTtl;
+};
+
+struct MetaGetResult {
+  bool found {false};
+  folly::fbstring value;
+  uint32_t flags {0};
+  // seconds left, or -1 if the item doesn't expire; only when asked for.
+  folly::Optional<int64_t> ttl;
+  folly::Optional<uint64_t> cas;
+
+  // W: this caller should recompute the value and store it.
+  bool win {false};
+  // X: the item was invalidated; the value is the old one.
+  bool stale {false};
+  // Z: another caller already won, and is presumably recomputing.
+  bool winTokenSent {false};
+};
+
+struct MetaSetOptions {
+  time_t ttl {0};
+  uint32_t flags {0};
+  // only store if the item's cas still matches; 0 to store regardless.
+  uint64_t cas {0};
+};
+
+enum class MetaStoreResult {
+  STORED,
+  // the cas didn't match.
+  EXISTS,
+  // the cas was given but the item is gone.
+  NOT_FOUND
+};
+
+struct MetaDeleteOptions {
+  // mark the item stale instead of removing it, so readers keep getting
+  // the old value (flagged X) and one of them wins the recompute.
+  bool invalidate {false};
+  // with invalidate, how long the stale item may be served.
+  folly::Optional<time_t> staleTtl;
+  uint64_t cas {0};
+};
+
+struct MetaArithmeticOptions {
+  // negative deltas decrement, stopping at zero.
+  int64_t delta {1};
+  // creates a missing counter at `initial`, living `vivifyTtl` seconds.
+  folly::Optional<time_t> vivifyTtl;
+  uint64_t initial {0};
+};
+
+struct LeaseOptions {
+  // ttl of the recomputed value.
+  time_t ttl {0};
+  // how long a winner has to store a value before the lease lapses and
+  // someone else can win.
+  time_t leaseTtl {30};
+  // refresh this many seconds before expiry; 0 to only refresh on a miss or
+  // after an invalidation.
+  time_t recacheTtl {0};
+  // with nothing stale to fall back on, losers poll for the winner's value
+  // this often, this many times, before computing it themselves.
+  std::chrono::milliseconds retryDelay {20};
+  size_t maxRetries {10};
+};
+
+// MemcachedAsyncClient plus memcached 1.6's meta commands (mg, ms, md, ma),
+// which libmemcached doesn't expose. every meta command carries an opaque
+// token that the reply has to echo, so a reply that doesn't line up with its
+// request fails the command instead of being handed to the wrong caller.
+// getOrCompute() uses mg's vivify, recache and stale flags for stampede
+// protection: when a hot key expires or is invalidated only one caller
+// recomputes it, while the rest are served the stale value.
+class MemcachedMetaClient: public MemcachedAsyncClient {
+ public:
+  using compute_fn_t = std::function<folly::Future<folly::fbstring> ()>;
+ protected:
+  uint64_t nextOpaque_ {1};
+
+  MemcachedMetaClient(folly::EventBase *base, const MemcachedConfig &config);
+
+  // sends `command key <flags> O<opaque>`, and `data` as its data block if
+  // it's set.
+  folly::Future<MemcachedReply> sendMeta(folly::StringPiece command,
+    folly::StringPiece key, folly::fbstring &&flags,
+    const folly::fbstring *data);
+
+  std::shared_ptr<MemcachedMetaClient> sharedMeta();
+
+  // what getOrCompute() does with each fetch: serve it, recompute it, or
+  // poll again for the winner's value.
+  folly::Future<folly::fbstring> handleLease(const folly::fbstring &key,
+    MetaGetResult &&result, compute_fn_t compute,
+    const LeaseOptions &options, size_t attempt);
+  folly::Future<folly::fbstring> recompute(const folly::fbstring &key,
+    const MetaGetResult &won, compute_fn_t compute,
+    const LeaseOptions &options);
+  folly::Future<folly::fbstring> retryLease(const folly::fbstring &key,
+    compute_fn_t compute, const LeaseOptions &options, size_t attempt);
+ public:
+  static std::shared_ptr<MemcachedMetaClient> createShared(
+    folly::EventBase *base, const MemcachedConfig &config);
+
+  folly::Future<MetaGetResult> metaGet(folly::StringPiece key,
+    const MetaGetOptions &options = MetaGetOptions {});
+  folly::Future<MetaStoreResult> metaSet(folly::StringPiece key,
+    folly::StringPiece value, const MetaSetOptions &options = MetaSetOptions {});
+
+  // resolves to false if the key doesn't exist (or the cas didn't match).
+  folly::Future<bool> metaDelete(folly::StringPiece key,
+    const MetaDeleteOptions &options = MetaDeleteOptions {});
+
+  // resolves to the counter's new value, or none if it doesn't exist.
+  folly::Future<folly::Optional<uint64_t>> metaArithmetic(
+    folly::StringPiece key,
+    const MetaArithmeticOptions &options = MetaArithmeticOptions {});
+
+  // a read-through get: the cached value if it's fresh, otherwise whichever
+  // caller wins the lease runs `compute` and stores its result, and everyone
+  // else gets the stale value, or waits for the winner's if there's none.
+  // if `compute` fails, the lease is given up so the next caller can win.
+  folly::Future<folly::fbstring> getOrCompute(folly::StringPiece key,
+    compute_fn_t compute, const LeaseOptions &options = LeaseOptions {});
+};
+
+namespace detail {
+
+// the parts of a meta reply's header line: its code, and its flags as a
+// letter each with an optional token.
+struct MetaReplyLine {
+  folly::StringPiece code;
+  std::vector<std::pair<char, folly::StringPiece>> flags;
+
+  bool hasFlag(char flag) const;
+  folly::Optional<folly::StringPiece> flagToken(char flag) const;
+};
+
+MetaReplyLine parseMetaReplyLine(folly::StringPiece line);
+
+} // detail
+
+}} // fredis::memcached
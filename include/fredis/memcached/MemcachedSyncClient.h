@@ -3,7 +3,16 @@
 #include <folly/futures/Unit.h>
 #include <folly/Optional.h>
 #include <folly/FBString.h>
+#include <folly/Range.h>
+#include <folly/io/IOBuf.h>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include "fredis/memcached/MemcachedConfig.h"
+#include "fredis/memcached/MemcachedValue.h"
+#include "fredis/stats/StatsRegistry.h"
+#include "fredis/compression/ValueCompressor.h"
 
 struct memcached_st;
 
@@ -13,6 +22,8 @@ class MemcachedSyncClient {
  protected:
   MemcachedConfig config_;
   memcached_st* mcHandle_ {nullptr};
+  std::shared_ptr<stats::StatsRegistry> stats_;
+  std::shared_ptr<compression::ValueCompressor> compressor_;
   MemcachedSyncClient(const MemcachedSyncClient&) = delete;
   MemcachedSyncClient& operator=(const MemcachedSyncClient&) = delete;
 
@@ -26,15 +37,82 @@ class MemcachedSyncClient {
   MemcachedConfig& getConfig();
   const MemcachedConfig& getConfig() const;
 
+  // fails with ConfigurationError if the config enables hot keys, which
+  // only MemcachedAsyncClient supports.
   folly::Try<folly::Unit> connect();
   void connectExcept();
   bool isConnected() const;
 
+  // every client records into its own registry unless given a shared one.
+  void setStatsRegistry(std::shared_ptr<stats::StatsRegistry>);
+  std::shared_ptr<stats::StatsRegistry> getStatsRegistry() const;
+  stats::StatsSnapshot getStats();
+
+  // values passed to set() are compressed by the compressor's rules, and
+  // values returned by get() are decoded. pass nullptr to turn it off.
+  void setValueCompressor(std::shared_ptr<compression::ValueCompressor>);
+  std::shared_ptr<compression::ValueCompressor> getValueCompressor() const;
+
+  // a miss is none, an empty value is an empty string, and anything else
+  // that goes wrong is an exception.
   using get_result_t = folly::Try<folly::Optional<folly::fbstring>>;
   get_result_t get(const folly::fbstring &key);
 
+  // as get(), but the IOBuf takes over the buffer libmemcached allocated
+  // for the value instead of copying it. compressed values still have to
+  // be decoded into a new buffer.
+  using iobuf_result_t = folly::Try<folly::Optional<
+    std::unique_ptr<folly::IOBuf>>>;
+  iobuf_result_t getIOBuf(const folly::fbstring &key);
+
+  // reads the value into `buffer`, resolving to the number of bytes
+  // written or none on a miss. fails with BufferTooSmall if it won't fit,
+  // so a caller can reuse one large buffer for every read.
+  using get_into_result_t = folly::Try<folly::Optional<size_t>>;
+  get_into_result_t getInto(const folly::fbstring &key,
+    folly::MutableByteRange buffer);
+
   using set_result_t = folly::Try<folly::Unit>;
   set_result_t set(const folly::fbstring &key, const folly::fbstring &val, time_t ttl = 0);
+
+  // the rest mirror MemcachedAsyncClient's commands of the same names,
+  // except that libmemcached limits counter deltas to 32 bits.
+  folly::Try<folly::Optional<MemcachedValue>> gets(const folly::fbstring &key);
+  folly::Try<CasResult> cas(const folly::fbstring &key,
+    const folly::fbstring &val, uint64_t casToken, time_t ttl = 0);
+  folly::Try<bool> add(const folly::fbstring &key, const folly::fbstring &val,
+    time_t ttl = 0);
+  folly::Try<bool> replace(const folly::fbstring &key,
+    const folly::fbstring &val, time_t ttl = 0);
+  // fails with ConfigurationError when the client has a compressor, since
+  // raw bytes after a compressed value would corrupt it.
+  folly::Try<bool> append(const folly::fbstring &key,
+    const folly::fbstring &val);
+
+  using counter_result_t = folly::Try<folly::Optional<uint64_t>>;
+  counter_result_t incr(const folly::fbstring &key, uint64_t delta);
+  counter_result_t decr(const folly::fbstring &key, uint64_t delta);
+  folly::Try<uint64_t> incr(const folly::fbstring &key, uint64_t delta,
+    uint64_t initial, time_t ttl);
+  folly::Try<uint64_t> decr(const folly::fbstring &key, uint64_t delta,
+    uint64_t initial, time_t ttl);
+
+  folly::Try<bool> touch(const folly::fbstring &key, time_t ttl);
+
+  // one memcached_mget for all the keys: libmemcached sends each server its
+  // share at once and the replies are read back as they come in. the map
+  // holds the keys that were found.
+  using multi_get_map_t = std::unordered_map<folly::fbstring, folly::fbstring>;
+  using multi_get_result_t = folly::Try<multi_get_map_t>;
+  multi_get_result_t multiGet(const std::vector<folly::fbstring> &keys);
+
+  // as multiGet(), handing each hit to `onHit` as it's read instead. if
+  // `onHit` throws, the remaining hits are read and dropped and the
+  // exception is rethrown once the connection is clean.
+  using hit_callback_t = std::function<void (folly::StringPiece key,
+    folly::fbstring &&value)>;
+  folly::Try<folly::Unit> multiGetEach(const std::vector<folly::fbstring> &keys,
+    const hit_callback_t &onHit);
 };
 
 }} // fredis::memcached
\ No newline at end of file
@@ -0,0 +1,22 @@
+#pragma once
+#include <cstdint>
+#include <folly/FBString.h>
+
+namespace fredis { namespace memcached {
+
+// one VALUE block of a get/gets reply.
+struct MemcachedValue {
+  folly::fbstring key;
+  uint32_t flags {0};
+  uint64_t cas {0};
+  folly::fbstring value;
+};
+
+enum class CasResult {
+  STORED,
+  // the item changed since its cas token was read.
+  EXISTS,
+  NOT_FOUND
+};
+
+}} // fredis::memcached
@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <folly/io/async/EventBase.h>
+
+namespace fredis { namespace redis {
+
+class AdmissionPolicy {
+ public:
+  enum class Mode {
+    // reject as soon as a cap is hit.
+    FAIL_FAST,
+
+    // hold requests client-side until a slot frees up or waitTimeout passes.
+    WAIT,
+
+    // shed load once an internal concurrency limit is hit. that limit
+    // shrinks as observed latency rises above the best latency seen so far,
+    // and grows back while latency stays flat.
+    ADAPTIVE
+  };
+  using duration_t = std::chrono::milliseconds;
+
+  Mode mode {Mode::FAIL_FAST};
+  size_t maxInFlightRequests {10000};
+
+  // outgoing command bytes not yet answered. 0 means no byte cap.
+  size_t maxInFlightBytes {0};
+  duration_t waitTimeout {100};
+
+  // ADAPTIVE only.
+  size_t minConcurrencyLimit {4};
+  size_t initialConcurrencyLimit {64};
+  double smoothing {0.2};
+
+  // latency up to minLatency * latencyTolerance doesn't shrink the limit.
+  double latencyTolerance {2.0};
+};
+
+// caps in-flight requests and bytes. give each RedisClient its own
+// controller for a per-client cap, and share one controller across
+// clients for a pool-wide cap. tryAcquire() and release() are lock-free
+// unless someone is waiting for a slot.
+class AdmissionController {
+ public:
+  using duration_t = std::chrono::microseconds;
+  using wakeup_t = std::function<void ()>;
+ protected:
+  AdmissionPolicy policy_;
+  std::atomic<size_t> inFlightRequests_ {0};
+  std::atomic<size_t> inFlightBytes_ {0};
+  std::atomic<size_t> concurrencyLimit_ {0};
+  std::atomic<size_t> rejected_ {0};
+
+  std::mutex adaptiveMutex_;
+  double adaptiveLimit_ {0};
+  double minLatency_ {0};
+  double smoothedLatency_ {0};
+  size_t samplesSinceReset_ {0};
+
+  struct Waiter {
+    folly::EventBase *base;
+    wakeup_t wakeup;
+  };
+  std::mutex waitersMutex_;
+  std::deque<Waiter> waiters_;
+  std::atomic<size_t> waiterCount_ {0};
+
+  AdmissionController(const AdmissionPolicy &policy);
+  size_t effectiveRequestLimit() const;
+  void recordLatency(duration_t latency, bool succeeded);
+  void wakeOneWaiter();
+ public:
+  static std::shared_ptr<AdmissionController> createShared(
+    const AdmissionPolicy &policy
+  );
+
+  const AdmissionPolicy& getPolicy() const;
+  bool tryAcquire(size_t bytes);
+
+  // give back a slot that was acquired but never used.
+  void cancel(size_t bytes);
+  void release(size_t bytes, duration_t latency, bool succeeded);
+
+  // runs `wakeup` on `base` once a slot may be available.
+  void notifyWhenAvailable(folly::EventBase *base, wakeup_t wakeup);
+
+  size_t getInFlightRequests() const;
+  size_t getInFlightBytes() const;
+  size_t getConcurrencyLimit() const;
+  size_t getRejectedCount() const;
+};
+
+}} // fredis::redis
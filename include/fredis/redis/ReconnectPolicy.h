@@ -0,0 +1,37 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+
+namespace fredis { namespace redis {
+
+// controls how a RedisClient recovers after its connection drops.
+// delays grow exponentially from initialBackoff up to maxBackoff,
+// and each one has up to `jitter` of itself randomly shaved off so that
+// a fleet of clients doesn't reconnect in lockstep after a failover.
+class ReconnectPolicy {
+ public:
+  using duration_t = std::chrono::milliseconds;
+
+  bool enabled {true};
+  duration_t initialBackoff {10};
+  duration_t maxBackoff {5000};
+  double backoffMultiplier {2.0};
+
+  // fraction in [0, 1]
+  double jitter {0.25};
+
+  // 0 means keep trying forever.
+  size_t maxAttempts {0};
+
+  // requests issued while reconnecting (plus replayed in-flight ones)
+  // are buffered up to this many; beyond that they fail immediately.
+  size_t maxQueuedRequests {4096};
+
+  // `unitRandom` is expected to be uniform in [0, 1).
+  duration_t backoffForAttempt(size_t attempt, double unitRandom) const;
+  bool shouldGiveUp(size_t attempt) const;
+
+  static ReconnectPolicy disabled();
+};
+
+}} // fredis::redis
@@ -4,18 +4,150 @@
 #include <memory>
 #include <utility>
 #include <functional>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <iterator>
+#include <map>
+#include <set>
+#include <type_traits>
 #include <folly/io/async/EventBase.h>
 #include <folly/futures/Future.h>
 #include <folly/futures/Unit.h>
 #include <folly/futures/Try.h>
+#include <folly/Conv.h>
+#include <folly/io/IOBuf.h>
 #include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
 #include "fredis/redis/RedisRequestContext.h"
 #include "fredis/redis/RedisSubscription.h"
+#include "fredis/redis/ReconnectPolicy.h"
+#include "fredis/redis/AdmissionController.h"
+#include "fredis/redis/RequestTracer.h"
+#include "fredis/redis/RedisValueStream.h"
+#include "fredis/stats/StatsRegistry.h"
+#include "fredis/compression/ValueCompressor.h"
+#include "fredis/codec/Codec.h"
+#include "fredis/redis/RedisError.h"
 
 struct redisAsyncContext;
 
 namespace fredis { namespace redis {
 
+namespace detail {
+bool isIdempotentCommand(folly::StringPiece commandName);
+
+// RESP building blocks: an array header, then one bulk string per argument.
+void appendRespArrayHeader(folly::fbstring &out, size_t nElements);
+void appendRespBulk(folly::fbstring &out, folly::StringPiece arg);
+
+// appendRespEncoded's scratch buffer is freed once it grows past this.
+static const size_t kMaxRespScratchBytes = 64 * 1024;
+
+// a bulk string holding codec::Codec<T>'s encoding of `value`. the value
+// is encoded into a per-thread scratch buffer first, so its length can be
+// written ahead of it without shifting it over.
+template<typename T>
+void appendRespEncoded(folly::fbstring &out, const T &value) {
+  static thread_local folly::fbstring scratch;
+  scratch.clear();
+  codec::Codec<T>::encode(value, scratch);
+  appendRespBulk(out, scratch);
+  if (scratch.capacity() > kMaxRespScratchBytes) {
+    folly::fbstring {}.swap(scratch);
+  }
+}
+
+// the decoded value of a GET-style reply, or none for nil. throws on
+// error replies and undecodable values.
+template<typename T>
+folly::Optional<T> decodeValueReply(RedisDynamicResponse &response) {
+  using ResponseType = RedisDynamicResponse::ResponseType;
+  if (response.isType(ResponseType::NIL)) {
+    return folly::Optional<T> {};
+  }
+  if (response.isType(ResponseType::ERROR)) {
+    throw RedisError(response.getErrorString().value().str());
+  }
+  auto decoded = codec::Codec<T>::decode(response.getString().value());
+  return folly::Optional<T> {std::move(decoded.value())};
+}
+
+// one argument of a container command: anything string-like is sent
+// as-is, everything else through its codec.
+inline void appendRespArg(folly::fbstring &out, folly::StringPiece arg) {
+  appendRespBulk(out, arg);
+}
+
+template<typename T>
+typename std::enable_if<
+  !std::is_convertible<const T&, folly::StringPiece>::value
+>::type appendRespArg(folly::fbstring &out, const T &value) {
+  appendRespEncoded(out, value);
+}
+
+// decodes one element of an array reply. nil is a RedisTypeError unless
+// the element type is an Optional.
+template<typename T>
+struct ElementDecoder {
+  static T decode(RedisDynamicResponse &element) {
+    auto decoded = decodeValueReply<T>(element);
+    if (!decoded.hasValue()) {
+      throw RedisTypeError("unexpected nil element in array reply");
+    }
+    return std::move(decoded.value());
+  }
+};
+
+template<typename T>
+struct ElementDecoder<folly::Optional<T>> {
+  static folly::Optional<T> decode(RedisDynamicResponse &element) {
+    return decodeValueReply<T>(element);
+  }
+};
+
+folly::fbvector<RedisDynamicResponse> elementsOfArrayReply(
+  RedisDynamicResponse &response);
+
+// each element of an array reply, decoded into TContainer's value_type
+// and inserted at end().
+template<typename TContainer>
+TContainer decodeArrayReply(RedisDynamicResponse &response) {
+  using element_t = typename TContainer::value_type;
+  TContainer result;
+  for (auto &element: elementsOfArrayReply(response)) {
+    result.insert(result.end(), ElementDecoder<element_t>::decode(element));
+  }
+  return result;
+}
+
+// a flat [k1, v1, k2, v2, ...] array reply (HGETALL, ZRANGE WITHSCORES)
+// decoded into a container of pairs, e.g. a std::map or a vector of pairs.
+template<typename TContainer>
+TContainer decodePairsReply(RedisDynamicResponse &response) {
+  using pair_t = typename TContainer::value_type;
+  using first_t = typename std::remove_const<
+    typename pair_t::first_type
+  >::type;
+  using second_t = typename pair_t::second_type;
+  auto elements = elementsOfArrayReply(response);
+  if (elements.size() % 2 != 0) {
+    throw RedisTypeError("odd number of elements in paired reply");
+  }
+  TContainer result;
+  for (size_t i = 0; i < elements.size(); i += 2) {
+    result.insert(result.end(), pair_t(
+      ElementDecoder<first_t>::decode(elements[i]),
+      ElementDecoder<second_t>::decode(elements[i + 1])
+    ));
+  }
+  return result;
+}
+}
+
 class RedisClient: public std::enable_shared_from_this<RedisClient> {
  public:
   using connect_promise_t = folly::Promise<
@@ -45,15 +177,54 @@ class RedisClient: public std::enable_shared_from_this<RedisClient> {
   using subscription_try_t = folly::Try<std::shared_ptr<subscription_t>>;
   using subscription_handler_ptr_t = subscription_t::handler_ptr_t;
 
+  enum class ConnectionState {
+    DISCONNECTED, CONNECTING, CONNECTED, RECONNECTING, CLOSING, CLOSED
+  };
+  using state_callback_t = std::function<void (ConnectionState)>;
+
  protected:
   folly::EventBase *base_ {nullptr};
   folly::fbstring host_;
   int port_ {0};
   struct redisAsyncContext *redisContext_ {nullptr};
   std::weak_ptr<subscription_t> currentSubscription_;
+  folly::fbstring subscribedChannel_;
   connect_promise_t connectPromise_;
   disconnect_promise_t disconnectPromise_;
 
+  ReconnectPolicy reconnectPolicy_;
+  std::atomic<ConnectionState> state_ {ConnectionState::DISCONNECTED};
+  state_callback_t stateCallback_;
+  size_t reconnectAttempt_ {0};
+  std::atomic<size_t> reconnectCount_ {0};
+  std::mt19937 jitterEngine_;
+
+  // requests waiting for a live connection, in submission order.
+  // in-flight idempotent requests are pushed here when the connection drops.
+  std::deque<RedisRequestContext*> pendingRequests_;
+
+  // finished request contexts, kept for reuse so that a steady stream of
+  // commands stops allocating them.
+  std::vector<RedisRequestContext*> requestPool_;
+  static const size_t kMaxPooledRequests = 256;
+
+  std::vector<std::shared_ptr<AdmissionController>> admissionControllers_;
+  struct AdmissionWaiter {
+    RedisRequestContext *reqCtx;
+    std::chrono::steady_clock::time_point deadline;
+    AdmissionPolicy::duration_t waitTimeout;
+  };
+  std::deque<AdmissionWaiter> admissionWaiters_;
+  std::shared_ptr<stats::StatsRegistry> stats_;
+
+  std::shared_ptr<RequestTracer> tracer_;
+  // traced requests handed to hiredis whose bytes haven't left yet.
+  std::vector<RedisRequestContext*> unflushedTraced_;
+  RequestTrace::time_point pendingFirstByteAt_;
+  RequestTrace::time_point lastReadEventAt_;
+  std::shared_ptr<compression::ValueCompressor> compressor_;
+  friend class RedisRequestContext;
+
   // not really for public use.
   RedisClient(folly::EventBase *base,
     const folly::fbstring& host, int port);
@@ -68,6 +239,78 @@ class RedisClient: public std::enable_shared_from_this<RedisClient> {
   response_future_t command2(cmd_str_ref cmd, arg_str_ref arg1,
       redis_signed_t arg2);
 
+  // `write` fills in the request's (recycled) encoded-command buffer; it
+  // runs after the request's trace (if any) has started.
+  template<typename TWriter>
+  RedisRequestContext* makeRequest(folly::StringPiece commandName,
+    const TWriter &write);
+
+  // `encode` appends the RESP-encoded command to the fbstring& it's given,
+  // the pooled request's buffer.
+  template<typename TEncoder>
+  response_future_t encodedCommand(folly::StringPiece commandName,
+      const TEncoder &encode) {
+    return submit(makeRequest(commandName, encode));
+  }
+
+  template<typename ...Args>
+  response_future_t formattedCommand(const char *format, Args... args);
+
+  // `commandName key` followed by `argsPerItem` arguments per item, all
+  // written by `appendItem` in a single pass over `items`.
+  template<typename TItems, typename TAppender>
+  response_future_t containerCommand(folly::StringPiece commandName,
+      arg_str_ref key, const TItems &items, size_t argsPerItem,
+      const TAppender &appendItem) {
+    return encodedCommand(commandName, [&](folly::fbstring &out) {
+      size_t count = std::distance(std::begin(items), std::end(items));
+      detail::appendRespArrayHeader(out, 2 + count * argsPerItem);
+      detail::appendRespBulk(out, commandName);
+      detail::appendRespBulk(out, key);
+      for (const auto &item: items) {
+        appendItem(out, item);
+      }
+    });
+  }
+
+  response_future_t rangeCommand(folly::StringPiece commandName,
+    arg_str_ref key, redis_signed_t start, redis_signed_t stop,
+    bool withScores = false);
+
+  response_future_t submit(RedisRequestContext *reqCtx);
+  void submitRequest(RedisRequestContext *reqCtx);
+  void dispatchRequest(RedisRequestContext *reqCtx);
+  void writeRequest(RedisRequestContext *reqCtx);
+  bool enqueueRequest(RedisRequestContext *reqCtx);
+  void flushPendingRequests();
+  void failPendingRequests(const folly::fbstring &reason);
+
+  void setState(ConnectionState state);
+  folly::Try<folly::Unit> startConnecting();
+  void scheduleReconnect();
+  void attemptReconnect();
+
+  // returns the controller that turned the request away, if any.
+  AdmissionController* tryAdmit(RedisRequestContext *reqCtx);
+  void waitForAdmission(RedisRequestContext *reqCtx,
+    AdmissionController *blocker);
+  void queueForAdmission(RedisRequestContext *reqCtx,
+    AdmissionPolicy::duration_t waitTimeout);
+  void rejectAdmission(RedisRequestContext *reqCtx);
+  void registerAdmissionWakeup(AdmissionController *blocker);
+  void drainAdmissionWaiters();
+  void expireAdmissionWaiters();
+  void failAdmissionWaiters(const folly::fbstring &reason);
+  void releaseAdmission(size_t bytes, std::chrono::microseconds latency,
+    bool succeeded);
+
+  // records a finished request, then hands its context back to the pool.
+  static void releaseRequest(RedisRequestContext *reqCtx);
+  void finishRequest(RedisRequestContext &reqCtx);
+  RedisRequestContext* acquireRequest(folly::StringPiece commandName);
+
+  response_future_t msetCompressed(const mset_list &pairs);
+
  public:
 
   RedisClient(RedisClient &&other);
@@ -77,8 +320,45 @@ class RedisClient: public std::enable_shared_from_this<RedisClient> {
     const folly::fbstring &host, int port);
 
   connect_future_t connect();
+  // once the client is closing or closed, further calls return a future
+  // that's already fulfilled.
   disconnect_future_t disconnect();
 
+  // must be called before connect().
+  void setReconnectPolicy(const ReconnectPolicy &policy);
+  const ReconnectPolicy& getReconnectPolicy() const;
+
+  folly::EventBase* getEventBase() const;
+  ConnectionState getConnectionState() const;
+  bool isConnected() const;
+  size_t getReconnectCount() const;
+  size_t getPendingRequestCount() const;
+
+  // invoked on the EventBase thread on every state transition.
+  void setConnectionStateCallback(state_callback_t callback);
+
+  // must be called before connect(). every added controller has to admit
+  // a request before it's sent: add a dedicated controller for a
+  // per-client cap and the same shared one to each client of a pool
+  // for a pool-wide cap.
+  void addAdmissionController(std::shared_ptr<AdmissionController>);
+  size_t getAdmissionWaitingCount() const;
+
+  // every client records into its own registry unless given a shared one.
+  void setStatsRegistry(std::shared_ptr<stats::StatsRegistry>);
+  std::shared_ptr<stats::StatsRegistry> getStatsRegistry() const;
+  stats::StatsSnapshot getStats();
+
+  // tracing is off until a tracer is set; pass nullptr to turn it off.
+  void setRequestTracer(std::shared_ptr<RequestTracer>);
+  std::shared_ptr<RequestTracer> getRequestTracer() const;
+
+  // compresses values passed to set() and mset() according to the
+  // compressor's rules, and decodes values returned by get() and mget().
+  // other commands see values as stored. pass nullptr to turn it off.
+  void setValueCompressor(std::shared_ptr<compression::ValueCompressor>);
+  std::shared_ptr<compression::ValueCompressor> getValueCompressor() const;
+
   response_future_t get(arg_str_ref);
   response_future_t set(arg_str_ref, arg_str_ref);
   response_future_t set(arg_str_ref, redis_signed_t);
@@ -86,6 +366,13 @@ class RedisClient: public std::enable_shared_from_this<RedisClient> {
 
   template<typename TCollection>
   response_future_t mset(const TCollection &args) {
+    if (compressor_) {
+      mset_list pairs;
+      for (const auto &keyVal: args) {
+        pairs.emplace_back(keyVal.first, keyVal.second);
+      }
+      return msetCompressed(pairs);
+    }
     std::ostringstream oss;
     oss << "MSET";
     for (const auto &keyVal: args) {
@@ -128,12 +415,226 @@ class RedisClient: public std::enable_shared_from_this<RedisClient> {
 
   response_future_t llen(arg_str_ref key);
 
+  // binary-safe commands: every argument is sent byte-for-byte.
+  response_future_t commandArgv(const std::vector<folly::StringPiece> &args);
+
+  // as above, plus a final argument read straight out of an IOBuf chain.
+  response_future_t commandArgv(const std::vector<folly::StringPiece> &args,
+    const folly::IOBuf &lastArg);
+
+  // completion-callback variants: no Promise/Future core is allocated and
+  // `complete` runs inline on the EventBase thread as soon as the reply is
+  // parsed. the response is only valid for the duration of that call.
+  using completion_fn_t = RedisRequestContext::completion_fn_t;
+
+  template<typename TEncoder>
+  void encodedCommandWithCallback(folly::StringPiece commandName,
+      const TEncoder &encode, completion_fn_t complete, void *target) {
+    auto reqCtx = makeRequest(commandName, encode);
+    reqCtx->setCompletion(complete, target);
+    submitRequest(reqCtx);
+  }
+
+  void commandArgvWithCallback(const std::vector<folly::StringPiece> &args,
+    completion_fn_t complete, void *target);
+
+  // the allocation-free fast path. `callback` is called as
+  // callback(folly::Try<response_t>&) and is stored inside a pooled request
+  // context, as is the encoded command, so once the pool is warm a command
+  // whose callback fits in RedisRequestContext::kInlineCallbackSize bytes
+  // costs no heap allocations. callbacks can issue further commands, e.g.
+  // a GET whose callback SETs.
+  template<typename TCallback>
+  void commandWithCallback(std::initializer_list<folly::StringPiece> args,
+      TCallback &&callback) {
+    DCHECK(args.size() > 0);
+    auto reqCtx = makeRequest(*args.begin(), [&args](folly::fbstring &out) {
+      detail::appendRespArrayHeader(out, args.size());
+      for (auto arg: args) {
+        detail::appendRespBulk(out, arg);
+      }
+    });
+    reqCtx->setCallback(std::forward<TCallback>(callback));
+    submitRequest(reqCtx);
+  }
+
+  template<typename TCallback>
+  void getWithCallback(folly::StringPiece key, TCallback &&callback) {
+    commandWithCallback({"GET", key}, std::forward<TCallback>(callback));
+  }
+
+  // values still go through the compressor, if there is one.
+  template<typename TCallback>
+  void setWithCallback(folly::StringPiece key, folly::StringPiece value,
+      TCallback &&callback) {
+    if (compressor_) {
+      auto encoded = compressor_->encode(key, value);
+      commandWithCallback({"SET", key, encoded},
+        std::forward<TCallback>(callback));
+      return;
+    }
+    commandWithCallback({"SET", key, value},
+      std::forward<TCallback>(callback));
+  }
+
+  // typed values, encoded and decoded by codec::Codec<T>. the value is
+  // encoded straight into the outgoing command and decoded straight from
+  // the reply.
+  template<typename T, typename = typename std::enable_if<
+    codec::HasCodec<T>::value>::type>
+  response_future_t set(arg_str_ref key, const T &value) {
+    if (compressor_) {
+      folly::fbstring raw;
+      codec::Codec<T>::encode(value, raw);
+      return commandArgv({"SET", key, compressor_->encode(key, raw)});
+    }
+    return encodedCommand("SET", [&key, &value](folly::fbstring &out) {
+      detail::appendRespArrayHeader(out, 3);
+      detail::appendRespBulk(out, "SET");
+      detail::appendRespBulk(out, key);
+      detail::appendRespEncoded(out, value);
+    });
+  }
+
+  // resolves to none if the key doesn't exist.
+  template<typename T>
+  folly::Future<folly::Optional<T>> get(arg_str_ref key) {
+    return get(key).then([](response_t response) {
+      return detail::decodeValueReply<T>(response);
+    });
+  }
+
+  // container commands: a whole container goes out as one command and
+  // comes back decoded into the container type asked for. elements that
+  // convert to StringPiece are sent as-is, anything else through
+  // codec::Codec. redis rejects these with an empty container.
+
+  // `pairs` is any iterable of (field, value) pairs, e.g. a std::map.
+  template<typename TPairs>
+  response_future_t hset(arg_str_ref key, const TPairs &pairs) {
+    using item_t = typename TPairs::value_type;
+    return containerCommand("HSET", key, pairs, 2,
+      [](folly::fbstring &out, const item_t &item) {
+        detail::appendRespArg(out, item.first);
+        detail::appendRespArg(out, item.second);
+      });
+  }
+
+  // one element per field, none where the field doesn't exist.
+  template<typename TResult = std::vector<folly::Optional<std::string>>,
+    typename TFields>
+  folly::Future<TResult> hmget(arg_str_ref key, const TFields &fields) {
+    using item_t = typename TFields::value_type;
+    return containerCommand("HMGET", key, fields, 1,
+      [](folly::fbstring &out, const item_t &field) {
+        detail::appendRespArg(out, field);
+      }).then([](response_t response) {
+        return detail::decodeArrayReply<TResult>(response);
+      });
+  }
+
+  template<typename TMap = std::map<std::string, std::string>>
+  folly::Future<TMap> hgetall(arg_str_ref key) {
+    return command1("HGETALL %s", key).then([](response_t response) {
+      return detail::decodePairsReply<TMap>(response);
+    });
+  }
+
+  template<typename TMembers>
+  response_future_t sadd(arg_str_ref key, const TMembers &members) {
+    using item_t = typename TMembers::value_type;
+    return containerCommand("SADD", key, members, 1,
+      [](folly::fbstring &out, const item_t &member) {
+        detail::appendRespArg(out, member);
+      });
+  }
+
+  template<typename TSet = std::set<std::string>>
+  folly::Future<TSet> smembers(arg_str_ref key) {
+    return command1("SMEMBERS %s", key).then([](response_t response) {
+      return detail::decodeArrayReply<TSet>(response);
+    });
+  }
+
+  template<typename TValues>
+  response_future_t rpush(arg_str_ref key, const TValues &values) {
+    using item_t = typename TValues::value_type;
+    return containerCommand("RPUSH", key, values, 1,
+      [](folly::fbstring &out, const item_t &value) {
+        detail::appendRespArg(out, value);
+      });
+  }
+
+  template<typename TList = std::vector<std::string>>
+  folly::Future<TList> lrange(arg_str_ref key, redis_signed_t start,
+      redis_signed_t stop) {
+    return rangeCommand("LRANGE", key, start, stop).then(
+      [](response_t response) {
+        return detail::decodeArrayReply<TList>(response);
+      });
+  }
+
+  // `pairs` holds (member, score) pairs, e.g. a std::map<string, double>.
+  template<typename TPairs>
+  response_future_t zadd(arg_str_ref key, const TPairs &pairs) {
+    using item_t = typename TPairs::value_type;
+    return containerCommand("ZADD", key, pairs, 2,
+      [](folly::fbstring &out, const item_t &item) {
+        detail::appendRespArg(out, item.second);
+        detail::appendRespArg(out, item.first);
+      });
+  }
+
+  // members in score order.
+  template<typename TMembers = std::vector<std::string>>
+  folly::Future<TMembers> zrange(arg_str_ref key, redis_signed_t start,
+      redis_signed_t stop) {
+    return rangeCommand("ZRANGE", key, start, stop).then(
+      [](response_t response) {
+        return detail::decodeArrayReply<TMembers>(response);
+      });
+  }
+
+  // (member, score) pairs in score order.
+  template<typename TPairs = std::vector<std::pair<std::string, double>>>
+  folly::Future<TPairs> zrangeWithScores(arg_str_ref key,
+      redis_signed_t start, redis_signed_t stop) {
+    return rangeCommand("ZRANGE", key, start, stop, true).then(
+      [](response_t response) {
+        return detail::decodePairsReply<TPairs>(response);
+      });
+  }
+
+  // streamed SET for large values: the chain (or whatever the producer
+  // returns) is sent in StreamOptions::chunkSize pieces without being
+  // coalesced, and the value only appears under `key` once all of it
+  // has been written.
+  folly::Future<folly::Unit> setStreaming(arg_str_ref key,
+    std::unique_ptr<folly::IOBuf> value,
+    const StreamOptions &options = StreamOptions {});
+  folly::Future<folly::Unit> setStreaming(arg_str_ref key,
+    chunk_producer_t producer,
+    const StreamOptions &options = StreamOptions {});
+
+  // streamed GET: the value is fetched with GETRANGE, up to
+  // StreamOptions::parallelism chunks at a time, and handed to `sink` in
+  // order. resolves to the value's length, or none if the key is missing.
+  // fails with RedisStreamError if the value's length changes midway;
+  // a concurrent overwrite with a same-length value isn't detected.
+  folly::Future<folly::Optional<size_t>> getStreaming(arg_str_ref key,
+    chunk_sink_t sink, const StreamOptions &options = StreamOptions {});
+
+  // the whole value as a chain of chunk-sized IOBufs (nullptr if missing).
+  folly::Future<std::unique_ptr<folly::IOBuf>> getChained(arg_str_ref key,
+    const StreamOptions &options = StreamOptions {});
+
   subscription_try_t subscribe(subscription_handler_ptr_t, arg_str_ref);
 
  protected:
   // event handler methods called from the static handlers (because C)
   void handleConnected(int status);
   void handleCommandResponse(RedisRequestContext *ctx, response_t&& data);
+  void handleCommandDropped(RedisRequestContext *ctx);
   void handleDisconnected(int status);
   void handleSubscriptionEvent(response_t&& data);
 
@@ -144,14 +645,60 @@ class RedisClient: public std::enable_shared_from_this<RedisClient> {
   static void hiredisCommandCallback(redisAsyncContext*, void *reply, void *pdata);
   static void hiredisDisconnectCallback(const redisAsyncContext*, int status);
   static void hiredisSubscriptionCallback(redisAsyncContext*, void *reply, void *pdata);
+
+  // called by the libevent adapter around socket I/O.
+  void noteReadEvent();
+  void noteWriteFlushed();
   ~RedisClient();
 };
 
 namespace detail {
 RedisClient* getClientFromContext(const redisAsyncContext* ctx);
+folly::StringPiece commandNameOfFormat(const char *format);
+const char* stringOfConnectionState(RedisClient::ConnectionState);
+
+// approximate size of the reply as it was sent over the wire.
+size_t estimateReplyBytes(const redisReply *reply);
+
+// GET and MGET, whose replies may hold compressed values.
+bool repliesWithValues(folly::StringPiece commandName);
+
+// swaps compressed string replies (and array elements) for their decoded
+// values, in place.
+folly::Try<folly::Unit> decompressReply(
+  compression::ValueCompressor &compressor, redisReply *reply);
+
+// RESP-encodes a command from its arguments, with an optional final
+// argument taken from an IOBuf chain, onto the end of `out`.
+void appendCommandArgv(folly::fbstring &out,
+  const std::vector<folly::StringPiece> &args,
+  const folly::IOBuf *lastArg = nullptr);
+
+folly::fbstring encodeCommandArgv(const std::vector<folly::StringPiece> &args,
+  const folly::IOBuf *lastArg = nullptr);
 }
 
 
+template<typename TWriter>
+RedisRequestContext* RedisClient::makeRequest(
+    folly::StringPiece commandName, const TWriter &write) {
+  RequestTrace::time_point startedAt;
+  bool traced = tracer_ && tracer_->shouldSample();
+  if (traced) {
+    startedAt = std::chrono::steady_clock::now();
+  }
+  auto reqCtx = acquireRequest(commandName);
+  write(reqCtx->encodedBuffer());
+  if (traced) {
+    auto origin = RequestTracer::currentOrigin();
+    if (origin == RequestTrace::time_point {}) {
+      origin = startedAt;
+    }
+    reqCtx->startTrace(origin, startedAt);
+  }
+  return reqCtx;
+}
+
 }} // fredis::redis
 
 
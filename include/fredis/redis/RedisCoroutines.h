@@ -0,0 +1,244 @@
+#pragma once
+// only available when built with FREDIS_COROUTINES=ON (C++20).
+#if FREDIS_HAVE_COROUTINES
+
+#include <coroutine>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/futures/Try.h>
+#include "fredis/redis/RedisClient.h"
+
+namespace fredis { namespace redis {
+
+namespace detail {
+
+// awaits one command sent through RedisClient's completion-callback path.
+// the command is encoded when the awaitable is built; it goes out when the
+// coroutine suspends on it, and the coroutine resumes inline on the
+// EventBase thread once `TDecoder` has turned the reply into a TResult.
+template<typename TResult, typename TDecoder>
+class ReplyAwaitable {
+ protected:
+  std::shared_ptr<RedisClient> client_;
+  folly::fbstring commandName_;
+  folly::fbstring encoded_;
+  TDecoder decode_;
+  folly::Try<TResult> result_;
+  std::coroutine_handle<> waiter_;
+  bool suspended_ {false};
+  bool completed_ {false};
+
+  static void complete(void *target,
+      folly::Try<RedisClient::response_t> &response) {
+    auto self = static_cast<ReplyAwaitable*>(target);
+    if (response.hasException()) {
+      self->result_ = folly::Try<TResult> {response.exception()};
+    } else {
+      self->result_ = folly::makeTryWith([self, &response]() {
+        return self->decode_(response.value());
+      });
+    }
+    self->completed_ = true;
+    if (self->suspended_) {
+      self->waiter_.resume();
+    }
+  }
+ public:
+  ReplyAwaitable(std::shared_ptr<RedisClient> client,
+      folly::StringPiece commandName, folly::fbstring &&encoded,
+      TDecoder decode)
+    : client_(std::move(client)), commandName_(commandName.fbstr()),
+      encoded_(std::move(encoded)), decode_(std::move(decode)) {}
+
+  ReplyAwaitable(const ReplyAwaitable&) = delete;
+  ReplyAwaitable& operator=(const ReplyAwaitable&) = delete;
+  ReplyAwaitable(ReplyAwaitable&&) = default;
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  // a request that fails before it's written (not connected, queue full)
+  // completes synchronously; don't suspend for it.
+  bool await_suspend(std::coroutine_handle<> waiter) {
+    waiter_ = waiter;
+    client_->encodedCommandWithCallback(commandName_,
+      [this](folly::fbstring &out) {
+        out.append(encoded_);
+      }, &ReplyAwaitable::complete, this);
+    if (completed_) {
+      return false;
+    }
+    suspended_ = true;
+    return true;
+  }
+
+  TResult await_resume() {
+    return std::move(result_.value());
+  }
+};
+
+template<typename TResult, typename TDecoder>
+ReplyAwaitable<TResult, TDecoder> makeReplyAwaitable(
+    std::shared_ptr<RedisClient> client, folly::StringPiece commandName,
+    folly::fbstring &&encoded, TDecoder decode) {
+  return ReplyAwaitable<TResult, TDecoder> {
+    std::move(client), commandName, std::move(encoded), std::move(decode)
+  };
+}
+
+// integer replies; error replies throw.
+struct IntegerReplyDecoder {
+  int64_t operator()(RedisDynamicResponse &response) const;
+};
+
+// status replies such as SET's OK; error replies throw.
+struct StatusReplyDecoder {
+  bool operator()(RedisDynamicResponse &response) const;
+};
+
+struct StringReplyDecoder {
+  folly::Optional<std::string> operator()(
+    RedisDynamicResponse &response) const;
+};
+
+template<typename T>
+struct ValueReplyDecoder {
+  folly::Optional<T> operator()(RedisDynamicResponse &response) const {
+    return decodeValueReply<T>(response);
+  }
+};
+
+folly::fbstring encodeArgs(std::initializer_list<folly::StringPiece> args);
+
+} // detail
+
+// co_await-able counterparts of RedisClient's commands, for use from C++20
+// coroutines running on the client's EventBase thread:
+//
+//   auto value = co_await coro.get("key");
+//
+// there is no Promise/Future pair and no continuation to allocate: each
+// command costs one pooled RedisRequestContext, plus, for commands longer
+// than fbstring's inline capacity, the awaitable's own copy of the
+// encoding, which is built before there is a context to write it into.
+// the awaitable must be co_awaited before the next one is built. values go through the client's
+// compressor, if it has one, just as they do for RedisClient::set/get.
+class RedisCoroClient {
+ protected:
+  std::shared_ptr<RedisClient> client_;
+ public:
+  explicit RedisCoroClient(std::shared_ptr<RedisClient> client);
+  RedisClient* getClient() const;
+
+  auto get(folly::StringPiece key) {
+    return detail::makeReplyAwaitable<folly::Optional<std::string>>(
+      client_, "GET", detail::encodeArgs({"GET", key}),
+      detail::StringReplyDecoder {}
+    );
+  }
+
+  template<typename T>
+  auto get(folly::StringPiece key) {
+    return detail::makeReplyAwaitable<folly::Optional<T>>(
+      client_, "GET", detail::encodeArgs({"GET", key}),
+      detail::ValueReplyDecoder<T> {}
+    );
+  }
+
+  auto set(folly::StringPiece key, folly::StringPiece value) {
+    auto compressor = client_->getValueCompressor();
+    if (compressor) {
+      auto compressed = compressor->encode(key, value);
+      return detail::makeReplyAwaitable<bool>(
+        client_, "SET", detail::encodeArgs({"SET", key, compressed}),
+        detail::StatusReplyDecoder {}
+      );
+    }
+    return detail::makeReplyAwaitable<bool>(
+      client_, "SET", detail::encodeArgs({"SET", key, value}),
+      detail::StatusReplyDecoder {}
+    );
+  }
+
+  template<typename T, typename = typename std::enable_if<
+    codec::HasCodec<T>::value &&
+    !std::is_convertible<const T&, folly::StringPiece>::value>::type>
+  auto set(folly::StringPiece key, const T &value) {
+    auto compressor = client_->getValueCompressor();
+    if (compressor) {
+      folly::fbstring raw;
+      codec::Codec<T>::encode(value, raw);
+      auto compressed = compressor->encode(key, raw);
+      return detail::makeReplyAwaitable<bool>(
+        client_, "SET", detail::encodeArgs({"SET", key, compressed}),
+        detail::StatusReplyDecoder {}
+      );
+    }
+    folly::fbstring encoded;
+    detail::appendRespArrayHeader(encoded, 3);
+    detail::appendRespBulk(encoded, "SET");
+    detail::appendRespBulk(encoded, key);
+    detail::appendRespEncoded(encoded, value);
+    return detail::makeReplyAwaitable<bool>(
+      client_, "SET", std::move(encoded), detail::StatusReplyDecoder {}
+    );
+  }
+
+  auto del(folly::StringPiece key) {
+    return detail::makeReplyAwaitable<int64_t>(
+      client_, "DEL", detail::encodeArgs({"DEL", key}),
+      detail::IntegerReplyDecoder {}
+    );
+  }
+
+  auto exists(folly::StringPiece key) {
+    return detail::makeReplyAwaitable<int64_t>(
+      client_, "EXISTS", detail::encodeArgs({"EXISTS", key}),
+      detail::IntegerReplyDecoder {}
+    );
+  }
+
+  auto incr(folly::StringPiece key) {
+    return detail::makeReplyAwaitable<int64_t>(
+      client_, "INCR", detail::encodeArgs({"INCR", key}),
+      detail::IntegerReplyDecoder {}
+    );
+  }
+
+  auto incrby(folly::StringPiece key, int64_t amount) {
+    auto amountStr = folly::to<folly::fbstring>(amount);
+    return detail::makeReplyAwaitable<int64_t>(
+      client_, "INCRBY", detail::encodeArgs({"INCRBY", key, amountStr}),
+      detail::IntegerReplyDecoder {}
+    );
+  }
+
+  auto expire(folly::StringPiece key, int64_t ttlSecs) {
+    auto ttlStr = folly::to<folly::fbstring>(ttlSecs);
+    return detail::makeReplyAwaitable<int64_t>(
+      client_, "EXPIRE", detail::encodeArgs({"EXPIRE", key, ttlStr}),
+      detail::IntegerReplyDecoder {}
+    );
+  }
+
+  // any command, decoded by `decode` (called with the RedisDynamicResponse&
+  // while the reply is still valid).
+  template<typename TResult, typename TDecoder>
+  auto commandArgv(const std::vector<folly::StringPiece> &args,
+      TDecoder decode) {
+    return detail::makeReplyAwaitable<TResult>(
+      client_, args.front(), detail::encodeCommandArgv(args),
+      std::move(decode)
+    );
+  }
+};
+
+}} // fredis::redis
+
+#endif // FREDIS_HAVE_COROUTINES
@@ -15,6 +15,11 @@ X(RedisEOFError, RedisError);
 X(RedisTypeError, RedisError);
 X(AlreadySubscribedError, RedisError);
 X(SubscriptionError, RedisError);
+X(RedisNotConnected, RedisIOError);
+X(RedisConnectionLost, RedisIOError);
+X(RedisQueueFull, RedisError);
+X(RedisOverloaded, RedisError);
+X(RedisStreamError, RedisError);
 
 #undef X
 
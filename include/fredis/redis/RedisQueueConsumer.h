@@ -0,0 +1,146 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <folly/Executor.h>
+#include <folly/ExceptionWrapper.h>
+#include <folly/FBString.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/Unit.h>
+#include "fredis/folly_util/EBThread.h"
+
+namespace fredis { namespace redis {
+
+class RedisClient;
+
+class QueueConsumerOptions {
+ public:
+  // producers RPUSH jobs onto this list; consumers pop from its head.
+  folly::fbstring queue;
+
+  // reliable mode: each job is moved onto this list (BLMOVE, redis 6.2+)
+  // while it runs and LREM'd once it's done, so a crash can't lose it.
+  // empty pops jobs outright.
+  folly::fbstring processingList;
+
+  // in reliable mode, start() first moves anything left on processingList
+  // by an earlier run back to the head of the queue. the processing list
+  // must then belong to this consumer alone.
+  bool recoverOnStart {true};
+
+  // jobs per pop: one BLMPOP ... COUNT, or in reliable mode a BLMOVE
+  // followed by pipelined LMOVEs.
+  size_t batchSize {16};
+
+  // BLMPOP needs redis 7. without it, each pop is a single BLPOP.
+  bool useLmpop {true};
+  std::chrono::milliseconds blockTimeout {1000};
+
+  // blocking connections, scaled between these with the backlog: one per
+  // backlogPerConsumer queued jobs, checked every scaleInterval.
+  size_t minConsumers {1};
+  size_t maxConsumers {4};
+  size_t backlogPerConsumer {100};
+  std::chrono::milliseconds scaleInterval {1000};
+
+  // pops pause while this many jobs are running, and never take more
+  // jobs than would bring the count past it.
+  size_t maxInFlightJobs {256};
+
+  // jobs whose handler threw go back on the tail of the queue.
+  bool requeueFailed {true};
+
+  // wait before popping again after a failed pop.
+  std::chrono::milliseconds retryDelay {100};
+};
+
+struct QueueConsumerStats {
+  size_t consumers {0};
+  size_t popped {0};
+  size_t completed {0};
+  size_t failed {0};
+  size_t requeued {0};
+  size_t recovered {0};
+  size_t popFailures {0};
+};
+
+// pops jobs off a redis list on a pool of dedicated connections, each
+// sitting in a blocking pop so that no other client's commands queue up
+// behind it. jobs run on `executor` (or inline on the EventBase thread if
+// there is none). start(), stop() and getStats() can be called from any
+// thread; everything else happens on `ebt`.
+class RedisQueueConsumer:
+    public std::enable_shared_from_this<RedisQueueConsumer> {
+ public:
+  using job_handler_t = std::function<void (const folly::fbstring &job)>;
+  using error_handler_t = std::function<void (const folly::exception_wrapper&)>;
+ protected:
+  struct Worker {
+    std::shared_ptr<RedisClient> client;
+    bool retiring {false};
+  };
+  std::shared_ptr<folly_util::EBThread> ebt_;
+  folly::fbstring host_;
+  int port_ {0};
+  QueueConsumerOptions options_;
+  job_handler_t handler_;
+  folly::Executor *executor_ {nullptr};
+  error_handler_t errorHandler_;
+
+  // LLEN, LREM, requeues and recovery go here.
+  std::shared_ptr<RedisClient> control_;
+  std::vector<std::shared_ptr<Worker>> workers_;
+  // workers waiting for in-flight jobs to drop below the limit.
+  std::vector<std::shared_ptr<Worker>> paused_;
+  size_t inFlightJobs_ {0};
+  // slots claimed by pops still waiting on redis, so that concurrent pops
+  // can't together take more jobs than maxInFlightJobs allows.
+  size_t reservedJobs_ {0};
+  QueueConsumerStats stats_;
+  bool running_ {false};
+  bool stopping_ {false};
+  std::vector<folly::Promise<folly::Unit>> stopPromises_;
+
+  RedisQueueConsumer(std::shared_ptr<folly_util::EBThread> ebt,
+    const folly::fbstring &host, int port,
+    const QueueConsumerOptions &options, job_handler_t handler,
+    folly::Executor *executor);
+
+  bool isReliable() const;
+  void startInLoop(std::shared_ptr<folly::Promise<folly::Unit>> started);
+  void recoverProcessing(std::function<void ()> then);
+  void spawnWorker();
+  void retire(std::shared_ptr<Worker> worker);
+  void popNext(std::shared_ptr<Worker> worker);
+  void onPopped(std::shared_ptr<Worker> worker, size_t reserved,
+    folly::Try<std::vector<folly::fbstring>> &&jobs);
+  void resumePaused();
+  void runJob(const folly::fbstring &job);
+  void finishJob(const folly::fbstring &job, folly::exception_wrapper error);
+  void scheduleScaling();
+  void rescale(size_t backlog);
+  void reportError(folly::exception_wrapper error);
+  void maybeFinishStopping();
+ public:
+  static std::shared_ptr<RedisQueueConsumer> createShared(
+    std::shared_ptr<folly_util::EBThread> ebt,
+    const folly::fbstring &host, int port,
+    const QueueConsumerOptions &options, job_handler_t handler,
+    folly::Executor *executor = nullptr);
+
+  // must be called before start(). runs on the EventBase thread.
+  void setErrorHandler(error_handler_t handler);
+
+  // connects, recovers the processing list if asked to and starts
+  // minConsumers connections popping.
+  folly::Future<folly::Unit> start();
+
+  // stops popping. resolves once every blocked pop has returned (up to
+  // blockTimeout) and every job it handed out has finished.
+  folly::Future<folly::Unit> stop();
+
+  folly::Future<QueueConsumerStats> getStats();
+};
+
+}} // fredis::redis
@@ -2,8 +2,17 @@
 
 #include <folly/futures/Future.h>
 #include <folly/futures/Promise.h>
+#include <folly/ExceptionWrapper.h>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
 #include <memory>
+#include <chrono>
+#include <new>
+#include <type_traits>
+#include <utility>
 #include "fredis/redis/RedisDynamicResponse.h"
+#include "fredis/redis/RequestTracer.h"
 
 namespace fredis { namespace redis {
 
@@ -16,23 +25,154 @@ class RedisRequestContext {
   using response_future_t = decltype(
     std::declval<response_promise_t>().getFuture()
   );
+
+  // completes a request without a future. the response inside `result`
+  // is only valid for the duration of the call.
+  using completion_fn_t = void (*)(void *target,
+    folly::Try<response_t> &result);
+
+  // callbacks up to this size are stored in the request itself.
+  static constexpr size_t kInlineCallbackSize = 64;
  protected:
   std::shared_ptr<RedisClient> client_;
-  response_promise_t donePromise_;
+
+  // only created if someone asks for a future; requests completed through
+  // a completion function never allocate a Promise/Future core.
+  folly::Optional<response_promise_t> donePromise_;
+  completion_fn_t complete_ {nullptr};
+  void *completionTarget_ {nullptr};
+
+  // storage for a callback set with setCallback(), and how to destroy it.
+  typename std::aligned_storage<kInlineCallbackSize>::type callbackStorage_;
+  void (*destroyCallback_)(void*) {nullptr};
+
+  response_promise_t& getPromise();
+
+  template<typename TCallback>
+  static void invokeCallback(void *target, folly::Try<response_t> &result) {
+    (*static_cast<TCallback*>(target))(result);
+  }
+
+  template<typename TCallback>
+  static void destroyInlineCallback(void *target) {
+    static_cast<TCallback*>(target)->~TCallback();
+  }
+
+  template<typename TCallback>
+  static void deleteCallback(void *target) {
+    delete static_cast<TCallback*>(target);
+  }
+
+  // the fully RESP-encoded command, kept around so that it can be
+  // written again if the connection drops before a reply arrives.
+  folly::fbstring commandName_;
+  folly::fbstring encodedCommand_;
+  bool idempotent_ {false};
+  bool written_ {false};
+  std::chrono::steady_clock::time_point createdAt_;
+
+  // set once the client's admission controllers have let this request in.
+  // contexts are pooled, so the slot isn't tied to destruction: the client
+  // hands it back in finishRequest(), when releaseRequest() returns the
+  // context to the pool.
+  bool admitted_ {false};
+  bool failed_ {false};
+  bool timedOut_ {false};
+  bool errorReply_ {false};
+  size_t responseBytes_ {0};
+  std::chrono::steady_clock::time_point admittedAt_;
+
+  // only allocated for requests picked by the client's RequestTracer.
+  std::unique_ptr<RequestTrace> trace_;
  public:
-  RedisRequestContext(std::shared_ptr<RedisClient>);
+  RedisRequestContext(std::shared_ptr<RedisClient>,
+    folly::fbstring&& commandName, folly::fbstring&& encodedCommand,
+    bool idempotent);
+  RedisRequestContext(const RedisRequestContext&) = delete;
+  RedisRequestContext& operator=(const RedisRequestContext&) = delete;
+  ~RedisRequestContext();
   response_future_t getFuture();
 
+  // use instead of getFuture(); `complete` runs exactly once.
+  void setCompletion(completion_fn_t complete, void *target);
+
+  // as setCompletion(), for any callable taking folly::Try<response_t>&.
+  // small callables live inside the request; larger ones are heap-allocated.
+  template<typename TCallback>
+  void setCallback(TCallback &&callback) {
+    using callback_t = typename std::decay<TCallback>::type;
+    if (sizeof(callback_t) <= kInlineCallbackSize &&
+        alignof(callback_t) <= alignof(decltype(callbackStorage_))) {
+      completionTarget_ = new (&callbackStorage_) callback_t(
+        std::forward<TCallback>(callback)
+      );
+      destroyCallback_ = &destroyInlineCallback<callback_t>;
+    } else {
+      completionTarget_ = new callback_t(std::forward<TCallback>(callback));
+      destroyCallback_ = &deleteCallback<callback_t>;
+    }
+    complete_ = &invokeCallback<callback_t>;
+  }
+
+  // readies a pooled request for another command. the encoded command's
+  // buffer is kept, so commands written with encodedBuffer() reuse it.
+  void reuse(std::shared_ptr<RedisClient> client,
+    folly::StringPiece commandName, bool idempotent);
+
+  // drops everything the last command left behind, including the
+  // reference to the client.
+  void recycle();
+  folly::fbstring& encodedBuffer();
+  const std::shared_ptr<RedisClient>& getClient() const;
+  const folly::fbstring& getCommandName() const;
+  const folly::fbstring& getEncodedCommand() const;
+  bool isIdempotent() const;
+
+  void markAdmitted();
+  void markWritten();
+  void markTimedOut();
+  void setResponseBytes(size_t nBytes, bool isErrorReply);
+
+  bool isAdmitted() const;
+  bool wasWritten() const;
+  bool hasFailed() const;
+  bool isTimedOut() const;
+  bool isErrorReply() const;
+  size_t getResponseBytes() const;
+  std::chrono::steady_clock::time_point getCreatedAt() const;
+  std::chrono::steady_clock::time_point getAdmittedAt() const;
+
+  void startTrace(RequestTrace::time_point submitted,
+    RequestTrace::time_point started);
+  RequestTrace* getTrace() const;
+  std::unique_ptr<RequestTrace> releaseTrace();
+
   template<typename T>
   void setValue(T&& result) {
-    donePromise_.setValue(std::forward<T>(result));
+    if (complete_) {
+      folly::Try<response_t> completed {std::forward<T>(result)};
+      complete_(completionTarget_, completed);
+      return;
+    }
+    getPromise().setValue(std::forward<T>(result));
   }
 
   template<typename T>
   void setValue(const T& result) {
-    donePromise_.setValue(result);
+    if (complete_) {
+      folly::Try<response_t> completed {result};
+      complete_(completionTarget_, completed);
+      return;
+    }
+    getPromise().setValue(result);
   }
 
+  void setException(folly::exception_wrapper ex);
 };
 
+namespace detail {
+// length of the first argument (usually the key) of a RESP-encoded command.
+size_t keyBytesOfEncodedCommand(folly::StringPiece encoded);
+}
+
 }} // fredis::redis
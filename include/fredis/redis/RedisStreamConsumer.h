@@ -0,0 +1,149 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <folly/ExceptionWrapper.h>
+#include <folly/FBString.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/Unit.h>
+#include "fredis/redis/RedisDynamicResponse.h"
+
+namespace fredis { namespace redis {
+
+class RedisClient;
+
+using stream_fields_t =
+  std::vector<std::pair<folly::fbstring, folly::fbstring>>;
+
+struct StreamEntry {
+  folly::fbstring id;
+  stream_fields_t fields;
+};
+
+class StreamConsumerOptions {
+ public:
+  folly::fbstring stream;
+  folly::fbstring group;
+  folly::fbstring consumer;
+
+  // COUNT for each XREADGROUP and XAUTOCLAIM.
+  size_t batchSize {128};
+  std::chrono::milliseconds blockTimeout {1000};
+
+  // XREADGROUPs kept in flight on the read connection. with the default
+  // of 2 the next read is already queued while a batch is handled.
+  size_t readAhead {2};
+
+  // acks are coalesced into one multi-ID XACK, sent after ackInterval
+  // or as soon as maxAckBatch IDs are waiting.
+  std::chrono::milliseconds ackInterval {50};
+  size_t maxAckBatch {512};
+
+  // entries pending for longer than claimMinIdle (e.g. on a consumer that
+  // died) are taken over with XAUTOCLAIM every claimInterval. zero turns
+  // reclaiming off.
+  std::chrono::milliseconds claimMinIdle {60 * 1000};
+  std::chrono::milliseconds claimInterval {30 * 1000};
+
+  // start() creates the group (and the stream) at this ID if it doesn't
+  // exist yet; empty skips creating it.
+  folly::fbstring createGroupAt {"$"};
+
+  // wait before retrying a failed read.
+  std::chrono::milliseconds retryDelay {100};
+};
+
+struct StreamConsumerStats {
+  size_t delivered {0};
+  size_t claimed {0};
+  size_t acked {0};
+  size_t ackBatches {0};
+  size_t readFailures {0};
+  size_t ackFailures {0};
+};
+
+// reads a consumer group with blocking XREADGROUPs and hands each batch to
+// a handler. everything, including ack(), has to run on the clients'
+// EventBase thread.
+//
+// `readClient` must be dedicated to this consumer: anything else sent on
+// it waits behind the blocking reads. acks and claims go on
+// `commandClient`, which can be shared.
+class RedisStreamConsumer:
+    public std::enable_shared_from_this<RedisStreamConsumer> {
+ public:
+  using batch_handler_t = std::function<void (std::vector<StreamEntry>&&)>;
+  using error_handler_t = std::function<void (const folly::exception_wrapper&)>;
+ protected:
+  std::shared_ptr<RedisClient> readClient_;
+  std::shared_ptr<RedisClient> commandClient_;
+  StreamConsumerOptions options_;
+  batch_handler_t handler_;
+  error_handler_t errorHandler_;
+  StreamConsumerStats stats_;
+  std::vector<folly::fbstring> pendingAcks_;
+  size_t readsInFlight_ {0};
+  size_t acksInFlight_ {0};
+  bool claimInFlight_ {false};
+  bool ackFlushScheduled_ {false};
+  bool retryScheduled_ {false};
+  bool running_ {false};
+  bool stopping_ {false};
+  std::vector<folly::Promise<folly::Unit>> stopPromises_;
+
+  RedisStreamConsumer(std::shared_ptr<RedisClient> readClient,
+    std::shared_ptr<RedisClient> commandClient,
+    const StreamConsumerOptions &options, batch_handler_t handler);
+
+  void beginReading();
+  void pumpReads();
+  void onRead(folly::Try<RedisDynamicResponse> &result);
+  void scheduleRetry();
+  void scheduleClaim();
+  void claimFrom(const folly::fbstring &cursor);
+  void scheduleAckFlush();
+  void deliver(std::vector<StreamEntry> &&entries);
+  void reportError(folly::exception_wrapper error);
+  void maybeFinishStopping();
+ public:
+  static std::shared_ptr<RedisStreamConsumer> createShared(
+    std::shared_ptr<RedisClient> readClient,
+    std::shared_ptr<RedisClient> commandClient,
+    const StreamConsumerOptions &options, batch_handler_t handler);
+
+  // read, ack and claim failures are passed here. failed reads are
+  // retried after retryDelay; entries whose ack failed stay pending and
+  // are eventually reclaimed.
+  void setErrorHandler(error_handler_t handler);
+
+  // creates the group if asked to, then starts reading.
+  folly::Future<folly::Unit> start();
+
+  // queues an entry's ID for the next XACK.
+  void ack(const folly::fbstring &id);
+  size_t getPendingAckCount() const;
+
+  // sends every queued ack now.
+  folly::Future<folly::Unit> flushAcks();
+
+  // stops issuing reads and flushes acks; resolves once the reads in
+  // flight (up to readAhead * blockTimeout away) have come back. entries
+  // they return are still handed to the handler.
+  folly::Future<folly::Unit> stop();
+
+  const StreamConsumerStats& getStats() const;
+};
+
+namespace detail {
+// entries in an XREADGROUP/XRANGE-style [[id, [field, value, ...]], ...]
+// array. deleted entries (nil fields) come back with no fields.
+std::vector<StreamEntry> parseStreamEntries(RedisDynamicResponse &entries);
+
+// the entries in an XREADGROUP reply: nil on timeout, else
+// [[stream, entries], ...].
+std::vector<StreamEntry> parseReadGroupReply(RedisDynamicResponse &reply);
+}
+
+}} // fredis::redis
@@ -0,0 +1,60 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/futures/Future.h>
+#include "fredis/redis/RedisStreamConsumer.h"
+
+namespace fredis { namespace redis {
+
+class RedisClient;
+
+class StreamProducerOptions {
+ public:
+  folly::fbstring stream;
+
+  // when nonzero, every XADD trims the stream to roughly this many
+  // entries (MAXLEN ~).
+  size_t maxLen {0};
+
+  // XADDs pipelined on the connection at once; the rest wait here.
+  size_t maxInFlight {256};
+};
+
+// appends to a stream with pipelined XADDs. adds made in the same
+// EventBase loop go out in one write, so a burst of add() calls costs
+// one round trip rather than one each. call it on the client's
+// EventBase thread.
+class RedisStreamProducer:
+    public std::enable_shared_from_this<RedisStreamProducer> {
+ protected:
+  struct QueuedAdd {
+    stream_fields_t fields;
+    folly::Promise<folly::fbstring> promise;
+  };
+  std::shared_ptr<RedisClient> client_;
+  StreamProducerOptions options_;
+  std::deque<QueuedAdd> queued_;
+  size_t inFlight_ {0};
+
+  RedisStreamProducer(std::shared_ptr<RedisClient> client,
+    const StreamProducerOptions &options);
+  void pump();
+  void send(QueuedAdd &&add);
+ public:
+  static std::shared_ptr<RedisStreamProducer> createShared(
+    std::shared_ptr<RedisClient> client, const StreamProducerOptions &options);
+
+  // resolves to the new entry's ID.
+  folly::Future<folly::fbstring> add(const stream_fields_t &fields);
+
+  // the IDs in the same order as `batch`; fails if any add fails.
+  folly::Future<std::vector<folly::fbstring>> addBatch(
+    const std::vector<stream_fields_t> &batch);
+
+  size_t getQueuedCount() const;
+  size_t getInFlightCount() const;
+};
+
+}} // fredis::redis
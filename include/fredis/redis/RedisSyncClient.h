@@ -0,0 +1,143 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/futures/Try.h>
+#include <folly/futures/Unit.h>
+#include "fredis/redis/RedisDynamicResponse.h"
+#include "fredis/stats/StatsRegistry.h"
+#include "fredis/compression/ValueCompressor.h"
+
+struct redisContext;
+struct redisReply;
+
+namespace fredis { namespace redis {
+
+namespace detail {
+struct RedisReplyDeleter {
+  void operator()(redisReply *reply) const;
+};
+}
+
+// a reply read by RedisSyncClient. RedisDynamicResponse only points into
+// the hiredis reply; this owns it, so the response stays valid for as
+// long as this does.
+class OwnedRedisResponse {
+ protected:
+  std::unique_ptr<redisReply, detail::RedisReplyDeleter> reply_;
+  RedisDynamicResponse response_;
+ public:
+  explicit OwnedRedisResponse(redisReply *reply);
+  OwnedRedisResponse(OwnedRedisResponse&&) = default;
+  OwnedRedisResponse& operator=(OwnedRedisResponse&&) = default;
+
+  RedisDynamicResponse& operator*();
+  RedisDynamicResponse* operator->();
+};
+
+// a blocking client for threads without an EventBase, in the style of
+// MemcachedSyncClient: hiredis in blocking mode, with every call made on
+// the caller's thread. commands can be pipelined by appending several
+// before reading their replies, so a single thread isn't limited to one
+// round trip per command. not thread-safe; use one client per thread.
+class RedisSyncClient {
+ public:
+  using response_result_t = folly::Try<OwnedRedisResponse>;
+  using get_result_t = folly::Try<folly::Optional<folly::fbstring>>;
+  using set_result_t = folly::Try<folly::Unit>;
+
+  // the most commands setMany() has in flight, and keys getMany() puts in
+  // one MGET.
+  static const size_t kMaxPipelineDepth = 1000;
+ protected:
+  struct PendingCommand {
+    folly::fbstring name;
+    std::chrono::steady_clock::time_point appendedAt;
+    size_t bytesOut {0};
+    // the connection failed before its reply was read.
+    bool lost {false};
+  };
+  std::string host_;
+  int port_ {0};
+  std::chrono::milliseconds timeout_ {0};
+  redisContext *context_ {nullptr};
+  std::deque<PendingCommand> pending_;
+  // reused by appendCommand().
+  std::vector<const char*> argv_;
+  std::vector<size_t> argvLengths_;
+  std::shared_ptr<stats::StatsRegistry> stats_;
+  std::shared_ptr<compression::ValueCompressor> compressor_;
+
+  RedisSyncClient(const RedisSyncClient&) = delete;
+  RedisSyncClient& operator=(const RedisSyncClient&) = delete;
+
+  // frees the context and fails every pending reply.
+  void dropConnection();
+ public:
+  // a zero timeout waits as long as the OS does; otherwise it applies to
+  // connecting and to every read and write.
+  RedisSyncClient(const std::string &host, int port,
+    std::chrono::milliseconds timeout = std::chrono::milliseconds {0});
+  RedisSyncClient(RedisSyncClient&&);
+  RedisSyncClient& operator=(RedisSyncClient&&);
+  ~RedisSyncClient();
+
+  folly::Try<folly::Unit> connect();
+  void connectExcept();
+  bool isConnected() const;
+
+  // every client records into its own registry unless given a shared one.
+  void setStatsRegistry(std::shared_ptr<stats::StatsRegistry>);
+  std::shared_ptr<stats::StatsRegistry> getStatsRegistry() const;
+  stats::StatsSnapshot getStats();
+
+  // as in RedisClient: set() and setMany() compress by the compressor's
+  // rules, and GET and MGET replies are decoded.
+  void setValueCompressor(std::shared_ptr<compression::ValueCompressor>);
+  std::shared_ptr<compression::ValueCompressor> getValueCompressor() const;
+
+  // pipelining. appendCommand() only adds the command to the client's
+  // output buffer; the next getReply() writes everything buffered at once
+  // and then reads the oldest unread reply. a connection error fails that
+  // reply and every other pending one, and the next appendCommand()
+  // reconnects (as does the first, if connect() wasn't called).
+  folly::Try<folly::Unit> appendCommand(
+    const std::vector<folly::StringPiece> &args);
+  response_result_t getReply();
+  size_t getPendingCount() const;
+
+  // appends every command, then reads every reply, in order.
+  std::vector<response_result_t> pipeline(
+    const std::vector<std::vector<folly::StringPiece>> &commands);
+
+  // one round trip, which can't be mixed with unread appended commands.
+  // redis error replies come back as ERROR responses here, and as
+  // RedisError exceptions from the typed commands below.
+  response_result_t command(const std::vector<folly::StringPiece> &args);
+
+  // a miss is none.
+  get_result_t get(folly::StringPiece key);
+  set_result_t set(folly::StringPiece key, folly::StringPiece value,
+    time_t ttl = 0);
+  // false if the key didn't exist.
+  folly::Try<bool> del(folly::StringPiece key);
+  folly::Try<int64_t> incrBy(folly::StringPiece key, int64_t delta);
+
+  // SETs pipelined kMaxPipelineDepth at a time. every reply is read, and
+  // the first error, if any, is returned.
+  set_result_t setMany(
+    const std::vector<std::pair<folly::fbstring, folly::fbstring>> &pairs,
+    time_t ttl = 0);
+
+  // one MGET per kMaxPipelineDepth keys; values in the keys' order.
+  folly::Try<std::vector<folly::Optional<folly::fbstring>>> getMany(
+    const std::vector<folly::fbstring> &keys);
+};
+
+}} // fredis::redis
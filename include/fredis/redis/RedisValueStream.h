@@ -0,0 +1,30 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <folly/io/IOBuf.h>
+
+namespace fredis { namespace redis {
+
+// large values move in chunks of at most chunkSize bytes, with up to
+// `parallelism` chunks in flight, so a request never holds much more than
+// chunkSize * parallelism bytes of the value at once.
+class StreamOptions {
+ public:
+  size_t chunkSize {1024 * 1024};
+  size_t parallelism {4};
+
+  // streamed writes go to a temporary key that is renamed over the real
+  // one at the end, so readers never see half a value. the temporary key
+  // expires after this long in case the writer goes away midway.
+  std::chrono::milliseconds tempKeyTtl {10 * 60 * 1000};
+};
+
+// returns the next chunk of the value, or nullptr once there are no more.
+using chunk_producer_t = std::function<std::unique_ptr<folly::IOBuf> ()>;
+
+// receives the value's chunks in order.
+using chunk_sink_t = std::function<void (std::unique_ptr<folly::IOBuf>)>;
+
+}} // fredis::redis
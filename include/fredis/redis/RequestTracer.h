@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <folly/FBString.h>
+
+namespace fredis { namespace redis {
+
+// timestamps for one request as it moves through a RedisClient.
+// stages that never happened (e.g. the request failed before it was
+// written) are left at the epoch.
+struct RequestTrace {
+  using time_point = std::chrono::steady_clock::time_point;
+  using micros_t = std::chrono::microseconds;
+
+  folly::fbstring command;
+  size_t keyBytes {0};
+  size_t requestBytes {0};
+  size_t responseBytes {0};
+  bool failed {false};
+
+  // when the request was handed to the event loop (see ScopedOrigin),
+  // otherwise when the command method was called.
+  time_point submitted;
+  time_point started;
+  time_point encoded;
+  time_point writeFlushed;
+  time_point firstByteRead;
+  time_point parsed;
+  time_point fulfilled;
+
+  micros_t total() const;
+  micros_t loopQueueTime() const;
+  micros_t encodeTime() const;
+  micros_t writeTime() const;
+  micros_t serverTime() const;
+  micros_t readTime() const;
+  micros_t callbackTime() const;
+
+  // GET key_bytes=3 total_us=.. queue_us=.. encode_us=.. write_us=..
+  //   server_us=.. read_us=.. callback_us=..
+  folly::fbstring describe() const;
+};
+
+class TracingOptions {
+ public:
+  // trace one in every `sampleEvery` requests. 1 traces everything.
+  size_t sampleEvery {100};
+
+  // sampled requests at least this slow go into the slow log.
+  std::chrono::milliseconds slowThreshold {10};
+  size_t slowLogCapacity {128};
+
+  // called on the client's EventBase thread for every sampled request.
+  std::function<void (const RequestTrace&)> spanHook;
+};
+
+// a client without a tracer does none of this work; with one, only
+// sampled requests pay for the extra clock reads.
+class RequestTracer {
+ protected:
+  TracingOptions options_;
+  mutable std::mutex slowLogMutex_;
+  std::deque<RequestTrace> slowLog_;
+  std::atomic<size_t> slowCount_ {0};
+  RequestTracer(const TracingOptions &options);
+ public:
+  static std::shared_ptr<RequestTracer> createShared(
+    const TracingOptions &options
+  );
+
+  const TracingOptions& getOptions() const;
+  bool shouldSample();
+  void finish(RequestTrace &&trace);
+
+  std::vector<RequestTrace> getSlowLog() const;
+  size_t getSlowCount() const;
+  void clearSlowLog();
+
+  // use inside a callback passed to runInEventBaseThread() so that
+  // requests issued in that scope count the time spent waiting in the
+  // EventBase's queue, e.g.
+  //   auto enqueuedAt = std::chrono::steady_clock::now();
+  //   ebt->runInEventBaseThread([=]() {
+  //     RequestTracer::ScopedOrigin origin {enqueuedAt};
+  //     client->get("foo");
+  //   });
+  class ScopedOrigin {
+   protected:
+    RequestTrace::time_point previous_;
+   public:
+    ScopedOrigin(RequestTrace::time_point origin);
+    ~ScopedOrigin();
+  };
+  static RequestTrace::time_point currentOrigin();
+};
+
+}} // fredis::redis
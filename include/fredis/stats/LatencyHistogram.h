@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <folly/FBVector.h>
+
+namespace fredis { namespace stats {
+
+// log-linear buckets in the style of HdrHistogram: every power of two
+// is split into 16 equal sub-buckets, so any recorded value lands in a
+// bucket within ~6% of it. values are microseconds.
+namespace histogram_layout {
+static const size_t kSubBucketBits = 4;
+static const size_t kSubBuckets = 1 << kSubBucketBits;
+static const size_t kMaxExponent = 40;
+static const size_t kNumBuckets = (kMaxExponent - kSubBucketBits + 2) * kSubBuckets;
+
+size_t bucketOfValue(uint64_t value);
+uint64_t lowerBoundOfBucket(size_t bucket);
+uint64_t upperBoundOfBucket(size_t bucket);
+}
+
+class HistogramSnapshot {
+ protected:
+  folly::fbvector<uint64_t> counts_;
+  uint64_t count_ {0};
+  uint64_t sum_ {0};
+  uint64_t max_ {0};
+ public:
+  HistogramSnapshot();
+  void addBucket(size_t bucket, uint64_t count);
+  void addSummary(uint64_t count, uint64_t sum, uint64_t max);
+  void merge(const HistogramSnapshot &other);
+
+  uint64_t getCount() const;
+  uint64_t getMax() const;
+  double getMean() const;
+
+  // `pct` in [0, 100]. returns the upper bound of the bucket holding
+  // that percentile, capped at the largest recorded value.
+  uint64_t getPercentile(double pct) const;
+};
+
+// a histogram with a single writer and any number of concurrent readers.
+// the writer never takes a lock or issues a locked instruction.
+class LatencyHistogram {
+ protected:
+  std::array<std::atomic<uint64_t>, histogram_layout::kNumBuckets> buckets_;
+  std::atomic<uint64_t> count_ {0};
+  std::atomic<uint64_t> sum_ {0};
+  std::atomic<uint64_t> max_ {0};
+ public:
+  LatencyHistogram();
+  LatencyHistogram(const LatencyHistogram&) = delete;
+  LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+  // must only be called from the owning thread.
+  void record(uint64_t value);
+  void mergeInto(HistogramSnapshot &snapshot) const;
+};
+
+}} // fredis::stats
@@ -0,0 +1,110 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include <folly/ThreadLocal.h>
+#include "fredis/stats/LatencyHistogram.h"
+
+namespace fredis { namespace stats {
+
+enum class Outcome {
+  SUCCESS, ERROR, TIMEOUT
+};
+
+struct CommandStatsSnapshot {
+  uint64_t count {0};
+  uint64_t errors {0};
+  uint64_t timeouts {0};
+  uint64_t bytesOut {0};
+  uint64_t bytesIn {0};
+  HistogramSnapshot latencyMicros;
+
+  void merge(const CommandStatsSnapshot &other);
+};
+
+struct StatsSnapshot {
+  std::map<std::string, CommandStatsSnapshot> commands;
+  std::chrono::steady_clock::time_point takenAt;
+
+  CommandStatsSnapshot total() const;
+
+  // one line per command:
+  //   GET count=10 errors=0 timeouts=0 bytes_out=250 bytes_in=90 mean_us=..
+  //     p50_us=.. p99_us=.. p999_us=.. max_us=..
+  folly::fbstring toString() const;
+};
+
+// counters and a latency histogram for one command on one thread.
+class CommandStats {
+ protected:
+  std::atomic<uint64_t> errors_ {0};
+  std::atomic<uint64_t> timeouts_ {0};
+  std::atomic<uint64_t> bytesOut_ {0};
+  std::atomic<uint64_t> bytesIn_ {0};
+  LatencyHistogram latency_;
+ public:
+  void record(std::chrono::microseconds latency, Outcome outcome,
+    size_t bytesOut, size_t bytesIn);
+  void mergeInto(CommandStatsSnapshot &snapshot) const;
+};
+
+// collects per-command stats from any number of threads. each thread
+// writes to its own shard without synchronization; getStats() merges
+// the shards while they keep being written to.
+class StatsRegistry {
+ public:
+  // commands past this many distinct names are folded into "OTHER".
+  static const size_t kMaxCommands = 256;
+
+  // how many folded names each shard remembers for its fast path; names
+  // past this go through the registry lock on every record.
+  static const size_t kMaxOverflowNames = 256;
+ protected:
+  class Shard {
+   protected:
+    std::atomic<CommandStats*> slots_[kMaxCommands];
+    std::unordered_map<folly::StringPiece, CommandStats*,
+      folly::StringPieceHash> byName_;
+    std::deque<std::string> overflowNames_;
+   public:
+    Shard();
+    ~Shard();
+    CommandStats* find(folly::StringPiece name);
+    CommandStats* create(folly::StringPiece internedName, size_t commandId);
+    CommandStats* createOverflow(folly::StringPiece name);
+    CommandStats* getSlot(size_t commandId) const;
+  };
+
+  std::mutex mutex_;
+  std::deque<std::string> commandNames_;
+  std::unordered_map<std::string, size_t> commandIds_;
+  std::vector<std::shared_ptr<Shard>> shards_;
+  folly::ThreadLocal<std::shared_ptr<Shard>> localShard_;
+  std::atomic<bool> enabled_ {true};
+
+  Shard* getLocalShard();
+  CommandStats* lookupSlow(Shard *shard, folly::StringPiece name);
+ public:
+  StatsRegistry();
+  StatsRegistry(const StatsRegistry&) = delete;
+  StatsRegistry& operator=(const StatsRegistry&) = delete;
+  static std::shared_ptr<StatsRegistry> createShared();
+
+  void setEnabled(bool enabled);
+  bool isEnabled() const;
+
+  void record(folly::StringPiece command, std::chrono::microseconds latency,
+    Outcome outcome, size_t bytesOut, size_t bytesIn);
+
+  StatsSnapshot getStats();
+};
+
+}} // fredis::stats
@@ -0,0 +1,63 @@
+#pragma once
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "fredis/testing/FakeServer.h"
+
+namespace fredis { namespace testing {
+
+// speaks the memcached text protocol: get gets set add replace append
+// prepend cas delete incr decr touch flush_all version quit, with flags,
+// cas uniques, expiry and noreply. also the meta commands mg ms md ma mn,
+// with opaques, quiet mode, and the vivify/recache/invalidate flags that
+// hand out win tokens. all data lives on the server's EventBase thread.
+class FakeMemcachedServer: public FakeServer {
+ protected:
+  using time_point = std::chrono::steady_clock::time_point;
+  struct Item {
+    std::string value;
+    uint32_t flags {0};
+    uint64_t casUnique {0};
+    time_point expiresAt;
+    // set by md with I; cleared when the item is replaced.
+    bool stale {false};
+    // a W flag has gone out, so later fetches get Z instead.
+    bool winTokenSent {false};
+  };
+  using meta_flags_t = std::vector<std::pair<char, std::string>>;
+  std::unordered_map<std::string, Item> items_;
+  uint64_t nextCasUnique_ {1};
+
+  FakeMemcachedServer(uint16_t port);
+  void handleInput(Connection &conn) override;
+
+  Item* lookup(const std::string &key);
+  time_point expiryOfExptime(int64_t exptime);
+  folly::fbstring executeRetrieval(const std::vector<std::string> &tokens);
+  folly::fbstring executeStorage(const std::vector<std::string> &tokens,
+    std::string &&data);
+  folly::fbstring executeOther(Connection &conn,
+    const std::vector<std::string> &tokens);
+
+  folly::fbstring executeMetaGet(const std::vector<std::string> &tokens);
+  folly::fbstring executeMetaSet(const std::vector<std::string> &tokens,
+    std::string &&data);
+  folly::fbstring executeMetaDelete(const std::vector<std::string> &tokens);
+  folly::fbstring executeMetaArithmetic(
+    const std::vector<std::string> &tokens);
+
+  // the k, O, c, f, s and t return flags asked for in `flags`, in order.
+  std::string metaReturnFlags(const meta_flags_t &flags,
+    const std::string &key, const Item *item);
+ public:
+  static std::shared_ptr<FakeMemcachedServer> createShared(uint16_t port = 0);
+};
+
+namespace detail {
+bool isMemcachedStorageCommand(folly::StringPiece command);
+}
+
+}} // fredis::testing
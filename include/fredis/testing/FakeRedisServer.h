@@ -0,0 +1,119 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "fredis/testing/FakeServer.h"
+
+namespace fredis { namespace testing {
+
+// speaks enough RESP for the commands fredis uses: PING ECHO GET SET SETNX
+// GETSET MGET MSET DEL EXISTS STRLEN APPEND GETRANGE INCR INCRBY DECR DECRBY
+// EXPIRE PERSIST TTL RENAME KEYS FLUSHALL FLUSHDB LPUSH RPUSH LPOP RPOP
+// LLEN LRANGE LINDEX LREM LMPOP BLMPOP LMOVE BLMOVE BLPOP BRPOP HSET HMSET
+// HGET HMGET HGETALL HLEN SADD SMEMBERS SCARD ZADD ZCARD ZRANGE XADD XLEN XGROUP CREATE XREADGROUP XACK
+// XAUTOCLAIM XPENDING SUBSCRIBE UNSUBSCRIBE PUBLISH.
+// XREADGROUP reads a single stream. blocking commands hold up their
+// connection until a write or the timeout, like the real thing.
+// all data lives on the server's EventBase thread.
+class FakeRedisServer: public FakeServer {
+ public:
+  using args_t = std::vector<std::string>;
+  enum class Kind {
+    STRING, LIST, HASH, SET, ZSET, STREAM
+  };
+ protected:
+  using time_point = std::chrono::steady_clock::time_point;
+  using stream_id_t = std::pair<uint64_t, uint64_t>;
+  struct PendingStreamEntry {
+    std::string consumer;
+    time_point deliveredAt;
+    uint64_t deliveries {1};
+  };
+  struct StreamGroup {
+    stream_id_t lastDelivered;
+    std::map<stream_id_t, PendingStreamEntry> pending;
+  };
+  struct Entry {
+    Kind kind {Kind::STRING};
+    std::string str;
+    std::deque<std::string> list;
+    std::map<std::string, std::string> hash;
+    std::set<std::string> members;
+    std::map<std::string, double> scores;
+    std::map<stream_id_t, args_t> stream;
+    stream_id_t lastStreamId;
+    std::map<std::string, StreamGroup> groups;
+    time_point expiresAt;
+  };
+  struct BlockedCommand {
+    args_t args;
+    std::vector<std::string> keys;
+    uint64_t generation {0};
+  };
+  std::unordered_map<std::string, Entry> data_;
+  std::map<std::string, std::set<uint64_t>> channels_;
+  std::map<uint64_t, Connection*> subscribers_;
+  // connections parked in a blocking command, by connection id.
+  std::map<uint64_t, BlockedCommand> blocked_;
+
+  // commands queued between MULTI and EXEC, by connection.
+  std::map<uint64_t, std::vector<args_t>> transactions_;
+  uint64_t nextBlockGeneration_ {1};
+
+  FakeRedisServer(uint16_t port);
+  void handleInput(Connection &conn) override;
+  void handleClosed(Connection &conn) override;
+
+  Entry* lookup(const std::string &key);
+
+  // the entry under `key`, created if missing; nullptr (with `error` set)
+  // if it holds a different kind of value.
+  Entry* lookupOrCreate(const std::string &key, Kind kind,
+    folly::fbstring &error);
+  folly::fbstring execute(Connection &conn, const args_t &args);
+
+  // stream commands. an empty reply means an XREADGROUP found nothing and
+  // is blocking; if `park` it has just parked the connection.
+  folly::fbstring executeStream(Connection &conn, const std::string &cmd,
+    const args_t &args, bool park = true);
+
+  // LMPOP BLMPOP LMOVE BLMOVE BLPOP BRPOP, with the same empty-reply
+  // convention as executeStream().
+  folly::fbstring executeBlockingPop(Connection &conn, const std::string &cmd,
+    const args_t &args, bool park = true);
+
+  // parks the connection until one of `keys` is written (when the command
+  // is retried) or the timeout passes (when it gets a nil reply). no
+  // further input is read from it meanwhile.
+  void blockOn(Connection &conn, const args_t &args,
+    std::vector<std::string> keys, int64_t timeoutMs);
+  void wakeBlocked(const std::string &key);
+  void unblock(uint64_t connectionId, folly::fbstring &&reply);
+  folly::fbstring incrementBy(const std::string &key, int64_t amount);
+ public:
+  static std::shared_ptr<FakeRedisServer> createShared(uint16_t port = 0);
+};
+
+namespace detail {
+// 1 when a full request was parsed into `args`, 0 when more bytes are
+// needed, -1 on a malformed request. `consumed` is only set on success.
+int parseRespRequest(folly::StringPiece input, size_t &consumed,
+  FakeRedisServer::args_t &args);
+
+folly::fbstring respSimple(folly::StringPiece status);
+folly::fbstring respError(folly::StringPiece message);
+folly::fbstring respInteger(int64_t value);
+folly::fbstring respBulk(folly::StringPiece value);
+folly::fbstring respNil();
+folly::fbstring respArray(const std::vector<folly::fbstring> &encodedItems);
+
+bool globMatch(folly::StringPiece pattern, folly::StringPiece text);
+}
+
+}} // fredis::testing
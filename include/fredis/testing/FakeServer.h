@@ -0,0 +1,117 @@
+#pragma once
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <event.h>
+#include <folly/FBString.h>
+#include <folly/Range.h>
+#include <folly/SocketAddress.h>
+#include <folly/io/async/AsyncServerSocket.h>
+#include <folly/io/async/AsyncSocket.h>
+#include <folly/io/async/EventBase.h>
+#include "fredis/folly_util/EBThread.h"
+#include "fredis/testing/FaultInjector.h"
+#include "fredis/FredisError.h"
+#include "fredis/macros.h"
+
+namespace fredis { namespace testing {
+
+FREDIS_DECLARE_EXCEPTION(FakeServerError, FredisError);
+
+// a loopback TCP server running on its own EBThread. subclasses speak a
+// protocol; this handles accepting, buffering, and delaying, splitting or
+// dropping replies according to the FaultInjector.
+class FakeServer: public folly::AsyncServerSocket::AcceptCallback {
+ public:
+  class Connection: public folly::AsyncSocket::ReadCallback {
+   protected:
+    using time_point = std::chrono::steady_clock::time_point;
+    struct PendingReply {
+      time_point readyAt;
+      folly::fbstring data;
+    };
+    FakeServer *server_ {nullptr};
+    uint64_t id_ {0};
+    folly::AsyncSocket::UniquePtr socket_;
+    std::string input_;
+    char readBuffer_[64 * 1024];
+    std::deque<PendingReply> pending_;
+    time_point lastReadyAt_;
+    struct event timer_;
+    bool timerArmed_ {false};
+    bool closed_ {false};
+
+    void enqueue(time_point readyAt, folly::fbstring &&data);
+    void flushReady();
+    void armTimer();
+    static void onTimer(int fd, short event, void *arg);
+   public:
+    Connection(FakeServer *server, uint64_t id,
+      folly::AsyncSocket::UniquePtr socket);
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+    ~Connection();
+
+    uint64_t getId() const;
+    bool isClosed() const;
+
+    // bytes received but not yet consumed by the protocol handler.
+    std::string& input();
+
+    // queue a reply to a request, subject to fault injection.
+    void reply(folly::StringPiece command, folly::fbstring &&data);
+
+    // queue unsolicited output (e.g. pubsub messages) behind earlier replies.
+    void push(folly::fbstring &&data);
+    void close();
+
+    void getReadBuffer(void **bufReturn, size_t *lenReturn) override;
+    void readDataAvailable(size_t len) noexcept override;
+    void readEOF() noexcept override;
+    void readErr(const folly::AsyncSocketException &ex) noexcept override;
+  };
+
+ protected:
+  std::shared_ptr<folly_util::EBThread> ebt_;
+  std::shared_ptr<folly::AsyncServerSocket> serverSocket_;
+  std::map<uint64_t, std::unique_ptr<Connection>> connections_;
+  uint64_t nextConnectionId_ {1};
+  uint16_t requestedPort_ {0};
+  folly::SocketAddress address_;
+  FaultInjector faults_;
+
+  // reset when the server stops, so deferred work can tell it's gone.
+  std::shared_ptr<bool> aliveToken_;
+
+  FakeServer(uint16_t port);
+  FakeServer(const FakeServer&) = delete;
+  FakeServer& operator=(const FakeServer&) = delete;
+
+  // consume as many complete requests from conn.input() as are available.
+  virtual void handleInput(Connection &conn) = 0;
+  virtual void handleClosed(Connection &conn);
+  void removeConnection(uint64_t id);
+  folly::EventBase* getEventBase();
+ public:
+  virtual ~FakeServer();
+
+  // binds and starts accepting; blocks until the server is listening.
+  void start();
+  void stop();
+
+  uint16_t getPort() const;
+  const folly::SocketAddress& getAddress() const;
+  FaultInjector& getFaultInjector();
+
+  // closes every open client connection, e.g. to exercise reconnects.
+  void dropConnections();
+  size_t getConnectionCount();
+
+  void connectionAccepted(int fd,
+    const folly::SocketAddress &clientAddr) noexcept override;
+  void acceptError(const std::exception &ex) noexcept override;
+};
+
+}} // fredis::testing
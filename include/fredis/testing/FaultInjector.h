@@ -0,0 +1,92 @@
+#pragma once
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <folly/Range.h>
+
+namespace fredis { namespace testing {
+
+using micros_t = std::chrono::microseconds;
+
+class ServiceTime {
+ public:
+  enum class Kind {
+    CONSTANT, UNIFORM, EXPONENTIAL
+  };
+  Kind kind {Kind::CONSTANT};
+  micros_t low {0};
+  micros_t high {0};
+
+  static ServiceTime constant(micros_t value);
+  static ServiceTime uniform(micros_t low, micros_t high);
+  static ServiceTime exponential(micros_t mean);
+
+  template<typename TEngine>
+  micros_t sample(TEngine &engine) const {
+    switch (kind) {
+      case Kind::UNIFORM: {
+        std::uniform_int_distribution<int64_t> dist(low.count(), high.count());
+        return micros_t {dist(engine)};
+      }
+      case Kind::EXPONENTIAL: {
+        if (low.count() <= 0) {
+          return micros_t {0};
+        }
+        std::exponential_distribution<double> dist(1.0 / (double) low.count());
+        return micros_t {(int64_t) dist(engine)};
+      }
+      default:
+        return low;
+    }
+  }
+};
+
+// what the fake server does to replies for one command.
+class FaultProfile {
+ public:
+  ServiceTime serviceTime;
+
+  // hold the connection's output back for stallDuration.
+  double stallProbability {0};
+  micros_t stallDuration {0};
+
+  // write half a reply, wait partialWriteGap, then write the rest.
+  double partialWriteProbability {0};
+  micros_t partialWriteGap {1000};
+
+  // close the connection instead of replying.
+  double disconnectProbability {0};
+};
+
+struct FaultDecision {
+  micros_t delay {0};
+  bool partialWrite {false};
+  micros_t partialWriteGap {0};
+  bool disconnect {false};
+};
+
+// per-command fault configuration, safe to change from any thread while
+// a server is running. decisions come from a seeded engine so a given
+// seed and request sequence always fails the same way.
+class FaultInjector {
+ protected:
+  std::mutex mutex_;
+  FaultProfile defaultProfile_;
+  std::map<std::string, FaultProfile> commandProfiles_;
+  std::mt19937_64 engine_;
+ public:
+  FaultInjector(uint64_t seed = 1);
+
+  void setSeed(uint64_t seed);
+  void setDefaultProfile(const FaultProfile &profile);
+
+  // command names are matched case-insensitively.
+  void setCommandProfile(folly::StringPiece command, const FaultProfile &profile);
+  void clear();
+
+  FaultDecision decide(folly::StringPiece command);
+};
+
+}} // fredis::testing
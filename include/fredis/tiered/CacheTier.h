@@ -0,0 +1,78 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/Unit.h>
+#include "fredis/memcached/MemcachedAsyncClient.h"
+#include "fredis/redis/RedisClient.h"
+
+namespace fredis { namespace tiered {
+
+// one layer of a TieredCache, wrapping one of the existing clients.
+// like the clients themselves, use it on their EventBase thread only.
+class CacheTier {
+ protected:
+  std::string name_;
+  time_t maxTtl_ {0};
+
+  CacheTier(const std::string &name, time_t maxTtl);
+ public:
+  virtual ~CacheTier() = default;
+
+  const std::string& getName() const;
+
+  // values written to this tier live at most this many seconds, and
+  // backfilled values exactly this long; 0 for no limit, which only the
+  // lowest tier of a TieredCache may have.
+  time_t getMaxTtl() const;
+
+  // `ttl` capped at getMaxTtl().
+  time_t capTtl(time_t ttl) const;
+
+  // resolves to none on a miss.
+  virtual folly::Future<folly::Optional<folly::fbstring>> get(
+    folly::StringPiece key) = 0;
+  virtual folly::Future<folly::Unit> set(folly::StringPiece key,
+    folly::StringPiece value, time_t ttl) = 0;
+  virtual folly::Future<folly::Unit> del(folly::StringPiece key) = 0;
+};
+
+class MemcachedTier: public CacheTier {
+ protected:
+  std::shared_ptr<memcached::MemcachedAsyncClient> client_;
+  MemcachedTier(std::shared_ptr<memcached::MemcachedAsyncClient> client,
+    const std::string &name, time_t maxTtl);
+ public:
+  static std::shared_ptr<MemcachedTier> createShared(
+    std::shared_ptr<memcached::MemcachedAsyncClient> client,
+    time_t maxTtl = 0, const std::string &name = "memcached");
+
+  folly::Future<folly::Optional<folly::fbstring>> get(
+    folly::StringPiece key) override;
+  folly::Future<folly::Unit> set(folly::StringPiece key,
+    folly::StringPiece value, time_t ttl) override;
+  folly::Future<folly::Unit> del(folly::StringPiece key) override;
+};
+
+class RedisTier: public CacheTier {
+ protected:
+  std::shared_ptr<redis::RedisClient> client_;
+  RedisTier(std::shared_ptr<redis::RedisClient> client,
+    const std::string &name, time_t maxTtl);
+ public:
+  static std::shared_ptr<RedisTier> createShared(
+    std::shared_ptr<redis::RedisClient> client,
+    time_t maxTtl = 0, const std::string &name = "redis");
+
+  folly::Future<folly::Optional<folly::fbstring>> get(
+    folly::StringPiece key) override;
+  // SET with EX, compressed by the client's compressor if it has one.
+  folly::Future<folly::Unit> set(folly::StringPiece key,
+    folly::StringPiece value, time_t ttl) override;
+  folly::Future<folly::Unit> del(folly::StringPiece key) override;
+};
+
+}} // fredis::tiered
@@ -0,0 +1,175 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <folly/FBString.h>
+#include <folly/Optional.h>
+#include <folly/Range.h>
+#include <folly/ExceptionWrapper.h>
+#include <folly/futures/Future.h>
+#include <folly/futures/Unit.h>
+#include "fredis/FredisError.h"
+#include "fredis/macros.h"
+#include "fredis/stats/LatencyHistogram.h"
+#include "fredis/tiered/CacheTier.h"
+
+namespace fredis { namespace tiered {
+
+FREDIS_DECLARE_EXCEPTION(TieredCacheError, FredisError);
+
+enum class LookupMode {
+  // ask each tier in turn, stopping at the first hit.
+  SEQUENTIAL,
+  // ask every tier at once; a lower tier's hit is used as soon as every
+  // tier above it has missed. costs lower-tier traffic on upper-tier hits,
+  // saves the upper tiers' round trip on their misses.
+  PARALLEL
+};
+
+enum class WritePolicy {
+  // set() writes every tier.
+  WRITE_THROUGH,
+  // set() writes only the lowest tier and deletes the key from the ones
+  // above it, which pick the value back up by backfill once it's read.
+  // a get that read the old value before the write doesn't backfill it.
+  WRITE_AROUND
+};
+
+class TieredCacheOptions {
+ public:
+  LookupMode lookupMode {LookupMode::SEQUENTIAL};
+  WritePolicy writePolicy {WritePolicy::WRITE_THROUGH};
+
+  // on a lower-tier hit, copy the value into the tiers above it, without
+  // holding up the get.
+  bool backfill {true};
+};
+
+struct TierStats {
+  std::string name;
+  uint64_t lookups {0};
+  uint64_t hits {0};
+  uint64_t misses {0};
+  // failed lookups, which count as misses for the get.
+  uint64_t errors {0};
+  uint64_t backfills {0};
+  uint64_t backfillErrors {0};
+
+  // microseconds gets spent waiting on this tier.
+  stats::HistogramSnapshot latency;
+  // this tier's part of the time gets spent waiting on tiers, in [0, 1].
+  // with parallel lookups the tiers' waits overlap, so this is a share of
+  // the summed waits rather than of the gets' wall time.
+  double latencyShare {0};
+
+  double getHitRatio() const;
+};
+
+// gets that failed are counted in neither hits nor misses.
+struct TieredCacheStats {
+  uint64_t gets {0};
+  uint64_t hits {0};
+  uint64_t misses {0};
+  // lower-tier hits not copied up because the key was written while
+  // they were being read.
+  uint64_t backfillsSkipped {0};
+  // microseconds from get() to its result.
+  stats::HistogramSnapshot latency;
+  std::vector<TierStats> tiers;
+
+  double getHitRatio() const;
+};
+
+// a read-through stack of cache tiers, fastest first, e.g. a memcached L1
+// in front of a Redis L2. a tier that fails a lookup is treated as missing
+// the key; get() only fails if every tier does. all tiers must share one
+// EventBase, and the cache is used on that thread only; stats can be read
+// from anywhere.
+class TieredCache: public std::enable_shared_from_this<TieredCache> {
+ protected:
+  struct TierCounters {
+    std::atomic<uint64_t> lookups {0};
+    std::atomic<uint64_t> hits {0};
+    std::atomic<uint64_t> misses {0};
+    std::atomic<uint64_t> errors {0};
+    std::atomic<uint64_t> backfills {0};
+    std::atomic<uint64_t> backfillErrors {0};
+    stats::LatencyHistogram latency;
+  };
+  struct ParallelLookup;
+
+  // a key with gets or writes in flight. `writes` counts writes starting
+  // and finishing, so a get can tell whether the value it read may be
+  // older than a write; the entry goes once the key is idle.
+  struct KeyActivity {
+    size_t reads {0};
+    size_t writesInFlight {0};
+    uint64_t writes {0};
+  };
+  std::unordered_map<folly::fbstring, KeyActivity> activity_;
+
+  std::vector<std::shared_ptr<CacheTier>> tiers_;
+  TieredCacheOptions options_;
+  std::unique_ptr<TierCounters[]> counters_;
+  std::atomic<uint64_t> gets_ {0};
+  std::atomic<uint64_t> hits_ {0};
+  std::atomic<uint64_t> misses_ {0};
+  std::atomic<uint64_t> backfillsSkipped_ {0};
+  stats::LatencyHistogram latency_;
+
+  TieredCache(std::vector<std::shared_ptr<CacheTier>> tiers,
+    const TieredCacheOptions &options);
+
+  // asks tier `index`, recording its outcome.
+  folly::Future<folly::Optional<folly::fbstring>> lookup(size_t index,
+    const folly::fbstring &key);
+  folly::Future<folly::Optional<folly::fbstring>> getSequential(
+    const folly::fbstring &key, uint64_t writesSeen, size_t index,
+    size_t failures, folly::exception_wrapper lastError);
+  folly::Future<folly::Optional<folly::fbstring>> getParallel(
+    const folly::fbstring &key, uint64_t writesSeen);
+
+  // resolves a parallel lookup once the answers so far decide it.
+  void settle(const folly::fbstring &key, ParallelLookup &lookup);
+
+  // beginRead() returns the key's write count, for backfill().
+  uint64_t beginRead(const folly::fbstring &key);
+  void endRead(const folly::fbstring &key);
+  void beginWrite(const folly::fbstring &key);
+  void endWrite(const folly::fbstring &key);
+  void forgetIfIdle(const folly::fbstring &key);
+  // endWrite() once `write` is done.
+  folly::Future<folly::Unit> endWriteAfter(const folly::fbstring &key,
+    folly::Future<folly::Unit> write);
+
+  // copies a value found in tier `found` into every tier above it, unless
+  // the key has been written since the get that found it began.
+  void backfill(const folly::fbstring &key, const folly::fbstring &value,
+    size_t found, uint64_t writesSeen);
+ public:
+  // throws TieredCacheError unless every tier but the lowest has a max
+  // ttl: backfilled copies would otherwise never expire, and could keep
+  // serving a value long after the lower tier dropped it.
+  static std::shared_ptr<TieredCache> createShared(
+    std::vector<std::shared_ptr<CacheTier>> tiers,
+    const TieredCacheOptions &options = TieredCacheOptions {});
+
+  const TieredCacheOptions& getOptions() const;
+
+  // resolves to none if no tier has the key.
+  folly::Future<folly::Optional<folly::fbstring>> get(folly::StringPiece key);
+
+  // writes per the write policy. each tier caps `ttl` at its own max ttl,
+  // so an L1 can hold values for less time than the L2 behind it.
+  folly::Future<folly::Unit> set(folly::StringPiece key,
+    folly::StringPiece value, time_t ttl = 0);
+
+  // removes the key from every tier.
+  folly::Future<folly::Unit> del(folly::StringPiece key);
+
+  TieredCacheStats getStats() const;
+};
+
+}} // fredis::tiered
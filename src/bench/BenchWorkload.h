@@ -0,0 +1,118 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+#include <folly/FBString.h>
+
+namespace fredis { namespace bench {
+
+// YCSB's zipfian generator (Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases"). theta <= 0 gives uniform keys.
+// ranks are scrambled before they're turned into keys, so the hot keys
+// don't all hash to the same place.
+class KeyChooser {
+ protected:
+  uint64_t keySpace_ {1};
+  double theta_ {0};
+  double zetan_ {0};
+  double alpha_ {0};
+  double eta_ {0};
+  std::uniform_real_distribution<double> unit_ {0.0, 1.0};
+  std::uniform_int_distribution<uint64_t> uniform_;
+
+  static double zeta(uint64_t n, double theta) {
+    double sum = 0;
+    for (uint64_t i = 1; i <= n; i++) {
+      sum += 1.0 / std::pow((double) i, theta);
+    }
+    return sum;
+  }
+
+  static uint64_t scramble(uint64_t rank) {
+    // fnv-1a over the bytes of the rank.
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 8; i++) {
+      hash ^= (rank >> (i * 8)) & 0xff;
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+ public:
+  KeyChooser(uint64_t keySpace, double theta)
+    : keySpace_(std::max(keySpace, (uint64_t) 1)),
+      theta_(std::min(theta, 0.9999)),
+      uniform_(0, keySpace_ - 1) {
+    if (theta_ > 0) {
+      zetan_ = zeta(keySpace_, theta_);
+      double zeta2 = zeta(2, theta_);
+      alpha_ = 1.0 / (1.0 - theta_);
+      eta_ = (1.0 - std::pow(2.0 / (double) keySpace_, 1.0 - theta_))
+        / (1.0 - zeta2 / zetan_);
+    }
+  }
+
+  template<typename TEngine>
+  uint64_t nextIndex(TEngine &engine) {
+    if (theta_ <= 0) {
+      return uniform_(engine);
+    }
+    double u = unit_(engine);
+    double uz = u * zetan_;
+    uint64_t rank = 0;
+    if (uz < 1.0) {
+      rank = 0;
+    } else if (uz < 1.0 + std::pow(0.5, theta_)) {
+      rank = 1;
+    } else {
+      rank = (uint64_t) ((double) keySpace_
+        * std::pow(eta_ * u - eta_ + 1.0, alpha_));
+    }
+    rank = std::min(rank, keySpace_ - 1);
+    return scramble(rank) % keySpace_;
+  }
+};
+
+// a pool of random printable values whose sizes follow the chosen
+// distribution ("fixed", "uniform" or "exponential").
+class ValuePool {
+ protected:
+  std::vector<folly::fbstring> values_;
+ public:
+  template<typename TEngine>
+  ValuePool(TEngine &engine, const std::string &distribution,
+      size_t minSize, size_t maxSize, size_t poolSize) {
+    maxSize = std::max(minSize, maxSize);
+    std::uniform_int_distribution<size_t> uniformSize(minSize, maxSize);
+    double mean = (double) (minSize + maxSize) / 2.0;
+    std::exponential_distribution<double> expSize(1.0 / std::max(1.0, mean));
+    std::uniform_int_distribution<int> printable('a', 'z');
+    values_.reserve(poolSize);
+    for (size_t i = 0; i < poolSize; i++) {
+      size_t size = minSize;
+      if (distribution == "uniform") {
+        size = uniformSize(engine);
+      } else if (distribution == "exponential") {
+        size = (size_t) expSize(engine);
+        size = std::max(minSize, std::min(maxSize, size));
+      }
+      folly::fbstring value;
+      value.reserve(size);
+      for (size_t j = 0; j < size; j++) {
+        value.push_back((char) printable(engine));
+      }
+      values_.push_back(std::move(value));
+    }
+  }
+
+  template<typename TEngine>
+  const folly::fbstring& next(TEngine &engine) {
+    std::uniform_int_distribution<size_t> pick(0, values_.size() - 1);
+    return values_[pick(engine)];
+  }
+};
+
+}} // fredis::bench
@@ -0,0 +1,315 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <folly/Baton.h>
+#include <folly/Conv.h>
+#include <folly/FBString.h>
+#include <folly/futures/Try.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "fredis/folly_util/EBThread.h"
+#include "fredis/memcached/MemcachedConfig.h"
+#include "fredis/memcached/MemcachedSyncClient.h"
+#include "fredis/redis/RedisClient.h"
+#include "fredis/stats/LatencyHistogram.h"
+#include "fredis/testing/FakeMemcachedServer.h"
+#include "fredis/testing/FakeRedisServer.h"
+#include "bench/BenchWorkload.h"
+
+DEFINE_string(backend, "redis", "redis or memcached");
+DEFINE_string(host, "127.0.0.1", "server host");
+DEFINE_int32(port, 0, "server port (default: 6379 for redis, 11211 for memcached)");
+DEFINE_int32(connections, 4, "total client connections");
+DEFINE_int32(threads, 2, "EventBase threads (redis); memcached uses one thread per connection");
+DEFINE_int32(pipeline, 16, "outstanding requests per redis connection");
+DEFINE_int32(duration_secs, 10, "how long to measure for");
+DEFINE_uint64(keyspace, 100000, "number of distinct keys");
+DEFINE_string(key_prefix, "fredis_bench:", "prefix for generated keys");
+DEFINE_double(zipf, 0.0, "zipfian skew in [0, 1); 0 picks keys uniformly");
+DEFINE_double(read_ratio, 0.9, "fraction of operations that are reads");
+DEFINE_string(value_dist, "fixed", "value size distribution: fixed, uniform or exponential");
+DEFINE_uint64(value_min, 100, "smallest value size in bytes");
+DEFINE_uint64(value_max, 100, "largest value size in bytes");
+DEFINE_bool(loopback, false, "run against an in-process fake server instead of --host/--port");
+DEFINE_string(memcached_preset, "default", "memcached behaviors: default, low-latency or bulk-write");
+DEFINE_int32(fake_service_us, 0, "with --loopback, mean exponential service time per request");
+
+using namespace std;
+using fredis::folly_util::EBThread;
+using fredis::redis::RedisClient;
+using fredis::redis::RedisDynamicResponse;
+using fredis::memcached::MemcachedBehaviors;
+using fredis::memcached::MemcachedConfig;
+using fredis::memcached::MemcachedSyncClient;
+using fredis::stats::LatencyHistogram;
+using fredis::stats::HistogramSnapshot;
+using fredis::bench::KeyChooser;
+using fredis::bench::ValuePool;
+using steady_clock_t = std::chrono::steady_clock;
+
+namespace {
+
+// everything one load-generating thread touches. the histogram has a
+// single writer, so it must only be recorded into from that thread.
+struct Worker {
+  std::mt19937_64 engine;
+  KeyChooser keys;
+  ValuePool values;
+  LatencyHistogram latency;
+  std::atomic<uint64_t> ops {0};
+  std::atomic<uint64_t> errors {0};
+  std::bernoulli_distribution isRead;
+
+  Worker(uint64_t seed)
+    : engine(seed),
+      keys(FLAGS_keyspace, FLAGS_zipf),
+      values(engine, FLAGS_value_dist, FLAGS_value_min, FLAGS_value_max, 1024),
+      isRead(FLAGS_read_ratio) {}
+
+  folly::fbstring nextKey() {
+    return folly::to<folly::fbstring>(FLAGS_key_prefix, keys.nextIndex(engine));
+  }
+
+  // only called while measuring.
+  void record(steady_clock_t::time_point startedAt, bool failed) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      steady_clock_t::now() - startedAt
+    );
+    latency.record((uint64_t) elapsed.count());
+    ops.fetch_add(1, std::memory_order_relaxed);
+    if (failed) {
+      errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+std::atomic<bool> stopping {false};
+
+// set from the moment every client has connected until `stopping`, so
+// that neither connection setup nor the drain afterwards is counted.
+std::atomic<bool> measuring {false};
+
+// lets the clients run for --duration_secs once they're all connected,
+// then stops them; returns the seconds measured.
+double measure() {
+  auto startedAt = steady_clock_t::now();
+  measuring.store(true);
+  this_thread::sleep_for(chrono::seconds(FLAGS_duration_secs));
+  measuring.store(false);
+  stopping.store(true);
+  return std::chrono::duration<double>(
+    steady_clock_t::now() - startedAt
+  ).count();
+}
+
+struct RedisChain {
+  std::shared_ptr<EBThread> ebt;
+  std::shared_ptr<RedisClient> client;
+  Worker *worker;
+  std::atomic<int> *liveChains;
+};
+
+void issueRedis(RedisChain chain) {
+  if (stopping.load(std::memory_order_relaxed)) {
+    chain.liveChains->fetch_sub(1);
+    return;
+  }
+  auto worker = chain.worker;
+  auto key = worker->nextKey();
+  auto startedAt = steady_clock_t::now();
+  auto future = worker->isRead(worker->engine)
+    ? chain.client->get(key)
+    : chain.client->set(key, worker->values.next(worker->engine));
+  future.then([chain, startedAt](folly::Try<RedisDynamicResponse> result) {
+    bool failed = result.hasException() ||
+      result.value().isType(RedisDynamicResponse::ResponseType::ERROR);
+    if (measuring.load(std::memory_order_relaxed)) {
+      chain.worker->record(startedAt, failed);
+    }
+    if (failed) {
+      // an already-failed future runs this inline; bounce through the
+      // loop instead of recursing.
+      chain.ebt->getBase()->runInLoop([chain]() {
+        issueRedis(chain);
+      });
+      return;
+    }
+    issueRedis(chain);
+  });
+}
+
+double runRedis(std::vector<std::unique_ptr<Worker>> &workers) {
+  int port = FLAGS_port ? FLAGS_port : 6379;
+  std::vector<std::shared_ptr<EBThread>> threads;
+  for (int i = 0; i < FLAGS_threads; i++) {
+    auto ebt = EBThread::createShared();
+    ebt->start();
+    threads.push_back(ebt);
+  }
+  std::vector<std::shared_ptr<RedisClient>> clients;
+  std::atomic<int> liveChains {0};
+  for (int i = 0; i < FLAGS_connections; i++) {
+    size_t threadIdx = i % threads.size();
+    auto ebt = threads[threadIdx];
+    auto worker = workers[threadIdx].get();
+    folly::Baton<std::atomic> connected;
+    std::shared_ptr<RedisClient> client;
+    ebt->runInEventBaseThread([&]() {
+      client = RedisClient::createShared(ebt->getBase(), FLAGS_host, port);
+      client->connect().then(
+        [&](folly::Try<std::shared_ptr<RedisClient>> result) {
+          if (result.hasException()) {
+            LOG(FATAL) << "couldn't connect to redis: "
+                       << result.exception().what();
+          }
+          for (int j = 0; j < FLAGS_pipeline; j++) {
+            liveChains.fetch_add(1);
+            issueRedis(RedisChain {ebt, client, worker, &liveChains});
+          }
+          connected.post();
+        });
+    });
+    connected.wait();
+    clients.push_back(client);
+  }
+  double elapsedSecs = measure();
+  while (liveChains.load() > 0) {
+    this_thread::sleep_for(chrono::milliseconds(10));
+  }
+  for (auto &ebt: threads) {
+    ebt->stop();
+    ebt->join();
+  }
+  return elapsedSecs;
+}
+
+double runMemcached(std::vector<std::unique_ptr<Worker>> &workers) {
+  int port = FLAGS_port ? FLAGS_port : 11211;
+  auto behaviors = MemcachedBehaviors::preset(FLAGS_memcached_preset);
+  if (behaviors.hasException()) {
+    LOG(FATAL) << behaviors.exception().what();
+  }
+  MemcachedConfig config {folly::SocketAddress(FLAGS_host.c_str(), port)};
+  config.setBehaviors(behaviors.value());
+  std::vector<std::thread> threads;
+  std::atomic<int> connected {0};
+  for (int i = 0; i < FLAGS_connections; i++) {
+    auto worker = workers[i].get();
+    threads.emplace_back([worker, config, &connected]() {
+      MemcachedSyncClient client {config};
+      client.connectExcept();
+      connected.fetch_add(1);
+      while (!stopping.load(std::memory_order_relaxed)) {
+        auto key = worker->nextKey();
+        auto startedAt = steady_clock_t::now();
+        bool failed = false;
+        if (worker->isRead(worker->engine)) {
+          failed = client.get(key).hasException();
+        } else {
+          failed = client.set(key, worker->values.next(worker->engine))
+            .hasException();
+        }
+        if (measuring.load(std::memory_order_relaxed)) {
+          worker->record(startedAt, failed);
+        }
+      }
+    });
+  }
+  while (connected.load() < FLAGS_connections) {
+    this_thread::sleep_for(chrono::milliseconds(1));
+  }
+  double elapsedSecs = measure();
+  for (auto &thread: threads) {
+    thread.join();
+  }
+  return elapsedSecs;
+}
+
+} // anonymous namespace
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  google::InstallFailureSignalHandler();
+
+  bool isRedis = FLAGS_backend == "redis";
+  if (!isRedis && FLAGS_backend != "memcached") {
+    LOG(FATAL) << "unknown --backend '" << FLAGS_backend << "'";
+  }
+  if (FLAGS_connections <= 0 || (isRedis && FLAGS_threads <= 0)) {
+    LOG(FATAL) << "--connections and --threads must be positive";
+  }
+  if (FLAGS_duration_secs <= 0) {
+    LOG(FATAL) << "--duration_secs must be positive";
+  }
+  size_t numWorkers = isRedis ? FLAGS_threads : FLAGS_connections;
+  std::random_device seeder;
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (size_t i = 0; i < numWorkers; i++) {
+    workers.emplace_back(new Worker {seeder()});
+  }
+
+  std::shared_ptr<fredis::testing::FakeServer> fakeServer;
+  if (FLAGS_loopback) {
+    if (isRedis) {
+      fakeServer = fredis::testing::FakeRedisServer::createShared();
+    } else {
+      fakeServer = fredis::testing::FakeMemcachedServer::createShared();
+    }
+    if (FLAGS_fake_service_us > 0) {
+      fredis::testing::FaultProfile profile;
+      profile.serviceTime = fredis::testing::ServiceTime::exponential(
+        fredis::testing::micros_t {FLAGS_fake_service_us}
+      );
+      fakeServer->getFaultInjector().setDefaultProfile(profile);
+    }
+    fakeServer->start();
+    FLAGS_host = "127.0.0.1";
+    FLAGS_port = fakeServer->getPort();
+  }
+
+  double elapsedSecs = isRedis ? runRedis(workers) : runMemcached(workers);
+  if (fakeServer) {
+    fakeServer->stop();
+  }
+
+  HistogramSnapshot latency;
+  uint64_t ops = 0;
+  uint64_t errors = 0;
+  for (auto &worker: workers) {
+    worker->latency.mergeInto(latency);
+    ops += worker->ops.load();
+    errors += worker->errors.load();
+  }
+  std::cout << "backend=" << FLAGS_backend
+            << " connections=" << FLAGS_connections
+            << " threads=" << (isRedis ? FLAGS_threads : FLAGS_connections)
+            << " pipeline=" << (isRedis ? FLAGS_pipeline : 1)
+            << " keyspace=" << FLAGS_keyspace
+            << " zipf=" << FLAGS_zipf
+            << " read_ratio=" << FLAGS_read_ratio
+            << " value_dist=" << FLAGS_value_dist
+            << " value_min=" << FLAGS_value_min
+            << " value_max=" << FLAGS_value_max;
+  if (!isRedis) {
+    std::cout << " memcached_preset=" << FLAGS_memcached_preset;
+  }
+  std::cout << "\n"
+            << "ops=" << ops
+            << " errors=" << errors
+            << " elapsed_s=" << elapsedSecs
+            << " ops_per_sec=" << (uint64_t) (ops / elapsedSecs) << "\n"
+            << "latency_us"
+            << " mean=" << (uint64_t) latency.getMean()
+            << " p50=" << latency.getPercentile(50)
+            << " p99=" << latency.getPercentile(99)
+            << " p999=" << latency.getPercentile(99.9)
+            << " max=" << latency.getMax() << std::endl;
+  return errors > 0 && errors == ops ? 1 : 0;
+}
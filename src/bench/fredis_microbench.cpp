@@ -0,0 +1,445 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <folly/Baton.h>
+#include <folly/Benchmark.h>
+#include <folly/Conv.h>
+#include <folly/FBString.h>
+#include <folly/SocketAddress.h>
+#include <folly/io/async/EventBase.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <hiredis/hiredis.h>
+
+#include "fredis/folly_util/EBThread.h"
+#include "fredis/memcached/MemcachedConfig.h"
+#include "fredis/memcached/MemcachedSyncClient.h"
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisDynamicResponse.h"
+#include "fredis/redis/RedisRequestContext.h"
+#include "fredis/testing/FakeMemcachedServer.h"
+
+using namespace std;
+using folly::fbstring;
+using fredis::folly_util::EBThread;
+using fredis::memcached::MemcachedConfig;
+using fredis::memcached::MemcachedSyncClient;
+using fredis::redis::RedisClient;
+using fredis::redis::RedisDynamicResponse;
+using fredis::redis::RedisRequestContext;
+using fredis::testing::FakeMemcachedServer;
+
+namespace {
+
+// hand-built hiredis replies, so response handling can be measured
+// without a server. children are owned by their parent.
+class ReplyTree {
+ protected:
+  std::vector<std::unique_ptr<redisReply>> nodes_;
+  std::vector<std::unique_ptr<redisReply*[]>> elementArrays_;
+
+  // a deque, so that stored strings never move.
+  std::deque<std::string> strings_;
+
+  redisReply* makeNode(int type) {
+    std::unique_ptr<redisReply> node {new redisReply};
+    memset(node.get(), 0, sizeof(redisReply));
+    node->type = type;
+    nodes_.push_back(std::move(node));
+    return nodes_.back().get();
+  }
+ public:
+  redisReply* stringReply(int type, const std::string &value) {
+    strings_.push_back(value);
+    auto node = makeNode(type);
+    node->str = (char*) strings_.back().data();
+    node->len = strings_.back().size();
+    return node;
+  }
+
+  redisReply* integer(long long value) {
+    auto node = makeNode(REDIS_REPLY_INTEGER);
+    node->integer = value;
+    return node;
+  }
+
+  redisReply* array(size_t nElements, size_t valueSize) {
+    auto node = makeNode(REDIS_REPLY_ARRAY);
+    elementArrays_.emplace_back(new redisReply*[nElements]);
+    node->element = elementArrays_.back().get();
+    node->elements = nElements;
+    std::string value(valueSize, 'v');
+    for (size_t i = 0; i < nElements; i++) {
+      node->element[i] = stringReply(REDIS_REPLY_STRING, value);
+    }
+    return node;
+  }
+};
+
+ReplyTree& replies() {
+  static ReplyTree tree;
+  return tree;
+}
+
+// folly calls each benchmark several times; build its reply only once.
+redisReply* shortStringReply() {
+  static redisReply *reply = replies().stringReply(
+    REDIS_REPLY_STRING, "some-short-value"
+  );
+  return reply;
+}
+
+redisReply* statusReply() {
+  static redisReply *reply = replies().stringReply(REDIS_REPLY_STATUS, "OK");
+  return reply;
+}
+
+redisReply* integerReply() {
+  static redisReply *reply = replies().integer(123456789);
+  return reply;
+}
+
+redisReply* array1kReply() {
+  static redisReply *reply = replies().array(1000, 32);
+  return reply;
+}
+
+std::vector<std::pair<std::string, std::string>> makePairs(size_t count) {
+  std::vector<std::pair<std::string, std::string>> pairs;
+  for (size_t i = 0; i < count; i++) {
+    pairs.emplace_back(
+      folly::to<std::string>("fredis:key:", i),
+      std::string(32, 'v')
+    );
+  }
+  return pairs;
+}
+
+std::shared_ptr<EBThread>& hopThread() {
+  static std::shared_ptr<EBThread> ebt;
+  return ebt;
+}
+
+std::shared_ptr<FakeMemcachedServer>& memcachedServer() {
+  static std::shared_ptr<FakeMemcachedServer> server;
+  return server;
+}
+
+} // anonymous namespace
+
+// command encoding: RedisClient formats commands with hiredis's printf-style
+// encoder; the argv encoder is the binary-safe alternative.
+
+BENCHMARK(encodeSetFormat, iters) {
+  for (size_t i = 0; i < iters; i++) {
+    char *target = nullptr;
+    int len = redisFormatCommand(&target, "SET %s %s",
+      "fredis:key:12345", "some-short-value");
+    folly::doNotOptimizeAway(len);
+    redisFreeCommand(target);
+  }
+}
+
+BENCHMARK_RELATIVE(encodeSetArgv, iters) {
+  const char *argv[] = {"SET", "fredis:key:12345", "some-short-value"};
+  const size_t argvLen[] = {3, 16, 16};
+  for (size_t i = 0; i < iters; i++) {
+    char *target = nullptr;
+    int len = redisFormatCommandArgv(&target, 3, argv, argvLen);
+    folly::doNotOptimizeAway(len);
+    redisFreeCommand(target);
+  }
+}
+
+// what RedisClient::mset() does today: build a string, then format it.
+BENCHMARK(encodeMset16Format, iters) {
+  std::vector<std::pair<std::string, std::string>> pairs;
+  BENCHMARK_SUSPEND {
+    pairs = makePairs(16);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    std::ostringstream oss;
+    oss << "MSET";
+    for (const auto &keyVal: pairs) {
+      oss << " " << keyVal.first << " " << keyVal.second;
+    }
+    char *target = nullptr;
+    int len = redisFormatCommand(&target, oss.str().c_str());
+    folly::doNotOptimizeAway(len);
+    redisFreeCommand(target);
+  }
+}
+
+BENCHMARK_RELATIVE(encodeMset16Argv, iters) {
+  std::vector<std::pair<std::string, std::string>> pairs;
+  BENCHMARK_SUSPEND {
+    pairs = makePairs(16);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    std::vector<const char*> argv;
+    std::vector<size_t> argvLen;
+    argv.push_back("MSET");
+    argvLen.push_back(4);
+    for (const auto &keyVal: pairs) {
+      argv.push_back(keyVal.first.data());
+      argvLen.push_back(keyVal.first.size());
+      argv.push_back(keyVal.second.data());
+      argvLen.push_back(keyVal.second.size());
+    }
+    char *target = nullptr;
+    int len = redisFormatCommandArgv(&target, argv.size(),
+      argv.data(), argvLen.data());
+    folly::doNotOptimizeAway(len);
+    redisFreeCommand(target);
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+BENCHMARK(constructResponse, iters) {
+  auto reply = shortStringReply();
+  for (size_t i = 0; i < iters; i++) {
+    RedisDynamicResponse response {reply};
+    folly::doNotOptimizeAway(
+      response.isType(RedisDynamicResponse::ResponseType::STRING)
+    );
+  }
+}
+
+BENCHMARK(responseGetString, iters) {
+  auto reply = shortStringReply();
+  RedisDynamicResponse response {reply};
+  for (size_t i = 0; i < iters; i++) {
+    folly::doNotOptimizeAway(response.getString().value().size());
+  }
+}
+
+BENCHMARK(responseGetArray1k, iters) {
+  auto reply = array1kReply();
+  RedisDynamicResponse response {reply};
+  for (size_t i = 0; i < iters; i++) {
+    auto elements = response.getArray();
+    folly::doNotOptimizeAway(elements.value().size());
+  }
+}
+
+BENCHMARK(pprintInteger, iters) {
+  auto reply = integerReply();
+  RedisDynamicResponse response {reply};
+  for (size_t i = 0; i < iters; i++) {
+    folly::doNotOptimizeAway(response.pprint().size());
+  }
+}
+
+BENCHMARK(pprintArray1k, iters) {
+  auto reply = array1kReply();
+  RedisDynamicResponse response {reply};
+  for (size_t i = 0; i < iters; i++) {
+    folly::doNotOptimizeAway(response.pprint().size());
+  }
+}
+
+BENCHMARK(responseTypeOfInt, iters) {
+  for (size_t i = 0; i < iters; i++) {
+    auto resType = fredis::redis::detail::responseTypeOfInt(
+      REDIS_REPLY_STRING + (int) (i % 6)
+    );
+    folly::doNotOptimizeAway(resType.hasValue());
+  }
+}
+
+// the error path builds and catches an exception.
+BENCHMARK(responseTypeOfIntInvalid, iters) {
+  for (size_t i = 0; i < iters; i++) {
+    auto resType = fredis::redis::detail::responseTypeOfInt(-1);
+    folly::doNotOptimizeAway(resType.hasException());
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+// construct, fulfill and destroy a context with a future attached, as
+// RedisClient did for every command before contexts were pooled.
+BENCHMARK(requestContextLifecycle, iters) {
+  std::unique_ptr<folly::EventBase> base;
+  std::shared_ptr<RedisClient> client;
+  fbstring encoded;
+  auto reply = statusReply();
+  BENCHMARK_SUSPEND {
+    base.reset(new folly::EventBase);
+    client = RedisClient::createShared(base.get(), "127.0.0.1", 6379);
+    char *target = nullptr;
+    int len = redisFormatCommand(&target, "GET %s", "fredis:key:12345");
+    encoded = fbstring {target, (size_t) len};
+    redisFreeCommand(target);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    auto reqCtx = new RedisRequestContext {
+      client, fbstring {"GET"}, fbstring {encoded}, true
+    };
+    auto future = reqCtx->getFuture();
+    reqCtx->setValue(RedisDynamicResponse {reply});
+    delete reqCtx;
+    folly::doNotOptimizeAway(future.isReady());
+  }
+  BENCHMARK_SUSPEND {
+    client.reset();
+    base.reset();
+  }
+}
+
+// the pooled fast path: one recycled context, completed through an inline
+// callback. should allocate nothing per iteration.
+BENCHMARK(pooledRequestCallback, iters) {
+  std::unique_ptr<folly::EventBase> base;
+  std::shared_ptr<RedisClient> client;
+  std::unique_ptr<RedisRequestContext> reqCtx;
+  auto reply = statusReply();
+  size_t completed = 0;
+  BENCHMARK_SUSPEND {
+    base.reset(new folly::EventBase);
+    client = RedisClient::createShared(base.get(), "127.0.0.1", 6379);
+    reqCtx.reset(new RedisRequestContext {
+      client, fbstring {"GET"}, fbstring {}, true
+    });
+    reqCtx->encodedBuffer().reserve(64);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    reqCtx->reuse(client, "GET", true);
+    auto &encoded = reqCtx->encodedBuffer();
+    fredis::redis::detail::appendRespArrayHeader(encoded, 2);
+    fredis::redis::detail::appendRespBulk(encoded, "GET");
+    fredis::redis::detail::appendRespBulk(encoded, "fredis:key:12345");
+    reqCtx->setCallback([&completed](folly::Try<RedisDynamicResponse> &r) {
+      completed += r.hasValue();
+    });
+    reqCtx->setValue(RedisDynamicResponse {reply});
+    reqCtx->recycle();
+  }
+  folly::doNotOptimizeAway(completed);
+  BENCHMARK_SUSPEND {
+    reqCtx.reset();
+    client.reset();
+    base.reset();
+  }
+}
+
+// round trip onto an EventBase thread and back.
+BENCHMARK(ebThreadHop, iters) {
+  BENCHMARK_SUSPEND {
+    if (!hopThread()) {
+      hopThread() = EBThread::createShared();
+      hopThread()->start();
+    }
+  }
+  for (size_t i = 0; i < iters; i++) {
+    folly::Baton<std::atomic> done;
+    hopThread()->runInEventBaseThread([&done]() {
+      done.post();
+    });
+    done.wait();
+  }
+}
+
+BENCHMARK_DRAW_LINE();
+
+void memcachedToConfigString(size_t iters, size_t nServers) {
+  MemcachedConfig config;
+  BENCHMARK_SUSPEND {
+    std::vector<folly::SocketAddress> servers;
+    for (size_t i = 0; i < nServers; i++) {
+      servers.emplace_back("127.0.0.1", 11211 + i);
+    }
+    config.addServers(servers);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    folly::doNotOptimizeAway(config.toConfigString().value().size());
+  }
+}
+
+BENCHMARK_PARAM(memcachedToConfigString, 1);
+BENCHMARK_PARAM(memcachedToConfigString, 8);
+
+// the copy MemcachedSyncClient::get() makes out of libmemcached's buffer.
+void memcachedValueCopy(size_t iters, size_t valueSize) {
+  char *source = nullptr;
+  BENCHMARK_SUSPEND {
+    source = (char*) malloc(valueSize);
+    memset(source, 'v', valueSize);
+  }
+  for (size_t i = 0; i < iters; i++) {
+    fbstring copied {source, valueSize};
+    folly::doNotOptimizeAway(copied.size());
+  }
+  BENCHMARK_SUSPEND {
+    free(source);
+  }
+}
+
+BENCHMARK_PARAM(memcachedValueCopy, 100);
+BENCHMARK_PARAM(memcachedValueCopy, 4096);
+BENCHMARK_PARAM(memcachedValueCopy, 65536);
+
+// full get() against the in-process fake server, for scale. with
+// `asIOBuf`, getIOBuf() instead, which keeps libmemcached's buffer.
+void memcachedGetLoop(size_t iters, size_t valueSize, bool asIOBuf) {
+  std::unique_ptr<MemcachedSyncClient> client;
+  BENCHMARK_SUSPEND {
+    if (!memcachedServer()) {
+      memcachedServer() = FakeMemcachedServer::createShared();
+      memcachedServer()->start();
+    }
+    client.reset(new MemcachedSyncClient {MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", memcachedServer()->getPort())
+    }});
+    client->setStatsRegistry(nullptr);
+    client->connectExcept();
+    client->set("fredis:microbench", fbstring(valueSize, 'v'));
+  }
+  for (size_t i = 0; i < iters; i++) {
+    if (asIOBuf) {
+      auto result = client->getIOBuf("fredis:microbench");
+      folly::doNotOptimizeAway(result.hasValue());
+    } else {
+      auto result = client->get("fredis:microbench");
+      folly::doNotOptimizeAway(result.hasValue());
+    }
+  }
+  BENCHMARK_SUSPEND {
+    client.reset();
+  }
+}
+
+void memcachedSyncGet(size_t iters, size_t valueSize) {
+  memcachedGetLoop(iters, valueSize, false);
+}
+
+void memcachedSyncGetIOBuf(size_t iters, size_t valueSize) {
+  memcachedGetLoop(iters, valueSize, true);
+}
+
+BENCHMARK_PARAM(memcachedSyncGet, 100);
+BENCHMARK_PARAM(memcachedSyncGet, 4096);
+BENCHMARK_PARAM(memcachedSyncGet, 65536);
+BENCHMARK_PARAM(memcachedSyncGet, 1048576);
+BENCHMARK_PARAM(memcachedSyncGetIOBuf, 65536);
+BENCHMARK_PARAM(memcachedSyncGetIOBuf, 1048576);
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  folly::runBenchmarks();
+  if (hopThread()) {
+    hopThread()->stop();
+    hopThread()->join();
+  }
+  if (memcachedServer()) {
+    memcachedServer()->stop();
+  }
+  return 0;
+}
@@ -0,0 +1,428 @@
+#include "fredis/compression/ValueCompressor.h"
+#include <chrono>
+#include <cstring>
+#include <utility>
+#include <folly/Conv.h>
+#include <folly/ExceptionWrapper.h>
+#include <folly/Varint.h>
+#include <folly/io/IOBuf.h>
+#include <zstd.h>
+#include <zdict.h>
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Try;
+
+namespace fredis { namespace compression {
+
+namespace {
+
+// every encoded value starts with these two bytes, then the codec id.
+const uint8_t kMagic0 = 0xFD;
+const uint8_t kMagic1 = 'z';
+const size_t kMaxHeaderBytes = 3 + folly::kMaxVarintLength64 + 4;
+
+using steady_clock_t = std::chrono::steady_clock;
+
+uint64_t microsSince(steady_clock_t::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    steady_clock_t::now() - start
+  ).count();
+}
+
+folly::io::Codec* follyCodec(ValueCodec codec, int level) {
+  // codecs may keep state between calls, so each thread gets its own.
+  static thread_local std::map<std::pair<int, int>,
+    std::unique_ptr<folly::io::Codec>> codecs;
+  auto key = std::make_pair((int) codec, level);
+  auto found = codecs.find(key);
+  if (found == codecs.end()) {
+    found = codecs.emplace(key, folly::io::getCodec(
+      detail::follyCodecTypeOf(codec), level
+    )).first;
+  }
+  return found->second.get();
+}
+
+struct ZstdContexts {
+  ZSTD_CCtx *cctx {nullptr};
+  ZSTD_DCtx *dctx {nullptr};
+  ZstdContexts()
+    : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+  ~ZstdContexts() {
+    ZSTD_freeCCtx(cctx);
+    ZSTD_freeDCtx(dctx);
+  }
+};
+
+ZstdContexts& zstdContexts() {
+  static thread_local ZstdContexts contexts;
+  return contexts;
+}
+
+void appendHeader(fbstring &out, ValueCodec codec, uint64_t originalLength,
+    uint32_t dictionaryId) {
+  out.push_back((char) kMagic0);
+  out.push_back((char) kMagic1);
+  out.push_back((char) codec);
+  if (codec == ValueCodec::NONE) {
+    return;
+  }
+  uint8_t varint[folly::kMaxVarintLength64];
+  size_t varintLen = folly::encodeVarint(originalLength, varint);
+  out.append((const char*) varint, varintLen);
+  if (codec == ValueCodec::ZSTD_DICT) {
+    for (int shift = 0; shift < 32; shift += 8) {
+      out.push_back((char) ((dictionaryId >> shift) & 0xFF));
+    }
+  }
+}
+
+fbstring fbstringOfChain(const folly::IOBuf &chain, fbstring &&prefix) {
+  fbstring result = std::move(prefix);
+  result.reserve(result.size() + chain.computeChainDataLength());
+  for (const auto &segment: chain) {
+    result.append((const char*) segment.data(), segment.size());
+  }
+  return result;
+}
+
+} // anonymous namespace
+
+ZstdDictionary::ZstdDictionary(uint32_t id, fbstring &&bytes, int level)
+  : id_(id), bytes_(std::move(bytes)) {
+  cdict_ = ZSTD_createCDict(bytes_.data(), bytes_.size(), level);
+  ddict_ = ZSTD_createDDict(bytes_.data(), bytes_.size());
+}
+
+ZstdDictionary::~ZstdDictionary() {
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+}
+
+shared_ptr<ZstdDictionary> ZstdDictionary::createShared(uint32_t id,
+    fbstring bytes, int level) {
+  shared_ptr<ZstdDictionary> instance {
+    new ZstdDictionary {id, std::move(bytes), level}
+  };
+  if (!instance->cdict_ || !instance->ddict_) {
+    throw CompressionError("zstd rejected the dictionary");
+  }
+  return instance;
+}
+
+Try<fbstring> ZstdDictionary::train(const vector<fbstring> &samples,
+    size_t capacity) {
+  fbstring concatenated;
+  vector<size_t> sizes;
+  for (const auto &sample: samples) {
+    concatenated.append(sample);
+    sizes.push_back(sample.size());
+  }
+  fbstring dictionary;
+  dictionary.resize(capacity);
+  size_t dictSize = ZDICT_trainFromBuffer(
+    &dictionary[0], capacity,
+    concatenated.data(), sizes.data(), (unsigned) sizes.size()
+  );
+  if (ZDICT_isError(dictSize)) {
+    return Try<fbstring> {folly::make_exception_wrapper<CompressionError>(
+      folly::to<std::string>("dictionary training failed: ",
+        ZDICT_getErrorName(dictSize))
+    )};
+  }
+  dictionary.resize(dictSize);
+  return Try<fbstring> {std::move(dictionary)};
+}
+
+uint32_t ZstdDictionary::getId() const {
+  return id_;
+}
+
+const fbstring& ZstdDictionary::getBytes() const {
+  return bytes_;
+}
+
+ZSTD_CDict* ZstdDictionary::getCompressionDict() const {
+  return cdict_;
+}
+
+ZSTD_DDict* ZstdDictionary::getDecompressionDict() const {
+  return ddict_;
+}
+
+CompressionRule CompressionRule::none(fbstring keyPrefix) {
+  CompressionRule rule;
+  rule.keyPrefix = std::move(keyPrefix);
+  rule.codec = ValueCodec::NONE;
+  return rule;
+}
+
+double CompressionStats::getRatio() const {
+  if (bytesBeforeCompression == 0) {
+    return 1.0;
+  }
+  return (double) bytesAfterCompression / (double) bytesBeforeCompression;
+}
+
+fbstring CompressionStats::toString() const {
+  return folly::to<fbstring>(
+    "compressed=", valuesCompressed,
+    " raw=", valuesStoredRaw,
+    " bytes_before=", bytesBeforeCompression,
+    " bytes_after=", bytesAfterCompression,
+    " ratio=", getRatio(),
+    " compress_us=", compressMicros,
+    " decompressed=", valuesDecompressed,
+    " decompress_us=", decompressMicros,
+    " decode_errors=", decodeErrors
+  );
+}
+
+ValueCompressor::ValueCompressor()
+  : defaultRule_(CompressionRule::none("")) {}
+
+shared_ptr<ValueCompressor> ValueCompressor::createShared() {
+  return shared_ptr<ValueCompressor> {new ValueCompressor};
+}
+
+void ValueCompressor::setDefaultRule(const CompressionRule &rule) {
+  defaultRule_ = rule;
+  if (rule.dictionary) {
+    addDictionary(rule.dictionary);
+  }
+}
+
+void ValueCompressor::addRule(const CompressionRule &rule) {
+  if (rule.codec == ValueCodec::ZSTD_DICT && !rule.dictionary) {
+    throw CompressionError("ZSTD_DICT rules need a dictionary");
+  }
+  rules_[rule.keyPrefix] = rule;
+  if (rule.dictionary) {
+    addDictionary(rule.dictionary);
+  }
+}
+
+void ValueCompressor::addDictionary(shared_ptr<ZstdDictionary> dictionary) {
+  dictionaries_[dictionary->getId()] = std::move(dictionary);
+}
+
+const CompressionRule& ValueCompressor::ruleForKey(StringPiece key) const {
+  const CompressionRule *best = &defaultRule_;
+  size_t bestLength = 0;
+  for (const auto &rule: rules_) {
+    if (rule.first.size() >= bestLength && key.startsWith(rule.first)) {
+      best = &rule.second;
+      bestLength = rule.first.size();
+    }
+  }
+  return *best;
+}
+
+fbstring ValueCompressor::storeRaw(StringPiece value) {
+  valuesStoredRaw_.fetch_add(1, std::memory_order_relaxed);
+  if (!isEncoded(value)) {
+    return value.fbstr();
+  }
+  // a raw value that happens to start with the magic needs a header too.
+  fbstring out;
+  out.reserve(value.size() + 3);
+  appendHeader(out, ValueCodec::NONE, value.size(), 0);
+  out.append(value.data(), value.size());
+  return out;
+}
+
+fbstring ValueCompressor::encode(StringPiece key, StringPiece value) {
+  const auto &rule = ruleForKey(key);
+  if (rule.codec == ValueCodec::NONE || value.size() < rule.minValueBytes) {
+    return storeRaw(value);
+  }
+  auto startedAt = steady_clock_t::now();
+  fbstring out;
+  uint32_t dictionaryId = rule.dictionary ? rule.dictionary->getId() : 0;
+  appendHeader(out, rule.codec, value.size(), dictionaryId);
+  try {
+    if (rule.codec == ValueCodec::ZSTD_DICT) {
+      size_t headerLen = out.size();
+      size_t bound = ZSTD_compressBound(value.size());
+      out.resize(headerLen + bound);
+      size_t written = ZSTD_compress_usingCDict(
+        zstdContexts().cctx, &out[headerLen], bound,
+        value.data(), value.size(), rule.dictionary->getCompressionDict()
+      );
+      if (ZSTD_isError(written)) {
+        throw CompressionError(ZSTD_getErrorName(written));
+      }
+      out.resize(headerLen + written);
+    } else {
+      auto input = folly::IOBuf::wrapBuffer(value.data(), value.size());
+      auto compressed = follyCodec(rule.codec, rule.level)->compress(
+        input.get()
+      );
+      out = fbstringOfChain(*compressed, std::move(out));
+    }
+  } catch (const std::exception&) {
+    return storeRaw(value);
+  }
+  compressMicros_.fetch_add(microsSince(startedAt), std::memory_order_relaxed);
+  if (out.size() >= value.size()) {
+    // not worth it.
+    return storeRaw(value);
+  }
+  valuesCompressed_.fetch_add(1, std::memory_order_relaxed);
+  bytesBeforeCompression_.fetch_add(value.size(), std::memory_order_relaxed);
+  bytesAfterCompression_.fetch_add(out.size(), std::memory_order_relaxed);
+  return out;
+}
+
+bool ValueCompressor::isEncoded(StringPiece stored) const {
+  return stored.size() >= 3
+    && (uint8_t) stored[0] == kMagic0
+    && (uint8_t) stored[1] == kMagic1
+    && (uint8_t) stored[2] <= (uint8_t) ValueCodec::ZSTD_DICT;
+}
+
+void ValueCompressor::setMaxValueBytes(size_t maxValueBytes) {
+  maxValueBytes_ = maxValueBytes;
+}
+
+size_t ValueCompressor::getMaxValueBytes() const {
+  return maxValueBytes_;
+}
+
+Try<fbstring> ValueCompressor::decode(StringPiece stored) {
+  if (!isEncoded(stored)) {
+    return Try<fbstring> {stored.fbstr()};
+  }
+  auto codec = (ValueCodec) stored[2];
+  if (codec == ValueCodec::NONE) {
+    return Try<fbstring> {stored.subpiece(3).fbstr()};
+  }
+  auto startedAt = steady_clock_t::now();
+  auto failed = [this](const std::string &reason) {
+    decodeErrors_.fetch_add(1, std::memory_order_relaxed);
+    return Try<fbstring> {folly::make_exception_wrapper<CompressionError>(
+      folly::to<std::string>("couldn't decode value: ", reason)
+    )};
+  };
+  folly::ByteRange body {
+    (const uint8_t*) stored.data() + 3, stored.size() - 3
+  };
+  uint64_t originalLength = 0;
+  try {
+    originalLength = folly::decodeVarint(body);
+  } catch (const std::exception&) {
+    return failed("bad length");
+  }
+  if (originalLength > maxValueBytes_) {
+    return failed(folly::to<std::string>(
+      "original length ", originalLength, " exceeds the limit of ",
+      maxValueBytes_
+    ));
+  }
+  if (codec == ValueCodec::ZSTD) {
+    auto frameLength = ZSTD_getFrameContentSize(body.data(), body.size());
+    if (frameLength == ZSTD_CONTENTSIZE_ERROR) {
+      return failed("bad zstd frame");
+    }
+    if (frameLength != ZSTD_CONTENTSIZE_UNKNOWN &&
+        frameLength != originalLength) {
+      return failed("zstd frame size doesn't match the header");
+    }
+  }
+  fbstring result;
+  try {
+    if (codec == ValueCodec::ZSTD_DICT) {
+      if (body.size() < 4) {
+        return failed("truncated header");
+      }
+      uint32_t dictionaryId = 0;
+      for (int i = 3; i >= 0; i--) {
+        dictionaryId = (dictionaryId << 8) | body[i];
+      }
+      body.advance(4);
+      auto dictionary = dictionaries_.find(dictionaryId);
+      if (dictionary == dictionaries_.end()) {
+        return failed(folly::to<std::string>(
+          "unknown zstd dictionary ", dictionaryId
+        ));
+      }
+      auto frameLength = ZSTD_getFrameContentSize(body.data(), body.size());
+      if (frameLength == ZSTD_CONTENTSIZE_ERROR) {
+        return failed("bad zstd frame");
+      }
+      if (frameLength != ZSTD_CONTENTSIZE_UNKNOWN &&
+          frameLength != originalLength) {
+        return failed("zstd frame size doesn't match the header");
+      }
+      result.resize(originalLength);
+      size_t written = ZSTD_decompress_usingDDict(
+        zstdContexts().dctx, &result[0], originalLength,
+        body.data(), body.size(),
+        dictionary->second->getDecompressionDict()
+      );
+      if (ZSTD_isError(written) || written != originalLength) {
+        return failed("zstd error");
+      }
+    } else {
+      auto input = folly::IOBuf::wrapBuffer(body.data(), body.size());
+      auto uncompressed = follyCodec(codec, folly::io::COMPRESSION_LEVEL_DEFAULT)
+        ->uncompress(input.get(), originalLength);
+      result = fbstringOfChain(*uncompressed, fbstring {});
+    }
+  } catch (const std::exception &ex) {
+    return failed(ex.what());
+  }
+  valuesDecompressed_.fetch_add(1, std::memory_order_relaxed);
+  decompressMicros_.fetch_add(microsSince(startedAt), std::memory_order_relaxed);
+  return Try<fbstring> {std::move(result)};
+}
+
+CompressionStats ValueCompressor::getStats() const {
+  CompressionStats stats;
+  stats.valuesCompressed = valuesCompressed_.load(std::memory_order_relaxed);
+  stats.valuesStoredRaw = valuesStoredRaw_.load(std::memory_order_relaxed);
+  stats.bytesBeforeCompression =
+    bytesBeforeCompression_.load(std::memory_order_relaxed);
+  stats.bytesAfterCompression =
+    bytesAfterCompression_.load(std::memory_order_relaxed);
+  stats.compressMicros = compressMicros_.load(std::memory_order_relaxed);
+  stats.valuesDecompressed =
+    valuesDecompressed_.load(std::memory_order_relaxed);
+  stats.decompressMicros = decompressMicros_.load(std::memory_order_relaxed);
+  stats.decodeErrors = decodeErrors_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+namespace detail {
+
+folly::io::CodecType follyCodecTypeOf(ValueCodec codec) {
+  switch (codec) {
+    case ValueCodec::LZ4:
+      return folly::io::CodecType::LZ4;
+    case ValueCodec::ZSTD:
+    case ValueCodec::ZSTD_DICT:
+      return folly::io::CodecType::ZSTD;
+    default:
+      return folly::io::CodecType::NO_COMPRESSION;
+  }
+}
+
+const char* stringOfValueCodec(ValueCodec codec) {
+  switch (codec) {
+    case ValueCodec::NONE:
+      return "NONE";
+    case ValueCodec::LZ4:
+      return "LZ4";
+    case ValueCodec::ZSTD:
+      return "ZSTD";
+    case ValueCodec::ZSTD_DICT:
+      return "ZSTD_DICT";
+  }
+  return "UNKNOWN";
+}
+
+} // detail
+
+}} // fredis::compression
@@ -0,0 +1,2025 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <folly/Baton.h>
+#include <folly/Conv.h>
+#include <folly/Varint.h>
+#include <folly/futures/Future.h>
+
+#include "fredis/folly_util/EBThread.h"
+#include "fredis/memcached/MemcachedAsyncClient.h"
+#include "fredis/memcached/MemcachedClientPool.h"
+#include "fredis/memcached/MemcachedConfig.h"
+#include "fredis/memcached/MemcachedMetaClient.h"
+#include "fredis/memcached/MemcachedSyncClient.h"
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisCoroutines.h"
+#include "fredis/redis/RedisDynamicResponse.h"
+#include "fredis/redis/RedisQueueConsumer.h"
+#include "fredis/redis/RedisStreamConsumer.h"
+#include "fredis/redis/RedisStreamProducer.h"
+#include "fredis/redis/RedisSyncClient.h"
+#include "fredis/stats/LatencyHistogram.h"
+#include "fredis/stats/StatsRegistry.h"
+#include "fredis/testing/FakeMemcachedServer.h"
+#include "fredis/testing/FakeRedisServer.h"
+#include "fredis/tiered/CacheTier.h"
+#include "fredis/tiered/TieredCache.h"
+
+using namespace fredis::redis;
+using namespace fredis::testing;
+using namespace std;
+using fredis::folly_util::EBThread;
+using fredis::memcached::MemcachedAsyncClient;
+using fredis::memcached::MemcachedBehaviors;
+using fredis::memcached::CasResult;
+using fredis::memcached::ConfigurationError;
+using fredis::memcached::RequestTimeout;
+using fredis::memcached::MemcachedClientPool;
+using fredis::memcached::MemcachedPoolOptions;
+using fredis::memcached::MemcachedConfig;
+using fredis::memcached::HotKeyOptions;
+using fredis::memcached::MemcachedMetaClient;
+using fredis::memcached::MetaArithmeticOptions;
+using fredis::memcached::MetaDeleteOptions;
+using fredis::memcached::MetaGetOptions;
+using fredis::memcached::MetaGetResult;
+using fredis::memcached::MetaSetOptions;
+using fredis::memcached::MetaStoreResult;
+using fredis::memcached::MemcachedSyncClient;
+using fredis::tiered::CacheTier;
+using fredis::tiered::LookupMode;
+using fredis::tiered::MemcachedTier;
+using fredis::tiered::RedisTier;
+using fredis::tiered::TieredCache;
+using fredis::tiered::TieredCacheOptions;
+using fredis::tiered::WritePolicy;
+
+using try_response_t = folly::Try<RedisDynamicResponse>;
+using try_connect_t = folly::Try<shared_ptr<RedisClient>>;
+
+struct FakeRedisContext {
+  shared_ptr<FakeRedisServer> server;
+  shared_ptr<EBThread> ebt;
+  shared_ptr<RedisClient> client;
+  folly::Baton<std::atomic> baton;
+
+  FakeRedisContext() {
+    server = FakeRedisServer::createShared();
+    server->start();
+    ebt = EBThread::createShared();
+    ebt->ensureStarted();
+  }
+
+  void start(std::function<void (shared_ptr<RedisClient>)> cb) {
+    ebt->runInEventBaseThread([this, cb]() {
+      client = RedisClient::createShared(
+        ebt->getBase(), "127.0.0.1", server->getPort()
+      );
+      client->connect().then([cb](try_connect_t result) {
+        EXPECT_FALSE(result.hasException());
+        cb(result.value());
+      });
+    });
+  }
+
+  ~FakeRedisContext() {
+    ebt->runInEventBaseThread([this]() {
+      client.reset();
+    });
+    ebt->stop();
+    ebt->join();
+    server->stop();
+  }
+};
+
+TEST(TestFakeServers, TestRespParsing) {
+  FakeRedisServer::args_t args;
+  size_t consumed = 0;
+  EXPECT_EQ(1, fredis::testing::detail::parseRespRequest(
+    "*2\r\n$3\r\nGET\r\n$3\r\nfoo\r\n*1", consumed, args
+  ));
+  EXPECT_EQ(22, consumed);
+  EXPECT_EQ((FakeRedisServer::args_t {"GET", "foo"}), args);
+  EXPECT_EQ(0, fredis::testing::detail::parseRespRequest(
+    "*2\r\n$3\r\nGET\r\n$3\r\nfo", consumed, args
+  ));
+  EXPECT_EQ(1, fredis::testing::detail::parseRespRequest(
+    "PING  hello\r\n", consumed, args
+  ));
+  EXPECT_EQ((FakeRedisServer::args_t {"PING", "hello"}), args);
+  EXPECT_EQ(-1, fredis::testing::detail::parseRespRequest(
+    "*1\r\n:3\r\n", consumed, args
+  ));
+}
+
+TEST(TestFakeServers, TestRedisSetGet) {
+  FakeRedisContext ctx;
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &matched](shared_ptr<RedisClient> client) {
+    client->set("foo", "bar")
+      .then([client](try_response_t) {
+        return client->get("foo");
+      })
+      .then([&ctx, &matched](try_response_t response) {
+        matched.store(
+          response.hasValue() &&
+          response.value().getString().value().str() == "bar"
+        );
+        ctx.baton.post();
+      });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+TEST(TestFakeServers, TestRedisSyncClient) {
+  auto server = FakeRedisServer::createShared();
+  server->start();
+  {
+    RedisSyncClient client {"127.0.0.1", server->getPort()};
+    client.connectExcept();
+    EXPECT_FALSE(client.set("foo", "bar").hasException());
+    EXPECT_EQ("bar", client.get("foo").value().value().toStdString());
+    EXPECT_FALSE(client.get("missing").value().hasValue());
+    EXPECT_EQ(5, client.incrBy("counter", 5).value());
+    EXPECT_TRUE(client.del("foo").value());
+    EXPECT_FALSE(client.del("foo").value());
+
+    // replies come back in the order their commands were appended.
+    for (size_t i = 0; i < 100; i++) {
+      EXPECT_FALSE(client.appendCommand({"SET",
+        folly::to<std::string>("key", i), folly::to<std::string>("value", i)
+      }).hasException());
+    }
+    EXPECT_FALSE(client.appendCommand({"GET", "key42"}).hasException());
+    EXPECT_EQ(101, client.getPendingCount());
+    for (size_t i = 0; i < 100; i++) {
+      EXPECT_FALSE(client.getReply().hasException());
+    }
+    auto last = client.getReply();
+    EXPECT_EQ("value42", last.value()->getString().value().str());
+    EXPECT_EQ(0, client.getPendingCount());
+
+    std::vector<std::pair<folly::fbstring, folly::fbstring>> pairs;
+    std::vector<folly::fbstring> keys;
+    for (size_t i = 0; i < 2500; i++) {
+      pairs.emplace_back(folly::to<folly::fbstring>("bulk-key", i),
+        folly::to<folly::fbstring>("bulk", i));
+      keys.push_back(pairs.back().first);
+    }
+    keys.push_back("missing");
+    EXPECT_FALSE(client.setMany(pairs, 60).hasException());
+    auto values = client.getMany(keys);
+    ASSERT_FALSE(values.hasException());
+    ASSERT_EQ(2501, values.value().size());
+    EXPECT_EQ("bulk1234", values.value()[1234].value().toStdString());
+    EXPECT_FALSE(values.value().back().hasValue());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestRedisServiceTime) {
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {50000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  std::atomic<int64_t> elapsedMs {0};
+  ctx.start([&ctx, &elapsedMs](shared_ptr<RedisClient> client) {
+    auto startedAt = std::chrono::steady_clock::now();
+    client->get("foo").then([&ctx, &elapsedMs, startedAt](try_response_t) {
+      elapsedMs.store(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - startedAt
+      ).count());
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_GE(elapsedMs.load(), 50);
+}
+
+TEST(TestFakeServers, TestRedisReconnectsAfterDrop) {
+  FakeRedisContext ctx;
+  folly::Baton<std::atomic> stored;
+  ctx.start([&stored](shared_ptr<RedisClient> client) {
+    client->set("foo", "bar").then([&stored](try_response_t) {
+      stored.post();
+    });
+  });
+  stored.wait();
+  ctx.server->dropConnections();
+  std::atomic<bool> matched {false};
+  ctx.ebt->runInEventBaseThread([&ctx, &matched]() {
+    auto client = ctx.client;
+    client->get("foo").then([&ctx, &matched](try_response_t response) {
+      matched.store(
+        response.hasValue() &&
+        response.value().getString().value().str() == "bar"
+      );
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+  EXPECT_GE(ctx.client->getReconnectCount(), 1);
+}
+
+TEST(TestFakeServers, TestRedisDisconnectAfterLostConnection) {
+  FakeRedisContext ctx;
+  folly::Baton<std::atomic> stored;
+  ctx.start([&stored](shared_ptr<RedisClient> client) {
+    client->setReconnectPolicy(ReconnectPolicy::disabled());
+    client->set("foo", "bar").then([&stored](try_response_t) {
+      stored.post();
+    });
+  });
+  stored.wait();
+  ctx.server->dropConnections();
+  while (ctx.client->getConnectionState() !=
+      RedisClient::ConnectionState::DISCONNECTED) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  std::atomic<bool> closed {false};
+  std::atomic<bool> closedAgain {false};
+  ctx.ebt->runInEventBaseThread([&ctx, &closed, &closedAgain]() {
+    ctx.client->disconnect().then([&closed](folly::Try<folly::Unit> result) {
+      closed.store(!result.hasException());
+    });
+    // a second disconnect is a no-op.
+    ctx.client->disconnect().then([&ctx, &closedAgain](
+        folly::Try<folly::Unit> result) {
+      closedAgain.store(!result.hasException());
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(closed.load());
+  EXPECT_TRUE(closedAgain.load());
+  EXPECT_EQ(RedisClient::ConnectionState::CLOSED,
+    ctx.client->getConnectionState());
+}
+
+namespace {
+
+// sends GET `key` from the client's thread and waits for the reply.
+bool getSucceeds(FakeRedisContext &ctx, const std::string &key) {
+  folly::Baton<std::atomic> done;
+  std::atomic<bool> succeeded {false};
+  ctx.ebt->runInEventBaseThread([&ctx, &key, &done, &succeeded]() {
+    ctx.client->get(key).then([&done, &succeeded](try_response_t response) {
+      succeeded.store(!response.hasException());
+      done.post();
+    });
+  });
+  done.wait();
+  return succeeded.load();
+}
+
+bool isOverloaded(const try_response_t &response) {
+  return response.hasException() &&
+    response.exception().is_compatible_with<RedisOverloaded>();
+}
+
+} // anonymous namespace
+
+TEST(TestFakeServers, TestRedisAdmissionFailFast) {
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {30000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  AdmissionPolicy policy;
+  policy.mode = AdmissionPolicy::Mode::FAIL_FAST;
+  policy.maxInFlightRequests = 1;
+  auto controller = AdmissionController::createShared(policy);
+  std::atomic<bool> firstOk {false};
+  std::atomic<bool> secondRejected {false};
+  ctx.start([&ctx, &controller, &firstOk, &secondRejected](
+      shared_ptr<RedisClient> client) {
+    client->addAdmissionController(controller);
+    client->get("foo").then([&ctx, &firstOk](try_response_t response) {
+      firstOk.store(!response.hasException());
+      ctx.baton.post();
+    });
+    client->get("foo").then([&secondRejected](try_response_t response) {
+      secondRejected.store(isOverloaded(response));
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(firstOk.load());
+  EXPECT_TRUE(secondRejected.load());
+  EXPECT_EQ(1, controller->getRejectedCount());
+  EXPECT_EQ(0, controller->getInFlightRequests());
+  EXPECT_TRUE(getSucceeds(ctx, "foo"));
+}
+
+TEST(TestFakeServers, TestRedisAdmissionWait) {
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {30000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  AdmissionPolicy policy;
+  policy.mode = AdmissionPolicy::Mode::WAIT;
+  policy.maxInFlightRequests = 1;
+  policy.waitTimeout = AdmissionPolicy::duration_t {1000};
+  auto controller = AdmissionController::createShared(policy);
+  std::atomic<size_t> waiting {0};
+  std::atomic<bool> firstOk {false};
+  std::atomic<bool> secondOk {false};
+  ctx.start([&ctx, &controller, &waiting, &firstOk, &secondOk](
+      shared_ptr<RedisClient> client) {
+    client->addAdmissionController(controller);
+    client->get("foo").then([&firstOk](try_response_t response) {
+      firstOk.store(!response.hasException());
+    });
+    // held client-side until the first GET gives its slot back.
+    client->get("foo").then([&ctx, &secondOk](try_response_t response) {
+      secondOk.store(!response.hasException());
+      ctx.baton.post();
+    });
+    waiting.store(client->getAdmissionWaitingCount());
+  });
+  ctx.baton.wait();
+  EXPECT_EQ(1, waiting.load());
+  EXPECT_TRUE(firstOk.load());
+  EXPECT_TRUE(secondOk.load());
+  EXPECT_EQ(0, ctx.client->getAdmissionWaitingCount());
+  EXPECT_EQ(0, controller->getInFlightRequests());
+}
+
+TEST(TestFakeServers, TestRedisAdmissionWaitKeepsOrder) {
+  FakeRedisContext ctx;
+  AdmissionPolicy policy;
+  policy.mode = AdmissionPolicy::Mode::WAIT;
+  policy.maxInFlightRequests = 1;
+  policy.waitTimeout = AdmissionPolicy::duration_t {1000};
+  auto controller = AdmissionController::createShared(policy);
+  std::vector<int> order;
+  ctx.start([&ctx, &controller, &order](shared_ptr<RedisClient> client) {
+    client->addAdmissionController(controller);
+    client->set("foo", "bar").then([&ctx, &order, client](try_response_t) {
+      order.push_back(1);
+      // runs once the SET has given its slot back, but before the
+      // waiting GET is woken up to take it.
+      client->getEventBase()->runInEventBaseThread([&ctx, &order, client]() {
+        client->get("foo").then([&ctx, &order](try_response_t) {
+          order.push_back(3);
+          ctx.baton.post();
+        });
+      });
+    });
+    client->get("foo").then([&order](try_response_t) {
+      order.push_back(2);
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_EQ((std::vector<int> {1, 2, 3}), order);
+  EXPECT_EQ(0, controller->getInFlightRequests());
+}
+
+TEST(TestFakeServers, TestRedisAdmissionWaitTimeout) {
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {200000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  AdmissionPolicy policy;
+  policy.mode = AdmissionPolicy::Mode::WAIT;
+  policy.maxInFlightRequests = 1;
+  policy.waitTimeout = AdmissionPolicy::duration_t {20};
+  auto controller = AdmissionController::createShared(policy);
+  std::atomic<bool> secondTimedOut {false};
+  std::atomic<bool> firstOk {false};
+  folly::Baton<std::atomic> firstDone;
+  ctx.start([&ctx, &controller, &firstOk, &firstDone, &secondTimedOut](
+      shared_ptr<RedisClient> client) {
+    client->addAdmissionController(controller);
+    client->get("foo").then([&firstOk, &firstDone](try_response_t response) {
+      firstOk.store(!response.hasException());
+      firstDone.post();
+    });
+    client->get("foo").then([&ctx, &secondTimedOut](try_response_t response) {
+      secondTimedOut.store(isOverloaded(response));
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(secondTimedOut.load());
+  firstDone.wait();
+  EXPECT_TRUE(firstOk.load());
+  EXPECT_EQ(0, ctx.client->getAdmissionWaitingCount());
+}
+
+TEST(TestFakeServers, TestRedisAdmissionByteCap) {
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {30000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  AdmissionPolicy policy;
+  policy.mode = AdmissionPolicy::Mode::FAIL_FAST;
+  policy.maxInFlightBytes = 100;
+  auto controller = AdmissionController::createShared(policy);
+  // each GET of this key encodes to 60 bytes, so only one fits.
+  std::string key (40, 'k');
+  std::atomic<size_t> bytesInFlight {0};
+  std::atomic<bool> firstOk {false};
+  std::atomic<bool> secondRejected {false};
+  ctx.start([&ctx, &controller, &key, &bytesInFlight, &firstOk,
+      &secondRejected](shared_ptr<RedisClient> client) {
+    client->addAdmissionController(controller);
+    client->get(key).then([&ctx, &firstOk](try_response_t response) {
+      firstOk.store(!response.hasException());
+      ctx.baton.post();
+    });
+    client->get(key).then([&secondRejected](try_response_t response) {
+      secondRejected.store(isOverloaded(response));
+    });
+    bytesInFlight.store(controller->getInFlightBytes());
+  });
+  ctx.baton.wait();
+  EXPECT_EQ(60, bytesInFlight.load());
+  EXPECT_TRUE(firstOk.load());
+  EXPECT_TRUE(secondRejected.load());
+  EXPECT_EQ(0, controller->getInFlightBytes());
+  EXPECT_TRUE(getSucceeds(ctx, key));
+}
+
+TEST(TestFakeServers, TestRedisAdmissionAdaptive) {
+  FakeRedisContext ctx;
+  AdmissionPolicy policy;
+  policy.mode = AdmissionPolicy::Mode::ADAPTIVE;
+  policy.initialConcurrencyLimit = 64;
+  policy.minConcurrencyLimit = 4;
+  auto controller = AdmissionController::createShared(policy);
+  ctx.start([&ctx, &controller](shared_ptr<RedisClient> client) {
+    client->addAdmissionController(controller);
+    ctx.baton.post();
+  });
+  ctx.baton.wait();
+
+  // fast replies set the baseline latency.
+  for (size_t i = 0; i < 20; i++) {
+    EXPECT_TRUE(getSucceeds(ctx, "foo"));
+  }
+  size_t baseline = controller->getConcurrencyLimit();
+
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {10000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  for (size_t i = 0; i < 30; i++) {
+    EXPECT_TRUE(getSucceeds(ctx, "foo"));
+  }
+  size_t shrunk = controller->getConcurrencyLimit();
+  EXPECT_LT(shrunk, baseline / 2);
+  EXPECT_GE(shrunk, 4);
+
+  ctx.server->getFaultInjector().clear();
+  for (size_t i = 0; i < 100; i++) {
+    EXPECT_TRUE(getSucceeds(ctx, "foo"));
+  }
+  EXPECT_GT(controller->getConcurrencyLimit(), shrunk);
+}
+
+TEST(TestFakeServers, TestLatencyHistogramAccuracy) {
+  using fredis::stats::HistogramSnapshot;
+  using fredis::stats::LatencyHistogram;
+  LatencyHistogram histogram;
+  for (uint64_t value = 1; value <= 10000; value++) {
+    histogram.record(value);
+  }
+  HistogramSnapshot snapshot;
+  histogram.mergeInto(snapshot);
+  EXPECT_EQ(10000, snapshot.getCount());
+  EXPECT_EQ(10000, snapshot.getMax());
+  EXPECT_NEAR(5000.5, snapshot.getMean(), 0.01);
+  // a percentile is its bucket's upper bound: never below the true
+  // value and at most one sub-bucket (1/16) above it.
+  for (double pct: {50.0, 90.0, 99.0, 99.9}) {
+    double exact = pct * 100;
+    auto reported = (double) snapshot.getPercentile(pct);
+    EXPECT_GE(reported, exact);
+    EXPECT_LE(reported, exact * 17 / 16);
+  }
+  EXPECT_EQ(10000, snapshot.getPercentile(100));
+}
+
+TEST(TestFakeServers, TestStatsRegistryFoldsExtraNames) {
+  using fredis::stats::Outcome;
+  using fredis::stats::StatsRegistry;
+  auto registry = StatsRegistry::createShared();
+  for (size_t round = 0; round < 2; round++) {
+    for (size_t i = 0; i < 300; i++) {
+      registry->record(folly::to<std::string>("cmd", i),
+        std::chrono::microseconds {10}, Outcome::SUCCESS, 1, 1);
+    }
+  }
+  auto snapshot = registry->getStats();
+  // OTHER holds one of the slots.
+  EXPECT_EQ(StatsRegistry::kMaxCommands, snapshot.commands.size());
+  EXPECT_EQ(2 * (300 - (StatsRegistry::kMaxCommands - 1)),
+    snapshot.commands["OTHER"].count);
+  EXPECT_EQ(600, snapshot.total().count);
+}
+
+TEST(TestFakeServers, TestRedisClientStats) {
+  using fredis::stats::StatsRegistry;
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {5000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  auto registry = StatsRegistry::createShared();
+  std::atomic<bool> incrFailed {false};
+  ctx.start([&ctx, &registry, &incrFailed](shared_ptr<RedisClient> client) {
+    client->setStatsRegistry(registry);
+    client->set("foo", "bar")
+      .then([client](try_response_t) {
+        return client->commandArgv({"INCR", "foo"});
+      })
+      .then([&ctx, &incrFailed](try_response_t response) {
+        incrFailed.store(response.hasValue() &&
+          response.value().isType(RedisDynamicResponse::ResponseType::ERROR));
+        ctx.baton.post();
+      });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(incrFailed.load());
+  for (size_t i = 0; i < 10; i++) {
+    EXPECT_TRUE(getSucceeds(ctx, "foo"));
+  }
+  auto stats = ctx.client->getStats();
+
+  const auto &set = stats.commands["SET"];
+  EXPECT_EQ(1, set.count);
+  EXPECT_EQ(0, set.errors);
+  // *3 $3 SET $3 foo $3 bar, answered by +OK.
+  EXPECT_EQ(31, set.bytesOut);
+  EXPECT_EQ(5, set.bytesIn);
+
+  const auto &incr = stats.commands["INCR"];
+  EXPECT_EQ(1, incr.count);
+  EXPECT_EQ(1, incr.errors);
+  EXPECT_EQ(23, incr.bytesOut);
+
+  const auto &get = stats.commands["GET"];
+  EXPECT_EQ(10, get.count);
+  EXPECT_EQ(0, get.errors);
+  EXPECT_EQ(0, get.timeouts);
+  EXPECT_EQ(10 * 22, get.bytesOut);
+  EXPECT_EQ(10 * 9, get.bytesIn);
+  // every GET waited out the injected service time.
+  EXPECT_GE(get.latencyMicros.getPercentile(0), 5000);
+  EXPECT_LE(get.latencyMicros.getPercentile(50), get.latencyMicros.getMax());
+  EXPECT_EQ(get.latencyMicros.getMax(), get.latencyMicros.getPercentile(100));
+  EXPECT_EQ(12, stats.total().count);
+}
+
+TEST(TestFakeServers, TestRedisRequestTracing) {
+  FakeRedisContext ctx;
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {20000});
+  ctx.server->getFaultInjector().setCommandProfile("get", slowGets);
+  std::mutex spansMutex;
+  std::vector<RequestTrace> spans;
+  TracingOptions options;
+  options.sampleEvery = 1;
+  options.slowThreshold = std::chrono::milliseconds {10};
+  options.slowLogCapacity = 3;
+  options.spanHook = [&spansMutex, &spans](const RequestTrace &trace) {
+    std::lock_guard<std::mutex> guard {spansMutex};
+    spans.push_back(trace);
+  };
+  auto tracer = RequestTracer::createShared(options);
+  ctx.start([&ctx, &tracer](shared_ptr<RedisClient> client) {
+    client->setRequestTracer(tracer);
+    client->set("foo", "bar").then([&ctx](try_response_t) {
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  for (size_t i = 0; i < 5; i++) {
+    EXPECT_TRUE(getSucceeds(ctx, "foo"));
+  }
+  // spans finish after the reply's callback runs. a last fast request
+  // guarantees the GETs have been fully recorded once its span shows up.
+  ctx.ebt->runInEventBaseThread([&ctx]() {
+    ctx.client->set("foo", "baz");
+  });
+  for (;;) {
+    {
+      std::lock_guard<std::mutex> guard {spansMutex};
+      if (spans.size() == 7) {
+        break;
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::lock_guard<std::mutex> guard {spansMutex};
+  EXPECT_EQ("SET", spans.front().command.toStdString());
+  for (const auto &span: spans) {
+    std::vector<RequestTrace::time_point> stages {
+      span.submitted, span.started, span.encoded, span.writeFlushed,
+      span.firstByteRead, span.parsed, span.fulfilled
+    };
+    for (size_t i = 0; i < stages.size(); i++) {
+      EXPECT_NE(RequestTrace::time_point {}, stages[i]);
+      if (i > 0) {
+        EXPECT_LE(stages[i - 1], stages[i]);
+      }
+    }
+    EXPECT_FALSE(span.failed);
+  }
+  EXPECT_EQ("SET", spans.back().command.toStdString());
+  const auto &lastGet = spans[5];
+  EXPECT_EQ("GET", lastGet.command.toStdString());
+  EXPECT_GE(lastGet.serverTime().count(), 20000);
+
+  // only the GETs were slow, and the log keeps the newest three.
+  EXPECT_EQ(5, tracer->getSlowCount());
+  auto slowLog = tracer->getSlowLog();
+  ASSERT_EQ(3, slowLog.size());
+  for (const auto &trace: slowLog) {
+    EXPECT_EQ("GET", trace.command.toStdString());
+    EXPECT_GE(trace.total().count(), 20000);
+  }
+  EXPECT_EQ(lastGet.fulfilled, slowLog.back().fulfilled);
+}
+
+TEST(TestFakeServers, TestMemcachedSetGet) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedSyncClient client { MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    }};
+    client.connectExcept();
+    EXPECT_FALSE(client.set("foo", "f1").hasException());
+    auto response = client.get("foo");
+    EXPECT_FALSE(response.hasException());
+    EXPECT_EQ("f1", response.value().value().toStdString());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedSyncClientRejectsHotKeys) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedConfig config {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    };
+    HotKeyOptions hotKeys;
+    hotKeys.keys.push_back("hot");
+    config.setHotKeys(hotKeys);
+    MemcachedSyncClient client {config};
+    auto connected = client.connect();
+    EXPECT_TRUE(connected.hasException());
+    EXPECT_TRUE(connected.exception().is_compatible_with<ConfigurationError>());
+    EXPECT_FALSE(client.isConnected());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedSyncAppendWithCompressor) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedSyncClient client { MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    }};
+    client.connectExcept();
+    client.setValueCompressor(
+      fredis::compression::ValueCompressor::createShared()
+    );
+    EXPECT_FALSE(client.set("item", "v1").hasException());
+    auto appended = client.append("item", "x");
+    EXPECT_TRUE(appended.hasException());
+    EXPECT_TRUE(appended.exception().is_compatible_with<ConfigurationError>());
+    EXPECT_EQ("v1", client.get("item").value().value().toStdString());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedSyncClientStats) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedConfig config {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    };
+    MemcachedBehaviors behaviors;
+    behaviors.pollTimeout = std::chrono::milliseconds {50};
+    config.setBehaviors(behaviors);
+    MemcachedSyncClient client {config};
+    client.connectExcept();
+    EXPECT_FALSE(client.set("foo", "f1").hasException());
+    EXPECT_TRUE(client.get("foo").value().hasValue());
+    EXPECT_FALSE(client.get("nope").value().hasValue());
+
+    FaultProfile slowGets;
+    slowGets.serviceTime = ServiceTime::constant(micros_t {200000});
+    server->getFaultInjector().setCommandProfile("get", slowGets);
+    EXPECT_TRUE(client.get("foo").hasException());
+
+    auto stats = client.getStats();
+    const auto &set = stats.commands["set"];
+    EXPECT_EQ(1, set.count);
+    EXPECT_EQ(0, set.errors);
+    EXPECT_EQ(5, set.bytesOut);
+
+    // a hit, a miss (not an error) and a timeout.
+    const auto &get = stats.commands["get"];
+    EXPECT_EQ(3, get.count);
+    EXPECT_EQ(0, get.errors);
+    EXPECT_EQ(1, get.timeouts);
+    EXPECT_EQ(3 + 4 + 3, get.bytesOut);
+    EXPECT_EQ(2, get.bytesIn);
+    EXPECT_GE(get.latencyMicros.getMax(), 50000);
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedSyncMultiGetEachThrows) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedSyncClient client { MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    }};
+    client.connectExcept();
+    std::vector<folly::fbstring> keys;
+    for (size_t i = 0; i < 5; i++) {
+      keys.push_back(folly::to<folly::fbstring>("k", i));
+      EXPECT_FALSE(client.set(keys.back(), folly::to<folly::fbstring>("v", i))
+        .hasException());
+    }
+    size_t hits = 0;
+    EXPECT_THROW(client.multiGetEach(keys, [&hits](folly::StringPiece,
+        folly::fbstring&&) {
+      hits++;
+      throw std::runtime_error("handler failed");
+    }), std::runtime_error);
+    EXPECT_EQ(1, hits);
+    // the hits after the throw were drained, not left for the next command.
+    EXPECT_EQ("v3", client.get("k3").value().value().toStdString());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedGetOutcomes) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedSyncClient client { MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    }};
+    client.connectExcept();
+    EXPECT_FALSE(client.set("empty", "").hasException());
+    EXPECT_FALSE(client.set("big", folly::fbstring(100000, 'b')).hasException());
+
+    // a miss and an empty value are different things.
+    auto missing = client.get("missing");
+    EXPECT_FALSE(missing.hasException());
+    EXPECT_FALSE(missing.value().hasValue());
+    auto empty = client.get("empty");
+    EXPECT_FALSE(empty.hasException());
+    EXPECT_TRUE(empty.value().hasValue());
+    EXPECT_EQ("", empty.value().value().toStdString());
+
+    auto buf = client.getIOBuf("big");
+    EXPECT_FALSE(buf.hasException());
+    EXPECT_TRUE(buf.value().hasValue());
+    EXPECT_EQ(100000, buf.value().value()->computeChainDataLength());
+    EXPECT_FALSE(client.getIOBuf("missing").value().hasValue());
+    EXPECT_EQ(0, client.getIOBuf("empty").value().value()->length());
+
+    std::vector<uint8_t> storage(200000);
+    folly::MutableByteRange buffer {storage.data(), storage.size()};
+    auto written = client.getInto("big", buffer);
+    EXPECT_FALSE(written.hasException());
+    EXPECT_EQ(100000, written.value().value());
+    EXPECT_EQ('b', storage[99999]);
+    EXPECT_FALSE(client.getInto("missing", buffer).value().hasValue());
+    auto tooSmall = client.getInto("big", buffer.subpiece(0, 10));
+    EXPECT_TRUE(tooSmall.hasException());
+
+    // the connection is still usable after a read that didn't fit.
+    EXPECT_EQ(0, client.getInto("empty", buffer).value().value());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedBehaviorPresets) {
+  EXPECT_TRUE(MemcachedBehaviors::preset("no-such-preset").hasException());
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  for (auto name: {"default", "low-latency", "bulk-write"}) {
+    MemcachedConfig config {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    };
+    config.setBehaviors(MemcachedBehaviors::preset(name).value());
+    MemcachedSyncClient client {config};
+    client.connectExcept();
+    EXPECT_FALSE(client.set(name, name).hasException());
+    // a read flushes any buffered writes ahead of it.
+    auto response = client.get(name);
+    EXPECT_FALSE(response.hasException());
+    EXPECT_EQ(name, response.value().value().toStdString());
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedClientPool) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  {
+    MemcachedPoolOptions options;
+    options.maxSize = 2;
+    options.acquireTimeout = std::chrono::milliseconds {1000};
+    auto pool = MemcachedClientPool::createShared(MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    }, options).value();
+    std::atomic<size_t> failures {0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 8; t++) {
+      threads.emplace_back([&pool, &failures, t]() {
+        for (size_t i = 0; i < 50; i++) {
+          auto key = folly::to<folly::fbstring>("t", t, ":", i);
+          auto stored = pool->set(key, key);
+          auto got = pool->get(key);
+          if (stored.hasException() || got.hasException() ||
+              !got.value().hasValue() || got.value().value() != key) {
+            failures++;
+          }
+        }
+      });
+    }
+    for (auto &thread: threads) {
+      thread.join();
+    }
+    EXPECT_EQ(0, failures.load());
+    auto poolStats = pool->getPoolStats();
+    EXPECT_EQ(2, poolStats.size);
+    EXPECT_EQ(0, poolStats.inUse);
+
+    // with both clients leased, a third acquire times out.
+    options.acquireTimeout = std::chrono::milliseconds {20};
+    auto small = MemcachedClientPool::createShared(MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    }, options).value();
+    auto first = small->acquire();
+    auto second = small->acquire();
+    EXPECT_TRUE(first.hasValue() && second.hasValue());
+    EXPECT_TRUE(small->acquire().hasException());
+    EXPECT_EQ(1, small->getPoolStats().timeouts);
+  }
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedAsyncClient) {
+  auto server1 = FakeMemcachedServer::createShared();
+  auto server2 = FakeMemcachedServer::createShared();
+  server1->start();
+  server2->start();
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedAsyncClient> client;
+  folly::Baton<std::atomic> baton;
+  std::atomic<bool> matched {false};
+  ebt->runInEventBaseThread([&]() {
+    client = MemcachedAsyncClient::createShared(ebt->getBase(), MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server1->getPort()),
+      folly::SocketAddress("127.0.0.1", server2->getPort())
+    });
+    std::vector<folly::Future<folly::Unit>> sets;
+    for (size_t i = 0; i < 20; i++) {
+      sets.push_back(client->set(folly::to<std::string>("key", i),
+        folly::to<std::string>("value", i)));
+    }
+    folly::collect(sets).then([&](std::vector<folly::Unit>) {
+      std::vector<folly::Future<folly::Optional<folly::fbstring>>> gets;
+      for (size_t i = 0; i < 20; i++) {
+        gets.push_back(client->get(folly::to<std::string>("key", i)));
+      }
+      gets.push_back(client->get("missing"));
+      return folly::collect(gets);
+    }).then([&](folly::Try<std::vector<folly::Optional<folly::fbstring>>> got) {
+      bool allMatched = got.hasValue() && !got.value().back().hasValue();
+      for (size_t i = 0; allMatched && i < 20; i++) {
+        allMatched = got.value()[i].value() == folly::to<std::string>("value", i);
+      }
+      matched.store(allMatched);
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_TRUE(matched.load());
+  // the keys were spread over both servers.
+  EXPECT_EQ(1, server1->getConnectionCount());
+  EXPECT_EQ(1, server2->getConnectionCount());
+  ebt->runInEventBaseThread([&client]() {
+    client.reset();
+  });
+  ebt->stop();
+  ebt->join();
+  server1->stop();
+  server2->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedCasAndCounters) {
+  auto server1 = FakeMemcachedServer::createShared();
+  auto server2 = FakeMemcachedServer::createShared();
+  server1->start();
+  server2->start();
+  {
+    MemcachedSyncClient client { MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server1->getPort())
+    }};
+    client.connectExcept();
+    EXPECT_FALSE(client.set("item", "v1").hasException());
+    auto item = client.gets("item");
+    EXPECT_FALSE(item.hasException());
+    auto token = item.value().value().cas;
+    EXPECT_TRUE(CasResult::STORED == client.cas("item", "v2", token).value());
+    EXPECT_TRUE(CasResult::EXISTS == client.cas("item", "v3", token).value());
+    EXPECT_TRUE(CasResult::NOT_FOUND ==
+      client.cas("missing", "v", token).value());
+
+    EXPECT_FALSE(client.add("item", "v").value());
+    EXPECT_TRUE(client.add("other", "v").value());
+    EXPECT_FALSE(client.replace("missing", "v").value());
+    EXPECT_TRUE(client.append("item", "x").value());
+    EXPECT_EQ("v2x", client.get("item").value().value().toStdString());
+
+    EXPECT_FALSE(client.incr("hits", 5).value().hasValue());
+    EXPECT_EQ(10, client.incr("hits", 5, 10, 0).value());
+    EXPECT_EQ(15, client.incr("hits", 5, 10, 0).value());
+    // decr stops at zero.
+    EXPECT_EQ(0, client.decr("hits", 100).value().value());
+    EXPECT_TRUE(client.touch("hits", 60).value());
+    EXPECT_FALSE(client.touch("missing", 60).value());
+  }
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedAsyncClient> client;
+  folly::Baton<std::atomic> baton;
+  std::atomic<bool> matched {false};
+  ebt->runInEventBaseThread([&]() {
+    client = MemcachedAsyncClient::createShared(ebt->getBase(), MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server1->getPort()),
+      folly::SocketAddress("127.0.0.1", server2->getPort())
+    });
+    std::vector<MemcachedAsyncClient::CounterUpdate> created, decremented,
+      bumped;
+    for (size_t i = 0; i < 20; i++) {
+      MemcachedAsyncClient::CounterUpdate update;
+      update.key = folly::to<folly::fbstring>("counter", i);
+      update.delta = 3;
+      update.initial = 1;
+      created.push_back(update);
+      update.delta = -1;
+      decremented.push_back(update);
+      update.delta = 7;
+      bumped.push_back(update);
+    }
+    client->applyCounters(created).then([&, decremented](
+        std::vector<uint64_t> values) {
+      // missing counters start at their initial value.
+      EXPECT_EQ(std::vector<uint64_t>(20, 1), values);
+      return client->applyCounters(decremented);
+    }).then([&, bumped](std::vector<uint64_t> values) {
+      EXPECT_EQ(std::vector<uint64_t>(20, 0), values);
+      return client->applyCountersNoReply(bumped);
+    }).then([&, bumped]() {
+      std::vector<folly::StringPiece> keys;
+      for (const auto &update: bumped) {
+        keys.push_back(update.key);
+      }
+      return client->multiGet(keys);
+    }).then([&](folly::Try<MemcachedAsyncClient::multi_get_map_t> found) {
+      bool allMatched = found.hasValue() && found.value().size() == 20;
+      for (size_t i = 0; allMatched && i < 20; i++) {
+        auto key = folly::to<folly::fbstring>("counter", i);
+        allMatched = found.value()[key] == "7";
+      }
+      matched.store(allMatched);
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_TRUE(matched.load());
+  ebt->runInEventBaseThread([&client]() {
+    client.reset();
+  });
+  ebt->stop();
+  ebt->join();
+  server1->stop();
+  server2->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedMetaLeases) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedMetaClient> client;
+  folly::Baton<std::atomic> baton;
+  std::atomic<bool> matched {false};
+  std::atomic<size_t> computed {0};
+  std::atomic<size_t> servedStale {0};
+  ebt->runInEventBaseThread([&]() {
+    auto base = ebt->getBase();
+    client = MemcachedMetaClient::createShared(base, MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    });
+    // a slow recompute, so every caller arrives while it's running.
+    auto computeAs = [&, base](folly::fbstring value) {
+      return [&, base, value]() {
+        computed++;
+        auto promise = std::make_shared<folly::Promise<folly::fbstring>>();
+        base->runAfterDelay([promise, value]() {
+          promise->setValue(value);
+        }, 50);
+        return promise->getFuture();
+      };
+    };
+    auto stampede = [&, computeAs](folly::fbstring value) {
+      std::vector<folly::Future<folly::fbstring>> gets;
+      for (size_t i = 0; i < 10; i++) {
+        gets.push_back(client->getOrCompute("hot", computeAs(value)));
+      }
+      return folly::collect(gets);
+    };
+    MetaGetOptions full;
+    full.ttl = true;
+    full.cas = true;
+    MetaArithmeticOptions create;
+    create.vivifyTtl = 60;
+    create.initial = 5;
+    MetaSetOptions expiring;
+    expiring.ttl = 100;
+    MetaArithmeticOptions decrement;
+    decrement.delta = -10;
+    client->metaSet("item", "v1", expiring).then([&, full](MetaStoreResult) {
+      return client->metaGet("item", full);
+    }).then([&, create](MetaGetResult item) {
+      EXPECT_TRUE(item.found);
+      EXPECT_EQ("v1", item.value.toStdString());
+      EXPECT_TRUE(item.ttl.hasValue() && item.ttl.value() > 0);
+      EXPECT_TRUE(item.cas.hasValue());
+      return client->metaArithmetic("counter", create);
+    }).then([&, decrement](folly::Optional<uint64_t> created) {
+      EXPECT_EQ(5, created.value());
+      return client->metaArithmetic("counter", decrement);
+    }).then([&, stampede](folly::Optional<uint64_t> decremented) {
+      EXPECT_EQ(0, decremented.value());
+      // a cold miss: one caller computes, the rest wait for its value.
+      return stampede("fresh1");
+    }).then([&](std::vector<folly::fbstring> values) {
+      EXPECT_EQ(std::vector<folly::fbstring>(10, "fresh1"), values);
+      MetaDeleteOptions invalidate;
+      invalidate.invalidate = true;
+      return client->metaDelete("hot", invalidate);
+    }).then([&, stampede](bool) {
+      // after an invalidation: one caller recomputes, the rest get the
+      // stale value without waiting.
+      return stampede("fresh2");
+    }).then([&](folly::Try<std::vector<folly::fbstring>> values) {
+      if (values.hasValue()) {
+        for (const auto &value: values.value()) {
+          if (value == "fresh1") {
+            servedStale++;
+          }
+        }
+      }
+      return client->metaGet("hot");
+    }).then([&](folly::Try<MetaGetResult> latest) {
+      matched.store(latest.hasValue() && latest.value().value == "fresh2" &&
+        !latest.value().stale);
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_TRUE(matched.load());
+  EXPECT_EQ(2, computed.load());
+  EXPECT_EQ(9, servedStale.load());
+  ebt->runInEventBaseThread([&client]() {
+    client.reset();
+  });
+  ebt->stop();
+  ebt->join();
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedHotKeyReplication) {
+  std::vector<shared_ptr<FakeMemcachedServer>> servers;
+  MemcachedConfig config;
+  for (size_t i = 0; i < 3; i++) {
+    servers.push_back(FakeMemcachedServer::createShared());
+    servers.back()->start();
+    config.addServer(
+      folly::SocketAddress("127.0.0.1", servers.back()->getPort())
+    );
+  }
+  HotKeyOptions hotKeys;
+  hotKeys.keys.push_back("celebrity");
+  hotKeys.detectThreshold = 5;
+  hotKeys.detectWindow = std::chrono::milliseconds(10000);
+  config.setHotKeys(hotKeys);
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedAsyncClient> client;
+  // shares the config, but never reads so never detects anything.
+  shared_ptr<MemcachedAsyncClient> writer;
+  // one unreplicated client per server, to look at each copy.
+  std::vector<shared_ptr<MemcachedAsyncClient>> direct;
+  folly::Baton<std::atomic> baton;
+  std::atomic<bool> matched {false};
+  std::atomic<size_t> copiesRead {0};
+  std::atomic<bool> staleCopies {true};
+  using maybe_values_t = std::vector<folly::Optional<folly::fbstring>>;
+  ebt->runInEventBaseThread([&]() {
+    auto base = ebt->getBase();
+    client = MemcachedAsyncClient::createShared(base, config);
+    writer = MemcachedAsyncClient::createShared(base, config);
+    for (const auto &server: servers) {
+      direct.push_back(MemcachedAsyncClient::createShared(base,
+        MemcachedConfig {folly::SocketAddress("127.0.0.1", server->getPort())}
+      ));
+    }
+    // replicated writes resolve with the key's own server, so give the
+    // other copies a moment before looking at them.
+    auto readCopies = [&, base](folly::fbstring key) {
+      auto promise = std::make_shared<folly::Promise<folly::Unit>>();
+      base->runAfterDelay([promise]() {
+        promise->setValue();
+      }, 50);
+      return promise->getFuture().then([&, key]() {
+        std::vector<folly::Future<folly::Optional<folly::fbstring>>> gets;
+        for (auto &copy: direct) {
+          gets.push_back(copy->get(key));
+        }
+        return folly::collect(gets);
+      });
+    };
+    auto readMany = [&](folly::fbstring key, size_t count) {
+      std::vector<folly::Future<folly::Optional<folly::fbstring>>> gets;
+      for (size_t i = 0; i < count; i++) {
+        gets.push_back(client->get(key));
+      }
+      return folly::collect(gets);
+    };
+    client->set("celebrity", "v1").then([&, readCopies]() {
+      return readCopies("celebrity");
+    }).then([&](maybe_values_t copies) {
+      for (const auto &copy: copies) {
+        EXPECT_EQ("v1", copy.value().toStdString());
+      }
+      // mark each copy, to tell which ones reads are served from.
+      std::vector<folly::Future<folly::Unit>> marks;
+      for (size_t i = 0; i < direct.size(); i++) {
+        marks.push_back(direct[i]->set("celebrity",
+          folly::to<std::string>("copy", i)));
+      }
+      return folly::collect(marks);
+    }).then([&, readMany](std::vector<folly::Unit>) {
+      return readMany("celebrity", 30);
+    }).then([&](maybe_values_t reads) {
+      std::set<folly::fbstring> seen;
+      for (const auto &read: reads) {
+        seen.insert(read.value());
+      }
+      copiesRead.store(seen.size());
+      return client->del("celebrity");
+    }).then([&, readCopies](bool) {
+      return readCopies("celebrity");
+    }).then([&](maybe_values_t copies) {
+      for (const auto &copy: copies) {
+        EXPECT_FALSE(copy.hasValue());
+      }
+      // written while it's cold, so only its own server has it until reads
+      // make it hot and the other copies are refilled.
+      return client->set("trending", "t1");
+    }).then([&, readMany]() {
+      return readMany("trending", 20);
+    }).then([&](folly::Try<maybe_values_t> reads) {
+      bool allMatched = reads.hasValue();
+      for (size_t i = 0; allMatched && i < reads.value().size(); i++) {
+        allMatched = reads.value()[i].value() == "t1";
+      }
+      matched.store(allMatched);
+      // the writer doesn't know the key is hot, but still deletes the
+      // copies the reading client refilled.
+      return writer->set("trending", "t2");
+    }).then([&, readCopies]() {
+      return readCopies("trending");
+    }).then([&](maybe_values_t copies) {
+      bool stale = false;
+      for (const auto &copy: copies) {
+        stale = stale || (copy.hasValue() && copy.value() != "t2");
+      }
+      staleCopies.store(stale);
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_TRUE(matched.load());
+  EXPECT_FALSE(staleCopies.load());
+  EXPECT_GT(copiesRead.load(), 1);
+  auto stats = client->getHotKeyStats();
+  EXPECT_EQ(1, stats.listedKeys);
+  EXPECT_EQ(1, stats.detectedKeys);
+  EXPECT_GT(stats.replicaReads, 0);
+  EXPECT_GT(stats.replicaMisses, 0);
+  EXPECT_GT(stats.repairs, 0);
+  EXPECT_GE(stats.invalidations, 2);
+  ebt->runInEventBaseThread([&]() {
+    client.reset();
+    writer.reset();
+    direct.clear();
+  });
+  ebt->stop();
+  ebt->join();
+  for (auto &server: servers) {
+    server->stop();
+  }
+}
+
+TEST(TestFakeServers, TestMemcachedMultiGet) {
+  auto fast = FakeMemcachedServer::createShared();
+  auto slow = FakeMemcachedServer::createShared();
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {100000});
+  slow->getFaultInjector().setCommandProfile("get", slowGets);
+  fast->start();
+  slow->start();
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedAsyncClient> client;
+  folly::Baton<std::atomic> baton;
+  std::vector<std::string> keys;
+  for (size_t i = 0; i < 20; i++) {
+    keys.push_back(folly::to<std::string>("key", i));
+  }
+  std::atomic<size_t> hits {0};
+  std::atomic<int64_t> firstHitMs {-1};
+  std::atomic<int64_t> doneMs {-1};
+  ebt->runInEventBaseThread([&]() {
+    client = MemcachedAsyncClient::createShared(ebt->getBase(), MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", fast->getPort()),
+      folly::SocketAddress("127.0.0.1", slow->getPort())
+    });
+    std::vector<folly::Future<folly::Unit>> sets;
+    for (const auto &key: keys) {
+      sets.push_back(client->set(key, "v" + key));
+    }
+    folly::collect(sets).then([&](std::vector<folly::Unit>) {
+      auto startedAt = std::chrono::steady_clock::now();
+      auto elapsedMs = [startedAt]() {
+        return (int64_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - startedAt
+        ).count();
+      };
+      auto withMissing = keys;
+      withMissing.push_back("missing");
+      return client->multiGetEach(std::vector<folly::StringPiece> {
+        withMissing.begin(), withMissing.end()
+      }, [&, elapsedMs](folly::StringPiece key, folly::fbstring &&value) {
+        if (value == "v" + key.str()) {
+          hits++;
+        }
+        int64_t unset = -1;
+        firstHitMs.compare_exchange_strong(unset, elapsedMs());
+      }).then([&, elapsedMs]() {
+        doneMs.store(elapsedMs());
+      });
+    }).ensure([&baton]() {
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_EQ(keys.size(), hits.load());
+  // the fast server's hits arrived without waiting for the slow one.
+  EXPECT_LE(0, firstHitMs.load());
+  EXPECT_GT(50, firstHitMs.load());
+  EXPECT_LE(100, doneMs.load());
+  ebt->runInEventBaseThread([&client]() {
+    client.reset();
+  });
+  ebt->stop();
+  ebt->join();
+  fast->stop();
+  slow->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedAsyncReadTimeout) {
+  auto server = FakeMemcachedServer::createShared();
+  FaultProfile slowGets;
+  slowGets.serviceTime = ServiceTime::constant(micros_t {200000});
+  server->getFaultInjector().setCommandProfile("get", slowGets);
+  server->start();
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedAsyncClient> client;
+  folly::Baton<std::atomic> baton;
+  std::atomic<bool> timedOut {false};
+  std::atomic<bool> recovered {false};
+  ebt->runInEventBaseThread([&]() {
+    MemcachedConfig config {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    };
+    MemcachedBehaviors behaviors;
+    behaviors.pollTimeout = std::chrono::milliseconds {50};
+    config.setBehaviors(behaviors);
+    client = MemcachedAsyncClient::createShared(ebt->getBase(), config);
+    client->set("foo", "f1").then([&]() {
+      return client->get("foo");
+    }).then([&](folly::Try<folly::Optional<folly::fbstring>> result) {
+      timedOut.store(result.hasException() &&
+        result.exception().is_compatible_with<RequestTimeout>());
+      server->getFaultInjector().clear();
+      return client->get("foo");
+    }).then([&](folly::Optional<folly::fbstring> value) {
+      recovered.store(value.hasValue() && value.value() == "f1");
+    }).ensure([&baton]() {
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_TRUE(timedOut.load());
+  EXPECT_TRUE(recovered.load());
+  ebt->runInEventBaseThread([&client]() {
+    client.reset();
+  });
+  ebt->stop();
+  ebt->join();
+  server->stop();
+}
+
+TEST(TestFakeServers, TestMemcachedAsyncMultiGetEachThrows) {
+  auto server = FakeMemcachedServer::createShared();
+  server->start();
+  auto ebt = EBThread::createShared();
+  ebt->ensureStarted();
+  shared_ptr<MemcachedAsyncClient> client;
+  folly::Baton<std::atomic> baton;
+  std::vector<std::string> keys {"key0", "key1", "key2"};
+  std::atomic<size_t> hits {0};
+  std::atomic<bool> failed {false};
+  std::atomic<bool> clean {false};
+  ebt->runInEventBaseThread([&]() {
+    client = MemcachedAsyncClient::createShared(ebt->getBase(), MemcachedConfig {
+      folly::SocketAddress("127.0.0.1", server->getPort())
+    });
+    std::vector<folly::Future<folly::Unit>> sets;
+    for (const auto &key: keys) {
+      sets.push_back(client->set(key, "v" + key));
+    }
+    folly::collect(sets).then([&](std::vector<folly::Unit>) {
+      return client->multiGetEach(std::vector<folly::StringPiece> {
+        keys.begin(), keys.end()
+      }, [&hits](folly::StringPiece, folly::fbstring&&) {
+        hits++;
+        throw std::runtime_error("handler failed");
+      }).then([&failed](folly::Try<folly::Unit> result) {
+        failed.store(result.hasException() &&
+          result.exception().is_compatible_with<std::runtime_error>());
+      });
+    }).then([&]() {
+      // the rest of the reply was read off the connection.
+      return client->get("key1");
+    }).then([&clean](folly::Optional<folly::fbstring> value) {
+      clean.store(value.hasValue() && value.value() == "vkey1");
+    }).ensure([&baton]() {
+      baton.post();
+    });
+  });
+  baton.wait();
+  EXPECT_EQ(1, hits.load());
+  EXPECT_TRUE(failed.load());
+  EXPECT_TRUE(clean.load());
+  ebt->runInEventBaseThread([&client]() {
+    client.reset();
+  });
+  ebt->stop();
+  ebt->join();
+  server->stop();
+}
+
+namespace {
+
+// an in-memory tier whose gets can be held open and answered later with
+// the value the tier had when they were asked, to race them with writes.
+class HeldTier: public CacheTier {
+ public:
+  using get_promise_t = folly::Promise<folly::Optional<folly::fbstring>>;
+  std::map<std::string, std::string> values;
+  bool holdGets {false};
+  std::vector<std::pair<folly::Optional<folly::fbstring>, get_promise_t>> held;
+
+  HeldTier(const std::string &name, time_t maxTtl)
+    : CacheTier(name, maxTtl) {}
+
+  folly::Future<folly::Optional<folly::fbstring>> get(
+      folly::StringPiece key) override {
+    folly::Optional<folly::fbstring> found;
+    auto value = values.find(key.str());
+    if (value != values.end()) {
+      found = folly::fbstring {value->second};
+    }
+    if (!holdGets) {
+      return folly::makeFuture(found);
+    }
+    held.emplace_back(found, get_promise_t {});
+    return held.back().second.getFuture();
+  }
+  folly::Future<folly::Unit> set(folly::StringPiece key,
+      folly::StringPiece value, time_t) override {
+    values[key.str()] = value.str();
+    return folly::makeFuture();
+  }
+  folly::Future<folly::Unit> del(folly::StringPiece key) override {
+    values.erase(key.str());
+    return folly::makeFuture();
+  }
+  void release() {
+    for (auto &get: held) {
+      get.second.setValue(get.first);
+    }
+    held.clear();
+  }
+};
+
+} // anonymous namespace
+
+TEST(TestFakeServers, TestTieredCacheSkipsStaleBackfill) {
+  auto l1 = std::make_shared<HeldTier>("l1", 10);
+  auto l2 = std::make_shared<HeldTier>("l2", 0);
+  l2->values["k"] = "old";
+  TieredCacheOptions around;
+  around.writePolicy = WritePolicy::WRITE_AROUND;
+  auto cache = TieredCache::createShared({l1, l2}, around);
+
+  // the get reads the old value from L2, and only answers after the set
+  // has replaced it and deleted L1's copy.
+  l2->holdGets = true;
+  auto racing = cache->get("k");
+  cache->set("k", "new", 60);
+  l2->release();
+  EXPECT_EQ("old", racing.value().value().toStdString());
+  EXPECT_EQ(0, l1->values.count("k"));
+  EXPECT_EQ(1, cache->getStats().backfillsSkipped);
+
+  l2->holdGets = false;
+  EXPECT_EQ("new", cache->get("k").value().value().toStdString());
+  EXPECT_EQ("new", l1->values["k"]);
+}
+
+TEST(TestFakeServers, TestTieredCache) {
+  auto memcachedServer = FakeMemcachedServer::createShared();
+  memcachedServer->start();
+  FakeRedisContext ctx;
+  shared_ptr<MemcachedAsyncClient> l1Client;
+  shared_ptr<TieredCache> aroundCache;
+  shared_ptr<TieredCache> throughCache;
+  std::atomic<bool> matched {false};
+  ctx.start([&](shared_ptr<RedisClient> redisClient) {
+    l1Client = MemcachedAsyncClient::createShared(ctx.ebt->getBase(),
+      MemcachedConfig {
+        folly::SocketAddress("127.0.0.1", memcachedServer->getPort())
+      }
+    );
+    std::vector<shared_ptr<CacheTier>> tiers {
+      MemcachedTier::createShared(l1Client, 10),
+      RedisTier::createShared(redisClient)
+    };
+    TieredCacheOptions around;
+    around.writePolicy = WritePolicy::WRITE_AROUND;
+    aroundCache = TieredCache::createShared(tiers, around);
+    TieredCacheOptions through;
+    through.lookupMode = LookupMode::PARALLEL;
+    throughCache = TieredCache::createShared(tiers, through);
+    // an upper tier without a max ttl would keep backfilled copies forever.
+    EXPECT_THROW(TieredCache::createShared({
+      MemcachedTier::createShared(l1Client), RedisTier::createShared(redisClient)
+    }), fredis::tiered::TieredCacheError);
+
+    // written around L1, so the first get comes from L2 and backfills L1.
+    aroundCache->set("k1", "v1", 60).then([&]() {
+      return aroundCache->get("k1");
+    }).then([&](folly::Optional<folly::fbstring> fromL2) {
+      EXPECT_EQ("v1", fromL2.value().toStdString());
+      return l1Client->get("k1");
+    }).then([&](folly::Optional<folly::fbstring> backfilled) {
+      EXPECT_EQ("v1", backfilled.value().toStdString());
+      return aroundCache->get("k1");
+    }).then([&](folly::Optional<folly::fbstring>) {
+      return throughCache->set("k2", "v2", 60);
+    }).then([&]() {
+      return l1Client->get("k2");
+    }).then([&](folly::Optional<folly::fbstring> written) {
+      EXPECT_EQ("v2", written.value().toStdString());
+      return throughCache->get("missing");
+    }).then([&](folly::Try<folly::Optional<folly::fbstring>> missing) {
+      matched.store(missing.hasValue() && !missing.value().hasValue());
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+  auto stats = aroundCache->getStats();
+  EXPECT_EQ(2, stats.gets);
+  EXPECT_EQ(2, stats.hits);
+  EXPECT_EQ(2, stats.tiers[0].lookups);
+  EXPECT_EQ(1, stats.tiers[0].hits);
+  EXPECT_EQ(1, stats.tiers[0].backfills);
+  EXPECT_EQ(1, stats.tiers[1].lookups);
+  EXPECT_EQ(1, stats.tiers[1].hits);
+  EXPECT_DOUBLE_EQ(0.5, stats.tiers[0].getHitRatio());
+  EXPECT_NEAR(1.0,
+    stats.tiers[0].latencyShare + stats.tiers[1].latencyShare, 1e-9);
+  auto parallel = throughCache->getStats();
+  EXPECT_EQ(1, parallel.misses);
+  EXPECT_EQ(1, parallel.tiers[1].lookups);
+  ctx.ebt->runInEventBaseThread([&]() {
+    aroundCache.reset();
+    throughCache.reset();
+    l1Client.reset();
+  });
+  memcachedServer->stop();
+}
+
+TEST(TestFakeServers, TestRedisStreamingRoundTrip) {
+  FakeRedisContext ctx;
+  std::string expected;
+  for (size_t i = 0; i < 10000; i++) {
+    expected.push_back((char) (i % 251));
+  }
+  std::atomic<bool> matched {false};
+  std::atomic<bool> missingIsNone {false};
+  std::atomic<int64_t> ttl {0};
+  ctx.start([&ctx, &expected, &matched, &missingIsNone, &ttl](
+      shared_ptr<RedisClient> client) {
+    // three segments, none aligned with the chunk size.
+    auto value = folly::IOBuf::copyBuffer(expected.data(), 3000);
+    value->prependChain(folly::IOBuf::copyBuffer(expected.data() + 3000, 4500));
+    value->prependChain(folly::IOBuf::copyBuffer(expected.data() + 7500, 2500));
+    StreamOptions options;
+    options.chunkSize = 1024;
+    options.parallelism = 3;
+    client->setStreaming("blob", std::move(value), options)
+      .then([client]() {
+        return client->commandArgv({"TTL", "blob"});
+      })
+      .then([client, options, &ttl](try_response_t response) {
+        ttl.store(response.value().getInt().value());
+        return client->getChained("blob", options);
+      })
+      .then([client, options, &expected, &matched](
+          std::unique_ptr<folly::IOBuf> chain) {
+        matched.store(chain && chain->countChainElements() == 10 &&
+          chain->moveToFbString().toStdString() == expected);
+        return client->getStreaming("no-such-blob",
+          [](std::unique_ptr<folly::IOBuf>) {}, options);
+      })
+      .then([&ctx, &missingIsNone](folly::Try<folly::Optional<size_t>> length) {
+        missingIsNone.store(length.hasValue() && !length.value().hasValue());
+        ctx.baton.post();
+      });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+  EXPECT_TRUE(missingIsNone.load());
+  // the temporary key's expiry didn't come along with the rename.
+  EXPECT_EQ(-1, ttl.load());
+}
+
+TEST(TestFakeServers, TestRedisCompressedRoundTrip) {
+  using namespace fredis::compression;
+  FakeRedisContext ctx;
+  auto compressor = ValueCompressor::createShared();
+  CompressionRule rule;
+  rule.keyPrefix = "json:";
+  rule.codec = ValueCodec::LZ4;
+  compressor->addRule(rule);
+
+  std::string document;
+  for (size_t i = 0; i < 200; i++) {
+    document += folly::to<std::string>("{\"id\":", i, ",\"kind\":\"widget\"},");
+  }
+  // a raw value that looks like it has a header must survive unchanged.
+  std::string lookalike {"\xFD" "z" "\x01" "not compressed"};
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &compressor, &document, &lookalike, &matched](
+      shared_ptr<RedisClient> client) {
+    client->setValueCompressor(compressor);
+    client->set("json:doc", document)
+      .then([client, &lookalike](try_response_t) {
+        return client->set("plain:doc", lookalike);
+      })
+      .then([client](try_response_t) {
+        return client->mget({"json:doc", "plain:doc"});
+      })
+      .then([&ctx, &document, &lookalike, &matched](try_response_t response) {
+        auto values = response.value().getArray().value();
+        matched.store(values.size() == 2 &&
+          values[0].getString().value().str() == document &&
+          values[1].getString().value().str() == lookalike);
+        ctx.baton.post();
+      });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+  auto stats = compressor->getStats();
+  EXPECT_EQ(1, stats.valuesCompressed);
+  EXPECT_EQ(1, stats.valuesStoredRaw);
+  EXPECT_LT(stats.getRatio(), 0.5);
+
+  // the length in the header is untrusted: huge or mismatched sizes fail.
+  std::string huge {"\xFD" "z" "\x01" "\x80\x80\x80\x80\x80\x20" "junk"};
+  EXPECT_TRUE(compressor->decode(huge).hasException());
+  CompressionRule zstdRule;
+  zstdRule.keyPrefix = "zstd:";
+  zstdRule.codec = ValueCodec::ZSTD;
+  compressor->addRule(zstdRule);
+  auto encoded = compressor->encode("zstd:doc", document);
+  EXPECT_EQ(document, compressor->decode(encoded).value().toStdString());
+  uint8_t varint[folly::kMaxVarintLength64];
+  size_t varintLen = folly::encodeVarint(document.size(), varint);
+  size_t liedLen = folly::encodeVarint(document.size() + 1, varint);
+  ASSERT_EQ(varintLen, liedLen);
+  auto tampered = encoded;
+  tampered.replace(3, liedLen, (const char*) varint, liedLen);
+  EXPECT_TRUE(compressor->decode(tampered).hasException());
+  compressor->setMaxValueBytes(document.size() - 1);
+  EXPECT_TRUE(compressor->decode(encoded).hasException());
+  EXPECT_EQ(3, compressor->getStats().decodeErrors);
+}
+
+namespace {
+struct Point {
+  int32_t x;
+  int32_t y;
+};
+}
+
+TEST(TestFakeServers, TestRedisTypedValues) {
+  using fredis::codec::Flat;
+  FakeRedisContext ctx;
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &matched](shared_ptr<RedisClient> client) {
+    std::vector<folly::fbstring> names {"a", "", std::string("b\0c", 3)};
+    folly::dynamic doc = folly::dynamic::object("name", "widget")("count", 3);
+    client->set("counter", 41);
+    client->incr("counter");
+    client->set("names", names);
+    client->set("doc", doc);
+    client->set("point", Flat<Point> {Point {3, -4}});
+    client->get<int64_t>("counter")
+      .then([client](folly::Optional<int64_t> counter) {
+        EXPECT_EQ(42, counter.value());
+        return client->get<std::vector<folly::fbstring>>("names");
+      })
+      .then([client, names](folly::Optional<std::vector<folly::fbstring>> got) {
+        EXPECT_EQ(names, got.value());
+        return client->get<folly::dynamic>("doc");
+      })
+      .then([client, doc](folly::Optional<folly::dynamic> got) {
+        EXPECT_EQ(doc, got.value());
+        return client->get<Flat<Point>>("point");
+      })
+      .then([client](folly::Optional<Flat<Point>> got) {
+        EXPECT_EQ(3, got.value().value.x);
+        EXPECT_EQ(-4, got.value().value.y);
+        return client->get<int64_t>("missing");
+      })
+      .then([&ctx, &matched](folly::Try<folly::Optional<int64_t>> missing) {
+        matched.store(missing.hasValue() && !missing.value().hasValue());
+        ctx.baton.post();
+      });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+TEST(TestFakeServers, TestRedisContainers) {
+  using field_list = std::vector<std::string>;
+  using score_list = std::vector<std::pair<std::string, double>>;
+  FakeRedisContext ctx;
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &matched](shared_ptr<RedisClient> client) {
+    std::map<std::string, int64_t> stock {{"apples", 3}, {"pears", 12}};
+    client->hset("stock", stock);
+    client->sadd("tags", field_list {"red", "green", "red"});
+    client->rpush("queue", std::vector<int64_t> {1, 2, 3});
+    client->zadd("ranks", std::map<std::string, double> {
+      {"low", 1.5}, {"high", 9}
+    });
+    client->hmget<std::vector<folly::Optional<int64_t>>>(
+        "stock", field_list {"pears", "plums"})
+      .then([client](std::vector<folly::Optional<int64_t>> got) {
+        EXPECT_EQ(12, got.at(0).value());
+        EXPECT_FALSE(got.at(1).hasValue());
+        return client->hgetall<std::map<std::string, int64_t>>("stock");
+      })
+      .then([client, stock](std::map<std::string, int64_t> got) {
+        EXPECT_EQ(stock, got);
+        return client->smembers("tags");
+      })
+      .then([client](std::set<std::string> got) {
+        EXPECT_EQ((std::set<std::string> {"green", "red"}), got);
+        return client->lrange<std::vector<int64_t>>("queue", 0, -1);
+      })
+      .then([client](std::vector<int64_t> got) {
+        EXPECT_EQ((std::vector<int64_t> {1, 2, 3}), got);
+        return client->zrangeWithScores("ranks", 0, -1);
+      })
+      .then([client](score_list got) {
+        EXPECT_EQ((score_list {{"low", 1.5}, {"high", 9}}), got);
+        return client->smembers("stock");
+      })
+      .then([&ctx, &matched](folly::Try<std::set<std::string>> wrongType) {
+        matched.store(wrongType.hasException<RedisError>());
+        ctx.baton.post();
+      });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+TEST(TestFakeServers, TestRedisStreamConsumer) {
+  FakeRedisContext ctx;
+  shared_ptr<RedisStreamConsumer> consumer;
+  size_t received = 0;
+  std::atomic<bool> matched {false};
+  ctx.start([&](shared_ptr<RedisClient> client) {
+    auto reader = RedisClient::createShared(
+      ctx.ebt->getBase(), "127.0.0.1", ctx.server->getPort()
+    );
+    StreamConsumerOptions options;
+    options.stream = "events";
+    options.group = "workers";
+    options.consumer = "w1";
+    options.batchSize = 4;
+    options.blockTimeout = std::chrono::milliseconds {50};
+    options.ackInterval = std::chrono::milliseconds {5};
+    options.createGroupAt = "0";
+    consumer = RedisStreamConsumer::createShared(reader, client, options,
+      [&ctx, &consumer, &received, &matched, client](
+          std::vector<StreamEntry> &&entries) {
+        EXPECT_LE(entries.size(), 4);
+        for (const auto &entry: entries) {
+          EXPECT_EQ("n", entry.fields.at(0).first);
+          consumer->ack(entry.id);
+        }
+        received += entries.size();
+        if (received < 10) {
+          return;
+        }
+        consumer->stop().then([client]() {
+          return client->commandArgv({"XPENDING", "events", "workers"});
+        }).then([&ctx, &consumer, &matched](RedisDynamicResponse pending) {
+          matched.store(pending.getArray().value()[0].getInt().value() == 0
+            && consumer->getStats().acked == 10);
+          consumer.reset();
+          ctx.baton.post();
+        });
+      });
+    reader->connect().then([&consumer](try_connect_t connected) {
+      connected.throwIfFailed();
+      return consumer->start();
+    }).then([client]() {
+      StreamProducerOptions producerOptions;
+      producerOptions.stream = "events";
+      auto producer = RedisStreamProducer::createShared(
+        client, producerOptions
+      );
+      std::vector<stream_fields_t> batch;
+      for (size_t i = 0; i < 10; i++) {
+        batch.push_back(stream_fields_t {{"n", folly::to<folly::fbstring>(i)}});
+      }
+      return producer->addBatch(batch);
+    }).then([](std::vector<folly::fbstring> ids) {
+      EXPECT_EQ(10, ids.size());
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+TEST(TestFakeServers, TestRedisQueueConsumer) {
+  FakeRedisContext ctx;
+  shared_ptr<RedisQueueConsumer> consumer;
+  std::vector<folly::fbstring> handled;
+  std::atomic<bool> matched {false};
+  QueueConsumerOptions options;
+  options.queue = "jobs";
+  options.processingList = "jobs:processing";
+  options.batchSize = 4;
+  options.maxConsumers = 1;
+  options.blockTimeout = std::chrono::milliseconds {50};
+  consumer = RedisQueueConsumer::createShared(ctx.ebt, "127.0.0.1",
+    ctx.server->getPort(), options,
+    [&ctx, &consumer, &handled, &matched](const folly::fbstring &job) {
+      handled.push_back(job);
+      if (handled.size() < 11) {
+        return;
+      }
+      consumer->stop().then([&consumer]() {
+        return consumer->getStats();
+      }).then([&ctx, &consumer, &handled, &matched](QueueConsumerStats stats) {
+        matched.store(handled.front() == "recovered" && stats.recovered == 1
+          && stats.popped == 11 && stats.completed == 11);
+        consumer.reset();
+        ctx.baton.post();
+      });
+    });
+  ctx.start([&consumer](shared_ptr<RedisClient> client) {
+    // left behind by an earlier run that died midway.
+    client->rpush("jobs:processing", std::vector<std::string> {"recovered"});
+    std::vector<std::string> jobs;
+    for (size_t i = 0; i < 10; i++) {
+      jobs.push_back(folly::to<std::string>("job-", i));
+    }
+    client->rpush("jobs", jobs).then([&consumer](RedisDynamicResponse) {
+      return consumer->start();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+namespace {
+
+// holds jobs until the test runs them, so they stay in flight meanwhile.
+class HoldingExecutor: public folly::Executor {
+ protected:
+  std::mutex mutex_;
+  std::vector<folly::Func> held_;
+ public:
+  void add(folly::Func func) override {
+    std::lock_guard<std::mutex> guard {mutex_};
+    held_.push_back(std::move(func));
+  }
+  std::vector<folly::Func> take() {
+    std::lock_guard<std::mutex> guard {mutex_};
+    std::vector<folly::Func> taken;
+    taken.swap(held_);
+    return taken;
+  }
+};
+
+} // anonymous namespace
+
+TEST(TestFakeServers, TestRedisQueueConsumerInFlightCap) {
+  FakeRedisContext ctx;
+  HoldingExecutor executor;
+  std::atomic<size_t> handled {0};
+  QueueConsumerOptions options;
+  options.queue = "capped-jobs";
+  options.batchSize = 16;
+  options.maxConsumers = 1;
+  options.maxInFlightJobs = 3;
+  options.blockTimeout = std::chrono::milliseconds {50};
+  auto consumer = RedisQueueConsumer::createShared(ctx.ebt, "127.0.0.1",
+    ctx.server->getPort(), options, [&handled](const folly::fbstring&) {
+      handled++;
+    }, &executor);
+  ctx.start([&ctx, &consumer](shared_ptr<RedisClient> client) {
+    std::vector<std::string> jobs;
+    for (size_t i = 0; i < 10; i++) {
+      jobs.push_back(folly::to<std::string>("job-", i));
+    }
+    client->rpush("capped-jobs", jobs).then([&consumer](RedisDynamicResponse) {
+      return consumer->start();
+    }).then([&ctx]() {
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  ctx.baton.reset();
+
+  size_t ran = 0;
+  while (ran < 10) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // however big the batch, a pop never takes more than the free slots.
+    auto held = executor.take();
+    EXPECT_LE(held.size(), 3);
+    ASSERT_GT(held.size(), 0);
+    for (auto &run: held) {
+      run();
+    }
+    ran += held.size();
+  }
+  std::atomic<size_t> popped {0};
+  ctx.ebt->runInEventBaseThread([&ctx, &consumer, &popped]() {
+    consumer->stop().then([&consumer]() {
+      return consumer->getStats();
+    }).then([&ctx, &consumer, &popped](QueueConsumerStats stats) {
+      popped.store(stats.popped);
+      consumer.reset();
+      ctx.baton.post();
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_EQ(10, popped.load());
+  EXPECT_EQ(10, handled.load());
+}
+
+TEST(TestFakeServers, TestRedisCallbackChain) {
+  FakeRedisContext ctx;
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &matched](shared_ptr<RedisClient> client) {
+    client->setWithCallback("source", "v1", [&ctx, &matched, client](
+        try_response_t &setResult) {
+      EXPECT_TRUE(setResult.hasValue());
+      client->getWithCallback("source", [&ctx, &matched, client](
+          try_response_t &got) {
+        // the reply is only valid in here; the SET encodes it right away.
+        auto value = got.value().getString().value();
+        client->setWithCallback("copy", value, [&ctx, &matched, client](
+            try_response_t&) {
+          client->getWithCallback("copy", [&ctx, &matched](
+              try_response_t &copied) {
+            matched.store(copied.value().getString().value() == "v1");
+            ctx.baton.post();
+          });
+        });
+      });
+    });
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+#if FREDIS_HAVE_COROUTINES
+
+// just enough of a coroutine type to run one to completion without
+// awaiting it.
+struct DetachedTask {
+  struct promise_type {
+    DetachedTask get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+DetachedTask runCoroutineCommands(shared_ptr<RedisClient> client,
+    std::atomic<bool> &matched, folly::Baton<std::atomic> &baton) {
+  RedisCoroClient coro {client};
+  co_await coro.set("counter", 41);
+  auto counter = co_await coro.incr("counter");
+  auto value = co_await coro.get<int64_t>("counter");
+  auto missing = co_await coro.get("missing");
+  matched.store(counter == 42 && value.value() == 42 && !missing.hasValue());
+  baton.post();
+}
+
+TEST(TestFakeServers, TestRedisCoroutines) {
+  FakeRedisContext ctx;
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &matched](shared_ptr<RedisClient> client) {
+    runCoroutineCommands(client, matched, ctx.baton);
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+}
+
+DetachedTask runCompressedCoroutineCommands(shared_ptr<RedisClient> client,
+    const std::string &document, std::atomic<bool> &matched,
+    folly::Baton<std::atomic> &baton) {
+  RedisCoroClient coro {client};
+  co_await coro.set("json:doc", folly::StringPiece {document});
+  auto value = co_await coro.get("json:doc");
+  matched.store(value.hasValue() && value.value() == document);
+  baton.post();
+}
+
+TEST(TestFakeServers, TestRedisCoroutinesCompressed) {
+  using namespace fredis::compression;
+  FakeRedisContext ctx;
+  auto compressor = ValueCompressor::createShared();
+  CompressionRule rule;
+  rule.keyPrefix = "json:";
+  rule.codec = ValueCodec::LZ4;
+  compressor->addRule(rule);
+  std::string document;
+  for (size_t i = 0; i < 200; i++) {
+    document += folly::to<std::string>("{\"id\":", i, ",\"kind\":\"widget\"},");
+  }
+  std::atomic<bool> matched {false};
+  ctx.start([&ctx, &compressor, &document, &matched](
+      shared_ptr<RedisClient> client) {
+    client->setValueCompressor(compressor);
+    runCompressedCoroutineCommands(client, document, matched, ctx.baton);
+  });
+  ctx.baton.wait();
+  EXPECT_TRUE(matched.load());
+  EXPECT_EQ(1, compressor->getStats().valuesCompressed);
+}
+
+#endif // FREDIS_HAVE_COROUTINES
@@ -0,0 +1,77 @@
+#include "fredis/memcached/HotKeyTracker.h"
+#include <algorithm>
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+
+namespace fredis { namespace memcached {
+
+HotKeyTracker::HotKeyTracker(const HotKeyOptions &options)
+  : options_(options), windowStart_(std::chrono::steady_clock::now()) {
+  options_.sampleRate = std::max((uint32_t) 1, options_.sampleRate);
+  // listed_ points into options_.keys, which never changes after this.
+  for (const auto &key: options_.keys) {
+    listed_.insert(key);
+  }
+}
+
+bool HotKeyTracker::isHot(StringPiece key) const {
+  if (listed_.count(key) > 0) {
+    return true;
+  }
+  return !detected_.empty() && detected_.count(key.fbstr()) > 0;
+}
+
+void HotKeyTracker::closeWindow(time_point now, vector<fbstring> &cooled) {
+  for (auto it = detected_.begin(); it != detected_.end();) {
+    auto count = counts_.find(*it);
+    uint64_t reads = count == counts_.end() ? 0 :
+      (uint64_t) count->second * options_.sampleRate;
+    if (reads < options_.detectThreshold) {
+      cooled.push_back(*it);
+      it = detected_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  counts_.clear();
+  windowStart_ = now;
+}
+
+void HotKeyTracker::recordRead(StringPiece key, time_point now,
+    vector<fbstring> &cooled) {
+  if (options_.detectThreshold == 0) {
+    return;
+  }
+  if (now - windowStart_ >= options_.detectWindow) {
+    closeWindow(now, cooled);
+  }
+  if (++reads_ % options_.sampleRate != 0 || listed_.count(key) > 0) {
+    return;
+  }
+  auto keyStr = key.fbstr();
+  auto count = counts_.find(keyStr);
+  if (count == counts_.end()) {
+    if (counts_.size() >= options_.maxTracked) {
+      return;
+    }
+    count = counts_.emplace(keyStr, 0).first;
+  }
+  count->second++;
+  if ((uint64_t) count->second * options_.sampleRate >=
+        options_.detectThreshold &&
+      detected_.size() < options_.maxDetected) {
+    detected_.insert(std::move(keyStr));
+  }
+}
+
+size_t HotKeyTracker::getListedCount() const {
+  return listed_.size();
+}
+
+size_t HotKeyTracker::getDetectedCount() const {
+  return detected_.size();
+}
+
+}} // fredis::memcached
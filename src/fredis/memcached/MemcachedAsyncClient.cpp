@@ -0,0 +1,690 @@
+#include "fredis/memcached/MemcachedAsyncClient.h"
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <folly/Conv.h>
+#include <glog/logging.h>
+#include "fredis/memcached/MemcachedError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Try;
+using folly::Unit;
+
+namespace fredis { namespace memcached {
+
+using steady_clock_t = std::chrono::steady_clock;
+
+MemcachedAsyncClient::MemcachedAsyncClient(folly::EventBase *base,
+    const MemcachedConfig &config)
+  : base_(base), config_(config),
+    stats_(stats::StatsRegistry::createShared()),
+    replicateHotKeys_(config.getHotKeys().isEnabled()),
+    hotKeys_(config.getHotKeys()),
+    replicaEngine_(std::random_device {}()) {
+  const auto &behaviors = config_.getBehaviors();
+  for (const auto &address: config_.getServers()) {
+    connections_.emplace_back(new MemcachedConnection(
+      base_, address, behaviors.connectTimeout, behaviors.pollTimeout
+    ));
+  }
+}
+
+shared_ptr<MemcachedAsyncClient> MemcachedAsyncClient::createShared(
+    folly::EventBase *base, const MemcachedConfig &config) {
+  return shared_ptr<MemcachedAsyncClient> {
+    new MemcachedAsyncClient {base, config}
+  };
+}
+
+const MemcachedConfig& MemcachedAsyncClient::getConfig() const {
+  return config_;
+}
+
+folly::EventBase* MemcachedAsyncClient::getEventBase() const {
+  return base_;
+}
+
+folly::Future<Unit> MemcachedAsyncClient::connect() {
+  if (connections_.empty()) {
+    return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+      ConfigurationError>("No servers are configured."));
+  }
+  if (config_.getBehaviors().distribution != KeyDistribution::MODULA) {
+    return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+      ConfigurationError>("MemcachedAsyncClient only supports the modula "
+        "key distribution."));
+  }
+  std::vector<folly::Future<Unit>> connected;
+  for (auto &conn: connections_) {
+    connected.push_back(conn->connect());
+  }
+  return folly::collect(connected).then([](std::vector<Unit>) {});
+}
+
+void MemcachedAsyncClient::setStatsRegistry(
+    std::shared_ptr<stats::StatsRegistry> registry) {
+  stats_ = std::move(registry);
+}
+
+std::shared_ptr<stats::StatsRegistry>
+    MemcachedAsyncClient::getStatsRegistry() const {
+  return stats_;
+}
+
+stats::StatsSnapshot MemcachedAsyncClient::getStats() {
+  if (!stats_) {
+    return stats::StatsSnapshot {};
+  }
+  return stats_->getStats();
+}
+
+HotKeyStats MemcachedAsyncClient::getHotKeyStats() const {
+  auto result = hotKeyStats_;
+  result.listedKeys = hotKeys_.getListedCount();
+  result.detectedKeys = hotKeys_.getDetectedCount();
+  return result;
+}
+
+void MemcachedAsyncClient::setValueCompressor(
+    std::shared_ptr<compression::ValueCompressor> compressor) {
+  compressor_ = std::move(compressor);
+}
+
+std::shared_ptr<compression::ValueCompressor>
+    MemcachedAsyncClient::getValueCompressor() const {
+  return compressor_;
+}
+
+MemcachedConnection& MemcachedAsyncClient::connectionForKey(StringPiece key) {
+  DCHECK(!connections_.empty());
+  return *connections_[detail::serverIndexForKey(key, connections_.size())];
+}
+
+size_t MemcachedAsyncClient::replicaCount() const {
+  return std::min(config_.getHotKeys().replicas, connections_.size());
+}
+
+bool MemcachedAsyncClient::isHotKey(StringPiece key) const {
+  return replicateHotKeys_ && replicaCount() > 1 && hotKeys_.isHot(key) &&
+    detail::isValidMemcachedKey(key);
+}
+
+bool MemcachedAsyncClient::mayBeReplicated(StringPiece key) const {
+  if (!replicateHotKeys_ || replicaCount() <= 1 ||
+      !detail::isValidMemcachedKey(key)) {
+    return false;
+  }
+  // detection is per client, so with it on any key may have copies made
+  // by a client that saw it read often.
+  return config_.getHotKeys().detectThreshold > 0 || hotKeys_.isHot(key);
+}
+
+MemcachedConnection& MemcachedAsyncClient::replicaConnection(StringPiece key,
+    size_t replica) {
+  return *connections_[
+    detail::replicaServerForKey(key, replica, connections_.size())
+  ];
+}
+
+void MemcachedAsyncClient::noteRead(StringPiece key) {
+  if (!replicateHotKeys_) {
+    return;
+  }
+  std::vector<fbstring> cooled;
+  hotKeys_.recordRead(key, steady_clock_t::now(), cooled);
+  for (const auto &cooledKey: cooled) {
+    invalidateReplicas(cooledKey);
+  }
+}
+
+void MemcachedAsyncClient::invalidateReplicas(StringPiece key) {
+  for (size_t replica = 1; replica < replicaCount(); replica++) {
+    sendTo(replicaConnection(key, replica), "delete",
+      folly::to<fbstring>("delete ", key, "\r\n"), ReplyShape::LINE,
+      MemcachedConnection::value_callback_t {});
+    hotKeyStats_.invalidations++;
+  }
+}
+
+folly::Future<MemcachedReply> MemcachedAsyncClient::send(StringPiece command,
+    StringPiece key, fbstring &&encoded, ReplyShape shape) {
+  if (connections_.empty()) {
+    return folly::makeFuture<MemcachedReply>(folly::make_exception_wrapper<
+      ConfigurationError>("No servers are configured."));
+  }
+  if (!detail::isValidMemcachedKey(key)) {
+    return folly::makeFuture<MemcachedReply>(folly::make_exception_wrapper<
+      InvalidKey>(folly::to<std::string>("invalid memcached key: '", key, "'")));
+  }
+  return sendTo(connectionForKey(key), command, std::move(encoded), shape,
+    MemcachedConnection::value_callback_t {});
+}
+
+folly::Future<MemcachedReply> MemcachedAsyncClient::sendTo(
+    MemcachedConnection &conn, StringPiece command, fbstring &&encoded,
+    ReplyShape shape, MemcachedConnection::value_callback_t onValue) {
+  auto reply = conn.send(encoded, shape, std::move(onValue));
+  if (!stats_) {
+    return reply;
+  }
+  auto registry = stats_;
+  auto commandName = command.str();
+  size_t bytesOut = encoded.size();
+  auto startedAt = steady_clock_t::now();
+  return reply.then([registry, commandName, bytesOut, startedAt](
+      Try<MemcachedReply> result) {
+    auto outcome = stats::Outcome::SUCCESS;
+    size_t bytesIn = 0;
+    if (result.hasException() || result.value().isError()) {
+      outcome = stats::Outcome::ERROR;
+    } else {
+      bytesIn = result.value().valueBytes;
+    }
+    registry->record(commandName,
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        steady_clock_t::now() - startedAt
+      ),
+      outcome, bytesOut, bytesIn
+    );
+    return std::move(result.value());
+  });
+}
+
+namespace {
+
+void throwIfError(const MemcachedReply &reply) {
+  if (reply.isError()) {
+    throw ProtocolError(reply.line.toStdString());
+  }
+}
+
+// the value in a single-key get's reply, decoded.
+folly::Optional<fbstring> valueOfGetReply(MemcachedReply &reply,
+    const std::shared_ptr<compression::ValueCompressor> &compressor) {
+  throwIfError(reply);
+  if (reply.values.empty()) {
+    return folly::Optional<fbstring> {};
+  }
+  auto &value = reply.values.front().value;
+  if (compressor) {
+    auto decoded = compressor->decode(value);
+    decoded.throwIfFailed();
+    return folly::Optional<fbstring> {std::move(decoded.value())};
+  }
+  return folly::Optional<fbstring> {std::move(value)};
+}
+
+}
+
+folly::Future<folly::Optional<fbstring>> MemcachedAsyncClient::get(
+    StringPiece key) {
+  noteRead(key);
+  if (isHotKey(key)) {
+    return getReplicated(key);
+  }
+  auto encoded = folly::to<fbstring>("get ", key, "\r\n");
+  auto compressor = compressor_;
+  return send("get", key, std::move(encoded), ReplyShape::VALUES)
+    .then([compressor](MemcachedReply reply) {
+      return valueOfGetReply(reply, compressor);
+    });
+}
+
+folly::Future<folly::Optional<fbstring>> MemcachedAsyncClient::getFrom(
+    MemcachedConnection &conn, StringPiece key) {
+  auto compressor = compressor_;
+  return sendTo(conn, "get", folly::to<fbstring>("get ", key, "\r\n"),
+      ReplyShape::VALUES, MemcachedConnection::value_callback_t {})
+    .then([compressor](MemcachedReply reply) {
+      return valueOfGetReply(reply, compressor);
+    });
+}
+
+folly::Future<folly::Optional<fbstring>> MemcachedAsyncClient::getReplicated(
+    StringPiece key) {
+  std::uniform_int_distribution<size_t> pick(0, replicaCount() - 1);
+  size_t replica = pick(replicaEngine_);
+  if (replica == 0) {
+    return getFrom(replicaConnection(key, 0), key);
+  }
+  hotKeyStats_.replicaReads++;
+  auto self = shared_from_this();
+  auto keyStr = key.fbstr();
+  return getFrom(replicaConnection(key, replica), key).then([self, keyStr,
+      replica](Try<folly::Optional<fbstring>> found) {
+    if (found.hasValue() && found.value().hasValue()) {
+      return folly::makeFuture(std::move(found.value()));
+    }
+    // the copy was never written (the key was detected hot after its last
+    // write), was evicted, or its server is down.
+    self->hotKeyStats_.replicaMisses++;
+    return self->getFrom(self->replicaConnection(keyStr, 0), keyStr)
+      .then([self, keyStr, replica](folly::Optional<fbstring> value) {
+        if (value.hasValue()) {
+          self->hotKeyStats_.repairs++;
+          auto ttl = self->config_.getHotKeys().repairTtl;
+          self->sendTo(self->replicaConnection(keyStr, replica), "set",
+            self->encodeStore("set", keyStr, value.value(), ttl, 0, true),
+            ReplyShape::LINE, MemcachedConnection::value_callback_t {});
+        }
+        return value;
+      });
+  });
+}
+
+folly::Future<MemcachedAsyncClient::multi_get_map_t>
+    MemcachedAsyncClient::multiGet(const std::vector<StringPiece> &keys) {
+  auto found = std::make_shared<multi_get_map_t>();
+  return multiGetEach(keys, [found](StringPiece key, fbstring &&value) {
+    (*found)[key.fbstr()] = std::move(value);
+  }).then([found]() {
+    return std::move(*found);
+  });
+}
+
+folly::Future<Unit> MemcachedAsyncClient::multiGetEach(
+    const std::vector<StringPiece> &keys, hit_callback_t onHit) {
+  if (connections_.empty()) {
+    return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+      ConfigurationError>("No servers are configured."));
+  }
+  // one list of keys per server, each sent as `get k1 k2 ...` commands of
+  // up to kMaxKeysPerGet keys.
+  std::vector<std::vector<StringPiece>> keysByServer(connections_.size());
+  for (auto key: keys) {
+    if (!detail::isValidMemcachedKey(key)) {
+      return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+        InvalidKey>(folly::to<std::string>("invalid memcached key: '", key,
+          "'")));
+    }
+    keysByServer[detail::serverIndexForKey(key, connections_.size())]
+      .push_back(key);
+  }
+  // the first undecodable value or handler exception fails the whole
+  // call once every server's reply is in; hits after it are dropped.
+  struct EachState {
+    hit_callback_t handler;
+    folly::exception_wrapper error;
+  };
+  auto state = std::make_shared<EachState>();
+  state->handler = std::move(onHit);
+  auto compressor = compressor_;
+  // runs inside the connection's noexcept read callback, so nothing may
+  // escape it.
+  MemcachedConnection::value_callback_t onValue = [compressor, state](
+      MemcachedValue &value) {
+    if (state->error) {
+      return;
+    }
+    if (compressor) {
+      auto decoded = compressor->decode(value.value);
+      if (decoded.hasException()) {
+        state->error = std::move(decoded.exception());
+        return;
+      }
+      value.value = std::move(decoded.value());
+    }
+    try {
+      state->handler(value.key, std::move(value.value));
+    } catch (const std::exception &ex) {
+      state->error = folly::exception_wrapper(std::current_exception(), ex);
+    } catch (...) {
+      state->error = folly::make_exception_wrapper<MemcachedError>(
+        "multiGetEach handler threw a non-std exception"
+      );
+    }
+  };
+  std::vector<folly::Future<MemcachedReply>> replies;
+  for (size_t server = 0; server < keysByServer.size(); server++) {
+    const auto &serverKeys = keysByServer[server];
+    for (size_t start = 0; start < serverKeys.size(); start += kMaxKeysPerGet) {
+      size_t end = std::min(serverKeys.size(), start + kMaxKeysPerGet);
+      fbstring encoded {"get"};
+      for (size_t i = start; i < end; i++) {
+        encoded.push_back(' ');
+        encoded.append(serverKeys[i].data(), serverKeys[i].size());
+      }
+      encoded.append("\r\n");
+      replies.push_back(sendTo(*connections_[server], "get",
+        std::move(encoded), ReplyShape::VALUES, onValue));
+    }
+  }
+  return folly::collect(replies).then([state](
+      std::vector<MemcachedReply> done) {
+    for (const auto &reply: done) {
+      throwIfError(reply);
+    }
+    if (state->error) {
+      state->error.throwException();
+    }
+  });
+}
+
+fbstring MemcachedAsyncClient::encodeStore(StringPiece command,
+    StringPiece key, StringPiece value, time_t ttl, uint64_t casToken,
+    bool compress) {
+  fbstring compressed;
+  if (compress && compressor_) {
+    compressed = compressor_->encode(key, value);
+    value = compressed;
+  }
+  auto encoded = folly::to<fbstring>(
+    command, " ", key, " 0 ", ttl, " ", value.size()
+  );
+  if (casToken != 0) {
+    encoded.append(folly::to<fbstring>(" ", casToken));
+  }
+  encoded.append("\r\n");
+  encoded.append(value.data(), value.size());
+  encoded.append("\r\n");
+  return encoded;
+}
+
+folly::Future<MemcachedReply> MemcachedAsyncClient::store(
+    StringPiece command, StringPiece key, StringPiece value, time_t ttl,
+    uint64_t casToken, bool compress) {
+  auto encoded = encodeStore(command, key, value, ttl, casToken, compress);
+  if (!mayBeReplicated(key)) {
+    return send(command, key, std::move(encoded), ReplyShape::LINE);
+  }
+  auto self = shared_from_this();
+  auto keyStr = key.fbstr();
+  if (command == "set" && isHotKey(key)) {
+    for (size_t replica = 1; replica < replicaCount(); replica++) {
+      sendTo(replicaConnection(key, replica), command, fbstring {encoded},
+          ReplyShape::LINE, MemcachedConnection::value_callback_t {})
+        .then([self, keyStr, replica](Try<MemcachedReply> reply) {
+          // a copy that may still hold the old value mustn't be read.
+          if (reply.hasException() || reply.value().line != "STORED") {
+            self->sendTo(self->replicaConnection(keyStr, replica), "delete",
+              folly::to<fbstring>("delete ", keyStr, "\r\n"),
+              ReplyShape::LINE, MemcachedConnection::value_callback_t {});
+            self->hotKeyStats_.invalidations++;
+          }
+        });
+    }
+    return send(command, key, std::move(encoded), ReplyShape::LINE);
+  }
+  // conditional writes and appends only mean something against one copy,
+  // and copies of a key this client doesn't see as hot may have been made
+  // by one that does. either way only the key's own server is written and
+  // the other copies are refilled from it on their next miss.
+  return send(command, key, std::move(encoded), ReplyShape::LINE)
+    .then([self, keyStr](MemcachedReply reply) {
+      self->invalidateReplicas(keyStr);
+      return reply;
+    });
+}
+
+namespace {
+
+// STORED or NOT_STORED.
+bool wasStored(const MemcachedReply &reply) {
+  if (reply.line == "STORED") {
+    return true;
+  }
+  if (reply.line == "NOT_STORED") {
+    return false;
+  }
+  throw ProtocolError(reply.line.toStdString());
+}
+
+}
+
+folly::Future<Unit> MemcachedAsyncClient::set(StringPiece key,
+    StringPiece value, time_t ttl) {
+  return store("set", key, value, ttl, 0, true)
+    .then([](MemcachedReply reply) {
+      if (reply.line != "STORED") {
+        throw ProtocolError(reply.line.toStdString());
+      }
+    });
+}
+
+folly::Future<bool> MemcachedAsyncClient::del(StringPiece key) {
+  if (mayBeReplicated(key)) {
+    invalidateReplicas(key);
+  }
+  auto encoded = folly::to<fbstring>("delete ", key, "\r\n");
+  return send("delete", key, std::move(encoded), ReplyShape::LINE)
+    .then([](MemcachedReply reply) {
+      throwIfError(reply);
+      return reply.line == "DELETED";
+    });
+}
+
+folly::Future<folly::Optional<MemcachedValue>> MemcachedAsyncClient::gets(
+    StringPiece key) {
+  auto encoded = folly::to<fbstring>("gets ", key, "\r\n");
+  auto compressor = compressor_;
+  return send("gets", key, std::move(encoded), ReplyShape::VALUES)
+    .then([compressor](MemcachedReply reply) {
+      throwIfError(reply);
+      if (reply.values.empty()) {
+        return folly::Optional<MemcachedValue> {};
+      }
+      auto &found = reply.values.front();
+      if (compressor) {
+        auto decoded = compressor->decode(found.value);
+        decoded.throwIfFailed();
+        found.value = std::move(decoded.value());
+      }
+      return folly::Optional<MemcachedValue> {std::move(found)};
+    });
+}
+
+folly::Future<CasResult> MemcachedAsyncClient::cas(StringPiece key,
+    StringPiece value, uint64_t casToken, time_t ttl) {
+  return store("cas", key, value, ttl, casToken, true)
+    .then([](MemcachedReply reply) {
+      if (reply.line == "STORED") {
+        return CasResult::STORED;
+      }
+      if (reply.line == "EXISTS") {
+        return CasResult::EXISTS;
+      }
+      if (reply.line == "NOT_FOUND") {
+        return CasResult::NOT_FOUND;
+      }
+      throw ProtocolError(reply.line.toStdString());
+    });
+}
+
+folly::Future<bool> MemcachedAsyncClient::add(StringPiece key,
+    StringPiece value, time_t ttl) {
+  return store("add", key, value, ttl, 0, true).then(wasStored);
+}
+
+folly::Future<bool> MemcachedAsyncClient::replace(StringPiece key,
+    StringPiece value, time_t ttl) {
+  return store("replace", key, value, ttl, 0, true).then(wasStored);
+}
+
+folly::Future<bool> MemcachedAsyncClient::append(StringPiece key,
+    StringPiece value) {
+  if (compressor_) {
+    return folly::makeFuture<bool>(folly::make_exception_wrapper<
+      ConfigurationError>("append can't be used with a value compressor."));
+  }
+  return store("append", key, value, 0, 0, false).then(wasStored);
+}
+
+folly::Future<folly::Optional<uint64_t>> MemcachedAsyncClient::arithmetic(
+    bool increment, StringPiece key, uint64_t delta) {
+  StringPiece command = increment ? "incr" : "decr";
+  auto encoded = folly::to<fbstring>(command, " ", key, " ", delta, "\r\n");
+  auto sent = send(command, key, std::move(encoded), ReplyShape::LINE);
+  if (mayBeReplicated(key)) {
+    auto self = shared_from_this();
+    auto keyStr = key.fbstr();
+    sent = sent.then([self, keyStr](MemcachedReply reply) {
+      self->invalidateReplicas(keyStr);
+      return reply;
+    });
+  }
+  return sent
+    .then([](MemcachedReply reply) {
+      if (reply.line == "NOT_FOUND") {
+        return folly::Optional<uint64_t> {};
+      }
+      try {
+        return folly::Optional<uint64_t> {folly::to<uint64_t>(reply.line)};
+      } catch (const std::range_error&) {
+        throw ProtocolError(reply.line.toStdString());
+      }
+    });
+}
+
+folly::Future<uint64_t> MemcachedAsyncClient::counter(bool increment,
+    StringPiece key, uint64_t delta, uint64_t initial, time_t ttl) {
+  auto self = shared_from_this();
+  auto keyStr = key.fbstr();
+  return arithmetic(increment, key, delta).then([self, increment, keyStr,
+      delta, initial, ttl](folly::Optional<uint64_t> current) {
+    if (current.hasValue()) {
+      return folly::makeFuture(current.value());
+    }
+    return self->store("add", keyStr, folly::to<fbstring>(initial), ttl, 0,
+        false).then([self, increment, keyStr, delta, initial, ttl](
+          MemcachedReply reply) {
+      if (wasStored(reply)) {
+        return folly::makeFuture(initial);
+      }
+      // another client created it between our incr and add.
+      return self->counter(increment, keyStr, delta, initial, ttl);
+    });
+  });
+}
+
+folly::Future<folly::Optional<uint64_t>> MemcachedAsyncClient::incr(
+    StringPiece key, uint64_t delta) {
+  return arithmetic(true, key, delta);
+}
+
+folly::Future<folly::Optional<uint64_t>> MemcachedAsyncClient::decr(
+    StringPiece key, uint64_t delta) {
+  return arithmetic(false, key, delta);
+}
+
+folly::Future<uint64_t> MemcachedAsyncClient::incr(StringPiece key,
+    uint64_t delta, uint64_t initial, time_t ttl) {
+  return counter(true, key, delta, initial, ttl);
+}
+
+folly::Future<uint64_t> MemcachedAsyncClient::decr(StringPiece key,
+    uint64_t delta, uint64_t initial, time_t ttl) {
+  return counter(false, key, delta, initial, ttl);
+}
+
+folly::Future<bool> MemcachedAsyncClient::touch(StringPiece key, time_t ttl) {
+  auto encoded = folly::to<fbstring>("touch ", key, " ", ttl, "\r\n");
+  if (mayBeReplicated(key)) {
+    for (size_t replica = 1; replica < replicaCount(); replica++) {
+      sendTo(replicaConnection(key, replica), "touch", fbstring {encoded},
+        ReplyShape::LINE, MemcachedConnection::value_callback_t {});
+    }
+  }
+  return send("touch", key, std::move(encoded), ReplyShape::LINE)
+    .then([](MemcachedReply reply) {
+      throwIfError(reply);
+      return reply.line == "TOUCHED";
+    });
+}
+
+folly::Future<std::vector<uint64_t>> MemcachedAsyncClient::applyCounters(
+    const std::vector<CounterUpdate> &updates) {
+  // commands sent in one loop iteration are written together, so issuing
+  // them all here is enough to batch them per server.
+  std::vector<folly::Future<uint64_t>> results;
+  results.reserve(updates.size());
+  for (const auto &update: updates) {
+    bool increment = update.delta >= 0;
+    uint64_t delta = increment ? update.delta : -(uint64_t) update.delta;
+    results.push_back(counter(increment, update.key, delta, update.initial,
+      update.ttl));
+  }
+  return folly::collect(results);
+}
+
+folly::Future<Unit> MemcachedAsyncClient::applyCountersNoReply(
+    const std::vector<CounterUpdate> &updates) {
+  if (connections_.empty()) {
+    return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+      ConfigurationError>("No servers are configured."));
+  }
+  for (const auto &update: updates) {
+    if (!detail::isValidMemcachedKey(update.key)) {
+      return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+        InvalidKey>(folly::to<std::string>("invalid memcached key: '",
+          update.key, "'")));
+    }
+  }
+  std::vector<bool> touched(connections_.size(), false);
+  for (const auto &update: updates) {
+    bool increment = update.delta >= 0;
+    uint64_t delta = increment ? update.delta : -(uint64_t) update.delta;
+    size_t server = detail::serverIndexForKey(update.key, connections_.size());
+    connections_[server]->sendNoReply(folly::to<fbstring>(
+      increment ? "incr " : "decr ", update.key, " ", delta, " noreply\r\n"
+    ));
+    touched[server] = true;
+    if (mayBeReplicated(update.key)) {
+      invalidateReplicas(update.key);
+    }
+  }
+  // a version command behind each server's updates answers once the
+  // server has read everything ahead of it.
+  std::vector<folly::Future<MemcachedReply>> fences;
+  for (size_t server = 0; server < connections_.size(); server++) {
+    if (touched[server]) {
+      fences.push_back(connections_[server]->send("version\r\n",
+        ReplyShape::LINE));
+    }
+  }
+  return folly::collect(fences).then([](std::vector<MemcachedReply>) {});
+}
+
+namespace detail {
+
+size_t serverIndexForKey(StringPiece key, size_t nServers) {
+  if (nServers <= 1) {
+    return 0;
+  }
+  // libhashkit's hashkit_one_at_a_time.
+  uint32_t value = 0;
+  for (char c: key) {
+    value += (uint32_t) c;
+    value += (value << 10);
+    value ^= (value >> 6);
+  }
+  value += (value << 3);
+  value ^= (value >> 11);
+  value += (value << 15);
+  return value % nServers;
+}
+
+size_t replicaServerForKey(StringPiece key, size_t replica,
+    size_t nServers) {
+  if (nServers <= 1) {
+    return 0;
+  }
+  return (serverIndexForKey(key, nServers) + replica) % nServers;
+}
+
+bool isValidMemcachedKey(StringPiece key) {
+  if (key.empty() || key.size() > 250) {
+    return false;
+  }
+  for (char c: key) {
+    if ((unsigned char) c <= ' ' || c == 0x7f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // detail
+
+}} // fredis::memcached
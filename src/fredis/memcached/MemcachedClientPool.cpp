@@ -0,0 +1,217 @@
+#include "fredis/memcached/MemcachedClientPool.h"
+#include <algorithm>
+#include "fredis/memcached/MemcachedError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::Try;
+using folly::make_exception_wrapper;
+
+namespace fredis { namespace memcached {
+
+using Lease = MemcachedClientPool::Lease;
+
+Lease::Lease(MemcachedClientPool *pool, Slot *slot)
+  : pool_(pool), slot_(slot) {}
+
+Lease::Lease(Lease &&other)
+  : pool_(other.pool_), slot_(other.slot_) {
+  other.slot_ = nullptr;
+}
+
+Lease& Lease::operator=(Lease &&other) {
+  std::swap(pool_, other.pool_);
+  std::swap(slot_, other.slot_);
+  return *this;
+}
+
+Lease::~Lease() {
+  if (slot_) {
+    pool_->release(slot_);
+  }
+}
+
+MemcachedSyncClient& Lease::operator*() const {
+  return *slot_->client;
+}
+
+MemcachedSyncClient* Lease::operator->() const {
+  return slot_->client.get();
+}
+
+MemcachedClientPool::MemcachedClientPool(const MemcachedConfig &config,
+    const MemcachedPoolOptions &options)
+  : config_(config), options_(options),
+    stats_(stats::StatsRegistry::createShared()) {
+  options_.maxSize = std::max((size_t) 1, options_.maxSize);
+  options_.initialSize = std::min(options_.initialSize, options_.maxSize);
+  slots_.reset(new Slot[options_.maxSize]);
+}
+
+Try<shared_ptr<MemcachedClientPool>> MemcachedClientPool::createShared(
+    const MemcachedConfig &config, const MemcachedPoolOptions &options,
+    std::shared_ptr<compression::ValueCompressor> compressor) {
+  shared_ptr<MemcachedClientPool> pool {
+    new MemcachedClientPool {config, options}
+  };
+  pool->compressor_ = std::move(compressor);
+  for (size_t i = 0; i < pool->options_.initialSize; i++) {
+    auto grown = pool->grow();
+    if (grown.hasException()) {
+      return Try<shared_ptr<MemcachedClientPool>> {grown.exception()};
+    }
+    pool->release(grown.value());
+  }
+  return Try<shared_ptr<MemcachedClientPool>> {std::move(pool)};
+}
+
+bool MemcachedClientPool::tryClaim(size_t index, int from) {
+  int expected = from;
+  int desired = from == EMPTY ? CONNECTING : BUSY;
+  return slots_[index].state.compare_exchange_strong(expected, desired);
+}
+
+MemcachedClientPool::Slot* MemcachedClientPool::tryAcquire() {
+  size_t hint = *lastSlot_;
+  if (hint > 0 && tryClaim(hint - 1, IDLE)) {
+    affinityHits_.fetch_add(1, std::memory_order_relaxed);
+    return &slots_[hint - 1];
+  }
+  // start where this thread left off, so threads without a free client
+  // of their own don't all pile onto the first slots.
+  size_t start = hint > 0 ? hint - 1 : 0;
+  for (size_t i = 0; i < options_.maxSize; i++) {
+    size_t index = (start + i) % options_.maxSize;
+    if (slots_[index].state.load(std::memory_order_relaxed) == IDLE &&
+        tryClaim(index, IDLE)) {
+      return &slots_[index];
+    }
+  }
+  return nullptr;
+}
+
+Try<MemcachedClientPool::Slot*> MemcachedClientPool::grow() {
+  for (size_t i = 0; i < options_.maxSize; i++) {
+    if (slots_[i].state.load(std::memory_order_relaxed) != EMPTY ||
+        !tryClaim(i, EMPTY)) {
+      continue;
+    }
+    auto &slot = slots_[i];
+    // connecting happens outside any lock; the slot is ours meanwhile.
+    slot.client.reset(new MemcachedSyncClient {config_});
+    slot.client->setStatsRegistry(stats_);
+    slot.client->setValueCompressor(compressor_);
+    auto connected = slot.client->connect();
+    if (connected.hasException()) {
+      slot.client.reset();
+      slot.state.store(EMPTY);
+      return Try<Slot*> {connected.exception()};
+    }
+    slot.state.store(BUSY);
+    return Try<Slot*> {&slot};
+  }
+  return Try<Slot*> {nullptr};
+}
+
+void MemcachedClientPool::release(Slot *slot) {
+  *lastSlot_ = (slot - slots_.get()) + 1;
+  slot->state.store(IDLE);
+  if (waiters_.load() > 0) {
+    std::lock_guard<std::mutex> guard(waitMutex_);
+    released_.notify_one();
+  }
+}
+
+Try<Lease> MemcachedClientPool::acquire() {
+  acquired_.fetch_add(1, std::memory_order_relaxed);
+  auto slot = tryAcquire();
+  if (slot) {
+    return Try<Lease> {Lease {this, slot}};
+  }
+  auto grown = grow();
+  if (grown.hasException()) {
+    return Try<Lease> {grown.exception()};
+  }
+  if (grown.value()) {
+    return Try<Lease> {Lease {this, grown.value()}};
+  }
+  waits_.fetch_add(1, std::memory_order_relaxed);
+  auto deadline = std::chrono::steady_clock::now() + options_.acquireTimeout;
+  {
+    std::unique_lock<std::mutex> lock(waitMutex_);
+    // release() marks the slot idle before checking for waiters, so one
+    // that's released after this increment is either found by the next
+    // tryAcquire() or wakes us.
+    waiters_++;
+    for (;;) {
+      slot = tryAcquire();
+      if (slot) {
+        break;
+      }
+      if (released_.wait_until(lock, deadline) == std::cv_status::timeout) {
+        slot = tryAcquire();
+        break;
+      }
+    }
+    waiters_--;
+  }
+  if (!slot) {
+    timeouts_.fetch_add(1, std::memory_order_relaxed);
+    return Try<Lease> {make_exception_wrapper<PoolTimeout>(
+      "timed out waiting for a memcached client"
+    )};
+  }
+  return Try<Lease> {Lease {this, slot}};
+}
+
+std::shared_ptr<stats::StatsRegistry>
+    MemcachedClientPool::getStatsRegistry() const {
+  return stats_;
+}
+
+MemcachedPoolStats MemcachedClientPool::getPoolStats() const {
+  MemcachedPoolStats poolStats;
+  for (size_t i = 0; i < options_.maxSize; i++) {
+    auto state = slots_[i].state.load();
+    if (state != EMPTY) {
+      poolStats.size++;
+    }
+    if (state == BUSY || state == CONNECTING) {
+      poolStats.inUse++;
+    }
+  }
+  poolStats.acquired = acquired_.load();
+  poolStats.affinityHits = affinityHits_.load();
+  poolStats.waits = waits_.load();
+  poolStats.timeouts = timeouts_.load();
+  return poolStats;
+}
+
+MemcachedSyncClient::get_result_t MemcachedClientPool::get(
+    const fbstring &key) {
+  auto lease = acquire();
+  if (lease.hasException()) {
+    return MemcachedSyncClient::get_result_t {lease.exception()};
+  }
+  return lease.value()->get(key);
+}
+
+MemcachedSyncClient::set_result_t MemcachedClientPool::set(
+    const fbstring &key, const fbstring &value, time_t ttl) {
+  auto lease = acquire();
+  if (lease.hasException()) {
+    return MemcachedSyncClient::set_result_t {lease.exception()};
+  }
+  return lease.value()->set(key, value, ttl);
+}
+
+MemcachedSyncClient::multi_get_result_t MemcachedClientPool::multiGet(
+    const std::vector<fbstring> &keys) {
+  auto lease = acquire();
+  if (lease.hasException()) {
+    return MemcachedSyncClient::multi_get_result_t {lease.exception()};
+  }
+  return lease.value()->multiGet(keys);
+}
+
+}} // fredis::memcached
@@ -1,6 +1,10 @@
 #include "fredis/memcached/MemcachedConfig.h"
 #include "fredis/memcached/MemcachedError.h"
 #include <libmemcached/memcached.h>
+#include <sstream>
+#include <utility>
+#include <vector>
+#include <folly/Conv.h>
 
 using folly::Try;
 using folly::Unit;
@@ -12,15 +16,85 @@ namespace fredis { namespace memcached {
 
 MemcachedConfig::MemcachedConfig(){}
 
-MemcachedConfig::MemcachedConfig(MemcachedConfig::server_init_list&& servers)
-  : serverHosts_(std::forward<MemcachedConfig::server_init_list>(servers)){}
+MemcachedConfig::MemcachedConfig(MemcachedConfig::server_init_list&& servers) {
+  addServers(std::forward<MemcachedConfig::server_init_list>(servers));
+}
 
 void MemcachedConfig::addServers(MemcachedConfig::server_init_list&& servers) {
   for (auto &&server: servers) {
-    serverHosts_.push_back(server);
+    addServer(server);
   }
 }
 
+void MemcachedConfig::addServer(const folly::SocketAddress &server,
+    uint32_t weight) {
+  serverHosts_.push_back(server);
+  serverWeights_.push_back(weight);
+}
+
+MemcachedBehaviors& MemcachedConfig::getBehaviors() {
+  return behaviors_;
+}
+
+const MemcachedBehaviors& MemcachedConfig::getBehaviors() const {
+  return behaviors_;
+}
+
+void MemcachedConfig::setBehaviors(const MemcachedBehaviors &behaviors) {
+  behaviors_ = behaviors;
+}
+
+HotKeyOptions& MemcachedConfig::getHotKeys() {
+  return hotKeys_;
+}
+
+const HotKeyOptions& MemcachedConfig::getHotKeys() const {
+  return hotKeys_;
+}
+
+void MemcachedConfig::setHotKeys(const HotKeyOptions &hotKeys) {
+  hotKeys_ = hotKeys;
+}
+
+bool HotKeyOptions::isEnabled() const {
+  return replicas > 1 && (!keys.empty() || detectThreshold > 0);
+}
+
+MemcachedBehaviors MemcachedBehaviors::lowLatency() {
+  MemcachedBehaviors behaviors;
+  behaviors.tcpNoDelay = true;
+  behaviors.nonBlocking = true;
+  behaviors.connectTimeout = std::chrono::milliseconds {100};
+  behaviors.pollTimeout = std::chrono::milliseconds {100};
+  behaviors.serverFailureLimit = 2;
+  behaviors.retryTimeout = std::chrono::seconds {2};
+  return behaviors;
+}
+
+MemcachedBehaviors MemcachedBehaviors::bulkWrite() {
+  MemcachedBehaviors behaviors;
+  behaviors.nonBlocking = true;
+  behaviors.bufferRequests = true;
+  behaviors.noReply = true;
+  behaviors.pollTimeout = std::chrono::milliseconds {1000};
+  return behaviors;
+}
+
+Try<MemcachedBehaviors> MemcachedBehaviors::preset(folly::StringPiece name) {
+  if (name == "default") {
+    return Try<MemcachedBehaviors> {MemcachedBehaviors {}};
+  }
+  if (name == "low-latency") {
+    return Try<MemcachedBehaviors> {lowLatency()};
+  }
+  if (name == "bulk-write") {
+    return Try<MemcachedBehaviors> {bulkWrite()};
+  }
+  return Try<MemcachedBehaviors> {make_exception_wrapper<ConfigurationError>(
+    folly::to<std::string>("unknown memcached behavior preset '", name, "'")
+  )};
+}
+
 Try<fbstring> MemcachedConfig::toConfigString() {
   std::ostringstream oss;
   size_t lastIdx = serverHosts_.size();
@@ -30,6 +104,9 @@ Try<fbstring> MemcachedConfig::toConfigString() {
   size_t idx = 0;
   for (auto &server: serverHosts_) {
     oss << "--SERVER=" << server.getAddressStr() << ":" << server.getPort();
+    if (serverWeights_[idx] > 0) {
+      oss << "/?" << serverWeights_[idx];
+    }
     if (idx < lastIdx) {
       oss << " ";
     }
@@ -47,6 +124,10 @@ bool MemcachedConfig::hasAnyServers() const {
   return serverHosts_.size() > 0;
 }
 
+const folly::fbvector<folly::SocketAddress>& MemcachedConfig::getServers() const {
+  return serverHosts_;
+}
+
 namespace detail {
 
 Try<fbstring> validateMemcachedConfigStr(const fbstring& configStr) {
@@ -63,6 +144,61 @@ Try<fbstring> validateMemcachedConfigStr(const fbstring& configStr) {
   return Try<fbstring>{fbstring{configStr}};
 }
 
+Try<Unit> applyMemcachedBehaviors(const MemcachedBehaviors &behaviors,
+    memcached_st *handle) {
+  std::vector<std::pair<memcached_behavior_t, uint64_t>> settings;
+  auto setFlag = [&settings](memcached_behavior_t flag, bool enabled) {
+    if (enabled) {
+      settings.emplace_back(flag, 1);
+    }
+  };
+  setFlag(MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, behaviors.binaryProtocol);
+  setFlag(MEMCACHED_BEHAVIOR_TCP_NODELAY, behaviors.tcpNoDelay);
+  setFlag(MEMCACHED_BEHAVIOR_NO_BLOCK, behaviors.nonBlocking);
+  setFlag(MEMCACHED_BEHAVIOR_BUFFER_REQUESTS, behaviors.bufferRequests);
+  setFlag(MEMCACHED_BEHAVIOR_NOREPLY, behaviors.noReply);
+  switch (behaviors.distribution) {
+    case KeyDistribution::KETAMA:
+      settings.emplace_back(MEMCACHED_BEHAVIOR_DISTRIBUTION,
+        MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA);
+      break;
+    case KeyDistribution::KETAMA_WEIGHTED:
+      settings.emplace_back(MEMCACHED_BEHAVIOR_DISTRIBUTION,
+        MEMCACHED_DISTRIBUTION_CONSISTENT_KETAMA);
+      settings.emplace_back(MEMCACHED_BEHAVIOR_KETAMA_WEIGHTED, 1);
+      break;
+    default:
+      break;
+  }
+  if (behaviors.connectTimeout.count() > 0) {
+    settings.emplace_back(MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT,
+      behaviors.connectTimeout.count());
+  }
+  if (behaviors.pollTimeout.count() > 0) {
+    settings.emplace_back(MEMCACHED_BEHAVIOR_POLL_TIMEOUT,
+      behaviors.pollTimeout.count());
+  }
+  if (behaviors.serverFailureLimit > 0) {
+    settings.emplace_back(MEMCACHED_BEHAVIOR_SERVER_FAILURE_LIMIT,
+      behaviors.serverFailureLimit);
+  }
+  if (behaviors.retryTimeout.count() > 0) {
+    settings.emplace_back(MEMCACHED_BEHAVIOR_RETRY_TIMEOUT,
+      behaviors.retryTimeout.count());
+  }
+  for (const auto &setting: settings) {
+    auto rc = memcached_behavior_set(handle, setting.first, setting.second);
+    if (memcached_failed(rc)) {
+      return Try<Unit> {make_exception_wrapper<ConfigurationError>(
+        folly::to<std::string>("setting memcached behavior ",
+          libmemcached_string_behavior(setting.first), " failed: ",
+          memcached_strerror(handle, rc))
+      )};
+    }
+  }
+  return Try<Unit> {Unit {}};
+}
+
 } // detail
 
 }} // fredis::memcached
@@ -0,0 +1,388 @@
+#include "fredis/memcached/MemcachedConnection.h"
+#include <folly/Conv.h>
+#include <folly/io/IOBuf.h>
+#include <glog/logging.h>
+#include "fredis/memcached/MemcachedError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Unit;
+
+namespace fredis { namespace memcached {
+
+bool MemcachedReply::isError() const {
+  StringPiece piece {line};
+  return piece == "ERROR" || piece.startsWith("CLIENT_ERROR") ||
+    piece.startsWith("SERVER_ERROR");
+}
+
+MemcachedConnection::ReplyTimeout::ReplyTimeout(folly::EventBase *base,
+    MemcachedConnection *parent)
+  : folly::AsyncTimeout(base), parent_(parent) {}
+
+void MemcachedConnection::ReplyTimeout::timeoutExpired() noexcept {
+  parent_->fail(folly::make_exception_wrapper<RequestTimeout>(
+    folly::to<std::string>("memcached at ", parent_->address_.describe(),
+      " didn't reply within ", parent_->readTimeout_.count(), "ms")
+  ));
+}
+
+MemcachedConnection::MemcachedConnection(folly::EventBase *base,
+    const folly::SocketAddress &address,
+    std::chrono::milliseconds connectTimeout,
+    std::chrono::milliseconds readTimeout)
+  : base_(base), address_(address), connectTimeout_(connectTimeout),
+    readTimeout_(readTimeout), replyTimeout_(base, this),
+    aliveToken_(std::make_shared<bool>(true)) {}
+
+MemcachedConnection::~MemcachedConnection() {
+  aliveToken_.reset();
+  fail(folly::make_exception_wrapper<ConnectionError>(
+    "memcached client was destroyed"
+  ));
+}
+
+MemcachedConnection::State MemcachedConnection::getState() const {
+  return state_;
+}
+
+const folly::SocketAddress& MemcachedConnection::getAddress() const {
+  return address_;
+}
+
+size_t MemcachedConnection::getInFlightCount() const {
+  return inFlight_.size();
+}
+
+folly::Future<Unit> MemcachedConnection::connect() {
+  if (state_ == State::CONNECTED) {
+    return folly::makeFuture();
+  }
+  connectPromises_.emplace_back();
+  auto connected = connectPromises_.back().getFuture();
+  if (state_ == State::DISCONNECTED) {
+    startConnecting();
+  }
+  return connected;
+}
+
+void MemcachedConnection::startConnecting() {
+  state_ = State::CONNECTING;
+  socket_.reset(new folly::AsyncSocket(base_));
+  socket_->connect(this, address_, connectTimeout_.count());
+}
+
+void MemcachedConnection::connectSuccess() noexcept {
+  state_ = State::CONNECTED;
+  socket_->setNoDelay(true);
+  socket_->setReadCB(this);
+  std::vector<folly::Promise<Unit>> promises;
+  promises.swap(connectPromises_);
+  for (auto &promise: promises) {
+    promise.setValue(Unit {});
+  }
+  if (!writeBuffer_.empty()) {
+    flush();
+  }
+}
+
+void MemcachedConnection::connectErr(
+    const folly::AsyncSocketException &ex) noexcept {
+  fail(folly::make_exception_wrapper<ConnectionError>(folly::to<std::string>(
+    "connecting to memcached at ", address_.describe(), " failed: ", ex.what()
+  )));
+}
+
+folly::Future<MemcachedReply> MemcachedConnection::send(StringPiece encoded,
+    ReplyShape shape) {
+  return send(encoded, shape, value_callback_t {});
+}
+
+folly::Future<MemcachedReply> MemcachedConnection::send(StringPiece encoded,
+    ReplyShape shape, value_callback_t onValue) {
+  writeBuffer_.append(encoded.data(), encoded.size());
+  inFlight_.emplace_back();
+  auto &request = inFlight_.back();
+  request.shape = shape;
+  request.onValue = std::move(onValue);
+  auto reply = request.promise.getFuture();
+  // already running for an earlier request; a steady stream of sends
+  // mustn't keep pushing it back.
+  if (!replyTimeout_.isScheduled()) {
+    updateReplyTimeout();
+  }
+  if (state_ == State::DISCONNECTED) {
+    startConnecting();
+  } else if (state_ == State::CONNECTED) {
+    scheduleFlush();
+  }
+  return reply;
+}
+
+void MemcachedConnection::sendNoReply(StringPiece encoded) {
+  writeBuffer_.append(encoded.data(), encoded.size());
+  if (state_ == State::DISCONNECTED) {
+    startConnecting();
+  } else if (state_ == State::CONNECTED) {
+    scheduleFlush();
+  }
+}
+
+void MemcachedConnection::scheduleFlush() {
+  if (flushScheduled_) {
+    return;
+  }
+  flushScheduled_ = true;
+  std::weak_ptr<bool> alive = aliveToken_;
+  base_->runInLoop([this, alive]() {
+    if (alive.lock()) {
+      flushScheduled_ = false;
+      flush();
+    }
+  });
+}
+
+void MemcachedConnection::flush() {
+  if (state_ != State::CONNECTED || writeBuffer_.empty()) {
+    return;
+  }
+  auto buf = folly::IOBuf::copyBuffer(writeBuffer_.data(), writeBuffer_.size());
+  writeBuffer_.clear();
+  writesInFlight_++;
+  socket_->writeChain(this, std::move(buf));
+}
+
+void MemcachedConnection::writeSuccess() noexcept {
+  writesInFlight_--;
+}
+
+void MemcachedConnection::writeErr(size_t,
+    const folly::AsyncSocketException &ex) noexcept {
+  writesInFlight_--;
+  fail(folly::make_exception_wrapper<ConnectionError>(folly::to<std::string>(
+    "writing to memcached at ", address_.describe(), " failed: ", ex.what()
+  )));
+}
+
+void MemcachedConnection::getReadBuffer(void **bufReturn, size_t *lenReturn) {
+  *bufReturn = readChunk_;
+  *lenReturn = sizeof(readChunk_);
+}
+
+void MemcachedConnection::readDataAvailable(size_t len) noexcept {
+  input_.append(readChunk_, len);
+  parseReplies();
+  updateReplyTimeout();
+}
+
+void MemcachedConnection::readEOF() noexcept {
+  fail(folly::make_exception_wrapper<ConnectionError>(folly::to<std::string>(
+    "memcached at ", address_.describe(), " closed the connection"
+  )));
+}
+
+void MemcachedConnection::readErr(
+    const folly::AsyncSocketException &ex) noexcept {
+  fail(folly::make_exception_wrapper<ConnectionError>(folly::to<std::string>(
+    "reading from memcached at ", address_.describe(), " failed: ", ex.what()
+  )));
+}
+
+void MemcachedConnection::parseReplies() {
+  size_t offset = 0;
+  while (!inFlight_.empty()) {
+    auto &front = inFlight_.front();
+    size_t consumed = 0;
+    auto step = detail::ReplyStep::INCOMPLETE;
+    try {
+      step = detail::parseMemcachedReplyStep(
+        StringPiece(input_).subpiece(offset), front.shape, front.reply,
+        consumed
+      );
+    } catch (const ProtocolError &ex) {
+      // there's no telling where the next reply starts.
+      fail(folly::exception_wrapper(std::current_exception(), ex));
+      return;
+    }
+    if (step == detail::ReplyStep::INCOMPLETE) {
+      break;
+    }
+    offset += consumed;
+    if (step == detail::ReplyStep::VALUE) {
+      if (front.onValue) {
+        front.onValue(front.reply.values.back());
+        front.reply.values.pop_back();
+      }
+      continue;
+    }
+    auto request = std::move(front);
+    inFlight_.pop_front();
+    // continuations run inline and may send more commands.
+    request.promise.setValue(std::move(request.reply));
+  }
+  input_.erase(0, offset);
+}
+
+void MemcachedConnection::updateReplyTimeout() {
+  if (readTimeout_.count() <= 0) {
+    return;
+  }
+  if (inFlight_.empty()) {
+    replyTimeout_.cancelTimeout();
+    return;
+  }
+  replyTimeout_.scheduleTimeout(readTimeout_.count());
+}
+
+void MemcachedConnection::fail(const folly::exception_wrapper &error) {
+  state_ = State::DISCONNECTED;
+  replyTimeout_.cancelTimeout();
+  input_.clear();
+  writeBuffer_.clear();
+  std::deque<Request> requests;
+  requests.swap(inFlight_);
+  std::vector<folly::Promise<Unit>> promises;
+  promises.swap(connectPromises_);
+  if (socket_) {
+    // AsyncSocket defers its own destruction if we're inside one of its
+    // callbacks. closing fails any pending writes, which land back here
+    // with nothing left to fail.
+    socket_->setReadCB(nullptr);
+    auto socket = std::move(socket_);
+    socket->closeNow();
+  }
+  for (auto &request: requests) {
+    request.promise.setException(error);
+  }
+  for (auto &promise: promises) {
+    promise.setException(error);
+  }
+}
+
+namespace detail {
+
+namespace {
+
+bool parseNumber(StringPiece token, uint64_t &out) {
+  if (token.empty()) {
+    return false;
+  }
+  uint64_t value = 0;
+  for (char c: token) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    value = value * 10 + (c - '0');
+  }
+  out = value;
+  return true;
+}
+
+// splits a header line on single spaces.
+std::vector<StringPiece> tokensOf(StringPiece line) {
+  std::vector<StringPiece> tokens;
+  while (!line.empty()) {
+    auto space = line.find(' ');
+    if (space == StringPiece::npos) {
+      tokens.push_back(line);
+      break;
+    }
+    if (space > 0) {
+      tokens.push_back(line.subpiece(0, space));
+    }
+    line.advance(space + 1);
+  }
+  return tokens;
+}
+
+// VA <bytes> <flags>*, then the data block; anything else is a single line.
+ReplyStep parseMetaReply(StringPiece input, StringPiece line,
+    MemcachedReply &reply, size_t &consumed) {
+  size_t dataStart = line.size() + 2;
+  if (!line.startsWith("VA ")) {
+    reply.line = line.fbstr();
+    consumed = dataStart;
+    return ReplyStep::DONE;
+  }
+  auto tokens = tokensOf(line);
+  uint64_t bytes = 0;
+  if (tokens.size() < 2 || !parseNumber(tokens[1], bytes)) {
+    throw ProtocolError(folly::to<std::string>(
+      "malformed VA line: '", line, "'"
+    ));
+  }
+  if (input.size() < dataStart + bytes + 2) {
+    return ReplyStep::INCOMPLETE;
+  }
+  MemcachedValue value;
+  value.value = input.subpiece(dataStart, bytes).fbstr();
+  reply.values.push_back(std::move(value));
+  reply.valueBytes += bytes;
+  reply.line = line.fbstr();
+  consumed = dataStart + bytes + 2;
+  return ReplyStep::DONE;
+}
+
+}
+
+ReplyStep parseMemcachedReplyStep(StringPiece input, ReplyShape shape,
+    MemcachedReply &reply, size_t &consumed) {
+  auto lineEnd = input.find("\r\n");
+  if (lineEnd == StringPiece::npos) {
+    return ReplyStep::INCOMPLETE;
+  }
+  auto line = input.subpiece(0, lineEnd);
+  if (shape == ReplyShape::META) {
+    return parseMetaReply(input, line, reply, consumed);
+  }
+  if (shape != ReplyShape::VALUES || !line.startsWith("VALUE ")) {
+    reply.line = line.fbstr();
+    consumed = lineEnd + 2;
+    return ReplyStep::DONE;
+  }
+  // VALUE <key> <flags> <bytes> [<cas unique>]
+  auto tokens = tokensOf(line);
+  uint64_t flags = 0, bytes = 0, cas = 0;
+  if (tokens.size() < 4 || !parseNumber(tokens[2], flags) ||
+      !parseNumber(tokens[3], bytes) ||
+      (tokens.size() > 4 && !parseNumber(tokens[4], cas))) {
+    throw ProtocolError(folly::to<std::string>(
+      "malformed VALUE line: '", line, "'"
+    ));
+  }
+  size_t dataStart = lineEnd + 2;
+  if (input.size() < dataStart + bytes + 2) {
+    return ReplyStep::INCOMPLETE;
+  }
+  MemcachedValue value;
+  value.key = tokens[1].fbstr();
+  value.flags = (uint32_t) flags;
+  value.cas = cas;
+  value.value = input.subpiece(dataStart, bytes).fbstr();
+  reply.values.push_back(std::move(value));
+  reply.valueBytes += bytes;
+  consumed = dataStart + bytes + 2;
+  return ReplyStep::VALUE;
+}
+
+size_t parseMemcachedReply(StringPiece input, ReplyShape shape,
+    MemcachedReply &reply) {
+  size_t pos = 0;
+  for (;;) {
+    size_t consumed = 0;
+    auto step = parseMemcachedReplyStep(input.subpiece(pos), shape, reply,
+      consumed);
+    if (step == ReplyStep::INCOMPLETE) {
+      return 0;
+    }
+    pos += consumed;
+    if (step == ReplyStep::DONE) {
+      return pos;
+    }
+  }
+}
+
+} // detail
+
+}} // fredis::memcached
@@ -0,0 +1,381 @@
+#include "fredis/memcached/MemcachedMetaClient.h"
+#include <stdexcept>
+#include <folly/Conv.h>
+#include "fredis/memcached/MemcachedError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Try;
+using folly::Unit;
+
+namespace fredis { namespace memcached {
+
+MemcachedMetaClient::MemcachedMetaClient(folly::EventBase *base,
+    const MemcachedConfig &config)
+  : MemcachedAsyncClient(base, config) {}
+
+shared_ptr<MemcachedMetaClient> MemcachedMetaClient::createShared(
+    folly::EventBase *base, const MemcachedConfig &config) {
+  return shared_ptr<MemcachedMetaClient> {
+    new MemcachedMetaClient {base, config}
+  };
+}
+
+shared_ptr<MemcachedMetaClient> MemcachedMetaClient::sharedMeta() {
+  return std::static_pointer_cast<MemcachedMetaClient>(shared_from_this());
+}
+
+namespace {
+
+template<typename T>
+T metaNumber(const detail::MetaReplyLine &parsed, char flag,
+    const fbstring &line) {
+  try {
+    return folly::to<T>(parsed.flagToken(flag).value());
+  } catch (const std::range_error&) {
+    throw ProtocolError(folly::to<std::string>(
+      "bad '", flag, "' flag in meta reply: '", line, "'"
+    ));
+  }
+}
+
+}
+
+folly::Future<MemcachedReply> MemcachedMetaClient::sendMeta(
+    StringPiece command, StringPiece key, fbstring &&flags,
+    const fbstring *data) {
+  auto opaque = nextOpaque_++;
+  auto encoded = folly::to<fbstring>(command, " ", key);
+  if (data) {
+    encoded.append(folly::to<fbstring>(" ", data->size()));
+  }
+  encoded.append(flags);
+  encoded.append(folly::to<fbstring>(" O", opaque, "\r\n"));
+  if (data) {
+    encoded.append(*data);
+    encoded.append("\r\n");
+  }
+  auto sent = send(command, key, std::move(encoded), ReplyShape::META);
+  if (command != "mg" && mayBeReplicated(key)) {
+    // meta commands only go to the key's own server.
+    auto self = sharedMeta();
+    auto keyStr = key.fbstr();
+    sent = sent.then([self, keyStr](MemcachedReply reply) {
+      self->invalidateReplicas(keyStr);
+      return reply;
+    });
+  }
+  return sent
+    .then([opaque](MemcachedReply reply) {
+      if (reply.isError()) {
+        throw ProtocolError(reply.line.toStdString());
+      }
+      // some server versions leave the opaque off misses.
+      auto echoed = detail::parseMetaReplyLine(reply.line).flagToken('O');
+      if (echoed.hasValue() && echoed.value() != folly::to<fbstring>(opaque)) {
+        throw ProtocolError(folly::to<std::string>(
+          "meta reply '", reply.line, "' doesn't match opaque ", opaque
+        ));
+      }
+      return reply;
+    });
+}
+
+folly::Future<MetaGetResult> MemcachedMetaClient::metaGet(StringPiece key,
+    const MetaGetOptions &options) {
+  fbstring flags;
+  if (options.value) {
+    flags.append(" v");
+  }
+  if (options.ttl) {
+    flags.append(" t");
+  }
+  if (options.cas) {
+    flags.append(" c");
+  }
+  if (options.flags) {
+    flags.append(" f");
+  }
+  if (options.vivifyTtl > 0) {
+    flags.append(folly::to<fbstring>(" N", options.vivifyTtl));
+  }
+  if (options.recacheTtl > 0) {
+    flags.append(folly::to<fbstring>(" R", options.recacheTtl));
+  }
+  if (options.touchTtl.hasValue()) {
+    flags.append(folly::to<fbstring>(" T", options.touchTtl.value()));
+  }
+  auto compressor = compressor_;
+  return sendMeta("mg", key, std::move(flags), nullptr)
+    .then([compressor](MemcachedReply reply) {
+      auto parsed = detail::parseMetaReplyLine(reply.line);
+      MetaGetResult result;
+      if (parsed.code == "EN") {
+        return result;
+      }
+      if (parsed.code != "VA" && parsed.code != "HD") {
+        throw ProtocolError(reply.line.toStdString());
+      }
+      result.found = true;
+      if (!reply.values.empty()) {
+        auto &stored = reply.values.front().value;
+        if (compressor) {
+          auto decoded = compressor->decode(stored);
+          decoded.throwIfFailed();
+          result.value = std::move(decoded.value());
+        } else {
+          result.value = std::move(stored);
+        }
+      }
+      if (parsed.hasFlag('t')) {
+        result.ttl = metaNumber<int64_t>(parsed, 't', reply.line);
+      }
+      if (parsed.hasFlag('c')) {
+        result.cas = metaNumber<uint64_t>(parsed, 'c', reply.line);
+      }
+      if (parsed.hasFlag('f')) {
+        result.flags = metaNumber<uint32_t>(parsed, 'f', reply.line);
+      }
+      result.win = parsed.hasFlag('W');
+      result.stale = parsed.hasFlag('X');
+      result.winTokenSent = parsed.hasFlag('Z');
+      return result;
+    });
+}
+
+folly::Future<MetaStoreResult> MemcachedMetaClient::metaSet(StringPiece key,
+    StringPiece value, const MetaSetOptions &options) {
+  fbstring data;
+  if (compressor_) {
+    data = compressor_->encode(key, value);
+  } else {
+    data = value.fbstr();
+  }
+  fbstring flags;
+  if (options.ttl != 0) {
+    flags.append(folly::to<fbstring>(" T", options.ttl));
+  }
+  if (options.flags != 0) {
+    flags.append(folly::to<fbstring>(" F", options.flags));
+  }
+  if (options.cas != 0) {
+    flags.append(folly::to<fbstring>(" C", options.cas));
+  }
+  return sendMeta("ms", key, std::move(flags), &data)
+    .then([](MemcachedReply reply) {
+      auto code = detail::parseMetaReplyLine(reply.line).code;
+      if (code == "HD") {
+        return MetaStoreResult::STORED;
+      }
+      if (code == "EX") {
+        return MetaStoreResult::EXISTS;
+      }
+      if (code == "NF") {
+        return MetaStoreResult::NOT_FOUND;
+      }
+      throw ProtocolError(reply.line.toStdString());
+    });
+}
+
+folly::Future<bool> MemcachedMetaClient::metaDelete(StringPiece key,
+    const MetaDeleteOptions &options) {
+  fbstring flags;
+  if (options.invalidate) {
+    flags.append(" I");
+    if (options.staleTtl.hasValue()) {
+      flags.append(folly::to<fbstring>(" T", options.staleTtl.value()));
+    }
+  }
+  if (options.cas != 0) {
+    flags.append(folly::to<fbstring>(" C", options.cas));
+  }
+  return sendMeta("md", key, std::move(flags), nullptr)
+    .then([](MemcachedReply reply) {
+      auto code = detail::parseMetaReplyLine(reply.line).code;
+      if (code == "HD") {
+        return true;
+      }
+      if (code == "NF" || code == "EX") {
+        return false;
+      }
+      throw ProtocolError(reply.line.toStdString());
+    });
+}
+
+folly::Future<folly::Optional<uint64_t>> MemcachedMetaClient::metaArithmetic(
+    StringPiece key, const MetaArithmeticOptions &options) {
+  uint64_t delta = options.delta >= 0 ?
+    options.delta : -(uint64_t) options.delta;
+  auto flags = folly::to<fbstring>(" v D", delta);
+  if (options.delta < 0) {
+    flags.append(" MD");
+  }
+  if (options.vivifyTtl.hasValue()) {
+    flags.append(folly::to<fbstring>(
+      " N", options.vivifyTtl.value(), " J", options.initial
+    ));
+  }
+  return sendMeta("ma", key, std::move(flags), nullptr)
+    .then([](MemcachedReply reply) {
+      auto code = detail::parseMetaReplyLine(reply.line).code;
+      if (code == "NF") {
+        return folly::Optional<uint64_t> {};
+      }
+      if (code != "VA" || reply.values.empty()) {
+        throw ProtocolError(reply.line.toStdString());
+      }
+      try {
+        return folly::Optional<uint64_t> {
+          folly::to<uint64_t>(reply.values.front().value)
+        };
+      } catch (const std::range_error&) {
+        throw ProtocolError(folly::to<std::string>(
+          "non-numeric counter value: '", reply.values.front().value, "'"
+        ));
+      }
+    });
+}
+
+folly::Future<fbstring> MemcachedMetaClient::getOrCompute(StringPiece key,
+    compute_fn_t compute, const LeaseOptions &options) {
+  MetaGetOptions lease;
+  lease.cas = true;
+  lease.vivifyTtl = options.leaseTtl;
+  lease.recacheTtl = options.recacheTtl;
+  auto self = sharedMeta();
+  auto keyStr = key.fbstr();
+  return metaGet(key, lease).then([self, keyStr, compute, options](
+      MetaGetResult result) {
+    return self->handleLease(keyStr, std::move(result), compute, options, 0);
+  });
+}
+
+folly::Future<fbstring> MemcachedMetaClient::handleLease(const fbstring &key,
+    MetaGetResult &&result, compute_fn_t compute, const LeaseOptions &options,
+    size_t attempt) {
+  // a plain miss only happens with leaseTtl 0, which opts out of leases.
+  if (result.win || !result.found) {
+    return recompute(key, result, std::move(compute), options);
+  }
+  // an empty placeholder that another caller won and is still filling.
+  bool pending = result.winTokenSent && !result.stale && result.value.empty();
+  if (result.found && !pending) {
+    return folly::makeFuture(std::move(result.value));
+  }
+  return retryLease(key, std::move(compute), options, attempt);
+}
+
+folly::Future<fbstring> MemcachedMetaClient::recompute(const fbstring &key,
+    const MetaGetResult &won, compute_fn_t compute,
+    const LeaseOptions &options) {
+  auto self = sharedMeta();
+  uint64_t casToken = won.cas.hasValue() ? won.cas.value() : 0;
+  // a fresh value that won an early refresh, rather than a miss or a stale
+  // value; it's still good if computing fails.
+  bool refreshing = !won.stale && !won.value.empty();
+  auto previous = won.value;
+  return compute().then([self, key, casToken, refreshing, previous, options](
+      Try<fbstring> computed) {
+    if (computed.hasValue()) {
+      MetaSetOptions store;
+      store.ttl = options.ttl;
+      // if it was invalidated again meanwhile, our value is already stale.
+      store.cas = casToken;
+      auto value = computed.value();
+      return self->metaSet(key, value, store).then(
+          [value](Try<MetaStoreResult>) {
+        return value;
+      });
+    }
+    if (refreshing) {
+      return folly::makeFuture(previous);
+    }
+    auto error = computed.exception();
+    if (casToken == 0) {
+      return folly::makeFuture<fbstring>(error);
+    }
+    // hand the lease back: a placeholder is removed and a stale value
+    // invalidated again, so the next caller wins.
+    MetaDeleteOptions release;
+    release.cas = casToken;
+    release.invalidate = !previous.empty();
+    return self->metaDelete(key, release).then([error](Try<bool>) {
+      return folly::makeFuture<fbstring>(error);
+    });
+  });
+}
+
+folly::Future<fbstring> MemcachedMetaClient::retryLease(const fbstring &key,
+    compute_fn_t compute, const LeaseOptions &options, size_t attempt) {
+  if (attempt >= options.maxRetries) {
+    // the winner is taking too long; compute our own copy, but leave
+    // storing it to them.
+    return compute();
+  }
+  auto self = sharedMeta();
+  auto delayed = std::make_shared<folly::Promise<Unit>>();
+  base_->runAfterDelay([delayed]() {
+    delayed->setValue(Unit {});
+  }, options.retryDelay.count());
+  return delayed->getFuture().then([self, key, compute, options, attempt]() {
+    MetaGetOptions lease;
+    lease.cas = true;
+    // if the winner gave up, the placeholder is gone and we can win it.
+    lease.vivifyTtl = options.leaseTtl;
+    return self->metaGet(key, lease).then([self, key, compute, options,
+        attempt](MetaGetResult result) {
+      return self->handleLease(key, std::move(result), compute, options,
+        attempt + 1);
+    });
+  });
+}
+
+namespace detail {
+
+bool MetaReplyLine::hasFlag(char flag) const {
+  return flagToken(flag).hasValue();
+}
+
+folly::Optional<StringPiece> MetaReplyLine::flagToken(char flag) const {
+  for (const auto &entry: flags) {
+    if (entry.first == flag) {
+      return entry.second;
+    }
+  }
+  return folly::none;
+}
+
+MetaReplyLine parseMetaReplyLine(StringPiece line) {
+  MetaReplyLine parsed;
+  auto space = line.find(' ');
+  parsed.code = line.subpiece(0, space);
+  if (space == StringPiece::npos) {
+    return parsed;
+  }
+  line.advance(space + 1);
+  // VA's first token is the value's size, not a flag.
+  if (parsed.code == "VA") {
+    space = line.find(' ');
+    if (space == StringPiece::npos) {
+      return parsed;
+    }
+    line.advance(space + 1);
+  }
+  while (!line.empty()) {
+    space = line.find(' ');
+    auto token = line.subpiece(0, space);
+    if (!token.empty()) {
+      parsed.flags.emplace_back(token[0], token.subpiece(1));
+    }
+    if (space == StringPiece::npos) {
+      break;
+    }
+    line.advance(space + 1);
+  }
+  return parsed;
+}
+
+} // detail
+
+}} // fredis::memcached
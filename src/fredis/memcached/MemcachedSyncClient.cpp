@@ -2,9 +2,14 @@
 #include "fredis/memcached/MemcachedSyncClient.h"
 #include "fredis/memcached/MemcachedError.h"
 #include <libmemcached/memcached.h>
+#include <folly/Conv.h>
 #include <folly/ScopeGuard.h>
 #include <folly/ExceptionWrapper.h>
 #include <glog/logging.h>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <limits>
 
 using folly::Try;
 using folly::Unit;
@@ -17,13 +22,16 @@ using namespace std;
 namespace fredis { namespace memcached {
 
 MemcachedSyncClient::MemcachedSyncClient(const MemcachedConfig& config)
-  : config_(config){}
+  : config_(config), stats_(stats::StatsRegistry::createShared()) {}
 
 MemcachedSyncClient::MemcachedSyncClient(MemcachedConfig&& config)
-  : config_(std::forward<MemcachedConfig>(config)){}
+  : config_(std::forward<MemcachedConfig>(config)),
+    stats_(stats::StatsRegistry::createShared()) {}
 
 MemcachedSyncClient::MemcachedSyncClient(MemcachedSyncClient&& other)
-  : config_(other.config_), mcHandle_(other.mcHandle_) {
+  : config_(other.config_), mcHandle_(other.mcHandle_),
+    stats_(std::move(other.stats_)),
+    compressor_(std::move(other.compressor_)) {
   other.mcHandle_ = nullptr;
 }
 
@@ -31,6 +39,8 @@ MemcachedSyncClient& MemcachedSyncClient::operator=(
     MemcachedSyncClient &&other) {
   std::swap(config_, other.config_);
   std::swap(mcHandle_, other.mcHandle_);
+  std::swap(stats_, other.stats_);
+  std::swap(compressor_, other.compressor_);
   return *this;
 }
 
@@ -49,6 +59,15 @@ Try<Unit> MemcachedSyncClient::connect() {
       )
     };
   }
+  // its writes don't invalidate replicas, so async readers sharing the
+  // cluster would keep serving stale copies.
+  if (config_.getHotKeys().isEnabled()) {
+    return Try<Unit>{
+      make_exception_wrapper<ConfigurationError>(
+        "MemcachedSyncClient doesn't support hot key replication."
+      )
+    };
+  }
   auto confStrOpt = config_.toConfigString();
   if (confStrOpt.hasException()) {
     return Try<Unit>{std::move(confStrOpt.exception())};
@@ -75,6 +94,16 @@ Try<Unit> MemcachedSyncClient::connect() {
     mcHandle_ = nullptr;
     return result;
   }
+  auto applied = detail::applyMemcachedBehaviors(
+    config_.getBehaviors(), mcHandle_
+  );
+  if (applied.hasException()) {
+    memcached_free(mcHandle_);
+    mcHandle_ = nullptr;
+    return applied;
+  }
+  // so gets() sees cas tokens.
+  memcached_behavior_set(mcHandle_, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
   return Try<Unit>{Unit{}};
 }
 
@@ -95,34 +124,219 @@ const MemcachedConfig& MemcachedSyncClient::getConfig() const {
   return config_;
 }
 
+void MemcachedSyncClient::setStatsRegistry(
+    std::shared_ptr<stats::StatsRegistry> registry) {
+  stats_ = std::move(registry);
+}
+
+std::shared_ptr<stats::StatsRegistry> MemcachedSyncClient::getStatsRegistry() const {
+  return stats_;
+}
+
+stats::StatsSnapshot MemcachedSyncClient::getStats() {
+  if (!stats_) {
+    return stats::StatsSnapshot {};
+  }
+  return stats_->getStats();
+}
+
+void MemcachedSyncClient::setValueCompressor(
+    std::shared_ptr<compression::ValueCompressor> compressor) {
+  compressor_ = std::move(compressor);
+}
+
+std::shared_ptr<compression::ValueCompressor>
+    MemcachedSyncClient::getValueCompressor() const {
+  return compressor_;
+}
+
+namespace {
+
+using steady_clock_t = std::chrono::steady_clock;
+
+void recordCommand(stats::StatsRegistry *registry, folly::StringPiece command,
+    steady_clock_t::time_point startedAt, memcached_return_t rc,
+    size_t bytesOut, size_t bytesIn) {
+  if (!registry) {
+    return;
+  }
+  auto outcome = stats::Outcome::SUCCESS;
+  if (rc == MEMCACHED_TIMEOUT) {
+    outcome = stats::Outcome::TIMEOUT;
+  } else if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_NOTFOUND &&
+      rc != MEMCACHED_BUFFERED) {
+    outcome = stats::Outcome::ERROR;
+  }
+  registry->record(command,
+    std::chrono::duration_cast<std::chrono::microseconds>(
+      steady_clock_t::now() - startedAt
+    ),
+    outcome, bytesOut, bytesIn
+  );
+}
+
+// memcached_get with its three outcomes told apart: true on a hit, with
+// `valBuff` set to libmemcached's malloc'd copy of the value (null for an
+// empty value) for the caller to free; false on a miss; or an error.
+Try<bool> fetchValue(memcached_st *handle, stats::StatsRegistry *registry,
+    const fbstring &key, char *&valBuff, size_t &valLen) {
+  auto startedAt = steady_clock_t::now();
+  memcached_return_t errCode;
+  uint32_t flags {0};
+  valBuff = memcached_get(handle, key.c_str(), key.size(),
+    &valLen, &flags, &errCode);
+  recordCommand(registry, "get", startedAt, errCode, key.size(), valLen);
+  if (errCode == MEMCACHED_SUCCESS) {
+    return Try<bool> {true};
+  }
+  if (valBuff != nullptr) {
+    free(valBuff);
+    valBuff = nullptr;
+  }
+  if (errCode == MEMCACHED_NOTFOUND) {
+    return Try<bool> {false};
+  }
+  return Try<bool> {make_exception_wrapper<ProtocolError>(
+    memcached_last_error_message(handle)
+  )};
+}
+
+} // anonymous namespace
+
 using get_result_t = MemcachedSyncClient::get_result_t;
 
 get_result_t MemcachedSyncClient::get(const fbstring &key) {
   DCHECK(isConnected());
-  memcached_return_t errCode;
+  char *valBuff {nullptr};
   size_t valLen {0};
-  uint32_t flags {0};
-  auto valBuff = memcached_get(mcHandle_, key.c_str(), key.size(),
-    &valLen, &flags, &errCode);
+  auto found = fetchValue(mcHandle_, stats_.get(), key, valBuff, valLen);
   auto guard = folly::makeGuard([&valBuff]() {
     if (valBuff != nullptr) {
       free(valBuff);
     }
   });
-  get_result_t result;
-  if (errCode != MEMCACHED_SUCCESS) {
-    result = get_result_t {make_exception_wrapper<ProtocolError>(
+  if (found.hasException()) {
+    return get_result_t {found.exception()};
+  }
+  if (!found.value()) {
+    return get_result_t {folly::Optional<fbstring> {}};
+  }
+  folly::StringPiece stored {valBuff == nullptr ? "" : valBuff, valLen};
+  if (compressor_) {
+    auto decoded = compressor_->decode(stored);
+    if (decoded.hasException()) {
+      return get_result_t {decoded.exception()};
+    }
+    return get_result_t {folly::Optional<fbstring> {
+      std::move(decoded.value())
+    }};
+  }
+  return get_result_t {folly::Optional<fbstring> {stored.fbstr()}};
+}
+
+using iobuf_result_t = MemcachedSyncClient::iobuf_result_t;
+
+iobuf_result_t MemcachedSyncClient::getIOBuf(const fbstring &key) {
+  DCHECK(isConnected());
+  using buf_ptr_t = std::unique_ptr<folly::IOBuf>;
+  char *valBuff {nullptr};
+  size_t valLen {0};
+  auto found = fetchValue(mcHandle_, stats_.get(), key, valBuff, valLen);
+  if (found.hasException()) {
+    return iobuf_result_t {found.exception()};
+  }
+  if (!found.value()) {
+    return iobuf_result_t {folly::Optional<buf_ptr_t> {}};
+  }
+  if (valBuff == nullptr) {
+    return iobuf_result_t {folly::Optional<buf_ptr_t> {
+      folly::IOBuf::create(0)
+    }};
+  }
+  auto buf = folly::IOBuf::takeOwnership(valBuff, valLen,
+    [](void *data, void*) {
+      free(data);
+    }
+  );
+  folly::StringPiece stored {valBuff, valLen};
+  if (compressor_ && compressor_->isEncoded(stored)) {
+    auto decoded = compressor_->decode(stored);
+    if (decoded.hasException()) {
+      return iobuf_result_t {decoded.exception()};
+    }
+    // hand the decoded string's buffer over as well, rather than copying.
+    auto owned = new fbstring {std::move(decoded.value())};
+    buf = folly::IOBuf::takeOwnership((void*) owned->data(), owned->size(),
+      [](void*, void *userData) {
+        delete (fbstring*) userData;
+      },
+      owned
+    );
+  }
+  return iobuf_result_t {folly::Optional<buf_ptr_t> {std::move(buf)}};
+}
+
+using get_into_result_t = MemcachedSyncClient::get_into_result_t;
+
+get_into_result_t MemcachedSyncClient::getInto(const fbstring &key,
+    folly::MutableByteRange buffer) {
+  DCHECK(isConnected());
+  auto startedAt = steady_clock_t::now();
+  const char *keyPtr = key.data();
+  size_t keyLength = key.size();
+  auto rc = memcached_mget(mcHandle_, &keyPtr, &keyLength, 1);
+  if (rc != MEMCACHED_SUCCESS) {
+    recordCommand(stats_.get(), "get", startedAt, rc, key.size(), 0);
+    return get_into_result_t {make_exception_wrapper<ProtocolError>(
       memcached_last_error_message(mcHandle_)
     )};
   }
-  if (valLen == 0) {
-    result = get_result_t {folly::Optional<fbstring>{}};
-  } else {
-    result = get_result_t {folly::Optional<fbstring>{
-      fbstring{valBuff, valLen}
-    }};
+  memcached_result_st result;
+  memcached_result_create(mcHandle_, &result);
+  auto guard = folly::makeGuard([&result]() {
+    memcached_result_free(&result);
+  });
+  get_into_result_t outcome {folly::Optional<size_t> {}};
+  size_t bytesIn = 0;
+  // the value is read out of the result's own buffer, which is reused from
+  // one fetch to the next; keep fetching until END so the connection is
+  // left clean.
+  while (memcached_fetch_result(mcHandle_, &result, &rc) != nullptr) {
+    folly::StringPiece value {
+      memcached_result_value(&result), memcached_result_length(&result)
+    };
+    bytesIn += value.size();
+    fbstring decoded;
+    if (compressor_ && compressor_->isEncoded(value)) {
+      auto decodedTry = compressor_->decode(value);
+      if (decodedTry.hasException()) {
+        outcome = get_into_result_t {decodedTry.exception()};
+        continue;
+      }
+      decoded = std::move(decodedTry.value());
+      value = decoded;
+    }
+    if (value.size() > buffer.size()) {
+      outcome = get_into_result_t {make_exception_wrapper<BufferTooSmall>(
+        folly::to<std::string>("value for '", key, "' is ", value.size(),
+          " bytes; the buffer holds ", buffer.size())
+      )};
+      continue;
+    }
+    if (!value.empty()) {
+      memcpy(buffer.data(), value.data(), value.size());
+    }
+    outcome = get_into_result_t {folly::Optional<size_t> {value.size()}};
+  }
+  if (rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS &&
+      rc != MEMCACHED_NOTFOUND) {
+    outcome = get_into_result_t {make_exception_wrapper<ProtocolError>(
+      memcached_last_error_message(mcHandle_)
+    )};
   }
-  return result;
+  recordCommand(stats_.get(), "get", startedAt,
+    rc == MEMCACHED_END ? MEMCACHED_SUCCESS : rc, key.size(), bytesIn);
+  return outcome;
 }
 
 using set_result_t = MemcachedSyncClient::set_result_t;
@@ -130,13 +344,23 @@ using set_result_t = MemcachedSyncClient::set_result_t;
 set_result_t MemcachedSyncClient::set(const fbstring& key,
     const fbstring& val, time_t ttl) {
   DCHECK(isConnected());
+  auto startedAt = steady_clock_t::now();
   uint32_t flags {0};
+  fbstring compressed;
+  folly::StringPiece stored {val};
+  if (compressor_) {
+    compressed = compressor_->encode(key, val);
+    stored = compressed;
+  }
   auto rc = memcached_set(mcHandle_,
     key.c_str(), key.size(),
-    val.c_str(), val.size(),
+    stored.data(), stored.size(),
     ttl, flags
   );
-  if (rc != MEMCACHED_SUCCESS) {
+  recordCommand(stats_.get(), "set", startedAt, rc,
+    key.size() + stored.size(), 0);
+  // with buffered requests, the write is queued rather than sent.
+  if (rc != MEMCACHED_SUCCESS && rc != MEMCACHED_BUFFERED) {
     return set_result_t {
       make_exception_wrapper<ProtocolError>(
         memcached_last_error_message(mcHandle_)
@@ -146,4 +370,342 @@ set_result_t MemcachedSyncClient::set(const fbstring& key,
   return set_result_t{Unit{}};
 }
 
-}} // fredis::memcached
\ No newline at end of file
+Try<folly::Optional<MemcachedValue>> MemcachedSyncClient::gets(
+    const fbstring &key) {
+  DCHECK(isConnected());
+  using gets_result_t = Try<folly::Optional<MemcachedValue>>;
+  auto startedAt = steady_clock_t::now();
+  const char *keyPtr = key.data();
+  size_t keyLength = key.size();
+  auto rc = memcached_mget(mcHandle_, &keyPtr, &keyLength, 1);
+  if (rc != MEMCACHED_SUCCESS) {
+    recordCommand(stats_.get(), "gets", startedAt, rc, key.size(), 0);
+    return gets_result_t {make_exception_wrapper<ProtocolError>(
+      memcached_last_error_message(mcHandle_)
+    )};
+  }
+  memcached_result_st result;
+  memcached_result_create(mcHandle_, &result);
+  auto guard = folly::makeGuard([&result]() {
+    memcached_result_free(&result);
+  });
+  gets_result_t outcome {folly::Optional<MemcachedValue> {}};
+  size_t bytesIn = 0;
+  while (memcached_fetch_result(mcHandle_, &result, &rc) != nullptr) {
+    MemcachedValue found;
+    found.key = key;
+    found.flags = memcached_result_flags(&result);
+    found.cas = memcached_result_cas(&result);
+    folly::StringPiece stored {
+      memcached_result_value(&result), memcached_result_length(&result)
+    };
+    bytesIn += stored.size();
+    if (compressor_) {
+      auto decoded = compressor_->decode(stored);
+      if (decoded.hasException()) {
+        outcome = gets_result_t {decoded.exception()};
+        continue;
+      }
+      found.value = std::move(decoded.value());
+    } else {
+      found.value = stored.fbstr();
+    }
+    outcome = gets_result_t {folly::Optional<MemcachedValue> {
+      std::move(found)
+    }};
+  }
+  if (rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS &&
+      rc != MEMCACHED_NOTFOUND) {
+    outcome = gets_result_t {make_exception_wrapper<ProtocolError>(
+      memcached_last_error_message(mcHandle_)
+    )};
+  }
+  recordCommand(stats_.get(), "gets", startedAt,
+    rc == MEMCACHED_END ? MEMCACHED_SUCCESS : rc, key.size(), bytesIn);
+  return outcome;
+}
+
+Try<CasResult> MemcachedSyncClient::cas(const fbstring &key,
+    const fbstring &val, uint64_t casToken, time_t ttl) {
+  DCHECK(isConnected());
+  auto startedAt = steady_clock_t::now();
+  fbstring compressed;
+  folly::StringPiece stored {val};
+  if (compressor_) {
+    compressed = compressor_->encode(key, val);
+    stored = compressed;
+  }
+  auto rc = memcached_cas(mcHandle_, key.c_str(), key.size(),
+    stored.data(), stored.size(), ttl, 0, casToken);
+  recordCommand(stats_.get(), "cas", startedAt,
+    rc == MEMCACHED_DATA_EXISTS ? MEMCACHED_SUCCESS : rc,
+    key.size() + stored.size(), 0);
+  switch (rc) {
+    case MEMCACHED_SUCCESS:
+    case MEMCACHED_BUFFERED:
+      return Try<CasResult> {CasResult::STORED};
+    case MEMCACHED_DATA_EXISTS:
+      return Try<CasResult> {CasResult::EXISTS};
+    case MEMCACHED_NOTFOUND:
+      return Try<CasResult> {CasResult::NOT_FOUND};
+    default:
+      return Try<CasResult> {make_exception_wrapper<ProtocolError>(
+        memcached_last_error_message(mcHandle_)
+      )};
+  }
+}
+
+namespace {
+
+using store_fn_t = memcached_return_t (*)(memcached_st*, const char*, size_t,
+  const char*, size_t, time_t, uint32_t);
+
+// add, replace or append: true if stored, false on NOT_STORED.
+Try<bool> conditionalStore(memcached_st *handle,
+    stats::StatsRegistry *registry, folly::StringPiece command,
+    store_fn_t storeFn, const fbstring &key, folly::StringPiece value,
+    time_t ttl) {
+  auto startedAt = steady_clock_t::now();
+  auto rc = storeFn(handle, key.c_str(), key.size(), value.data(),
+    value.size(), ttl, 0);
+  recordCommand(registry, command, startedAt,
+    rc == MEMCACHED_NOTSTORED ? MEMCACHED_SUCCESS : rc,
+    key.size() + value.size(), 0);
+  if (rc == MEMCACHED_SUCCESS || rc == MEMCACHED_BUFFERED) {
+    return Try<bool> {true};
+  }
+  if (rc == MEMCACHED_NOTSTORED) {
+    return Try<bool> {false};
+  }
+  return Try<bool> {make_exception_wrapper<ProtocolError>(
+    memcached_last_error_message(handle)
+  )};
+}
+
+} // anonymous namespace
+
+Try<bool> MemcachedSyncClient::add(const fbstring &key, const fbstring &val,
+    time_t ttl) {
+  DCHECK(isConnected());
+  if (compressor_) {
+    return conditionalStore(mcHandle_, stats_.get(), "add", memcached_add,
+      key, compressor_->encode(key, val), ttl);
+  }
+  return conditionalStore(mcHandle_, stats_.get(), "add", memcached_add,
+    key, val, ttl);
+}
+
+Try<bool> MemcachedSyncClient::replace(const fbstring &key,
+    const fbstring &val, time_t ttl) {
+  DCHECK(isConnected());
+  if (compressor_) {
+    return conditionalStore(mcHandle_, stats_.get(), "replace",
+      memcached_replace, key, compressor_->encode(key, val), ttl);
+  }
+  return conditionalStore(mcHandle_, stats_.get(), "replace",
+    memcached_replace, key, val, ttl);
+}
+
+Try<bool> MemcachedSyncClient::append(const fbstring &key,
+    const fbstring &val) {
+  DCHECK(isConnected());
+  if (compressor_) {
+    return Try<bool> {make_exception_wrapper<ConfigurationError>(
+      "append can't be used with a value compressor."
+    )};
+  }
+  return conditionalStore(mcHandle_, stats_.get(), "append", memcached_append,
+    key, val, 0);
+}
+
+using counter_result_t = MemcachedSyncClient::counter_result_t;
+
+namespace {
+
+using arithmetic_fn_t = memcached_return_t (*)(memcached_st*, const char*,
+  size_t, uint32_t, uint64_t*);
+
+counter_result_t arithmetic(memcached_st *handle,
+    stats::StatsRegistry *registry, bool increment, const fbstring &key,
+    uint64_t delta) {
+  if (delta > std::numeric_limits<uint32_t>::max()) {
+    return counter_result_t {make_exception_wrapper<ProtocolError>(
+      "libmemcached only takes 32-bit counter deltas"
+    )};
+  }
+  auto startedAt = steady_clock_t::now();
+  arithmetic_fn_t arithmeticFn = increment ?
+    memcached_increment : memcached_decrement;
+  uint64_t value {0};
+  auto rc = arithmeticFn(handle, key.c_str(), key.size(), (uint32_t) delta,
+    &value);
+  recordCommand(registry, increment ? "incr" : "decr", startedAt, rc,
+    key.size(), 0);
+  if (rc == MEMCACHED_SUCCESS) {
+    return counter_result_t {folly::Optional<uint64_t> {value}};
+  }
+  if (rc == MEMCACHED_NOTFOUND) {
+    return counter_result_t {folly::Optional<uint64_t> {}};
+  }
+  return counter_result_t {make_exception_wrapper<ProtocolError>(
+    memcached_last_error_message(handle)
+  )};
+}
+
+Try<uint64_t> counter(memcached_st *handle, stats::StatsRegistry *registry,
+    bool increment, const fbstring &key, uint64_t delta, uint64_t initial,
+    time_t ttl) {
+  auto initialStr = folly::to<fbstring>(initial);
+  for (;;) {
+    auto current = arithmetic(handle, registry, increment, key, delta);
+    if (current.hasException()) {
+      return Try<uint64_t> {current.exception()};
+    }
+    if (current.value().hasValue()) {
+      return Try<uint64_t> {current.value().value()};
+    }
+    auto added = conditionalStore(handle, registry, "add", memcached_add, key,
+      initialStr, ttl);
+    if (added.hasException()) {
+      return Try<uint64_t> {added.exception()};
+    }
+    if (added.value()) {
+      return Try<uint64_t> {initial};
+    }
+    // another client created it between our incr and add.
+  }
+}
+
+} // anonymous namespace
+
+counter_result_t MemcachedSyncClient::incr(const fbstring &key,
+    uint64_t delta) {
+  DCHECK(isConnected());
+  return arithmetic(mcHandle_, stats_.get(), true, key, delta);
+}
+
+counter_result_t MemcachedSyncClient::decr(const fbstring &key,
+    uint64_t delta) {
+  DCHECK(isConnected());
+  return arithmetic(mcHandle_, stats_.get(), false, key, delta);
+}
+
+Try<uint64_t> MemcachedSyncClient::incr(const fbstring &key, uint64_t delta,
+    uint64_t initial, time_t ttl) {
+  DCHECK(isConnected());
+  return counter(mcHandle_, stats_.get(), true, key, delta, initial, ttl);
+}
+
+Try<uint64_t> MemcachedSyncClient::decr(const fbstring &key, uint64_t delta,
+    uint64_t initial, time_t ttl) {
+  DCHECK(isConnected());
+  return counter(mcHandle_, stats_.get(), false, key, delta, initial, ttl);
+}
+
+Try<bool> MemcachedSyncClient::touch(const fbstring &key, time_t ttl) {
+  DCHECK(isConnected());
+  auto startedAt = steady_clock_t::now();
+  auto rc = memcached_touch(mcHandle_, key.c_str(), key.size(), ttl);
+  recordCommand(stats_.get(), "touch", startedAt, rc, key.size(), 0);
+  if (rc == MEMCACHED_SUCCESS) {
+    return Try<bool> {true};
+  }
+  if (rc == MEMCACHED_NOTFOUND) {
+    return Try<bool> {false};
+  }
+  return Try<bool> {make_exception_wrapper<ProtocolError>(
+    memcached_last_error_message(mcHandle_)
+  )};
+}
+
+using multi_get_result_t = MemcachedSyncClient::multi_get_result_t;
+
+multi_get_result_t MemcachedSyncClient::multiGet(
+    const std::vector<fbstring> &keys) {
+  multi_get_map_t found;
+  auto fetched = multiGetEach(keys, [&found](folly::StringPiece key,
+      fbstring &&value) {
+    found[key.fbstr()] = std::move(value);
+  });
+  if (fetched.hasException()) {
+    return multi_get_result_t {fetched.exception()};
+  }
+  return multi_get_result_t {std::move(found)};
+}
+
+Try<Unit> MemcachedSyncClient::multiGetEach(const std::vector<fbstring> &keys,
+    const hit_callback_t &onHit) {
+  DCHECK(isConnected());
+  if (keys.empty()) {
+    return Try<Unit> {Unit {}};
+  }
+  auto startedAt = steady_clock_t::now();
+  std::vector<const char*> keyPtrs;
+  std::vector<size_t> keyLengths;
+  size_t bytesOut = 0;
+  for (const auto &key: keys) {
+    keyPtrs.push_back(key.data());
+    keyLengths.push_back(key.size());
+    bytesOut += key.size();
+  }
+  auto rc = memcached_mget(mcHandle_, keyPtrs.data(), keyLengths.data(),
+    keys.size());
+  if (rc != MEMCACHED_SUCCESS) {
+    recordCommand(stats_.get(), "mget", startedAt, rc, bytesOut, 0);
+    return Try<Unit> {make_exception_wrapper<ProtocolError>(
+      memcached_last_error_message(mcHandle_)
+    )};
+  }
+  memcached_result_st result;
+  memcached_result_create(mcHandle_, &result);
+  auto guard = folly::makeGuard([&result]() {
+    memcached_result_free(&result);
+  });
+  size_t bytesIn = 0;
+  Try<Unit> outcome {Unit {}};
+  // thrown by onHit; held until the fetch is done, since results left
+  // unread on the connection would be taken as the next command's reply.
+  std::exception_ptr callbackError;
+  while (memcached_fetch_result(mcHandle_, &result, &rc) != nullptr) {
+    folly::StringPiece key {
+      memcached_result_key_value(&result), memcached_result_key_length(&result)
+    };
+    folly::StringPiece value {
+      memcached_result_value(&result), memcached_result_length(&result)
+    };
+    bytesIn += value.size();
+    if (!outcome.hasValue() || callbackError) {
+      // keep reading so the connection is left clean.
+      continue;
+    }
+    try {
+      if (compressor_) {
+        auto decoded = compressor_->decode(value);
+        if (decoded.hasException()) {
+          outcome = Try<Unit> {decoded.exception()};
+          continue;
+        }
+        onHit(key, std::move(decoded.value()));
+      } else {
+        onHit(key, value.fbstr());
+      }
+    } catch (...) {
+      callbackError = std::current_exception();
+    }
+  }
+  // fetching ends with MEMCACHED_END once every server is done.
+  if (rc != MEMCACHED_END && rc != MEMCACHED_SUCCESS &&
+      rc != MEMCACHED_NOTFOUND && outcome.hasValue()) {
+    outcome = Try<Unit> {make_exception_wrapper<ProtocolError>(
+      memcached_last_error_message(mcHandle_)
+    )};
+  }
+  recordCommand(stats_.get(), "mget", startedAt,
+    rc == MEMCACHED_END ? MEMCACHED_SUCCESS : rc, bytesOut, bytesIn);
+  if (callbackError) {
+    std::rethrow_exception(callbackError);
+  }
+  return outcome;
+}
+
+}} // fredis::memcached
@@ -0,0 +1,167 @@
+#include "fredis/redis/AdmissionController.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace fredis { namespace redis {
+
+using Mode = AdmissionPolicy::Mode;
+using duration_t = AdmissionController::duration_t;
+
+// how many latency samples pass before the minimum latency estimate
+// is allowed to drift back up, e.g. after the server moves hosts.
+static const size_t kMinLatencyResetInterval = 5000;
+
+AdmissionController::AdmissionController(const AdmissionPolicy &policy)
+  : policy_(policy) {
+  size_t initialLimit = policy_.maxInFlightRequests;
+  if (policy_.mode == Mode::ADAPTIVE) {
+    initialLimit = std::min(policy_.initialConcurrencyLimit,
+      policy_.maxInFlightRequests);
+    initialLimit = std::max(initialLimit, policy_.minConcurrencyLimit);
+  }
+  adaptiveLimit_ = (double) initialLimit;
+  concurrencyLimit_.store(initialLimit);
+}
+
+shared_ptr<AdmissionController> AdmissionController::createShared(
+    const AdmissionPolicy &policy) {
+  return shared_ptr<AdmissionController> {new AdmissionController {policy}};
+}
+
+const AdmissionPolicy& AdmissionController::getPolicy() const {
+  return policy_;
+}
+
+size_t AdmissionController::effectiveRequestLimit() const {
+  return concurrencyLimit_.load(std::memory_order_relaxed);
+}
+
+bool AdmissionController::tryAcquire(size_t bytes) {
+  size_t limit = effectiveRequestLimit();
+  size_t current = inFlightRequests_.load(std::memory_order_relaxed);
+  for (;;) {
+    if (current >= limit) {
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    if (inFlightRequests_.compare_exchange_weak(current, current + 1,
+          std::memory_order_acq_rel)) {
+      break;
+    }
+  }
+  if (policy_.maxInFlightBytes > 0) {
+    size_t previous = inFlightBytes_.fetch_add(bytes, std::memory_order_acq_rel);
+    // a single oversized request is still let through when nothing
+    // else is in flight, otherwise it could never be sent at all.
+    if (previous > 0 && previous + bytes > policy_.maxInFlightBytes) {
+      inFlightBytes_.fetch_sub(bytes, std::memory_order_acq_rel);
+      inFlightRequests_.fetch_sub(1, std::memory_order_acq_rel);
+      rejected_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+  }
+  return true;
+}
+
+void AdmissionController::cancel(size_t bytes) {
+  if (policy_.maxInFlightBytes > 0) {
+    inFlightBytes_.fetch_sub(bytes, std::memory_order_acq_rel);
+  }
+  inFlightRequests_.fetch_sub(1, std::memory_order_acq_rel);
+  wakeOneWaiter();
+}
+
+void AdmissionController::release(size_t bytes, duration_t latency,
+    bool succeeded) {
+  if (policy_.mode == Mode::ADAPTIVE) {
+    recordLatency(latency, succeeded);
+  }
+  cancel(bytes);
+}
+
+void AdmissionController::recordLatency(duration_t latency, bool succeeded) {
+  // samples are a statistical signal; if another thread is already
+  // updating the estimate, dropping this one is cheaper than waiting.
+  std::unique_lock<std::mutex> lock {adaptiveMutex_, std::try_to_lock};
+  if (!lock.owns_lock()) {
+    return;
+  }
+  double sample = std::max(1.0, (double) latency.count());
+  if (minLatency_ <= 0 || sample < minLatency_) {
+    minLatency_ = sample;
+  }
+  if (smoothedLatency_ <= 0) {
+    smoothedLatency_ = sample;
+  } else {
+    smoothedLatency_ += policy_.smoothing * (sample - smoothedLatency_);
+  }
+  samplesSinceReset_++;
+  if (samplesSinceReset_ >= kMinLatencyResetInterval) {
+    minLatency_ = smoothedLatency_;
+    samplesSinceReset_ = 0;
+  }
+
+  // gradient < 1 when latency is rising above the baseline; the sqrt
+  // term leaves room for the limit to probe upward while it's flat.
+  double gradient = (minLatency_ * policy_.latencyTolerance) / smoothedLatency_;
+  gradient = std::max(0.5, std::min(1.0, gradient));
+  double target = adaptiveLimit_ * gradient + std::sqrt(adaptiveLimit_);
+  if (!succeeded) {
+    target = adaptiveLimit_ * 0.9;
+  }
+  adaptiveLimit_ += policy_.smoothing * (target - adaptiveLimit_);
+  adaptiveLimit_ = std::max(adaptiveLimit_, (double) policy_.minConcurrencyLimit);
+  adaptiveLimit_ = std::min(adaptiveLimit_, (double) policy_.maxInFlightRequests);
+  concurrencyLimit_.store((size_t) adaptiveLimit_, std::memory_order_relaxed);
+}
+
+void AdmissionController::notifyWhenAvailable(folly::EventBase *base,
+    wakeup_t wakeup) {
+  {
+    std::lock_guard<std::mutex> guard {waitersMutex_};
+    waiters_.push_back(Waiter {base, std::move(wakeup)});
+    waiterCount_.fetch_add(1, std::memory_order_acq_rel);
+  }
+  // a slot may have been released between the caller's failed
+  // tryAcquire() and registering here.
+  if (inFlightRequests_.load(std::memory_order_acquire) < effectiveRequestLimit()) {
+    wakeOneWaiter();
+  }
+}
+
+void AdmissionController::wakeOneWaiter() {
+  if (waiterCount_.load(std::memory_order_acquire) == 0) {
+    return;
+  }
+  Waiter waiter;
+  {
+    std::lock_guard<std::mutex> guard {waitersMutex_};
+    if (waiters_.empty()) {
+      return;
+    }
+    waiter = std::move(waiters_.front());
+    waiters_.pop_front();
+    waiterCount_.fetch_sub(1, std::memory_order_acq_rel);
+  }
+  waiter.base->runInEventBaseThread(std::move(waiter.wakeup));
+}
+
+size_t AdmissionController::getInFlightRequests() const {
+  return inFlightRequests_.load(std::memory_order_relaxed);
+}
+
+size_t AdmissionController::getInFlightBytes() const {
+  return inFlightBytes_.load(std::memory_order_relaxed);
+}
+
+size_t AdmissionController::getConcurrencyLimit() const {
+  return effectiveRequestLimit();
+}
+
+size_t AdmissionController::getRejectedCount() const {
+  return rejected_.load(std::memory_order_relaxed);
+}
+
+}} // fredis::redis
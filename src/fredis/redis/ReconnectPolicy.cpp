@@ -0,0 +1,34 @@
+#include "fredis/redis/ReconnectPolicy.h"
+#include <algorithm>
+#include <cmath>
+
+namespace fredis { namespace redis {
+
+using duration_t = ReconnectPolicy::duration_t;
+
+duration_t ReconnectPolicy::backoffForAttempt(size_t attempt,
+    double unitRandom) const {
+  double base = (double) initialBackoff.count();
+  double ceiling = (double) maxBackoff.count();
+  double delay = base * std::pow(backoffMultiplier, (double) attempt);
+  delay = std::min(delay, ceiling);
+  double jitterFrac = std::max(0.0, std::min(1.0, jitter));
+  unitRandom = std::max(0.0, std::min(1.0, unitRandom));
+  delay -= delay * jitterFrac * unitRandom;
+  return duration_t {(int64_t) std::max(0.0, delay)};
+}
+
+bool ReconnectPolicy::shouldGiveUp(size_t attempt) const {
+  if (!enabled) {
+    return true;
+  }
+  return maxAttempts > 0 && attempt >= maxAttempts;
+}
+
+ReconnectPolicy ReconnectPolicy::disabled() {
+  ReconnectPolicy policy;
+  policy.enabled = false;
+  return policy;
+}
+
+}} // fredis::redis
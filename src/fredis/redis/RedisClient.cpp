@@ -1,7 +1,13 @@
 #include "fredis/redis/RedisClient.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_set>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include <glog/logging.h>
+#include <folly/Conv.h>
 #include <folly/ExceptionWrapper.h>
 #include "fredis/redis/RedisError.h"
 #include "fredis/redis/RedisRequestContext.h"
@@ -21,7 +27,9 @@ using arg_str_list = typename RedisClient::arg_str_list;
 using mset_init_list = typename RedisClient::mset_init_list;
 
 RedisClient::RedisClient(folly::EventBase *base, const fbstring &host, int port)
-  : base_(base), host_(host), port_(port) {}
+  : base_(base), host_(host), port_(port),
+    jitterEngine_(std::random_device{}()),
+    stats_(stats::StatsRegistry::createShared()) {}
 
 
 RedisClient::RedisClient(RedisClient &&other)
@@ -29,9 +37,25 @@ RedisClient::RedisClient(RedisClient &&other)
     host_(other.host_),
     port_(other.port_),
     redisContext_(other.redisContext_),
+    subscribedChannel_(std::move(other.subscribedChannel_)),
     connectPromise_(std::move(other.connectPromise_)),
-    disconnectPromise_(std::move(other.disconnectPromise_)) {
+    disconnectPromise_(std::move(other.disconnectPromise_)),
+    reconnectPolicy_(other.reconnectPolicy_),
+    stateCallback_(std::move(other.stateCallback_)),
+    reconnectAttempt_(other.reconnectAttempt_),
+    jitterEngine_(std::move(other.jitterEngine_)),
+    pendingRequests_(std::move(other.pendingRequests_)),
+    admissionControllers_(std::move(other.admissionControllers_)),
+    admissionWaiters_(std::move(other.admissionWaiters_)),
+    stats_(std::move(other.stats_)),
+    tracer_(std::move(other.tracer_)),
+    compressor_(std::move(other.compressor_)) {
+  state_.store(other.state_.load());
+  reconnectCount_.store(other.reconnectCount_.load());
   other.redisContext_ = nullptr;
+  if (redisContext_) {
+    redisContext_->data = (void*) this;
+  }
 }
 
 RedisClient& RedisClient::operator=(RedisClient &&other) {
@@ -39,8 +63,31 @@ RedisClient& RedisClient::operator=(RedisClient &&other) {
   std::swap(host_, other.host_);
   std::swap(port_, other.port_);
   std::swap(redisContext_, other.redisContext_);
+  std::swap(subscribedChannel_, other.subscribedChannel_);
   std::swap(connectPromise_, other.connectPromise_);
   std::swap(disconnectPromise_, other.disconnectPromise_);
+  std::swap(reconnectPolicy_, other.reconnectPolicy_);
+  std::swap(stateCallback_, other.stateCallback_);
+  std::swap(reconnectAttempt_, other.reconnectAttempt_);
+  std::swap(jitterEngine_, other.jitterEngine_);
+  std::swap(pendingRequests_, other.pendingRequests_);
+  std::swap(admissionControllers_, other.admissionControllers_);
+  std::swap(admissionWaiters_, other.admissionWaiters_);
+  std::swap(stats_, other.stats_);
+  std::swap(tracer_, other.tracer_);
+  std::swap(compressor_, other.compressor_);
+  auto selfState = state_.load();
+  state_.store(other.state_.load());
+  other.state_.store(selfState);
+  auto selfCount = reconnectCount_.load();
+  reconnectCount_.store(other.reconnectCount_.load());
+  other.reconnectCount_.store(selfCount);
+  if (redisContext_) {
+    redisContext_->data = (void*) this;
+  }
+  if (other.redisContext_) {
+    other.redisContext_->data = (void*) &other;
+  }
   return *this;
 }
 
@@ -49,15 +96,112 @@ std::shared_ptr<RedisClient> RedisClient::createShared(folly::EventBase *base,
   return std::make_shared<RedisClient>(RedisClient(base, host, port));
 }
 
-RedisClient::connect_future_t RedisClient::connect() {
-  CHECK(!redisContext_);
-  redisContext_ = redisAsyncConnect(host_.c_str(), port_);
-  if (redisContext_->err) {
-    folly::Try<shared_ptr<RedisClient>> errResult {
-      folly::make_exception_wrapper<RedisIOError>(redisContext_->errstr)
+void RedisClient::setReconnectPolicy(const ReconnectPolicy &policy) {
+  reconnectPolicy_ = policy;
+}
+
+const ReconnectPolicy& RedisClient::getReconnectPolicy() const {
+  return reconnectPolicy_;
+}
+
+RedisClient::ConnectionState RedisClient::getConnectionState() const {
+  return state_.load(std::memory_order_acquire);
+}
+
+bool RedisClient::isConnected() const {
+  return getConnectionState() == ConnectionState::CONNECTED;
+}
+
+folly::EventBase* RedisClient::getEventBase() const {
+  return base_;
+}
+
+size_t RedisClient::getReconnectCount() const {
+  return reconnectCount_.load(std::memory_order_relaxed);
+}
+
+size_t RedisClient::getPendingRequestCount() const {
+  return pendingRequests_.size();
+}
+
+void RedisClient::setConnectionStateCallback(state_callback_t callback) {
+  stateCallback_ = std::move(callback);
+}
+
+void RedisClient::addAdmissionController(
+    std::shared_ptr<AdmissionController> controller) {
+  admissionControllers_.push_back(std::move(controller));
+}
+
+size_t RedisClient::getAdmissionWaitingCount() const {
+  return admissionWaiters_.size();
+}
+
+void RedisClient::setStatsRegistry(
+    std::shared_ptr<stats::StatsRegistry> registry) {
+  stats_ = std::move(registry);
+}
+
+std::shared_ptr<stats::StatsRegistry> RedisClient::getStatsRegistry() const {
+  return stats_;
+}
+
+stats::StatsSnapshot RedisClient::getStats() {
+  if (!stats_) {
+    return stats::StatsSnapshot {};
+  }
+  return stats_->getStats();
+}
+
+void RedisClient::setRequestTracer(std::shared_ptr<RequestTracer> tracer) {
+  tracer_ = std::move(tracer);
+}
+
+std::shared_ptr<RequestTracer> RedisClient::getRequestTracer() const {
+  return tracer_;
+}
+
+void RedisClient::setValueCompressor(
+    std::shared_ptr<compression::ValueCompressor> compressor) {
+  compressor_ = std::move(compressor);
+}
+
+std::shared_ptr<compression::ValueCompressor>
+    RedisClient::getValueCompressor() const {
+  return compressor_;
+}
+
+void RedisClient::setState(ConnectionState state) {
+  auto previous = state_.exchange(state, std::memory_order_acq_rel);
+  if (previous != state) {
+    VLOG(1) << "redis client " << host_ << ":" << port_ << " "
+            << detail::stringOfConnectionState(previous) << " -> "
+            << detail::stringOfConnectionState(state);
+    if (stateCallback_) {
+      stateCallback_(state);
+    }
+  }
+}
+
+folly::Try<folly::Unit> RedisClient::startConnecting() {
+  DCHECK(!redisContext_);
+  auto context = redisAsyncConnect(host_.c_str(), port_);
+  if (!context) {
+    return folly::Try<folly::Unit> {
+      folly::make_exception_wrapper<RedisIOError>(
+        "redisAsyncConnect() could not allocate a context."
+      )
     };
-    return folly::makeFuture(errResult);
   }
+  if (context->err) {
+    folly::Try<folly::Unit> result {
+      folly::make_exception_wrapper<RedisIOError>(context->errstr)
+    };
+    redisAsyncFree(context);
+    return result;
+  }
+  context->data = (void*) this;
+  redisContext_ = context;
   hiredis_adapter::fredisLibeventAttach(
     this, redisContext_, base_->getLibeventBase()
   );
@@ -65,58 +209,439 @@ RedisClient::connect_future_t RedisClient::connect() {
     &RedisClient::hiredisConnectCallback);
   redisAsyncSetDisconnectCallback(redisContext_,
     &RedisClient::hiredisDisconnectCallback);
+  return folly::Try<folly::Unit> {folly::Unit {}};
+}
+
+RedisClient::connect_future_t RedisClient::connect() {
+  CHECK(!redisContext_);
+  auto started = startConnecting();
+  if (started.hasException()) {
+    folly::Try<shared_ptr<RedisClient>> errResult {
+      std::move(started.exception())
+    };
+    return folly::makeFuture(errResult);
+  }
+  setState(ConnectionState::CONNECTING);
   return connectPromise_.getFuture();
 }
 
 RedisClient::disconnect_future_t RedisClient::disconnect() {
-  CHECK(!!redisContext_);
+  auto state = getConnectionState();
+  if (state == ConnectionState::CLOSING || state == ConnectionState::CLOSED) {
+    // only the first call's future tracks the close itself.
+    disconnect_promise_t closed;
+    closed.setValue(folly::Try<folly::Unit> {folly::Unit {}});
+    return closed.getFuture();
+  }
+  if (!redisContext_ || state == ConnectionState::RECONNECTING) {
+    // there is no established connection to close (the initial connect
+    // failed, or we are between reconnect attempts or gave up on them);
+    // just stop trying.
+    setState(ConnectionState::CLOSED);
+    if (redisContext_) {
+      auto context = redisContext_;
+      redisContext_ = nullptr;
+      context->data = nullptr;
+      redisAsyncFree(context);
+    }
+    failPendingRequests("client was disconnected");
+    failAdmissionWaiters("client was disconnected");
+    disconnectPromise_.setValue(folly::Try<folly::Unit> {folly::Unit {}});
+    return disconnectPromise_.getFuture();
+  }
+  setState(ConnectionState::CLOSING);
   redisAsyncDisconnect(redisContext_);
   return disconnectPromise_.getFuture();
 }
 
+namespace {
+
+// leaves `out` as it was if the command can't be formatted.
+template<typename ...Args>
+void appendFormattedCommand(fbstring &out, const char *format,
+    Args... args) {
+  char *target = nullptr;
+  int len = redisFormatCommand(&target, format, args...);
+  if (len < 0 || !target) {
+    return;
+  }
+  out.append(target, (size_t) len);
+  redisFreeCommand(target);
+}
+
+} // anonymous namespace
+
+template<typename ...Args>
+RedisClient::response_future_t RedisClient::formattedCommand(
+    const char *format, Args... args) {
+  return encodedCommand(detail::commandNameOfFormat(format),
+    [&](fbstring &out) {
+      appendFormattedCommand(out, format, args...);
+    });
+}
+
+RedisClient::response_future_t RedisClient::commandArgv(
+    const std::vector<folly::StringPiece> &args) {
+  DCHECK(!args.empty());
+  return encodedCommand(args.front(), [&args](fbstring &out) {
+    detail::appendCommandArgv(out, args);
+  });
+}
+
+RedisClient::response_future_t RedisClient::commandArgv(
+    const std::vector<folly::StringPiece> &args, const folly::IOBuf &lastArg) {
+  DCHECK(!args.empty());
+  return encodedCommand(args.front(), [&args, &lastArg](fbstring &out) {
+    detail::appendCommandArgv(out, args, &lastArg);
+  });
+}
+
+void RedisClient::commandArgvWithCallback(
+    const std::vector<folly::StringPiece> &args, completion_fn_t complete,
+    void *target) {
+  DCHECK(!args.empty());
+  encodedCommandWithCallback(args.front(), [&args](fbstring &out) {
+    detail::appendCommandArgv(out, args);
+  }, complete, target);
+}
+
 RedisClient::response_future_t RedisClient::command0(cmd_str_ref cmd) {
-  auto reqCtx = new RedisRequestContext {shared_from_this()};
-  redisAsyncCommand(redisContext_,
-    &RedisClient::hiredisCommandCallback,
-    (void*) reqCtx,
-    cmd.c_str()
-  );
-  return reqCtx->getFuture();
+  return formattedCommand(cmd.c_str());
 }
 
 RedisClient::response_future_t RedisClient::command1(cmd_str_ref cmd,
     arg_str_ref arg) {
-  auto reqCtx = new RedisRequestContext {shared_from_this()};
-  redisAsyncCommand(redisContext_,
-    &RedisClient::hiredisCommandCallback,
-    (void*) reqCtx,
-    cmd.c_str(), arg.c_str()
-  );
-  return reqCtx->getFuture();
+  return formattedCommand(cmd.c_str(), arg.c_str());
 }
 
 RedisClient::response_future_t RedisClient::command2(cmd_str_ref cmd,
     arg_str_ref arg1, arg_str_ref arg2) {
-  auto reqCtx = new RedisRequestContext {shared_from_this()};
-  redisAsyncCommand(redisContext_,
-    &RedisClient::hiredisCommandCallback,
-    (void*) reqCtx,
-    cmd.c_str(), arg1.c_str(), arg2.c_str()
-  );
-  return reqCtx->getFuture();
+  return formattedCommand(cmd.c_str(), arg1.c_str(), arg2.c_str());
 }
 
 RedisClient::response_future_t RedisClient::command2(cmd_str_ref cmd,
     arg_str_ref arg1, redis_signed_t arg2) {
-  auto reqCtx = new RedisRequestContext {shared_from_this()};
-  redisAsyncCommand(redisContext_,
+  return formattedCommand(cmd.c_str(), arg1.c_str(), arg2);
+}
+
+RedisClient::response_future_t RedisClient::submit(
+    RedisRequestContext *reqCtx) {
+  auto future = reqCtx->getFuture();
+  submitRequest(reqCtx);
+  return future;
+}
+
+void RedisClient::submitRequest(RedisRequestContext *reqCtx) {
+  if (reqCtx->getEncodedCommand().empty()) {
+    reqCtx->setException(folly::make_exception_wrapper<RedisProtocolError>(
+      "Failed to encode redis command."
+    ));
+    releaseRequest(reqCtx);
+    return;
+  }
+  if (!admissionControllers_.empty()) {
+    // a freed slot belongs to the oldest waiter, so that commands still
+    // reach the connection in the order they were sent.
+    if (!admissionWaiters_.empty()) {
+      queueForAdmission(reqCtx, admissionWaiters_.back().waitTimeout);
+      return;
+    }
+    auto blocker = tryAdmit(reqCtx);
+    if (blocker) {
+      waitForAdmission(reqCtx, blocker);
+      return;
+    }
+  }
+  dispatchRequest(reqCtx);
+}
+
+void RedisClient::dispatchRequest(RedisRequestContext *reqCtx) {
+  switch (getConnectionState()) {
+    case ConnectionState::CONNECTING:
+    case ConnectionState::CONNECTED:
+      writeRequest(reqCtx);
+      break;
+    case ConnectionState::RECONNECTING:
+      if (!enqueueRequest(reqCtx)) {
+        reqCtx->setException(folly::make_exception_wrapper<RedisQueueFull>(
+          "Reconnect queue is full."
+        ));
+        releaseRequest(reqCtx);
+      }
+      break;
+    default:
+      reqCtx->setException(folly::make_exception_wrapper<RedisNotConnected>(
+        "Redis client is not connected."
+      ));
+      releaseRequest(reqCtx);
+      break;
+  }
+}
+
+AdmissionController* RedisClient::tryAdmit(RedisRequestContext *reqCtx) {
+  size_t bytes = reqCtx->getEncodedCommand().size();
+  for (size_t i = 0; i < admissionControllers_.size(); i++) {
+    if (!admissionControllers_[i]->tryAcquire(bytes)) {
+      for (size_t j = 0; j < i; j++) {
+        admissionControllers_[j]->cancel(bytes);
+      }
+      return admissionControllers_[i].get();
+    }
+  }
+  reqCtx->markAdmitted();
+  return nullptr;
+}
+
+void RedisClient::waitForAdmission(RedisRequestContext *reqCtx,
+    AdmissionController *blocker) {
+  const auto &policy = blocker->getPolicy();
+  if (policy.mode != AdmissionPolicy::Mode::WAIT) {
+    rejectAdmission(reqCtx);
+    return;
+  }
+  queueForAdmission(reqCtx, policy.waitTimeout);
+  registerAdmissionWakeup(blocker);
+}
+
+void RedisClient::queueForAdmission(RedisRequestContext *reqCtx,
+    AdmissionPolicy::duration_t waitTimeout) {
+  admissionWaiters_.push_back(AdmissionWaiter {
+    reqCtx, std::chrono::steady_clock::now() + waitTimeout, waitTimeout
+  });
+  std::weak_ptr<RedisClient> weakSelf = shared_from_this();
+  base_->runAfterDelay([weakSelf]() {
+    auto self = weakSelf.lock();
+    if (self) {
+      self->drainAdmissionWaiters();
+    }
+  }, waitTimeout.count() + 1);
+}
+
+void RedisClient::rejectAdmission(RedisRequestContext *reqCtx) {
+  reqCtx->setException(folly::make_exception_wrapper<RedisOverloaded>(
+    "Request rejected by admission control."
+  ));
+  releaseRequest(reqCtx);
+}
+
+void RedisClient::registerAdmissionWakeup(AdmissionController *blocker) {
+  std::weak_ptr<RedisClient> weakSelf = shared_from_this();
+  blocker->notifyWhenAvailable(base_, [weakSelf]() {
+    auto self = weakSelf.lock();
+    if (self) {
+      self->drainAdmissionWaiters();
+    }
+  });
+}
+
+void RedisClient::drainAdmissionWaiters() {
+  expireAdmissionWaiters();
+  while (!admissionWaiters_.empty()) {
+    auto reqCtx = admissionWaiters_.front().reqCtx;
+    auto blocker = tryAdmit(reqCtx);
+    if (blocker &&
+        blocker->getPolicy().mode == AdmissionPolicy::Mode::WAIT) {
+      registerAdmissionWakeup(blocker);
+      break;
+    }
+    // a request queued behind the waiters can still be turned away by a
+    // controller that doesn't wait.
+    admissionWaiters_.pop_front();
+    if (blocker) {
+      rejectAdmission(reqCtx);
+      continue;
+    }
+    dispatchRequest(reqCtx);
+  }
+}
+
+void RedisClient::expireAdmissionWaiters() {
+  auto now = std::chrono::steady_clock::now();
+  // failing a request can run continuations that send (and queue) new
+  // commands, so sort the waiters out before failing any of them.
+  std::deque<AdmissionWaiter> waiters;
+  std::swap(waiters, admissionWaiters_);
+  std::deque<AdmissionWaiter> expired;
+  for (auto &waiter: waiters) {
+    if (waiter.deadline > now) {
+      admissionWaiters_.push_back(waiter);
+    } else {
+      expired.push_back(waiter);
+    }
+  }
+  for (auto &waiter: expired) {
+    waiter.reqCtx->markTimedOut();
+    waiter.reqCtx->setException(folly::make_exception_wrapper<RedisOverloaded>(
+      "Timed out waiting for admission."
+    ));
+    releaseRequest(waiter.reqCtx);
+  }
+}
+
+void RedisClient::failAdmissionWaiters(const fbstring &reason) {
+  std::deque<AdmissionWaiter> toFail;
+  std::swap(toFail, admissionWaiters_);
+  for (auto &waiter: toFail) {
+    waiter.reqCtx->setException(
+      folly::make_exception_wrapper<RedisNotConnected>(reason.toStdString())
+    );
+    releaseRequest(waiter.reqCtx);
+  }
+}
+
+void RedisClient::releaseAdmission(size_t bytes,
+    std::chrono::microseconds latency, bool succeeded) {
+  for (auto &controller: admissionControllers_) {
+    controller->release(bytes, latency, succeeded);
+  }
+}
+
+RedisRequestContext* RedisClient::acquireRequest(
+    folly::StringPiece commandName) {
+  bool idempotent = detail::isIdempotentCommand(commandName);
+  if (requestPool_.empty()) {
+    return new RedisRequestContext {
+      shared_from_this(), commandName.fbstr(), fbstring {}, idempotent
+    };
+  }
+  auto reqCtx = requestPool_.back();
+  requestPool_.pop_back();
+  reqCtx->reuse(shared_from_this(), commandName, idempotent);
+  return reqCtx;
+}
+
+void RedisClient::releaseRequest(RedisRequestContext *reqCtx) {
+  // the context's reference may be the last one; hold on to the client
+  // until its pool has been dealt with.
+  auto client = reqCtx->getClient();
+  client->finishRequest(*reqCtx);
+  reqCtx->recycle();
+  if (client->requestPool_.size() < kMaxPooledRequests) {
+    client->requestPool_.push_back(reqCtx);
+  } else {
+    delete reqCtx;
+  }
+}
+
+void RedisClient::finishRequest(RedisRequestContext &reqCtx) {
+  if (!reqCtx.isAdmitted() && !stats_ && !reqCtx.getTrace()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (reqCtx.getTrace() && tracer_) {
+    auto trace = reqCtx.releaseTrace();
+    if (trace->fulfilled == RequestTrace::time_point {}) {
+      trace->fulfilled = now;
+    }
+    trace->failed = reqCtx.hasFailed() || reqCtx.isErrorReply();
+    trace->responseBytes = reqCtx.getResponseBytes();
+    tracer_->finish(std::move(*trace));
+  }
+  if (reqCtx.isAdmitted()) {
+    releaseAdmission(reqCtx.getEncodedCommand().size(),
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        now - reqCtx.getAdmittedAt()
+      ),
+      !reqCtx.hasFailed()
+    );
+  }
+  if (stats_) {
+    auto outcome = stats::Outcome::SUCCESS;
+    if (reqCtx.isTimedOut()) {
+      outcome = stats::Outcome::TIMEOUT;
+    } else if (reqCtx.hasFailed() || reqCtx.isErrorReply()) {
+      outcome = stats::Outcome::ERROR;
+    }
+    stats_->record(
+      reqCtx.getCommandName(),
+      std::chrono::duration_cast<std::chrono::microseconds>(
+        now - reqCtx.getCreatedAt()
+      ),
+      outcome,
+      reqCtx.wasWritten() ? reqCtx.getEncodedCommand().size() : 0,
+      reqCtx.getResponseBytes()
+    );
+  }
+}
+
+void RedisClient::writeRequest(RedisRequestContext *reqCtx) {
+  DCHECK(!!redisContext_);
+  reqCtx->markWritten();
+  if (reqCtx->getTrace()) {
+    unflushedTraced_.push_back(reqCtx);
+  }
+  const auto &encoded = reqCtx->getEncodedCommand();
+  int rc = redisAsyncFormattedCommand(redisContext_,
     &RedisClient::hiredisCommandCallback,
     (void*) reqCtx,
-    cmd.c_str(), arg1.c_str(), arg2
+    encoded.data(), encoded.size()
+  );
+  if (rc != REDIS_OK) {
+    // hiredis refuses new commands once the context is being torn down.
+    handleCommandDropped(reqCtx);
+  }
+}
+
+bool RedisClient::enqueueRequest(RedisRequestContext *reqCtx) {
+  if (pendingRequests_.size() >= reconnectPolicy_.maxQueuedRequests) {
+    return false;
+  }
+  pendingRequests_.push_back(reqCtx);
+  return true;
+}
+
+void RedisClient::flushPendingRequests() {
+  std::deque<RedisRequestContext*> toWrite;
+  std::swap(toWrite, pendingRequests_);
+  for (auto reqCtx: toWrite) {
+    writeRequest(reqCtx);
+  }
+}
+
+void RedisClient::failPendingRequests(const fbstring &reason) {
+  std::deque<RedisRequestContext*> toFail;
+  std::swap(toFail, pendingRequests_);
+  for (auto reqCtx: toFail) {
+    reqCtx->setException(
+      folly::make_exception_wrapper<RedisNotConnected>(reason.toStdString())
+    );
+    releaseRequest(reqCtx);
+  }
+}
+
+void RedisClient::scheduleReconnect() {
+  if (reconnectPolicy_.shouldGiveUp(reconnectAttempt_)) {
+    LOG(WARNING) << "giving up reconnecting to redis at " << host_ << ":"
+                 << port_ << " after " << reconnectAttempt_ << " attempts.";
+    setState(ConnectionState::DISCONNECTED);
+    failPendingRequests("gave up reconnecting to redis");
+    return;
+  }
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  auto delay = reconnectPolicy_.backoffForAttempt(
+    reconnectAttempt_, unit(jitterEngine_)
   );
-  return reqCtx->getFuture();
+  reconnectAttempt_++;
+  std::weak_ptr<RedisClient> weakSelf = shared_from_this();
+  base_->runAfterDelay([weakSelf]() {
+    auto self = weakSelf.lock();
+    if (self) {
+      self->attemptReconnect();
+    }
+  }, delay.count());
 }
 
+void RedisClient::attemptReconnect() {
+  if (getConnectionState() != ConnectionState::RECONNECTING) {
+    return;
+  }
+  auto started = startConnecting();
+  if (started.hasException()) {
+    LOG(INFO) << "redis reconnect attempt failed: '"
+              << started.exception().what() << "'";
+    scheduleReconnect();
+  }
+}
 
 RedisClient::response_future_t RedisClient::get(arg_str_ref key) {
   return command1("GET %s", key);
@@ -136,6 +661,9 @@ RedisClient::response_future_t RedisClient::expire(arg_str_ref key,
 }
 
 RedisClient::response_future_t RedisClient::set(arg_str_ref key, arg_str_ref val) {
+  if (compressor_) {
+    return commandArgv({"SET", key, compressor_->encode(key, val)});
+  }
   return command2("SET %s %s", key, val);
 }
 
@@ -150,6 +678,21 @@ RedisClient::response_future_t RedisClient::mset(mset_init_list&& msetList) {
   return mset(toMset);
 }
 
+RedisClient::response_future_t RedisClient::msetCompressed(
+    const mset_list &pairs) {
+  std::vector<fbstring> encodedValues;
+  encodedValues.reserve(pairs.size());
+  std::vector<folly::StringPiece> args {"MSET"};
+  for (const auto &keyVal: pairs) {
+    encodedValues.push_back(compressor_->encode(keyVal.first, keyVal.second));
+  }
+  for (size_t i = 0; i < pairs.size(); i++) {
+    args.push_back(pairs[i].first);
+    args.push_back(encodedValues[i]);
+  }
+  return commandArgv(args);
+}
+
 RedisClient::response_future_t RedisClient::mget(mget_init_list&& mgetList) {
   folly::fbvector<arg_str_t> toMget{
     std::forward<mget_init_list>(mgetList)
@@ -194,6 +737,21 @@ RedisClient::response_future_t RedisClient::llen(arg_str_ref key) {
   return command1("LLEN %s", key);
 }
 
+RedisClient::response_future_t RedisClient::rangeCommand(
+    folly::StringPiece commandName, arg_str_ref key, redis_signed_t start,
+    redis_signed_t stop, bool withScores) {
+  return encodedCommand(commandName, [&](fbstring &out) {
+    detail::appendRespArrayHeader(out, withScores ? 5 : 4);
+    detail::appendRespBulk(out, commandName);
+    detail::appendRespBulk(out, key);
+    detail::appendRespEncoded(out, start);
+    detail::appendRespEncoded(out, stop);
+    if (withScores) {
+      detail::appendRespBulk(out, "WITHSCORES");
+    }
+  });
+}
+
 RedisClient::response_future_t RedisClient::strlen(arg_str_ref key) {
   return command1("STRLEN %s", key);
 }
@@ -209,6 +767,7 @@ subscription_try_t RedisClient::subscribe(subscription_handler_ptr_t handler,
     std::forward<subscription_handler_ptr_t>(handler)
   );
   currentSubscription_ = subscription;
+  subscribedChannel_ = channel;
   redisAsyncCommand(
     redisContext_,
     &RedisClient::hiredisSubscriptionCallback,
@@ -220,40 +779,187 @@ subscription_try_t RedisClient::subscribe(subscription_handler_ptr_t handler,
 
 void RedisClient::hiredisConnectCallback(const redisAsyncContext *ac, int status) {
   auto clientPtr = detail::getClientFromContext(ac);
-  clientPtr->handleConnected(status);
+  if (clientPtr) {
+    clientPtr->handleConnected(status);
+  }
 }
 
 void RedisClient::hiredisDisconnectCallback(const redisAsyncContext *ac, int status) {
   auto clientPtr = detail::getClientFromContext(ac);
-  clientPtr->handleDisconnected(status);
+  if (clientPtr) {
+    clientPtr->handleDisconnected(status);
+  }
 }
 
 void RedisClient::hiredisCommandCallback(redisAsyncContext *ac, void *reply, void *pdata) {
   auto clientPtr = detail::getClientFromContext(ac);
   auto reqCtx = (RedisRequestContext*) pdata;
+  if (!clientPtr) {
+    // the owning client is being destroyed.
+    reqCtx->setException(folly::make_exception_wrapper<RedisConnectionLost>(
+      "Redis client was destroyed."
+    ));
+    releaseRequest(reqCtx);
+    return;
+  }
+  if (!reply) {
+    // hiredis flushes in-flight callbacks with a null reply
+    // when the connection goes away.
+    clientPtr->handleCommandDropped(reqCtx);
+    return;
+  }
   auto bareReply = (redisReply*) reply;
+  auto trace = reqCtx->getTrace();
+  if (trace) {
+    trace->parsed = std::chrono::steady_clock::now();
+    trace->firstByteRead = clientPtr->pendingFirstByteAt_;
+    // if more bytes are already buffered they arrived with the read event
+    // that's being processed; otherwise the next reply's first byte
+    // hasn't arrived yet.
+    auto reader = ac->c.reader;
+    if (reader && reader->pos < reader->len) {
+      clientPtr->pendingFirstByteAt_ = clientPtr->lastReadEventAt_;
+    } else {
+      clientPtr->pendingFirstByteAt_ = RequestTrace::time_point {};
+    }
+  }
+  reqCtx->setResponseBytes(
+    detail::estimateReplyBytes(bareReply),
+    bareReply->type == REDIS_REPLY_ERROR
+  );
+  if (clientPtr->compressor_ &&
+      detail::repliesWithValues(reqCtx->getCommandName())) {
+    auto decoded = detail::decompressReply(*clientPtr->compressor_, bareReply);
+    if (decoded.hasException()) {
+      reqCtx->setException(decoded.exception());
+      releaseRequest(reqCtx);
+      return;
+    }
+  }
   clientPtr->handleCommandResponse(reqCtx, RedisDynamicResponse {bareReply});
 }
 
 void RedisClient::hiredisSubscriptionCallback(redisAsyncContext *ac, void *reply, void*) {
   auto clientPtr = detail::getClientFromContext(ac);
+  if (!clientPtr || !reply) {
+    return;
+  }
   auto bareReply = (redisReply*) reply;
   clientPtr->handleSubscriptionEvent(RedisDynamicResponse {bareReply});
 }
 
 void RedisClient::handleConnected(int status) {
-  CHECK(status == REDIS_OK);
+  auto state = getConnectionState();
+  if (status != REDIS_OK) {
+    fbstring errMsg = redisContext_ ? redisContext_->errstr : "connect failed";
+    // hiredis frees the context itself once this callback returns.
+    redisContext_ = nullptr;
+    if (state == ConnectionState::RECONNECTING) {
+      LOG(INFO) << "redis reconnect attempt failed: '" << errMsg << "'";
+      scheduleReconnect();
+      return;
+    }
+    setState(ConnectionState::DISCONNECTED);
+    connectPromise_.setValue(folly::Try<shared_ptr<RedisClient>> {
+      folly::make_exception_wrapper<RedisIOError>(errMsg.toStdString())
+    });
+    return;
+  }
+  reconnectAttempt_ = 0;
+  setState(ConnectionState::CONNECTED);
+  if (state == ConnectionState::RECONNECTING) {
+    reconnectCount_.fetch_add(1, std::memory_order_relaxed);
+    if (currentSubscription_.lock()) {
+      redisAsyncCommand(
+        redisContext_,
+        &RedisClient::hiredisSubscriptionCallback,
+        nullptr,
+        "SUBSCRIBE %s", subscribedChannel_.c_str()
+      );
+    }
+    flushPendingRequests();
+    return;
+  }
   auto selfPtr = shared_from_this();
   connectPromise_.setValue(folly::Try<decltype(selfPtr)> {selfPtr});
 }
 
 void RedisClient::handleCommandResponse(RedisRequestContext *ctx, RedisDynamicResponse &&response) {
   ctx->setValue(std::forward<RedisDynamicResponse>(response));
+  auto trace = ctx->getTrace();
+  if (trace) {
+    // continuations attached to the future have run inline by now.
+    trace->fulfilled = std::chrono::steady_clock::now();
+  }
+  releaseRequest(ctx);
+}
+
+void RedisClient::noteReadEvent() {
+  if (!tracer_) {
+    return;
+  }
+  lastReadEventAt_ = std::chrono::steady_clock::now();
+  if (pendingFirstByteAt_ == RequestTrace::time_point {}) {
+    pendingFirstByteAt_ = lastReadEventAt_;
+  }
+}
+
+void RedisClient::noteWriteFlushed() {
+  if (unflushedTraced_.empty()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  for (auto reqCtx: unflushedTraced_) {
+    reqCtx->getTrace()->writeFlushed = now;
+  }
+  unflushedTraced_.clear();
+}
+
+void RedisClient::handleCommandDropped(RedisRequestContext *ctx) {
+  if (ctx->getTrace()) {
+    unflushedTraced_.erase(
+      std::remove(unflushedTraced_.begin(), unflushedTraced_.end(), ctx),
+      unflushedTraced_.end()
+    );
+  }
+  auto state = getConnectionState();
+  bool recovering = reconnectPolicy_.enabled && (
+    state == ConnectionState::CONNECTED ||
+    state == ConnectionState::RECONNECTING
+  );
+  // a dropped idempotent command can safely be written again once
+  // we've reconnected. anything else may or may not have been applied,
+  // so the caller has to decide.
+  if (recovering && ctx->isIdempotent() && enqueueRequest(ctx)) {
+    return;
+  }
+  ctx->setException(folly::make_exception_wrapper<RedisConnectionLost>(
+    "Connection to redis was lost before a reply arrived."
+  ));
+  releaseRequest(ctx);
 }
 
 void RedisClient::handleDisconnected(int status) {
-  CHECK(status == REDIS_OK);
-  disconnectPromise_.setValue(folly::Try<folly::Unit> {folly::Unit {}});
+  // hiredis frees the context itself once this callback returns.
+  redisContext_ = nullptr;
+  unflushedTraced_.clear();
+  pendingFirstByteAt_ = RequestTrace::time_point {};
+  if (getConnectionState() == ConnectionState::CLOSING) {
+    setState(ConnectionState::CLOSED);
+    failPendingRequests("client was disconnected");
+    failAdmissionWaiters("client was disconnected");
+    disconnectPromise_.setValue(folly::Try<folly::Unit> {folly::Unit {}});
+    return;
+  }
+  LOG(WARNING) << "lost connection to redis at " << host_ << ":" << port_
+               << " (status " << status << ")";
+  if (!reconnectPolicy_.enabled) {
+    setState(ConnectionState::DISCONNECTED);
+    failPendingRequests("connection to redis was lost");
+    return;
+  }
+  setState(ConnectionState::RECONNECTING);
+  scheduleReconnect();
 }
 
 void RedisClient::handleSubscriptionEvent(RedisDynamicResponse&& response) {
@@ -265,17 +971,204 @@ void RedisClient::handleSubscriptionEvent(RedisDynamicResponse&& response) {
 
 RedisClient::~RedisClient() {
   if (redisContext_) {
-    delete redisContext_;
+    // detach first: hiredis may still fire callbacks while tearing down.
+    redisContext_->data = nullptr;
+    redisAsyncFree(redisContext_);
     redisContext_ = nullptr;
   }
+  for (auto reqCtx: requestPool_) {
+    delete reqCtx;
+  }
 }
 
 namespace detail {
 RedisClient* getClientFromContext(const redisAsyncContext *ctx) {
-  auto evData = (hiredis_adapter::fredisLibeventEvents*) ctx->ev.data;
-  return evData->client;
+  // the libevent adapter's data is freed before hiredis runs the disconnect
+  // callback, so the client pointer lives on the context itself.
+  return (RedisClient*) ctx->data;
 }
+
+folly::StringPiece commandNameOfFormat(const char *format) {
+  folly::StringPiece formatPiece {format};
+  auto spaceIdx = formatPiece.find(' ');
+  if (spaceIdx == folly::StringPiece::npos) {
+    return formatPiece;
+  }
+  return formatPiece.subpiece(0, spaceIdx);
 }
 
-}} // fredis::redis
+// commands that can be written again after a reconnect: applying them
+// twice leaves the same data behind and gets the same reply back. DEL,
+// PERSIST and the HSET/SADD/ZADD family are left out since a replay
+// reports different counts than the original would have.
+bool isIdempotentCommand(folly::StringPiece commandName) {
+  static const std::unordered_set<folly::StringPiece, folly::StringPieceHash>
+      kIdempotentCommands {
+    "GET", "MGET", "SET", "MSET", "EXISTS", "EXPIRE", "KEYS", "STRLEN",
+    "LLEN", "TTL", "PTTL", "TYPE", "GETRANGE", "SETEX", "PSETEX", "HGET",
+    "HMGET", "HGETALL", "HLEN", "HMSET", "SMEMBERS", "SCARD", "SISMEMBER",
+    "LRANGE", "LINDEX", "ZRANGE", "ZSCORE", "ZCARD", "PING", "ECHO"
+  };
+  // names are looked up upper-cased; none of the listed ones is long.
+  char upper[16];
+  if (commandName.size() > sizeof(upper)) {
+    return false;
+  }
+  for (size_t i = 0; i < commandName.size(); i++) {
+    upper[i] = (char) toupper((unsigned char) commandName[i]);
+  }
+  return kIdempotentCommands.count(
+    folly::StringPiece {upper, commandName.size()}
+  ) > 0;
+}
+
+bool repliesWithValues(folly::StringPiece commandName) {
+  return commandName.equals("GET", folly::AsciiCaseInsensitive()) ||
+    commandName.equals("MGET", folly::AsciiCaseInsensitive());
+}
+
+void appendRespArrayHeader(fbstring &out, size_t nElements) {
+  out.push_back('*');
+  folly::toAppend(nElements, &out);
+  out.append("\r\n");
+}
+
+void appendRespBulk(fbstring &out, folly::StringPiece arg) {
+  out.push_back('$');
+  folly::toAppend(arg.size(), &out);
+  out.append("\r\n");
+  out.append(arg.data(), arg.size());
+  out.append("\r\n");
+}
 
+folly::fbvector<RedisDynamicResponse> elementsOfArrayReply(
+    RedisDynamicResponse &response) {
+  using ResponseType = RedisDynamicResponse::ResponseType;
+  if (response.isType(ResponseType::ERROR)) {
+    throw RedisError(response.getErrorString().value().str());
+  }
+  if (!response.isType(ResponseType::ARRAY)) {
+    throw RedisTypeError("expected an array reply");
+  }
+  return std::move(response.getArray().value());
+}
+
+void appendCommandArgv(fbstring &out,
+    const std::vector<folly::StringPiece> &args,
+    const folly::IOBuf *lastArg) {
+  size_t lastArgLength = lastArg ? lastArg->computeChainDataLength() : 0;
+  size_t expectedSize = 16 + lastArgLength;
+  for (const auto &arg: args) {
+    expectedSize += arg.size() + 16;
+  }
+  out.reserve(out.size() + expectedSize);
+  appendRespArrayHeader(out, args.size() + (lastArg ? 1 : 0));
+  for (const auto &arg: args) {
+    appendRespBulk(out, arg);
+  }
+  if (lastArg) {
+    out.push_back('$');
+    folly::toAppend(lastArgLength, &out);
+    out.append("\r\n");
+    for (const auto &segment: *lastArg) {
+      out.append((const char*) segment.data(), segment.size());
+    }
+    out.append("\r\n");
+  }
+}
+
+fbstring encodeCommandArgv(const std::vector<folly::StringPiece> &args,
+    const folly::IOBuf *lastArg) {
+  fbstring encoded;
+  appendCommandArgv(encoded, args, lastArg);
+  return encoded;
+}
+
+static size_t digitsOf(size_t n) {
+  size_t digits = 1;
+  while (n >= 10) {
+    n /= 10;
+    digits++;
+  }
+  return digits;
+}
+
+size_t estimateReplyBytes(const redisReply *reply) {
+  // each RESP element is a type byte, a payload and a trailing CRLF.
+  switch (reply->type) {
+    case REDIS_REPLY_STRING:
+      return 1 + digitsOf(reply->len) + 2 + reply->len + 2;
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+      return 1 + reply->len + 2;
+    case REDIS_REPLY_INTEGER:
+      return 1 + 20 + 2;
+    case REDIS_REPLY_NIL:
+      return 5;
+    case REDIS_REPLY_ARRAY: {
+      size_t total = 1 + digitsOf(reply->elements) + 2;
+      for (size_t i = 0; i < reply->elements; i++) {
+        total += estimateReplyBytes(reply->element[i]);
+      }
+      return total;
+    }
+    default:
+      return 0;
+  }
+}
+
+using ConnectionState = RedisClient::ConnectionState;
+
+const char* stringOfConnectionState(ConnectionState state) {
+  switch (state) {
+    case ConnectionState::DISCONNECTED:
+      return "DISCONNECTED";
+    case ConnectionState::CONNECTING:
+      return "CONNECTING";
+    case ConnectionState::CONNECTED:
+      return "CONNECTED";
+    case ConnectionState::RECONNECTING:
+      return "RECONNECTING";
+    case ConnectionState::CLOSING:
+      return "CLOSING";
+    case ConnectionState::CLOSED:
+      return "CLOSED";
+  }
+  return "UNKNOWN";
+}
+
+folly::Try<folly::Unit> decompressReply(
+    compression::ValueCompressor &compressor, redisReply *reply) {
+  if (reply->type == REDIS_REPLY_ARRAY) {
+    for (size_t i = 0; i < reply->elements; i++) {
+      auto decoded = decompressReply(compressor, reply->element[i]);
+      if (decoded.hasException()) {
+        return decoded;
+      }
+    }
+    return folly::Try<folly::Unit> {folly::Unit {}};
+  }
+  if (reply->type != REDIS_REPLY_STRING) {
+    return folly::Try<folly::Unit> {folly::Unit {}};
+  }
+  folly::StringPiece stored {reply->str, (size_t) reply->len};
+  if (!compressor.isEncoded(stored)) {
+    return folly::Try<folly::Unit> {folly::Unit {}};
+  }
+  auto decoded = compressor.decode(stored);
+  if (decoded.hasException()) {
+    return folly::Try<folly::Unit> {decoded.exception()};
+  }
+  // hiredis frees reply strings with free().
+  const auto &value = decoded.value();
+  auto replacement = (char*) malloc(value.size() + 1);
+  memcpy(replacement, value.data(), value.size());
+  replacement[value.size()] = '\0';
+  free(reply->str);
+  reply->str = replacement;
+  reply->len = value.size();
+  return folly::Try<folly::Unit> {folly::Unit {}};
+}
+} // detail
+
+}} // fredis::redis
@@ -0,0 +1,66 @@
+#include "fredis/redis/RedisCoroutines.h"
+#if FREDIS_HAVE_COROUTINES
+
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+
+namespace fredis { namespace redis {
+
+using ResponseType = RedisDynamicResponse::ResponseType;
+
+namespace detail {
+
+namespace {
+
+void throwIfError(RedisDynamicResponse &response) {
+  if (response.isType(ResponseType::ERROR)) {
+    throw RedisError(response.getErrorString().value().str());
+  }
+}
+
+}
+
+int64_t IntegerReplyDecoder::operator()(
+    RedisDynamicResponse &response) const {
+  throwIfError(response);
+  return response.getInt().value();
+}
+
+bool StatusReplyDecoder::operator()(RedisDynamicResponse &response) const {
+  throwIfError(response);
+  return !response.isNil();
+}
+
+folly::Optional<std::string> StringReplyDecoder::operator()(
+    RedisDynamicResponse &response) const {
+  throwIfError(response);
+  if (response.isNil()) {
+    return folly::none;
+  }
+  return response.getString().value().str();
+}
+
+fbstring encodeArgs(std::initializer_list<StringPiece> args) {
+  fbstring encoded;
+  appendRespArrayHeader(encoded, args.size());
+  for (auto arg: args) {
+    appendRespBulk(encoded, arg);
+  }
+  return encoded;
+}
+
+} // detail
+
+RedisCoroClient::RedisCoroClient(shared_ptr<RedisClient> client)
+  : client_(client) {}
+
+RedisClient* RedisCoroClient::getClient() const {
+  return client_.get();
+}
+
+}} // fredis::redis
+
+#endif // FREDIS_HAVE_COROUTINES
@@ -0,0 +1,450 @@
+#include "fredis/redis/RedisQueueConsumer.h"
+#include <algorithm>
+#include <folly/Conv.h>
+#include <folly/Optional.h>
+#include "fredis/folly_util/folly_util.h"
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::Try;
+using folly::Unit;
+
+namespace fredis { namespace redis {
+
+using response_t = RedisClient::response_t;
+using ResponseType = RedisDynamicResponse::ResponseType;
+using job_list_t = std::vector<fbstring>;
+
+namespace {
+
+void throwIfError(response_t &reply) {
+  if (reply.isType(ResponseType::ERROR)) {
+    throw RedisError(reply.getErrorString().value().str());
+  }
+}
+
+// BLMPOP: nil on timeout, else [key, [job, ...]].
+job_list_t jobsOfMultiPopReply(response_t &reply) {
+  throwIfError(reply);
+  job_list_t jobs;
+  if (reply.isNil()) {
+    return jobs;
+  }
+  auto parts = reply.getArray().value();
+  if (parts.size() != 2) {
+    throw RedisTypeError("malformed BLMPOP reply");
+  }
+  for (auto &job: parts[1].getArray().value()) {
+    jobs.push_back(job.getString().value().fbstr());
+  }
+  return jobs;
+}
+
+// BLPOP: nil on timeout, else [key, job].
+job_list_t jobsOfPopReply(response_t &reply) {
+  throwIfError(reply);
+  job_list_t jobs;
+  if (reply.isNil()) {
+    return jobs;
+  }
+  auto parts = reply.getArray().value();
+  if (parts.size() != 2) {
+    throw RedisTypeError("malformed BLPOP reply");
+  }
+  jobs.push_back(parts[1].getString().value().fbstr());
+  return jobs;
+}
+
+// (B)LMOVE: the moved job, or none.
+folly::Optional<fbstring> jobOfMoveReply(response_t &reply) {
+  throwIfError(reply);
+  if (reply.isNil()) {
+    return folly::none;
+  }
+  return reply.getString().value().fbstr();
+}
+
+}
+
+RedisQueueConsumer::RedisQueueConsumer(
+    shared_ptr<folly_util::EBThread> ebt, const fbstring &host, int port,
+    const QueueConsumerOptions &options, job_handler_t handler,
+    folly::Executor *executor)
+  : ebt_(ebt), host_(host), port_(port), options_(options),
+    handler_(std::move(handler)), executor_(executor) {
+  options_.batchSize = std::max((size_t) 1, options_.batchSize);
+  options_.minConsumers = std::max((size_t) 1, options_.minConsumers);
+  options_.maxConsumers = std::max(options_.minConsumers,
+    options_.maxConsumers);
+  options_.backlogPerConsumer = std::max((size_t) 1,
+    options_.backlogPerConsumer);
+  options_.maxInFlightJobs = std::max((size_t) 1, options_.maxInFlightJobs);
+}
+
+shared_ptr<RedisQueueConsumer> RedisQueueConsumer::createShared(
+    shared_ptr<folly_util::EBThread> ebt, const fbstring &host, int port,
+    const QueueConsumerOptions &options, job_handler_t handler,
+    folly::Executor *executor) {
+  return shared_ptr<RedisQueueConsumer>(new RedisQueueConsumer(
+    ebt, host, port, options, std::move(handler), executor
+  ));
+}
+
+void RedisQueueConsumer::setErrorHandler(error_handler_t handler) {
+  errorHandler_ = std::move(handler);
+}
+
+bool RedisQueueConsumer::isReliable() const {
+  return !options_.processingList.empty();
+}
+
+folly::Future<Unit> RedisQueueConsumer::start() {
+  auto started = std::make_shared<folly::Promise<Unit>>();
+  auto future = started->getFuture();
+  auto self = shared_from_this();
+  ebt_->runInEventBaseThread([self, started]() {
+    self->startInLoop(started);
+  });
+  return future;
+}
+
+void RedisQueueConsumer::startInLoop(
+    shared_ptr<folly::Promise<Unit>> started) {
+  if (running_) {
+    started->setException(RedisError("queue consumer is already running"));
+    return;
+  }
+  running_ = true;
+  stopping_ = false;
+  control_ = RedisClient::createShared(ebt_->getBase(), host_, port_);
+  auto self = shared_from_this();
+  control_->connect().then([self, started](
+      Try<shared_ptr<RedisClient>> connected) {
+    if (connected.hasException()) {
+      self->running_ = false;
+      started->setException(connected.exception());
+      return;
+    }
+    auto begin = [self, started]() {
+      for (size_t i = 0; i < self->options_.minConsumers; i++) {
+        self->spawnWorker();
+      }
+      self->scheduleScaling();
+      started->setValue(Unit {});
+    };
+    if (self->isReliable() && self->options_.recoverOnStart) {
+      self->recoverProcessing(begin);
+    } else {
+      begin();
+    }
+  });
+}
+
+void RedisQueueConsumer::recoverProcessing(std::function<void ()> then) {
+  // tail of the processing list to the head of the queue, one at a time,
+  // which puts the jobs back in their original order.
+  auto self = shared_from_this();
+  control_->commandArgv({
+    "LMOVE", options_.processingList, options_.queue, "RIGHT", "LEFT"
+  }).then([self, then](Try<response_t> result) {
+    folly::Optional<fbstring> moved;
+    try {
+      moved = jobOfMoveReply(result.value());
+    } catch (const std::exception &ex) {
+      self->reportError(folly::exception_wrapper(std::current_exception(), ex));
+    }
+    if (!moved.hasValue()) {
+      then();
+      return;
+    }
+    self->stats_.recovered++;
+    self->recoverProcessing(then);
+  });
+}
+
+void RedisQueueConsumer::spawnWorker() {
+  auto worker = std::make_shared<Worker>();
+  worker->client = RedisClient::createShared(ebt_->getBase(), host_, port_);
+  workers_.push_back(worker);
+  auto self = shared_from_this();
+  worker->client->connect().then([self, worker](
+      Try<shared_ptr<RedisClient>> connected) {
+    if (connected.hasException()) {
+      self->reportError(connected.exception());
+      self->retire(worker);
+      return;
+    }
+    self->popNext(worker);
+  });
+}
+
+void RedisQueueConsumer::retire(shared_ptr<Worker> worker) {
+  auto found = std::find(workers_.begin(), workers_.end(), worker);
+  if (found == workers_.end()) {
+    return;
+  }
+  workers_.erase(found);
+  paused_.erase(std::remove(paused_.begin(), paused_.end(), worker),
+    paused_.end());
+  auto client = worker->client;
+  client->disconnect().then([client](Try<Unit>) {});
+  maybeFinishStopping();
+}
+
+void RedisQueueConsumer::popNext(shared_ptr<Worker> worker) {
+  if (stopping_ || worker->retiring) {
+    retire(worker);
+    return;
+  }
+  size_t used = inFlightJobs_ + reservedJobs_;
+  if (used >= options_.maxInFlightJobs) {
+    paused_.push_back(worker);
+    return;
+  }
+  size_t batchSize = std::min(options_.batchSize,
+    options_.maxInFlightJobs - used);
+  reservedJobs_ += batchSize;
+  auto self = shared_from_this();
+  auto timeout = folly::to<fbstring>(options_.blockTimeout.count() / 1000.0);
+  auto &client = worker->client;
+  folly::Future<job_list_t> popped = folly::makeFuture(job_list_t {});
+  if (isReliable()) {
+    // the blocking move waits for the first job; the moves pipelined
+    // behind it pick up the rest of the batch as soon as it returns.
+    std::vector<folly::Future<folly::Optional<fbstring>>> moves;
+    moves.push_back(client->commandArgv({
+      "BLMOVE", options_.queue, options_.processingList, "LEFT", "RIGHT",
+      timeout
+    }).then([](response_t reply) {
+      return jobOfMoveReply(reply);
+    }));
+    for (size_t i = 1; i < batchSize; i++) {
+      moves.push_back(client->commandArgv({
+        "LMOVE", options_.queue, options_.processingList, "LEFT", "RIGHT"
+      }).then([](response_t reply) {
+        return jobOfMoveReply(reply);
+      }));
+    }
+    popped = folly::collectAll(moves).then([self](
+        std::vector<Try<folly::Optional<fbstring>>> results) -> job_list_t {
+      job_list_t jobs;
+      folly::exception_wrapper error;
+      for (auto &result: results) {
+        if (result.hasException()) {
+          error = result.exception();
+        } else if (result.value().hasValue()) {
+          jobs.push_back(std::move(result.value().value()));
+        }
+      }
+      if (error && jobs.empty()) {
+        error.throwException();
+      }
+      if (error) {
+        // the jobs that did move still have to run.
+        self->reportError(error);
+      }
+      return jobs;
+    });
+  } else if (options_.useLmpop) {
+    popped = client->commandArgv({
+      "BLMPOP", timeout, "1", options_.queue, "LEFT",
+      "COUNT", folly::to<fbstring>(batchSize)
+    }).then([](response_t reply) {
+      return jobsOfMultiPopReply(reply);
+    });
+  } else {
+    popped = client->commandArgv({"BLPOP", options_.queue, timeout})
+      .then([](response_t reply) {
+        return jobsOfPopReply(reply);
+      });
+  }
+  popped.then([self, worker, batchSize](Try<job_list_t> jobs) {
+    self->onPopped(worker, batchSize, std::move(jobs));
+  });
+}
+
+void RedisQueueConsumer::onPopped(shared_ptr<Worker> worker,
+    size_t reserved, Try<job_list_t> &&jobs) {
+  reservedJobs_ -= reserved;
+  if (jobs.hasException()) {
+    stats_.popFailures++;
+    reportError(jobs.exception());
+    if (stopping_ || worker->retiring) {
+      retire(worker);
+      return;
+    }
+    std::weak_ptr<RedisQueueConsumer> weakSelf = shared_from_this();
+    ebt_->getBase()->runAfterDelay([weakSelf, worker]() {
+      auto self = weakSelf.lock();
+      if (self) {
+        self->popNext(worker);
+      }
+    }, options_.retryDelay.count());
+    return;
+  }
+  stats_.popped += jobs.value().size();
+  for (const auto &job: jobs.value()) {
+    runJob(job);
+  }
+  if (jobs.value().size() < reserved) {
+    // slots this pop didn't fill may let paused workers go again.
+    resumePaused();
+  }
+  popNext(worker);
+}
+
+void RedisQueueConsumer::resumePaused() {
+  std::vector<shared_ptr<Worker>> paused;
+  paused.swap(paused_);
+  for (auto &worker: paused) {
+    popNext(worker);
+  }
+}
+
+void RedisQueueConsumer::runJob(const fbstring &job) {
+  inFlightJobs_++;
+  auto self = shared_from_this();
+  auto run = [self, job]() {
+    folly::exception_wrapper error;
+    try {
+      self->handler_(job);
+    } catch (const std::exception &ex) {
+      error = folly::exception_wrapper(std::current_exception(), ex);
+    }
+    self->ebt_->runInEventBaseThread([self, job, error]() {
+      self->finishJob(job, error);
+    });
+  };
+  if (executor_) {
+    executor_->add(run);
+  } else {
+    run();
+  }
+}
+
+void RedisQueueConsumer::finishJob(const fbstring &job,
+    folly::exception_wrapper error) {
+  inFlightJobs_--;
+  if (error) {
+    stats_.failed++;
+    reportError(error);
+    if (options_.requeueFailed) {
+      stats_.requeued++;
+      control_->commandArgv({"RPUSH", options_.queue, job});
+    }
+  } else {
+    stats_.completed++;
+  }
+  if (isReliable()) {
+    // after any requeue, so a crash in between duplicates the job rather
+    // than losing it.
+    control_->commandArgv({"LREM", options_.processingList, "1", job});
+  }
+  resumePaused();
+  maybeFinishStopping();
+}
+
+void RedisQueueConsumer::scheduleScaling() {
+  if (stopping_ || options_.scaleInterval.count() <= 0 ||
+      options_.minConsumers == options_.maxConsumers) {
+    return;
+  }
+  std::weak_ptr<RedisQueueConsumer> weakSelf = shared_from_this();
+  ebt_->getBase()->runAfterDelay([weakSelf]() {
+    auto self = weakSelf.lock();
+    if (!self || self->stopping_) {
+      return;
+    }
+    self->control_->commandArgv({"LLEN", self->options_.queue})
+      .then([self](Try<response_t> result) {
+        if (result.hasException()) {
+          self->reportError(result.exception());
+        } else if (result.value().isType(ResponseType::INTEGER)) {
+          self->rescale(result.value().getInt().value());
+        }
+        self->scheduleScaling();
+      });
+  }, options_.scaleInterval.count());
+}
+
+void RedisQueueConsumer::rescale(size_t backlog) {
+  if (stopping_) {
+    return;
+  }
+  size_t wanted = (backlog + options_.backlogPerConsumer - 1)
+    / options_.backlogPerConsumer;
+  wanted = std::min(options_.maxConsumers,
+    std::max(options_.minConsumers, wanted));
+  size_t active = 0;
+  for (const auto &worker: workers_) {
+    active += worker->retiring ? 0 : 1;
+  }
+  for (; active < wanted; active++) {
+    spawnWorker();
+  }
+  // the newest go first; each finishes its current pop before leaving.
+  for (auto it = workers_.rbegin(); it != workers_.rend(); ++it) {
+    if (active <= wanted) {
+      break;
+    }
+    if (!(*it)->retiring) {
+      (*it)->retiring = true;
+      active--;
+    }
+  }
+}
+
+void RedisQueueConsumer::reportError(folly::exception_wrapper error) {
+  if (errorHandler_) {
+    errorHandler_(error);
+  }
+}
+
+folly::Future<Unit> RedisQueueConsumer::stop() {
+  auto stopped = std::make_shared<folly::Promise<Unit>>();
+  auto future = stopped->getFuture();
+  auto self = shared_from_this();
+  ebt_->runInEventBaseThread([self, stopped]() {
+    if (!self->running_) {
+      stopped->setValue(Unit {});
+      return;
+    }
+    self->stopping_ = true;
+    self->stopPromises_.push_back(std::move(*stopped));
+    std::vector<shared_ptr<Worker>> paused;
+    paused.swap(self->paused_);
+    for (auto &worker: paused) {
+      self->retire(worker);
+    }
+    self->maybeFinishStopping();
+  });
+  return future;
+}
+
+void RedisQueueConsumer::maybeFinishStopping() {
+  if (!stopping_ || !running_ || !workers_.empty() || inFlightJobs_ > 0) {
+    return;
+  }
+  running_ = false;
+  auto control = control_;
+  control->disconnect().then([control](Try<Unit>) {});
+  std::vector<folly::Promise<Unit>> promises;
+  promises.swap(stopPromises_);
+  for (auto &promise: promises) {
+    promise.setValue(Unit {});
+  }
+}
+
+folly::Future<QueueConsumerStats> RedisQueueConsumer::getStats() {
+  auto self = shared_from_this();
+  return folly_util::runInEventLoop<QueueConsumerStats>(ebt_->getBase(),
+    [self]() -> QueueConsumerStats {
+      auto stats = self->stats_;
+      stats.consumers = self->workers_.size();
+      return stats;
+    });
+}
+
+}} // fredis::redis
@@ -1,14 +1,192 @@
 #include "fredis/redis/RedisRequestContext.h"
+#include "fredis/redis/RedisClient.h"
 
 using namespace std;
+using folly::fbstring;
 
 namespace fredis { namespace redis {
 
-RedisRequestContext::RedisRequestContext(std::shared_ptr<RedisClient> client)
-  : client_(client){}
+using time_point = std::chrono::steady_clock::time_point;
+
+RedisRequestContext::RedisRequestContext(std::shared_ptr<RedisClient> client,
+    fbstring&& commandName, fbstring&& encodedCommand, bool idempotent)
+  : client_(client),
+    commandName_(std::forward<fbstring>(commandName)),
+    encodedCommand_(std::forward<fbstring>(encodedCommand)),
+    idempotent_(idempotent),
+    createdAt_(std::chrono::steady_clock::now()) {}
+
+RedisRequestContext::~RedisRequestContext() {
+  recycle();
+}
+
+void RedisRequestContext::reuse(std::shared_ptr<RedisClient> client,
+    folly::StringPiece commandName, bool idempotent) {
+  client_ = std::move(client);
+  commandName_.assign(commandName.data(), commandName.size());
+  encodedCommand_.clear();
+  idempotent_ = idempotent;
+  createdAt_ = std::chrono::steady_clock::now();
+}
+
+void RedisRequestContext::recycle() {
+  if (destroyCallback_) {
+    destroyCallback_(completionTarget_);
+    destroyCallback_ = nullptr;
+  }
+  complete_ = nullptr;
+  completionTarget_ = nullptr;
+  donePromise_.clear();
+  trace_.reset();
+  client_.reset();
+  written_ = false;
+  admitted_ = false;
+  failed_ = false;
+  timedOut_ = false;
+  errorReply_ = false;
+  responseBytes_ = 0;
+}
+
+fbstring& RedisRequestContext::encodedBuffer() {
+  return encodedCommand_;
+}
+
+const std::shared_ptr<RedisClient>& RedisRequestContext::getClient() const {
+  return client_;
+}
+
+const fbstring& RedisRequestContext::getCommandName() const {
+  return commandName_;
+}
+
+void RedisRequestContext::markAdmitted() {
+  admitted_ = true;
+  admittedAt_ = std::chrono::steady_clock::now();
+}
+
+void RedisRequestContext::markWritten() {
+  written_ = true;
+}
+
+void RedisRequestContext::markTimedOut() {
+  timedOut_ = true;
+}
+
+void RedisRequestContext::setResponseBytes(size_t nBytes, bool isErrorReply) {
+  responseBytes_ = nBytes;
+  errorReply_ = isErrorReply;
+}
+
+bool RedisRequestContext::isAdmitted() const {
+  return admitted_;
+}
+
+bool RedisRequestContext::wasWritten() const {
+  return written_;
+}
+
+bool RedisRequestContext::hasFailed() const {
+  return failed_;
+}
+
+bool RedisRequestContext::isTimedOut() const {
+  return timedOut_;
+}
+
+bool RedisRequestContext::isErrorReply() const {
+  return errorReply_;
+}
+
+size_t RedisRequestContext::getResponseBytes() const {
+  return responseBytes_;
+}
+
+time_point RedisRequestContext::getCreatedAt() const {
+  return createdAt_;
+}
+
+time_point RedisRequestContext::getAdmittedAt() const {
+  return admittedAt_;
+}
+
+RedisRequestContext::response_promise_t& RedisRequestContext::getPromise() {
+  if (!donePromise_.hasValue()) {
+    donePromise_.emplace();
+  }
+  return donePromise_.value();
+}
 
 RedisRequestContext::response_future_t RedisRequestContext::getFuture() {
-  return donePromise_.getFuture();
+  return getPromise().getFuture();
+}
+
+void RedisRequestContext::setCompletion(completion_fn_t complete,
+    void *target) {
+  complete_ = complete;
+  completionTarget_ = target;
+}
+
+const fbstring& RedisRequestContext::getEncodedCommand() const {
+  return encodedCommand_;
 }
 
+bool RedisRequestContext::isIdempotent() const {
+  return idempotent_;
+}
+
+void RedisRequestContext::startTrace(time_point submitted,
+    time_point started) {
+  trace_.reset(new RequestTrace);
+  trace_->command = commandName_;
+  trace_->submitted = submitted;
+  trace_->started = started;
+  trace_->encoded = std::chrono::steady_clock::now();
+  trace_->requestBytes = encodedCommand_.size();
+  trace_->keyBytes = detail::keyBytesOfEncodedCommand(encodedCommand_);
+}
+
+RequestTrace* RedisRequestContext::getTrace() const {
+  return trace_.get();
+}
+
+std::unique_ptr<RequestTrace> RedisRequestContext::releaseTrace() {
+  return std::move(trace_);
+}
+
+void RedisRequestContext::setException(folly::exception_wrapper ex) {
+  failed_ = true;
+  if (complete_) {
+    folly::Try<response_t> completed {std::move(ex)};
+    complete_(completionTarget_, completed);
+    return;
+  }
+  getPromise().setException(std::move(ex));
+}
+
+namespace detail {
+
+size_t keyBytesOfEncodedCommand(folly::StringPiece encoded) {
+  // *<argc>\r\n$<len>\r\n<command>\r\n$<len>\r\n<key>\r\n...
+  // skip the array header and the command name, then read the
+  // length of the first argument.
+  size_t pos = 0;
+  for (int crlfToSkip = 3; crlfToSkip > 0; crlfToSkip--) {
+    pos = encoded.find("\r\n", pos);
+    if (pos == folly::StringPiece::npos) {
+      return 0;
+    }
+    pos += 2;
+  }
+  if (pos >= encoded.size() || encoded[pos] != '$') {
+    return 0;
+  }
+  size_t len = 0;
+  for (pos++; pos < encoded.size() && encoded[pos] >= '0' && encoded[pos] <= '9'; pos++) {
+    len = len * 10 + (encoded[pos] - '0');
+  }
+  return len;
+}
+
+} // detail
+
 }} // fredis::redis
@@ -0,0 +1,366 @@
+#include "fredis/redis/RedisStreamConsumer.h"
+#include <algorithm>
+#include <iterator>
+#include <folly/Conv.h>
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Try;
+using folly::Unit;
+
+namespace fredis { namespace redis {
+
+using response_t = RedisClient::response_t;
+using ResponseType = RedisDynamicResponse::ResponseType;
+
+namespace {
+
+// the error carried by a failed request or an error reply, if any.
+folly::exception_wrapper errorOf(Try<response_t> &result, StringPiece context) {
+  if (result.hasException()) {
+    return result.exception();
+  }
+  if (result.value().isType(ResponseType::ERROR)) {
+    return folly::make_exception_wrapper<RedisStreamError>(
+      folly::to<std::string>(context, ": ",
+        result.value().getErrorString().value())
+    );
+  }
+  return folly::exception_wrapper {};
+}
+
+}
+
+RedisStreamConsumer::RedisStreamConsumer(
+    shared_ptr<RedisClient> readClient, shared_ptr<RedisClient> commandClient,
+    const StreamConsumerOptions &options, batch_handler_t handler)
+  : readClient_(readClient), commandClient_(commandClient),
+    options_(options), handler_(std::move(handler)) {
+  options_.batchSize = std::max((size_t) 1, options_.batchSize);
+  options_.readAhead = std::max((size_t) 1, options_.readAhead);
+  options_.maxAckBatch = std::max((size_t) 1, options_.maxAckBatch);
+}
+
+shared_ptr<RedisStreamConsumer> RedisStreamConsumer::createShared(
+    shared_ptr<RedisClient> readClient, shared_ptr<RedisClient> commandClient,
+    const StreamConsumerOptions &options, batch_handler_t handler) {
+  return shared_ptr<RedisStreamConsumer>(new RedisStreamConsumer(
+    readClient, commandClient, options, std::move(handler)
+  ));
+}
+
+void RedisStreamConsumer::setErrorHandler(error_handler_t handler) {
+  errorHandler_ = std::move(handler);
+}
+
+const StreamConsumerStats& RedisStreamConsumer::getStats() const {
+  return stats_;
+}
+
+size_t RedisStreamConsumer::getPendingAckCount() const {
+  return pendingAcks_.size();
+}
+
+folly::Future<Unit> RedisStreamConsumer::start() {
+  if (running_) {
+    return folly::makeFuture<Unit>(folly::make_exception_wrapper<
+      RedisStreamError>("stream consumer is already running"));
+  }
+  running_ = true;
+  stopping_ = false;
+  if (options_.createGroupAt.empty()) {
+    beginReading();
+    return folly::makeFuture();
+  }
+  auto self = shared_from_this();
+  return commandClient_->commandArgv({
+    "XGROUP", "CREATE", options_.stream, options_.group,
+    options_.createGroupAt, "MKSTREAM"
+  }).then([self](Try<response_t> result) {
+    auto error = errorOf(result, "creating consumer group failed");
+    // BUSYGROUP: it already exists.
+    if (error && (result.hasException() ||
+        !result.value().getErrorString().value().startsWith("BUSYGROUP"))) {
+      self->running_ = false;
+      error.throwException();
+    }
+    self->beginReading();
+  });
+}
+
+void RedisStreamConsumer::beginReading() {
+  pumpReads();
+  if (options_.claimInterval.count() > 0) {
+    claimFrom("0-0");
+  }
+}
+
+void RedisStreamConsumer::pumpReads() {
+  if (stopping_ || retryScheduled_) {
+    return;
+  }
+  auto count = folly::to<fbstring>(options_.batchSize);
+  auto block = folly::to<fbstring>(options_.blockTimeout.count());
+  while (readsInFlight_ < options_.readAhead) {
+    readsInFlight_++;
+    auto self = shared_from_this();
+    readClient_->commandArgv({
+      "XREADGROUP", "GROUP", options_.group, options_.consumer,
+      "COUNT", count, "BLOCK", block, "STREAMS", options_.stream, ">"
+    }).then([self](Try<response_t> result) {
+      self->onRead(result);
+    });
+  }
+}
+
+void RedisStreamConsumer::onRead(Try<response_t> &result) {
+  readsInFlight_--;
+  auto error = errorOf(result, "XREADGROUP failed");
+  std::vector<StreamEntry> entries;
+  if (!error) {
+    try {
+      entries = detail::parseReadGroupReply(result.value());
+    } catch (const std::exception &ex) {
+      error = folly::exception_wrapper(std::current_exception(), ex);
+    }
+  }
+  if (error) {
+    stats_.readFailures++;
+    reportError(error);
+    scheduleRetry();
+  } else {
+    // the next read goes out before this batch is handled.
+    pumpReads();
+    deliver(std::move(entries));
+  }
+  maybeFinishStopping();
+}
+
+void RedisStreamConsumer::scheduleRetry() {
+  if (stopping_ || retryScheduled_) {
+    return;
+  }
+  retryScheduled_ = true;
+  std::weak_ptr<RedisStreamConsumer> weakSelf = shared_from_this();
+  readClient_->getEventBase()->runAfterDelay([weakSelf]() {
+    auto self = weakSelf.lock();
+    if (self) {
+      self->retryScheduled_ = false;
+      self->pumpReads();
+    }
+  }, options_.retryDelay.count());
+}
+
+void RedisStreamConsumer::scheduleClaim() {
+  if (stopping_ || options_.claimInterval.count() <= 0) {
+    return;
+  }
+  std::weak_ptr<RedisStreamConsumer> weakSelf = shared_from_this();
+  commandClient_->getEventBase()->runAfterDelay([weakSelf]() {
+    auto self = weakSelf.lock();
+    if (self) {
+      self->claimFrom("0-0");
+    }
+  }, options_.claimInterval.count());
+}
+
+void RedisStreamConsumer::claimFrom(const fbstring &cursor) {
+  if (stopping_ || claimInFlight_) {
+    return;
+  }
+  claimInFlight_ = true;
+  auto self = shared_from_this();
+  commandClient_->commandArgv({
+    "XAUTOCLAIM", options_.stream, options_.group, options_.consumer,
+    folly::to<fbstring>(options_.claimMinIdle.count()), cursor,
+    "COUNT", folly::to<fbstring>(options_.batchSize)
+  }).then([self](Try<response_t> result) {
+    self->claimInFlight_ = false;
+    auto error = errorOf(result, "XAUTOCLAIM failed");
+    fbstring nextCursor;
+    std::vector<StreamEntry> entries;
+    if (!error) {
+      try {
+        // [next cursor, entries, deleted IDs (redis 7+)]
+        auto parts = result.value().getArray().value();
+        if (parts.size() < 2) {
+          throw RedisTypeError("malformed XAUTOCLAIM reply");
+        }
+        nextCursor = parts[0].getString().value().fbstr();
+        entries = detail::parseStreamEntries(parts[1]);
+      } catch (const std::exception &ex) {
+        error = folly::exception_wrapper(std::current_exception(), ex);
+      }
+    }
+    if (error) {
+      self->reportError(error);
+      self->scheduleClaim();
+    } else {
+      self->stats_.claimed += entries.size();
+      self->deliver(std::move(entries));
+      if (nextCursor != "0-0" && !self->stopping_) {
+        self->claimFrom(nextCursor);
+      } else {
+        self->scheduleClaim();
+      }
+    }
+    self->maybeFinishStopping();
+  });
+}
+
+void RedisStreamConsumer::deliver(std::vector<StreamEntry> &&entries) {
+  if (entries.empty()) {
+    return;
+  }
+  stats_.delivered += entries.size();
+  try {
+    handler_(std::move(entries));
+  } catch (const std::exception &ex) {
+    reportError(folly::exception_wrapper(std::current_exception(), ex));
+  }
+}
+
+void RedisStreamConsumer::reportError(folly::exception_wrapper error) {
+  if (errorHandler_) {
+    errorHandler_(error);
+  }
+}
+
+void RedisStreamConsumer::ack(const fbstring &id) {
+  pendingAcks_.push_back(id);
+  if (pendingAcks_.size() >= options_.maxAckBatch) {
+    flushAcks();
+  } else {
+    scheduleAckFlush();
+  }
+}
+
+void RedisStreamConsumer::scheduleAckFlush() {
+  if (ackFlushScheduled_) {
+    return;
+  }
+  ackFlushScheduled_ = true;
+  std::weak_ptr<RedisStreamConsumer> weakSelf = shared_from_this();
+  commandClient_->getEventBase()->runAfterDelay([weakSelf]() {
+    auto self = weakSelf.lock();
+    if (self) {
+      self->ackFlushScheduled_ = false;
+      self->flushAcks();
+    }
+  }, options_.ackInterval.count());
+}
+
+folly::Future<Unit> RedisStreamConsumer::flushAcks() {
+  if (pendingAcks_.empty()) {
+    return folly::makeFuture();
+  }
+  std::vector<fbstring> ids;
+  ids.swap(pendingAcks_);
+  std::vector<StringPiece> args {"XACK", options_.stream, options_.group};
+  args.insert(args.end(), ids.begin(), ids.end());
+  acksInFlight_++;
+  auto self = shared_from_this();
+  size_t count = ids.size();
+  return commandClient_->commandArgv(args)
+    .then([self, count](Try<response_t> result) {
+      self->acksInFlight_--;
+      auto error = errorOf(result, "XACK failed");
+      if (error) {
+        self->stats_.ackFailures++;
+        self->reportError(error);
+      } else {
+        self->stats_.acked += count;
+        self->stats_.ackBatches++;
+      }
+      self->maybeFinishStopping();
+      if (error) {
+        error.throwException();
+      }
+    });
+}
+
+folly::Future<Unit> RedisStreamConsumer::stop() {
+  if (!running_) {
+    return folly::makeFuture();
+  }
+  stopping_ = true;
+  stopPromises_.emplace_back();
+  auto stopped = stopPromises_.back().getFuture();
+  maybeFinishStopping();
+  return stopped;
+}
+
+void RedisStreamConsumer::maybeFinishStopping() {
+  if (!stopping_ || !running_ || readsInFlight_ > 0 || claimInFlight_) {
+    return;
+  }
+  if (!pendingAcks_.empty()) {
+    // acks made while the last batches were handled.
+    flushAcks();
+    return;
+  }
+  if (acksInFlight_ > 0) {
+    return;
+  }
+  running_ = false;
+  std::vector<folly::Promise<Unit>> promises;
+  promises.swap(stopPromises_);
+  for (auto &promise: promises) {
+    promise.setValue(Unit {});
+  }
+}
+
+namespace detail {
+
+std::vector<StreamEntry> parseStreamEntries(RedisDynamicResponse &entries) {
+  std::vector<StreamEntry> parsed;
+  for (auto &item: entries.getArray().value()) {
+    auto parts = item.getArray().value();
+    if (parts.size() != 2) {
+      throw RedisTypeError("malformed stream entry");
+    }
+    StreamEntry entry;
+    entry.id = parts[0].getString().value().fbstr();
+    if (!parts[1].isNil()) {
+      auto fields = parts[1].getArray().value();
+      if (fields.size() % 2 != 0) {
+        throw RedisTypeError("odd number of fields in stream entry");
+      }
+      for (size_t i = 0; i < fields.size(); i += 2) {
+        entry.fields.emplace_back(
+          fields[i].getString().value().fbstr(),
+          fields[i + 1].getString().value().fbstr()
+        );
+      }
+    }
+    parsed.push_back(std::move(entry));
+  }
+  return parsed;
+}
+
+std::vector<StreamEntry> parseReadGroupReply(RedisDynamicResponse &reply) {
+  if (reply.isType(ResponseType::ERROR)) {
+    throw RedisError(reply.getErrorString().value().str());
+  }
+  std::vector<StreamEntry> entries;
+  if (reply.isNil()) {
+    return entries;
+  }
+  for (auto &stream: reply.getArray().value()) {
+    auto parts = stream.getArray().value();
+    if (parts.size() != 2) {
+      throw RedisTypeError("malformed XREADGROUP reply");
+    }
+    auto streamEntries = parseStreamEntries(parts[1]);
+    std::move(streamEntries.begin(), streamEntries.end(),
+      std::back_inserter(entries));
+  }
+  return entries;
+}
+
+}
+
+}} // fredis::redis
@@ -0,0 +1,95 @@
+#include "fredis/redis/RedisStreamProducer.h"
+#include <algorithm>
+#include <folly/Conv.h>
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Try;
+
+namespace fredis { namespace redis {
+
+using response_t = RedisClient::response_t;
+using ResponseType = RedisDynamicResponse::ResponseType;
+
+RedisStreamProducer::RedisStreamProducer(shared_ptr<RedisClient> client,
+    const StreamProducerOptions &options)
+  : client_(client), options_(options) {
+  options_.maxInFlight = std::max((size_t) 1, options_.maxInFlight);
+}
+
+shared_ptr<RedisStreamProducer> RedisStreamProducer::createShared(
+    shared_ptr<RedisClient> client, const StreamProducerOptions &options) {
+  return shared_ptr<RedisStreamProducer>(
+    new RedisStreamProducer(client, options)
+  );
+}
+
+size_t RedisStreamProducer::getQueuedCount() const {
+  return queued_.size();
+}
+
+size_t RedisStreamProducer::getInFlightCount() const {
+  return inFlight_;
+}
+
+folly::Future<fbstring> RedisStreamProducer::add(
+    const stream_fields_t &fields) {
+  queued_.push_back(QueuedAdd {fields, folly::Promise<fbstring> {}});
+  auto added = queued_.back().promise.getFuture();
+  pump();
+  return added;
+}
+
+folly::Future<std::vector<fbstring>> RedisStreamProducer::addBatch(
+    const std::vector<stream_fields_t> &batch) {
+  std::vector<folly::Future<fbstring>> added;
+  added.reserve(batch.size());
+  for (const auto &fields: batch) {
+    added.push_back(add(fields));
+  }
+  return folly::collect(added);
+}
+
+void RedisStreamProducer::pump() {
+  while (inFlight_ < options_.maxInFlight && !queued_.empty()) {
+    auto next = std::move(queued_.front());
+    queued_.pop_front();
+    send(std::move(next));
+  }
+}
+
+void RedisStreamProducer::send(QueuedAdd &&add) {
+  auto maxLen = folly::to<fbstring>(options_.maxLen);
+  std::vector<StringPiece> args {"XADD", options_.stream};
+  if (options_.maxLen > 0) {
+    args.insert(args.end(), {"MAXLEN", "~", maxLen});
+  }
+  args.push_back("*");
+  for (const auto &field: add.fields) {
+    args.push_back(field.first);
+    args.push_back(field.second);
+  }
+  inFlight_++;
+  auto promise = std::make_shared<folly::Promise<fbstring>>(
+    std::move(add.promise)
+  );
+  auto self = shared_from_this();
+  client_->commandArgv(args).then([self, promise](Try<response_t> result) {
+    self->inFlight_--;
+    if (result.hasException()) {
+      promise->setException(result.exception());
+    } else if (result.value().isType(ResponseType::ERROR)) {
+      promise->setException(RedisStreamError(folly::to<std::string>(
+        "XADD failed: ", result.value().getErrorString().value()
+      )));
+    } else {
+      promise->setValue(result.value().getString().value().fbstr());
+    }
+    self->pump();
+  });
+}
+
+}} // fredis::redis
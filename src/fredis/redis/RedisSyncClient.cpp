@@ -0,0 +1,454 @@
+#include "fredis/redis/RedisSyncClient.h"
+#include <sys/time.h>
+#include <folly/Conv.h>
+#include <folly/ExceptionWrapper.h>
+#include <glog/logging.h>
+#include <hiredis/hiredis.h>
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::Try;
+using folly::Unit;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Optional;
+using folly::make_exception_wrapper;
+
+namespace fredis { namespace redis {
+
+using steady_clock_t = std::chrono::steady_clock;
+using ResponseType = RedisDynamicResponse::ResponseType;
+
+namespace detail {
+void RedisReplyDeleter::operator()(redisReply *reply) const {
+  if (reply) {
+    freeReplyObject(reply);
+  }
+}
+}
+
+OwnedRedisResponse::OwnedRedisResponse(redisReply *reply)
+  : reply_(reply), response_(reply) {}
+
+RedisDynamicResponse& OwnedRedisResponse::operator*() {
+  return response_;
+}
+
+RedisDynamicResponse* OwnedRedisResponse::operator->() {
+  return &response_;
+}
+
+namespace {
+
+struct timeval timevalOfMillis(std::chrono::milliseconds timeout) {
+  struct timeval tv;
+  tv.tv_sec = timeout.count() / 1000;
+  tv.tv_usec = (timeout.count() % 1000) * 1000;
+  return tv;
+}
+
+folly::exception_wrapper errorOfReply(RedisDynamicResponse &response) {
+  return make_exception_wrapper<RedisError>(
+    response.getErrorString().value().str()
+  );
+}
+
+// a GET-style reply: a string, or nil for a miss.
+Try<Optional<fbstring>> valueOfReply(RedisDynamicResponse &response) {
+  if (response.isType(ResponseType::ERROR)) {
+    return Try<Optional<fbstring>> {errorOfReply(response)};
+  }
+  if (response.isNil()) {
+    return Try<Optional<fbstring>> {Optional<fbstring> {}};
+  }
+  auto value = response.getString();
+  if (value.hasException()) {
+    return Try<Optional<fbstring>> {value.exception()};
+  }
+  return Try<Optional<fbstring>> {Optional<fbstring> {
+    fbstring {value.value().data(), value.value().size()}
+  }};
+}
+
+}
+
+RedisSyncClient::RedisSyncClient(const std::string &host, int port,
+    std::chrono::milliseconds timeout)
+  : host_(host), port_(port), timeout_(timeout),
+    stats_(stats::StatsRegistry::createShared()) {}
+
+RedisSyncClient::RedisSyncClient(RedisSyncClient &&other)
+  : host_(std::move(other.host_)), port_(other.port_),
+    timeout_(other.timeout_), context_(other.context_),
+    pending_(std::move(other.pending_)), stats_(std::move(other.stats_)),
+    compressor_(std::move(other.compressor_)) {
+  other.context_ = nullptr;
+}
+
+RedisSyncClient& RedisSyncClient::operator=(RedisSyncClient &&other) {
+  std::swap(host_, other.host_);
+  std::swap(port_, other.port_);
+  std::swap(timeout_, other.timeout_);
+  std::swap(context_, other.context_);
+  std::swap(pending_, other.pending_);
+  std::swap(stats_, other.stats_);
+  std::swap(compressor_, other.compressor_);
+  return *this;
+}
+
+RedisSyncClient::~RedisSyncClient() {
+  if (context_) {
+    redisFree(context_);
+  }
+}
+
+Try<Unit> RedisSyncClient::connect() {
+  if (isConnected()) {
+    return Try<Unit> {make_exception_wrapper<RedisError>(
+      "redis client already connected"
+    )};
+  }
+  if (timeout_.count() > 0) {
+    context_ = redisConnectWithTimeout(host_.c_str(), port_,
+      timevalOfMillis(timeout_));
+  } else {
+    context_ = redisConnect(host_.c_str(), port_);
+  }
+  if (!context_) {
+    return Try<Unit> {make_exception_wrapper<RedisIOError>(
+      "hiredis couldn't allocate a context"
+    )};
+  }
+  if (context_->err) {
+    Try<Unit> result {make_exception_wrapper<RedisIOError>(
+      std::string(context_->errstr)
+    )};
+    redisFree(context_);
+    context_ = nullptr;
+    return result;
+  }
+  if (timeout_.count() > 0 &&
+      redisSetTimeout(context_, timevalOfMillis(timeout_)) != REDIS_OK) {
+    Try<Unit> result {make_exception_wrapper<RedisIOError>(
+      std::string(context_->errstr)
+    )};
+    redisFree(context_);
+    context_ = nullptr;
+    return result;
+  }
+  return Try<Unit> {Unit {}};
+}
+
+void RedisSyncClient::connectExcept() {
+  connect().throwIfFailed();
+}
+
+bool RedisSyncClient::isConnected() const {
+  return !!context_;
+}
+
+void RedisSyncClient::dropConnection() {
+  if (context_) {
+    redisFree(context_);
+    context_ = nullptr;
+  }
+  for (auto &command: pending_) {
+    command.lost = true;
+  }
+}
+
+void RedisSyncClient::setStatsRegistry(
+    std::shared_ptr<stats::StatsRegistry> registry) {
+  stats_ = std::move(registry);
+}
+
+std::shared_ptr<stats::StatsRegistry>
+    RedisSyncClient::getStatsRegistry() const {
+  return stats_;
+}
+
+stats::StatsSnapshot RedisSyncClient::getStats() {
+  if (!stats_) {
+    return stats::StatsSnapshot {};
+  }
+  return stats_->getStats();
+}
+
+void RedisSyncClient::setValueCompressor(
+    std::shared_ptr<compression::ValueCompressor> compressor) {
+  compressor_ = std::move(compressor);
+}
+
+std::shared_ptr<compression::ValueCompressor>
+    RedisSyncClient::getValueCompressor() const {
+  return compressor_;
+}
+
+Try<Unit> RedisSyncClient::appendCommand(const vector<StringPiece> &args) {
+  if (args.empty()) {
+    return Try<Unit> {make_exception_wrapper<RedisError>(
+      "can't send an empty command"
+    )};
+  }
+  if (!context_) {
+    auto connected = connect();
+    if (connected.hasException()) {
+      return connected;
+    }
+  }
+  argv_.clear();
+  argvLengths_.clear();
+  PendingCommand command;
+  for (auto arg: args) {
+    argv_.push_back(arg.data());
+    argvLengths_.push_back(arg.size());
+    command.bytesOut += arg.size();
+  }
+  if (redisAppendCommandArgv(context_, argv_.size(), argv_.data(),
+      argvLengths_.data()) != REDIS_OK) {
+    return Try<Unit> {make_exception_wrapper<RedisIOError>(
+      std::string(context_->errstr)
+    )};
+  }
+  command.name = args.front().fbstr();
+  command.appendedAt = steady_clock_t::now();
+  pending_.push_back(std::move(command));
+  return Try<Unit> {Unit {}};
+}
+
+RedisSyncClient::response_result_t RedisSyncClient::getReply() {
+  if (pending_.empty()) {
+    return response_result_t {make_exception_wrapper<RedisError>(
+      "getReply() called with no commands pending"
+    )};
+  }
+  auto command = std::move(pending_.front());
+  pending_.pop_front();
+  if (command.lost) {
+    return response_result_t {make_exception_wrapper<RedisConnectionLost>(
+      "connection lost before the reply was read"
+    )};
+  }
+  auto recordAs = [this, &command](stats::Outcome outcome, size_t bytesIn) {
+    if (stats_) {
+      stats_->record(command.name,
+        std::chrono::duration_cast<std::chrono::microseconds>(
+          steady_clock_t::now() - command.appendedAt
+        ),
+        outcome, command.bytesOut, bytesIn
+      );
+    }
+  };
+  void *raw = nullptr;
+  if (redisGetReply(context_, &raw) != REDIS_OK || !raw) {
+    std::string message = context_->errstr;
+    recordAs(stats::Outcome::ERROR, 0);
+    dropConnection();
+    return response_result_t {make_exception_wrapper<RedisIOError>(message)};
+  }
+  auto reply = (redisReply*) raw;
+  OwnedRedisResponse response {reply};
+  recordAs(
+    reply->type == REDIS_REPLY_ERROR ? stats::Outcome::ERROR :
+      stats::Outcome::SUCCESS,
+    detail::estimateReplyBytes(reply)
+  );
+  if (compressor_ && detail::repliesWithValues(command.name)) {
+    auto decoded = detail::decompressReply(*compressor_, reply);
+    if (decoded.hasException()) {
+      return response_result_t {decoded.exception()};
+    }
+  }
+  return response_result_t {std::move(response)};
+}
+
+size_t RedisSyncClient::getPendingCount() const {
+  return pending_.size();
+}
+
+vector<RedisSyncClient::response_result_t> RedisSyncClient::pipeline(
+    const vector<vector<StringPiece>> &commands) {
+  vector<response_result_t> results;
+  results.reserve(commands.size());
+  // a command that couldn't be appended has no reply to wait for.
+  vector<folly::exception_wrapper> appendErrors(commands.size());
+  for (size_t i = 0; i < commands.size(); i++) {
+    auto appended = appendCommand(commands[i]);
+    if (appended.hasException()) {
+      appendErrors[i] = appended.exception();
+    }
+  }
+  for (size_t i = 0; i < commands.size(); i++) {
+    if (appendErrors[i]) {
+      results.emplace_back(appendErrors[i]);
+    } else {
+      results.push_back(getReply());
+    }
+  }
+  return results;
+}
+
+RedisSyncClient::response_result_t RedisSyncClient::command(
+    const vector<StringPiece> &args) {
+  if (!pending_.empty()) {
+    return response_result_t {make_exception_wrapper<RedisError>(
+      "command() called with appended replies still unread"
+    )};
+  }
+  auto appended = appendCommand(args);
+  if (appended.hasException()) {
+    return response_result_t {appended.exception()};
+  }
+  return getReply();
+}
+
+RedisSyncClient::get_result_t RedisSyncClient::get(StringPiece key) {
+  auto response = command({"GET", key});
+  if (response.hasException()) {
+    return get_result_t {response.exception()};
+  }
+  return valueOfReply(*response.value());
+}
+
+RedisSyncClient::set_result_t RedisSyncClient::set(StringPiece key,
+    StringPiece value, time_t ttl) {
+  fbstring encoded;
+  if (compressor_) {
+    encoded = compressor_->encode(key, value);
+    value = encoded;
+  }
+  vector<StringPiece> args {"SET", key, value};
+  auto ttlStr = folly::to<fbstring>(ttl);
+  if (ttl > 0) {
+    args.push_back("EX");
+    args.push_back(ttlStr);
+  }
+  auto response = command(args);
+  if (response.hasException()) {
+    return set_result_t {response.exception()};
+  }
+  if (response.value()->isType(ResponseType::ERROR)) {
+    return set_result_t {errorOfReply(*response.value())};
+  }
+  return set_result_t {Unit {}};
+}
+
+Try<bool> RedisSyncClient::del(StringPiece key) {
+  auto response = command({"DEL", key});
+  if (response.hasException()) {
+    return Try<bool> {response.exception()};
+  }
+  if (response.value()->isType(ResponseType::ERROR)) {
+    return Try<bool> {errorOfReply(*response.value())};
+  }
+  auto deleted = response.value()->getInt();
+  if (deleted.hasException()) {
+    return Try<bool> {deleted.exception()};
+  }
+  return Try<bool> {deleted.value() > 0};
+}
+
+Try<int64_t> RedisSyncClient::incrBy(StringPiece key, int64_t delta) {
+  auto deltaStr = folly::to<fbstring>(delta);
+  auto response = command({"INCRBY", key, deltaStr});
+  if (response.hasException()) {
+    return Try<int64_t> {response.exception()};
+  }
+  if (response.value()->isType(ResponseType::ERROR)) {
+    return Try<int64_t> {errorOfReply(*response.value())};
+  }
+  return response.value()->getInt();
+}
+
+RedisSyncClient::set_result_t RedisSyncClient::setMany(
+    const vector<pair<fbstring, fbstring>> &pairs, time_t ttl) {
+  if (!pending_.empty()) {
+    return set_result_t {make_exception_wrapper<RedisError>(
+      "setMany() called with appended replies still unread"
+    )};
+  }
+  auto ttlStr = folly::to<fbstring>(ttl);
+  folly::exception_wrapper firstError;
+  for (size_t start = 0; start < pairs.size(); start += kMaxPipelineDepth) {
+    size_t end = start + kMaxPipelineDepth;
+    if (end > pairs.size()) {
+      end = pairs.size();
+    }
+    size_t appended = 0;
+    for (size_t i = start; i < end; i++) {
+      StringPiece value = pairs[i].second;
+      fbstring encoded;
+      if (compressor_) {
+        encoded = compressor_->encode(pairs[i].first, value);
+        value = encoded;
+      }
+      vector<StringPiece> args {"SET", pairs[i].first, value};
+      if (ttl > 0) {
+        args.push_back("EX");
+        args.push_back(ttlStr);
+      }
+      auto sent = appendCommand(args);
+      if (sent.hasException()) {
+        if (!firstError) {
+          firstError = sent.exception();
+        }
+        break;
+      }
+      appended++;
+    }
+    for (size_t i = 0; i < appended; i++) {
+      auto reply = getReply();
+      if (firstError) {
+        continue;
+      }
+      if (reply.hasException()) {
+        firstError = reply.exception();
+      } else if (reply.value()->isType(ResponseType::ERROR)) {
+        firstError = errorOfReply(*reply.value());
+      }
+    }
+    if (firstError) {
+      return set_result_t {firstError};
+    }
+  }
+  return set_result_t {Unit {}};
+}
+
+Try<vector<Optional<fbstring>>> RedisSyncClient::getMany(
+    const vector<fbstring> &keys) {
+  using result_t = Try<vector<Optional<fbstring>>>;
+  vector<Optional<fbstring>> values;
+  values.reserve(keys.size());
+  for (size_t start = 0; start < keys.size(); start += kMaxPipelineDepth) {
+    size_t end = start + kMaxPipelineDepth;
+    if (end > keys.size()) {
+      end = keys.size();
+    }
+    vector<StringPiece> args {"MGET"};
+    for (size_t i = start; i < end; i++) {
+      args.push_back(keys[i]);
+    }
+    auto response = command(args);
+    if (response.hasException()) {
+      return result_t {response.exception()};
+    }
+    if (response.value()->isType(ResponseType::ERROR)) {
+      return result_t {errorOfReply(*response.value())};
+    }
+    auto elements = response.value()->getArray();
+    if (elements.hasException()) {
+      return result_t {elements.exception()};
+    }
+    for (auto &element: elements.value()) {
+      auto value = valueOfReply(element);
+      if (value.hasException()) {
+        return result_t {value.exception()};
+      }
+      values.push_back(std::move(value.value()));
+    }
+  }
+  return result_t {std::move(values)};
+}
+
+}} // fredis::redis
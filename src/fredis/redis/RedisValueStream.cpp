@@ -0,0 +1,373 @@
+#include "fredis/redis/RedisValueStream.h"
+#include <algorithm>
+#include <map>
+#include <random>
+#include <folly/Conv.h>
+#include <folly/ExceptionWrapper.h>
+#include <folly/io/Cursor.h>
+#include <glog/logging.h>
+#include "fredis/redis/RedisClient.h"
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::IOBuf;
+using folly::StringPiece;
+using folly::Try;
+using folly::Unit;
+
+namespace fredis { namespace redis {
+
+using response_t = RedisClient::response_t;
+using ResponseType = RedisDynamicResponse::ResponseType;
+using arg_str_ref = RedisClient::arg_str_ref;
+
+namespace {
+
+// true (and `error` set) if the request failed or redis replied with an error.
+bool failedResponse(Try<response_t> &result, StringPiece context,
+    folly::exception_wrapper &error) {
+  if (result.hasException()) {
+    error = result.exception();
+    return true;
+  }
+  if (result.value().isType(ResponseType::ERROR)) {
+    error = folly::make_exception_wrapper<RedisStreamError>(
+      folly::to<std::string>(context, ": ",
+        result.value().getErrorString().value())
+    );
+    return true;
+  }
+  return false;
+}
+
+fbstring makeTempKey(arg_str_ref key) {
+  static thread_local std::mt19937_64 engine {std::random_device{}()};
+  return folly::to<fbstring>(key, ":fredis-stream-tmp:", engine());
+}
+
+// writes chunks into a temporary key with APPEND, then renames it into place.
+class StreamWriter: public std::enable_shared_from_this<StreamWriter> {
+ protected:
+  std::shared_ptr<RedisClient> client_;
+  fbstring key_;
+  fbstring tempKey_;
+  StreamOptions options_;
+  chunk_producer_t producer_;
+  folly::Promise<Unit> done_;
+  size_t inFlight_ {0};
+  bool exhausted_ {false};
+  bool committing_ {false};
+  bool finished_ {false};
+
+  void pump() {
+    while (!finished_ && !exhausted_ && inFlight_ < options_.parallelism) {
+      std::unique_ptr<IOBuf> chunk;
+      try {
+        chunk = producer_();
+      } catch (const std::exception &ex) {
+        fail(folly::exception_wrapper(std::current_exception(), ex));
+        return;
+      }
+      if (!chunk) {
+        exhausted_ = true;
+        break;
+      }
+      if (chunk->computeChainDataLength() == 0) {
+        continue;
+      }
+      inFlight_++;
+      auto self = shared_from_this();
+      client_->commandArgv({"APPEND", tempKey_}, *chunk)
+        .then([self](Try<response_t> result) {
+          self->onChunkWritten(result);
+        });
+    }
+    if (!finished_ && !committing_ && exhausted_ && inFlight_ == 0) {
+      commit();
+    }
+  }
+
+  void onChunkWritten(Try<response_t> &result) {
+    inFlight_--;
+    folly::exception_wrapper error;
+    if (failedResponse(result, "streamed write failed", error)) {
+      fail(error);
+      return;
+    }
+    pump();
+  }
+
+  void commit() {
+    committing_ = true;
+    auto self = shared_from_this();
+    // a rename carries the temporary key's TTL along, so drop it in the
+    // same transaction: the live key must never end up expiring.
+    client_->commandArgv({"MULTI"});
+    client_->commandArgv({"PERSIST", tempKey_});
+    client_->commandArgv({"RENAME", tempKey_, key_});
+    client_->commandArgv({"EXEC"})
+      .then([self](Try<response_t> result) {
+        folly::exception_wrapper error;
+        if (failedResponse(result, "committing streamed value failed",
+            error)) {
+          self->fail(error);
+          return;
+        }
+        auto &replies = result.value();
+        if (!replies.isType(ResponseType::ARRAY)) {
+          self->fail(folly::make_exception_wrapper<RedisStreamError>(
+            "committing streamed value failed: transaction was aborted"
+          ));
+          return;
+        }
+        for (auto &reply: replies.getArray().value()) {
+          if (reply.isType(ResponseType::ERROR)) {
+            self->fail(folly::make_exception_wrapper<RedisStreamError>(
+              folly::to<std::string>("committing streamed value failed: ",
+                reply.getErrorString().value())
+            ));
+            return;
+          }
+        }
+        self->finished_ = true;
+        self->done_.setValue(Unit {});
+      });
+  }
+
+  void fail(folly::exception_wrapper error) {
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    client_->commandArgv({"DEL", tempKey_});
+    done_.setException(error);
+  }
+
+ public:
+  StreamWriter(std::shared_ptr<RedisClient> client, arg_str_ref key,
+      chunk_producer_t &&producer, const StreamOptions &options)
+    : client_(client), key_(key), tempKey_(makeTempKey(key)),
+      options_(options), producer_(std::move(producer)) {
+    options_.parallelism = std::max((size_t) 1, options_.parallelism);
+  }
+
+  folly::Future<Unit> start() {
+    auto future = done_.getFuture();
+    auto ttl = folly::to<fbstring>(options_.tempKeyTtl.count());
+    inFlight_++;
+    auto self = shared_from_this();
+    client_->commandArgv({"SET", tempKey_, "", "PX", ttl})
+      .then([self](Try<response_t> result) {
+        self->onChunkWritten(result);
+      });
+    pump();
+    return future;
+  }
+};
+
+// fetches GETRANGE chunks, possibly out of order, and feeds them to the
+// sink in order.
+class StreamReader: public std::enable_shared_from_this<StreamReader> {
+ protected:
+  std::shared_ptr<RedisClient> client_;
+  fbstring key_;
+  StreamOptions options_;
+  chunk_sink_t sink_;
+  folly::Promise<folly::Optional<size_t>> done_;
+  size_t length_ {0};
+  size_t nextOffset_ {0};
+  size_t deliveredBytes_ {0};
+  size_t inFlight_ {0};
+  std::map<size_t, std::unique_ptr<IOBuf>> arrived_;
+  bool finished_ {false};
+
+  void onLength(Try<response_t> &result) {
+    folly::exception_wrapper error;
+    if (failedResponse(result, "STRLEN failed", error)) {
+      fail(error);
+      return;
+    }
+    auto length = result.value().getInt();
+    if (length.hasException()) {
+      fail(length.exception());
+      return;
+    }
+    length_ = length.value();
+    if (length_ > 0) {
+      pump();
+      return;
+    }
+    // STRLEN can't tell a missing key from an empty value.
+    auto self = shared_from_this();
+    client_->commandArgv({"EXISTS", key_})
+      .then([self](Try<response_t> exists) {
+        folly::exception_wrapper existsError;
+        if (failedResponse(exists, "EXISTS failed", existsError)) {
+          self->fail(existsError);
+          return;
+        }
+        self->finished_ = true;
+        if (exists.value().getInt().value() == 0) {
+          self->done_.setValue(folly::Optional<size_t> {});
+        } else {
+          self->done_.setValue(folly::Optional<size_t> {0});
+        }
+      });
+  }
+
+  void pump() {
+    while (!finished_ && inFlight_ < options_.parallelism
+        && nextOffset_ < length_) {
+      size_t offset = nextOffset_;
+      size_t size = std::min(options_.chunkSize, length_ - offset);
+      nextOffset_ += size;
+      inFlight_++;
+      auto self = shared_from_this();
+      client_->commandArgv({
+        "GETRANGE", key_,
+        folly::to<fbstring>(offset), folly::to<fbstring>(offset + size - 1)
+      }).then([self, offset, size](Try<response_t> result) {
+        self->onChunk(result, offset, size);
+      });
+    }
+  }
+
+  void onChunk(Try<response_t> &result, size_t offset, size_t size) {
+    inFlight_--;
+    if (finished_) {
+      return;
+    }
+    folly::exception_wrapper error;
+    if (failedResponse(result, "GETRANGE failed", error)) {
+      fail(error);
+      return;
+    }
+    auto piece = result.value().getString();
+    if (piece.hasException()) {
+      fail(piece.exception());
+      return;
+    }
+    if (piece.value().size() != size) {
+      fail(folly::make_exception_wrapper<RedisStreamError>(
+        "value changed length while it was being read"
+      ));
+      return;
+    }
+    arrived_[offset] = IOBuf::copyBuffer(piece.value().data(), size);
+    deliver();
+    pump();
+  }
+
+  void deliver() {
+    while (!finished_ && !arrived_.empty()
+        && arrived_.begin()->first == deliveredBytes_) {
+      auto chunk = std::move(arrived_.begin()->second);
+      arrived_.erase(arrived_.begin());
+      deliveredBytes_ += chunk->length();
+      try {
+        sink_(std::move(chunk));
+      } catch (const std::exception &ex) {
+        fail(folly::exception_wrapper(std::current_exception(), ex));
+        return;
+      }
+    }
+    if (!finished_ && deliveredBytes_ == length_) {
+      finished_ = true;
+      done_.setValue(folly::Optional<size_t> {length_});
+    }
+  }
+
+  void fail(folly::exception_wrapper error) {
+    if (finished_) {
+      return;
+    }
+    finished_ = true;
+    arrived_.clear();
+    done_.setException(error);
+  }
+
+ public:
+  StreamReader(std::shared_ptr<RedisClient> client, arg_str_ref key,
+      chunk_sink_t &&sink, const StreamOptions &options)
+    : client_(client), key_(key), options_(options), sink_(std::move(sink)) {
+    options_.chunkSize = std::max((size_t) 1, options_.chunkSize);
+    options_.parallelism = std::max((size_t) 1, options_.parallelism);
+  }
+
+  folly::Future<folly::Optional<size_t>> start() {
+    auto future = done_.getFuture();
+    auto self = shared_from_this();
+    client_->commandArgv({"STRLEN", key_})
+      .then([self](Try<response_t> result) {
+        self->onLength(result);
+      });
+    return future;
+  }
+};
+
+} // anonymous namespace
+
+folly::Future<Unit> RedisClient::setStreaming(arg_str_ref key,
+    std::unique_ptr<IOBuf> value, const StreamOptions &options) {
+  if (!value) {
+    value = IOBuf::create(0);
+  }
+  // chunks are clones of the chain, so nothing is copied until encoding.
+  std::shared_ptr<IOBuf> chain {std::move(value)};
+  auto cursor = std::make_shared<folly::io::Cursor>(chain.get());
+  auto remaining = std::make_shared<size_t>(chain->computeChainDataLength());
+  size_t chunkSize = std::max((size_t) 1, options.chunkSize);
+  return setStreaming(key,
+    [chain, cursor, remaining, chunkSize]() -> std::unique_ptr<IOBuf> {
+      if (*remaining == 0) {
+        return nullptr;
+      }
+      size_t size = std::min(chunkSize, *remaining);
+      std::unique_ptr<IOBuf> chunk;
+      cursor->clone(chunk, size);
+      *remaining -= size;
+      return chunk;
+    },
+    options
+  );
+}
+
+folly::Future<Unit> RedisClient::setStreaming(arg_str_ref key,
+    chunk_producer_t producer, const StreamOptions &options) {
+  auto writer = std::make_shared<StreamWriter>(
+    shared_from_this(), key, std::move(producer), options
+  );
+  return writer->start();
+}
+
+folly::Future<folly::Optional<size_t>> RedisClient::getStreaming(
+    arg_str_ref key, chunk_sink_t sink, const StreamOptions &options) {
+  auto reader = std::make_shared<StreamReader>(
+    shared_from_this(), key, std::move(sink), options
+  );
+  return reader->start();
+}
+
+folly::Future<std::unique_ptr<IOBuf>> RedisClient::getChained(
+    arg_str_ref key, const StreamOptions &options) {
+  auto head = std::make_shared<std::unique_ptr<IOBuf>>();
+  return getStreaming(key, [head](std::unique_ptr<IOBuf> chunk) {
+    if (*head) {
+      (*head)->prependChain(std::move(chunk));
+    } else {
+      *head = std::move(chunk);
+    }
+  }, options).then([head](folly::Optional<size_t> length)
+      -> std::unique_ptr<IOBuf> {
+    if (!length) {
+      return nullptr;
+    }
+    if (!*head) {
+      return IOBuf::create(0);
+    }
+    return std::move(*head);
+  });
+}
+
+}} // fredis::redis
@@ -0,0 +1,136 @@
+#include "fredis/redis/RequestTracer.h"
+#include <sstream>
+
+using namespace std;
+using folly::fbstring;
+
+namespace fredis { namespace redis {
+
+using time_point = RequestTrace::time_point;
+using micros_t = RequestTrace::micros_t;
+
+static micros_t elapsed(time_point from, time_point to) {
+  if (from == time_point {} || to == time_point {} || to < from) {
+    return micros_t {0};
+  }
+  return std::chrono::duration_cast<micros_t>(to - from);
+}
+
+micros_t RequestTrace::total() const {
+  return elapsed(submitted, fulfilled);
+}
+
+micros_t RequestTrace::loopQueueTime() const {
+  return elapsed(submitted, started);
+}
+
+micros_t RequestTrace::encodeTime() const {
+  return elapsed(started, encoded);
+}
+
+micros_t RequestTrace::writeTime() const {
+  return elapsed(encoded, writeFlushed);
+}
+
+micros_t RequestTrace::serverTime() const {
+  return elapsed(writeFlushed, firstByteRead);
+}
+
+micros_t RequestTrace::readTime() const {
+  return elapsed(firstByteRead, parsed);
+}
+
+micros_t RequestTrace::callbackTime() const {
+  return elapsed(parsed, fulfilled);
+}
+
+fbstring RequestTrace::describe() const {
+  std::ostringstream oss;
+  oss << command
+      << " key_bytes=" << keyBytes
+      << " request_bytes=" << requestBytes
+      << " response_bytes=" << responseBytes
+      << " total_us=" << total().count()
+      << " queue_us=" << loopQueueTime().count()
+      << " encode_us=" << encodeTime().count()
+      << " write_us=" << writeTime().count()
+      << " server_us=" << serverTime().count()
+      << " read_us=" << readTime().count()
+      << " callback_us=" << callbackTime().count();
+  if (failed) {
+    oss << " failed";
+  }
+  return oss.str();
+}
+
+RequestTracer::RequestTracer(const TracingOptions &options)
+  : options_(options) {
+  if (options_.sampleEvery == 0) {
+    options_.sampleEvery = 1;
+  }
+}
+
+shared_ptr<RequestTracer> RequestTracer::createShared(
+    const TracingOptions &options) {
+  return shared_ptr<RequestTracer> {new RequestTracer {options}};
+}
+
+const TracingOptions& RequestTracer::getOptions() const {
+  return options_;
+}
+
+bool RequestTracer::shouldSample() {
+  // per-thread counter: sampling doesn't need to be exact across threads,
+  // and this keeps the untraced path free of shared writes.
+  static thread_local size_t counter = 0;
+  return (counter++ % options_.sampleEvery) == 0;
+}
+
+void RequestTracer::finish(RequestTrace &&trace) {
+  if (options_.spanHook) {
+    options_.spanHook(trace);
+  }
+  if (trace.total() < options_.slowThreshold) {
+    return;
+  }
+  slowCount_.fetch_add(1, std::memory_order_relaxed);
+  if (options_.slowLogCapacity == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard {slowLogMutex_};
+  if (slowLog_.size() >= options_.slowLogCapacity) {
+    slowLog_.pop_front();
+  }
+  slowLog_.push_back(std::move(trace));
+}
+
+vector<RequestTrace> RequestTracer::getSlowLog() const {
+  std::lock_guard<std::mutex> guard {slowLogMutex_};
+  return vector<RequestTrace> {slowLog_.begin(), slowLog_.end()};
+}
+
+size_t RequestTracer::getSlowCount() const {
+  return slowCount_.load(std::memory_order_relaxed);
+}
+
+void RequestTracer::clearSlowLog() {
+  std::lock_guard<std::mutex> guard {slowLogMutex_};
+  slowLog_.clear();
+}
+
+static thread_local time_point currentOrigin_;
+
+RequestTracer::ScopedOrigin::ScopedOrigin(time_point origin)
+  : previous_(currentOrigin_) {
+  currentOrigin_ = origin;
+}
+
+RequestTracer::ScopedOrigin::~ScopedOrigin() {
+  currentOrigin_ = previous_;
+}
+
+time_point RequestTracer::currentOrigin() {
+  return currentOrigin_;
+}
+
+}} // fredis::redis
@@ -9,6 +9,7 @@ namespace fredis { namespace redis { namespace hiredis_adapter {
 void fredisLibeventReadEvent(int fd, short event, void *arg) {
     ((void)fd); ((void)event);
     fredisLibeventEvents *e = (fredisLibeventEvents*)arg;
+    e->client->noteReadEvent();
     redisAsyncHandleRead(e->context);
 }
 
@@ -36,6 +37,8 @@ void fredisLibeventAddWrite(void *privdata) {
 void fredisLibeventDelWrite(void *privdata) {
     fredisLibeventEvents *e = (fredisLibeventEvents*)privdata;
     event_del(&e->wev);
+    /* hiredis only drops write interest once its output buffer is empty */
+    e->client->noteWriteFlushed();
 }
 
 void fredisLibeventCleanup(void *privdata) {
@@ -0,0 +1,135 @@
+#include "fredis/stats/LatencyHistogram.h"
+#include <algorithm>
+#include <cmath>
+
+namespace fredis { namespace stats {
+
+namespace histogram_layout {
+
+size_t bucketOfValue(uint64_t value) {
+  if (value < kSubBuckets) {
+    return (size_t) value;
+  }
+  size_t msb = 63 - __builtin_clzll(value);
+  if (msb > kMaxExponent) {
+    return kNumBuckets - 1;
+  }
+  size_t shift = msb - kSubBucketBits;
+  size_t subBucket = (size_t) ((value >> shift) & (kSubBuckets - 1));
+  return (msb - kSubBucketBits + 1) * kSubBuckets + subBucket;
+}
+
+uint64_t lowerBoundOfBucket(size_t bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  size_t msb = bucket / kSubBuckets + kSubBucketBits - 1;
+  uint64_t subBucket = bucket % kSubBuckets;
+  return (kSubBuckets + subBucket) << (msb - kSubBucketBits);
+}
+
+uint64_t upperBoundOfBucket(size_t bucket) {
+  if (bucket + 1 >= kNumBuckets) {
+    return UINT64_MAX;
+  }
+  return lowerBoundOfBucket(bucket + 1) - 1;
+}
+
+} // histogram_layout
+
+using namespace histogram_layout;
+
+HistogramSnapshot::HistogramSnapshot()
+  : counts_(kNumBuckets, 0) {}
+
+void HistogramSnapshot::addBucket(size_t bucket, uint64_t count) {
+  counts_[bucket] += count;
+}
+
+void HistogramSnapshot::addSummary(uint64_t count, uint64_t sum,
+    uint64_t max) {
+  count_ += count;
+  sum_ += sum;
+  max_ = std::max(max_, max);
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot &other) {
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    counts_[i] += other.counts_[i];
+  }
+  addSummary(other.count_, other.sum_, other.max_);
+}
+
+uint64_t HistogramSnapshot::getCount() const {
+  return count_;
+}
+
+uint64_t HistogramSnapshot::getMax() const {
+  return max_;
+}
+
+double HistogramSnapshot::getMean() const {
+  if (count_ == 0) {
+    return 0;
+  }
+  return (double) sum_ / (double) count_;
+}
+
+uint64_t HistogramSnapshot::getPercentile(double pct) const {
+  uint64_t total = 0;
+  for (auto bucketCount: counts_) {
+    total += bucketCount;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  pct = std::max(0.0, std::min(100.0, pct));
+  uint64_t target = (uint64_t) std::ceil((pct / 100.0) * (double) total);
+  target = std::max(target, (uint64_t) 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    seen += counts_[i];
+    if (seen >= target) {
+      return std::min(upperBoundOfBucket(i), max_);
+    }
+  }
+  return max_;
+}
+
+LatencyHistogram::LatencyHistogram() {
+  for (auto &bucket: buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+// single writer: a relaxed load + store is enough and avoids the cost
+// of an atomic read-modify-write on every request.
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t amount) {
+  counter.store(counter.load(std::memory_order_relaxed) + amount,
+    std::memory_order_relaxed);
+}
+
+void LatencyHistogram::record(uint64_t value) {
+  bump(buckets_[bucketOfValue(value)], 1);
+  bump(count_, 1);
+  bump(sum_, value);
+  if (value > max_.load(std::memory_order_relaxed)) {
+    max_.store(value, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::mergeInto(HistogramSnapshot &snapshot) const {
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    auto bucketCount = buckets_[i].load(std::memory_order_relaxed);
+    if (bucketCount > 0) {
+      snapshot.addBucket(i, bucketCount);
+    }
+  }
+  snapshot.addSummary(
+    count_.load(std::memory_order_relaxed),
+    sum_.load(std::memory_order_relaxed),
+    max_.load(std::memory_order_relaxed)
+  );
+}
+
+}} // fredis::stats
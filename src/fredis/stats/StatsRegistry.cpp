@@ -0,0 +1,215 @@
+#include "fredis/stats/StatsRegistry.h"
+#include <sstream>
+
+using namespace std;
+using folly::StringPiece;
+using folly::fbstring;
+
+namespace fredis { namespace stats {
+
+static inline void bump(std::atomic<uint64_t> &counter, uint64_t amount) {
+  counter.store(counter.load(std::memory_order_relaxed) + amount,
+    std::memory_order_relaxed);
+}
+
+const size_t StatsRegistry::kMaxCommands;
+
+void CommandStatsSnapshot::merge(const CommandStatsSnapshot &other) {
+  count += other.count;
+  errors += other.errors;
+  timeouts += other.timeouts;
+  bytesOut += other.bytesOut;
+  bytesIn += other.bytesIn;
+  latencyMicros.merge(other.latencyMicros);
+}
+
+CommandStatsSnapshot StatsSnapshot::total() const {
+  CommandStatsSnapshot result;
+  for (const auto &entry: commands) {
+    result.merge(entry.second);
+  }
+  return result;
+}
+
+fbstring StatsSnapshot::toString() const {
+  std::ostringstream oss;
+  for (const auto &entry: commands) {
+    const auto &cmd = entry.second;
+    oss << entry.first
+        << " count=" << cmd.count
+        << " errors=" << cmd.errors
+        << " timeouts=" << cmd.timeouts
+        << " bytes_out=" << cmd.bytesOut
+        << " bytes_in=" << cmd.bytesIn
+        << " mean_us=" << (uint64_t) cmd.latencyMicros.getMean()
+        << " p50_us=" << cmd.latencyMicros.getPercentile(50)
+        << " p99_us=" << cmd.latencyMicros.getPercentile(99)
+        << " p999_us=" << cmd.latencyMicros.getPercentile(99.9)
+        << " max_us=" << cmd.latencyMicros.getMax()
+        << "\n";
+  }
+  return oss.str();
+}
+
+void CommandStats::record(std::chrono::microseconds latency, Outcome outcome,
+    size_t bytesOut, size_t bytesIn) {
+  latency_.record((uint64_t) std::max((int64_t) 0, (int64_t) latency.count()));
+  if (outcome == Outcome::ERROR) {
+    bump(errors_, 1);
+  } else if (outcome == Outcome::TIMEOUT) {
+    bump(timeouts_, 1);
+  }
+  bump(bytesOut_, bytesOut);
+  bump(bytesIn_, bytesIn);
+}
+
+void CommandStats::mergeInto(CommandStatsSnapshot &snapshot) const {
+  CommandStatsSnapshot mine;
+  latency_.mergeInto(mine.latencyMicros);
+  mine.count = mine.latencyMicros.getCount();
+  mine.errors = errors_.load(std::memory_order_relaxed);
+  mine.timeouts = timeouts_.load(std::memory_order_relaxed);
+  mine.bytesOut = bytesOut_.load(std::memory_order_relaxed);
+  mine.bytesIn = bytesIn_.load(std::memory_order_relaxed);
+  snapshot.merge(mine);
+}
+
+StatsRegistry::Shard::Shard() {
+  for (auto &slot: slots_) {
+    slot.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+StatsRegistry::Shard::~Shard() {
+  for (auto &slot: slots_) {
+    delete slot.load(std::memory_order_relaxed);
+  }
+}
+
+CommandStats* StatsRegistry::Shard::find(StringPiece name) {
+  auto found = byName_.find(name);
+  if (found == byName_.end()) {
+    return nullptr;
+  }
+  return found->second;
+}
+
+CommandStats* StatsRegistry::Shard::create(StringPiece internedName,
+    size_t commandId) {
+  auto existing = getSlot(commandId);
+  if (!existing) {
+    existing = new CommandStats;
+    slots_[commandId].store(existing, std::memory_order_release);
+  }
+  byName_.insert(std::make_pair(internedName, existing));
+  return existing;
+}
+
+CommandStats* StatsRegistry::Shard::createOverflow(StringPiece name) {
+  auto other = getSlot(0);
+  if (!other) {
+    other = new CommandStats;
+    slots_[0].store(other, std::memory_order_release);
+  }
+  if (overflowNames_.size() < kMaxOverflowNames) {
+    overflowNames_.push_back(name.str());
+    byName_.insert(std::make_pair(StringPiece {overflowNames_.back()}, other));
+  }
+  return other;
+}
+
+CommandStats* StatsRegistry::Shard::getSlot(size_t commandId) const {
+  return slots_[commandId].load(std::memory_order_acquire);
+}
+
+StatsRegistry::StatsRegistry() {
+  commandNames_.push_back("OTHER");
+  commandIds_.insert(std::make_pair(commandNames_.back(), 0));
+}
+
+shared_ptr<StatsRegistry> StatsRegistry::createShared() {
+  return std::make_shared<StatsRegistry>();
+}
+
+void StatsRegistry::setEnabled(bool enabled) {
+  enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+bool StatsRegistry::isEnabled() const {
+  return enabled_.load(std::memory_order_relaxed);
+}
+
+StatsRegistry::Shard* StatsRegistry::getLocalShard() {
+  auto &local = *localShard_;
+  if (!local) {
+    local = std::make_shared<Shard>();
+    std::lock_guard<std::mutex> guard {mutex_};
+    shards_.push_back(local);
+  }
+  return local.get();
+}
+
+CommandStats* StatsRegistry::lookupSlow(Shard *shard, StringPiece name) {
+  size_t commandId = 0;
+  StringPiece interned;
+  bool overflowed = false;
+  {
+    std::lock_guard<std::mutex> guard {mutex_};
+    std::string key = name.str();
+    auto found = commandIds_.find(key);
+    if (found != commandIds_.end()) {
+      commandId = found->second;
+      interned = commandNames_[commandId];
+    } else if (commandNames_.size() < kMaxCommands) {
+      commandId = commandNames_.size();
+      commandNames_.push_back(key);
+      commandIds_.insert(std::make_pair(key, commandId));
+      interned = commandNames_.back();
+    } else {
+      overflowed = true;
+    }
+  }
+  if (overflowed) {
+    // out of slots: record under OTHER. the name is only kept by this
+    // shard (and only up to a limit), never in the shared name table.
+    return shard->createOverflow(name);
+  }
+  return shard->create(interned, commandId);
+}
+
+void StatsRegistry::record(StringPiece command,
+    std::chrono::microseconds latency, Outcome outcome,
+    size_t bytesOut, size_t bytesIn) {
+  if (!isEnabled()) {
+    return;
+  }
+  auto shard = getLocalShard();
+  auto stats = shard->find(command);
+  if (!stats) {
+    stats = lookupSlow(shard, command);
+  }
+  stats->record(latency, outcome, bytesOut, bytesIn);
+}
+
+StatsSnapshot StatsRegistry::getStats() {
+  StatsSnapshot snapshot;
+  snapshot.takenAt = std::chrono::steady_clock::now();
+  std::vector<std::shared_ptr<Shard>> shards;
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> guard {mutex_};
+    shards = shards_;
+    names.assign(commandNames_.begin(), commandNames_.end());
+  }
+  for (const auto &shard: shards) {
+    for (size_t commandId = 0; commandId < names.size(); commandId++) {
+      auto slot = shard->getSlot(commandId);
+      if (slot) {
+        slot->mergeInto(snapshot.commands[names[commandId]]);
+      }
+    }
+  }
+  return snapshot;
+}
+
+}} // fredis::stats
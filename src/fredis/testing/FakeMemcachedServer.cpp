@@ -0,0 +1,569 @@
+#include "fredis/testing/FakeMemcachedServer.h"
+#include <ctime>
+#include <folly/Conv.h>
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+
+namespace fredis { namespace testing {
+
+using Connection = FakeServer::Connection;
+
+namespace detail {
+
+bool isMemcachedStorageCommand(StringPiece command) {
+  return command == "set" || command == "add" || command == "replace"
+    || command == "append" || command == "prepend" || command == "cas";
+}
+
+} // detail
+
+// memcached treats exptimes past thirty days as absolute unix times.
+static const int64_t kMaxRelativeExptime = 60 * 60 * 24 * 30;
+
+static vector<string> tokenize(StringPiece line) {
+  vector<string> tokens;
+  size_t start = 0;
+  while (start < line.size()) {
+    auto space = line.find(' ', start);
+    if (space == StringPiece::npos) {
+      space = line.size();
+    }
+    if (space > start) {
+      tokens.push_back(line.subpiece(start, space - start).str());
+    }
+    start = space + 1;
+  }
+  return tokens;
+}
+
+static bool parseUnsigned(const string &token, uint64_t &out) {
+  if (token.empty()) {
+    return false;
+  }
+  uint64_t value = 0;
+  for (char c: token) {
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    value = value * 10 + (c - '0');
+  }
+  out = value;
+  return true;
+}
+
+// meta flags are a letter, optionally followed by a token: v, T30, Oabc.
+static vector<pair<char, string>> metaFlagsOf(const vector<string> &tokens,
+    size_t start) {
+  vector<pair<char, string>> flags;
+  for (size_t i = start; i < tokens.size(); i++) {
+    flags.emplace_back(tokens[i][0], tokens[i].substr(1));
+  }
+  return flags;
+}
+
+static bool hasMetaFlag(const vector<pair<char, string>> &flags, char flag,
+    string *token = nullptr) {
+  for (const auto &entry: flags) {
+    if (entry.first == flag) {
+      if (token) {
+        *token = entry.second;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool parseSigned(const string &token, int64_t &out) {
+  uint64_t magnitude = 0;
+  if (!token.empty() && token[0] == '-') {
+    if (!parseUnsigned(token.substr(1), magnitude)) {
+      return false;
+    }
+    out = -((int64_t) magnitude);
+    return true;
+  }
+  if (!parseUnsigned(token, magnitude)) {
+    return false;
+  }
+  out = (int64_t) magnitude;
+  return true;
+}
+
+FakeMemcachedServer::FakeMemcachedServer(uint16_t port)
+  : FakeServer(port) {}
+
+shared_ptr<FakeMemcachedServer> FakeMemcachedServer::createShared(
+    uint16_t port) {
+  return shared_ptr<FakeMemcachedServer> {new FakeMemcachedServer {port}};
+}
+
+FakeMemcachedServer::Item* FakeMemcachedServer::lookup(const string &key) {
+  auto found = items_.find(key);
+  if (found == items_.end()) {
+    return nullptr;
+  }
+  auto &item = found->second;
+  if (item.expiresAt != time_point {} &&
+      std::chrono::steady_clock::now() >= item.expiresAt) {
+    items_.erase(found);
+    return nullptr;
+  }
+  return &item;
+}
+
+FakeMemcachedServer::time_point FakeMemcachedServer::expiryOfExptime(
+    int64_t exptime) {
+  auto now = std::chrono::steady_clock::now();
+  if (exptime == 0) {
+    return time_point {};
+  }
+  if (exptime < 0) {
+    return now;
+  }
+  if (exptime > kMaxRelativeExptime) {
+    exptime = std::max((int64_t) 0, exptime - (int64_t) ::time(nullptr));
+    if (exptime == 0) {
+      return now;
+    }
+  }
+  return now + std::chrono::seconds {exptime};
+}
+
+void FakeMemcachedServer::handleInput(Connection &conn) {
+  auto &input = conn.input();
+  size_t offset = 0;
+  while (!conn.isClosed()) {
+    auto lineEnd = input.find("\r\n", offset);
+    if (lineEnd == string::npos) {
+      break;
+    }
+    auto tokens = tokenize(StringPiece(
+      input.data() + offset, lineEnd - offset
+    ));
+    size_t consumed = lineEnd + 2 - offset;
+    if (tokens.empty()) {
+      offset += consumed;
+      conn.reply("ERROR", "ERROR\r\n");
+      continue;
+    }
+    const auto &command = tokens[0];
+    bool noreply = tokens.size() > 1 && tokens.back() == "noreply";
+    bool isMetaSet = command == "ms";
+    fbstring response;
+    if (detail::isMemcachedStorageCommand(command) || isMetaSet) {
+      uint64_t bytes = 0;
+      // ms <key> <datalen> <flags>*
+      size_t minTokens = isMetaSet ? 3 : command == "cas" ? 6 : 5;
+      size_t bytesToken = isMetaSet ? 2 : 4;
+      if (tokens.size() < minTokens ||
+          !parseUnsigned(tokens[bytesToken], bytes)) {
+        offset += consumed;
+        conn.reply(command, "CLIENT_ERROR bad command line format\r\n");
+        continue;
+      }
+      size_t dataStart = lineEnd + 2;
+      if (input.size() < dataStart + bytes + 2) {
+        break;
+      }
+      if (input.compare(dataStart + bytes, 2, "\r\n") != 0) {
+        offset = dataStart + bytes + 2;
+        conn.reply(command, "CLIENT_ERROR bad data chunk\r\n");
+        continue;
+      }
+      string data = input.substr(dataStart, bytes);
+      offset = dataStart + bytes + 2;
+      if (isMetaSet) {
+        response = executeMetaSet(tokens, std::move(data));
+      } else {
+        response = executeStorage(tokens, std::move(data));
+      }
+    } else {
+      offset += consumed;
+      if (command == "get" || command == "gets") {
+        response = executeRetrieval(tokens);
+      } else if (command == "mg") {
+        response = executeMetaGet(tokens);
+      } else if (command == "md") {
+        response = executeMetaDelete(tokens);
+      } else if (command == "ma") {
+        response = executeMetaArithmetic(tokens);
+      } else if (command == "mn") {
+        response = "MN\r\n";
+      } else {
+        response = executeOther(conn, tokens);
+      }
+    }
+    if (!noreply && !response.empty()) {
+      conn.reply(command, std::move(response));
+    }
+  }
+  if (!conn.isClosed()) {
+    input.erase(0, offset);
+  }
+}
+
+fbstring FakeMemcachedServer::executeRetrieval(const vector<string> &tokens) {
+  if (tokens.size() < 2) {
+    return "ERROR\r\n";
+  }
+  bool withCas = tokens[0] == "gets";
+  fbstring response;
+  for (size_t i = 1; i < tokens.size(); i++) {
+    auto item = lookup(tokens[i]);
+    if (!item) {
+      continue;
+    }
+    response.append(folly::to<fbstring>(
+      "VALUE ", tokens[i], " ", item->flags, " ", item->value.size()
+    ));
+    if (withCas) {
+      response.append(folly::to<fbstring>(" ", item->casUnique));
+    }
+    response.append("\r\n");
+    response.append(item->value);
+    response.append("\r\n");
+  }
+  response.append("END\r\n");
+  return response;
+}
+
+fbstring FakeMemcachedServer::executeStorage(const vector<string> &tokens,
+    string &&data) {
+  const auto &command = tokens[0];
+  const auto &key = tokens[1];
+  uint64_t flags = 0;
+  int64_t exptime = 0;
+  uint64_t casUnique = 0;
+  if (!parseUnsigned(tokens[2], flags) || !parseSigned(tokens[3], exptime)
+      || (command == "cas" && !parseUnsigned(tokens[5], casUnique))) {
+    return "CLIENT_ERROR bad command line format\r\n";
+  }
+  auto existing = lookup(key);
+  if (command == "add" && existing) {
+    return "NOT_STORED\r\n";
+  }
+  if ((command == "replace" || command == "append" || command == "prepend")
+      && !existing) {
+    return "NOT_STORED\r\n";
+  }
+  if (command == "cas") {
+    if (!existing) {
+      return "NOT_FOUND\r\n";
+    }
+    if (existing->casUnique != casUnique) {
+      return "EXISTS\r\n";
+    }
+  }
+  if (command == "append" || command == "prepend") {
+    // flags and exptime are ignored, as in memcached.
+    if (command == "append") {
+      existing->value.append(data);
+    } else {
+      existing->value.insert(0, data);
+    }
+    existing->casUnique = nextCasUnique_++;
+    return "STORED\r\n";
+  }
+  Item item;
+  item.value = std::move(data);
+  item.flags = (uint32_t) flags;
+  item.casUnique = nextCasUnique_++;
+  item.expiresAt = expiryOfExptime(exptime);
+  items_[key] = std::move(item);
+  return "STORED\r\n";
+}
+
+fbstring FakeMemcachedServer::executeOther(Connection &conn,
+    const vector<string> &tokens) {
+  const auto &command = tokens[0];
+  if (command == "delete") {
+    if (tokens.size() < 2) {
+      return "ERROR\r\n";
+    }
+    if (!lookup(tokens[1])) {
+      return "NOT_FOUND\r\n";
+    }
+    items_.erase(tokens[1]);
+    return "DELETED\r\n";
+  }
+  if (command == "incr" || command == "decr") {
+    uint64_t delta = 0;
+    if (tokens.size() < 3 || !parseUnsigned(tokens[2], delta)) {
+      return "CLIENT_ERROR invalid numeric delta argument\r\n";
+    }
+    auto item = lookup(tokens[1]);
+    if (!item) {
+      return "NOT_FOUND\r\n";
+    }
+    uint64_t current = 0;
+    if (!parseUnsigned(item->value, current)) {
+      return "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
+    }
+    if (command == "incr") {
+      current += delta;
+    } else {
+      // decr saturates at zero instead of wrapping.
+      current = delta > current ? 0 : current - delta;
+    }
+    item->value = folly::to<string>(current);
+    item->casUnique = nextCasUnique_++;
+    return folly::to<fbstring>(current, "\r\n");
+  }
+  if (command == "touch") {
+    int64_t exptime = 0;
+    if (tokens.size() < 3 || !parseSigned(tokens[2], exptime)) {
+      return "ERROR\r\n";
+    }
+    auto item = lookup(tokens[1]);
+    if (!item) {
+      return "NOT_FOUND\r\n";
+    }
+    item->expiresAt = expiryOfExptime(exptime);
+    return "TOUCHED\r\n";
+  }
+  if (command == "flush_all") {
+    items_.clear();
+    return "OK\r\n";
+  }
+  if (command == "version") {
+    return "VERSION 1.4.25-fredis-fake\r\n";
+  }
+  if (command == "quit") {
+    conn.close();
+    return "";
+  }
+  return "ERROR\r\n";
+}
+
+string FakeMemcachedServer::metaReturnFlags(const meta_flags_t &flags,
+    const string &key, const Item *item) {
+  string returned;
+  for (const auto &flag: flags) {
+    switch (flag.first) {
+      case 'k':
+        returned += " k" + key;
+        break;
+      case 'O':
+        returned += " O" + flag.second;
+        break;
+      case 'c':
+        if (item) {
+          returned += folly::to<string>(" c", item->casUnique);
+        }
+        break;
+      case 'f':
+        if (item) {
+          returned += folly::to<string>(" f", item->flags);
+        }
+        break;
+      case 's':
+        if (item) {
+          returned += folly::to<string>(" s", item->value.size());
+        }
+        break;
+      case 't':
+        if (item) {
+          int64_t remaining = -1;
+          if (item->expiresAt != time_point {}) {
+            remaining = std::chrono::duration_cast<std::chrono::seconds>(
+              item->expiresAt - std::chrono::steady_clock::now()
+            ).count();
+          }
+          returned += folly::to<string>(" t", remaining);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  return returned;
+}
+
+fbstring FakeMemcachedServer::executeMetaGet(const vector<string> &tokens) {
+  if (tokens.size() < 2) {
+    return "CLIENT_ERROR bad command line format\r\n";
+  }
+  const auto &key = tokens[1];
+  auto flags = metaFlagsOf(tokens, 2);
+  bool quiet = hasMetaFlag(flags, 'q');
+  auto item = lookup(key);
+  bool win = false;
+  string token;
+  if (!item) {
+    int64_t vivifyTtl = 0;
+    if (!hasMetaFlag(flags, 'N', &token) || !parseSigned(token, vivifyTtl)) {
+      return quiet ? "" : "EN" + metaReturnFlags(flags, key, nullptr) + "\r\n";
+    }
+    // an empty placeholder, whose creator is told to fill it in.
+    Item placeholder;
+    placeholder.casUnique = nextCasUnique_++;
+    placeholder.expiresAt = expiryOfExptime(vivifyTtl);
+    placeholder.winTokenSent = true;
+    items_[key] = std::move(placeholder);
+    item = &items_[key];
+    win = true;
+  } else {
+    int64_t recacheTtl = 0;
+    bool recache = hasMetaFlag(flags, 'R', &token) &&
+      parseSigned(token, recacheTtl) && item->expiresAt != time_point {} &&
+      item->expiresAt - std::chrono::steady_clock::now() <
+        std::chrono::seconds {recacheTtl};
+    if ((item->stale || recache) && !item->winTokenSent) {
+      item->winTokenSent = true;
+      win = true;
+    }
+    int64_t touchTtl = 0;
+    if (hasMetaFlag(flags, 'T', &token) && parseSigned(token, touchTtl)) {
+      item->expiresAt = expiryOfExptime(touchTtl);
+    }
+  }
+  auto returned = metaReturnFlags(flags, key, item);
+  if (win) {
+    returned += " W";
+  }
+  if (item->stale) {
+    returned += " X";
+  }
+  if (!win && item->winTokenSent) {
+    returned += " Z";
+  }
+  if (!hasMetaFlag(flags, 'v')) {
+    return "HD" + returned + "\r\n";
+  }
+  return folly::to<fbstring>(
+    "VA ", item->value.size(), returned, "\r\n", item->value, "\r\n"
+  );
+}
+
+fbstring FakeMemcachedServer::executeMetaSet(const vector<string> &tokens,
+    string &&data) {
+  const auto &key = tokens[1];
+  auto flags = metaFlagsOf(tokens, 3);
+  string token;
+  uint64_t casUnique = 0, itemFlags = 0;
+  int64_t exptime = 0;
+  auto existing = lookup(key);
+  if (hasMetaFlag(flags, 'C', &token) && parseUnsigned(token, casUnique)) {
+    if (!existing) {
+      return "NF" + metaReturnFlags(flags, key, nullptr) + "\r\n";
+    }
+    if (existing->casUnique != casUnique) {
+      return "EX" + metaReturnFlags(flags, key, nullptr) + "\r\n";
+    }
+  }
+  if (hasMetaFlag(flags, 'T', &token)) {
+    parseSigned(token, exptime);
+  }
+  if (hasMetaFlag(flags, 'F', &token)) {
+    parseUnsigned(token, itemFlags);
+  }
+  Item item;
+  item.value = std::move(data);
+  item.flags = (uint32_t) itemFlags;
+  item.casUnique = nextCasUnique_++;
+  item.expiresAt = expiryOfExptime(exptime);
+  items_[key] = std::move(item);
+  if (hasMetaFlag(flags, 'q')) {
+    return "";
+  }
+  return "HD" + metaReturnFlags(flags, key, &items_[key]) + "\r\n";
+}
+
+fbstring FakeMemcachedServer::executeMetaDelete(const vector<string> &tokens) {
+  if (tokens.size() < 2) {
+    return "CLIENT_ERROR bad command line format\r\n";
+  }
+  const auto &key = tokens[1];
+  auto flags = metaFlagsOf(tokens, 2);
+  string token;
+  auto item = lookup(key);
+  if (!item) {
+    return "NF" + metaReturnFlags(flags, key, nullptr) + "\r\n";
+  }
+  uint64_t casUnique = 0;
+  if (hasMetaFlag(flags, 'C', &token) && parseUnsigned(token, casUnique) &&
+      item->casUnique != casUnique) {
+    return "EX" + metaReturnFlags(flags, key, nullptr) + "\r\n";
+  }
+  auto returned = metaReturnFlags(flags, key, nullptr);
+  if (hasMetaFlag(flags, 'I')) {
+    // invalidate: keep serving the value, marked stale, until it's replaced.
+    item->stale = true;
+    item->winTokenSent = false;
+    item->casUnique = nextCasUnique_++;
+    int64_t exptime = 0;
+    if (hasMetaFlag(flags, 'T', &token) && parseSigned(token, exptime)) {
+      item->expiresAt = expiryOfExptime(exptime);
+    }
+  } else {
+    items_.erase(key);
+  }
+  if (hasMetaFlag(flags, 'q')) {
+    return "";
+  }
+  return "HD" + returned + "\r\n";
+}
+
+fbstring FakeMemcachedServer::executeMetaArithmetic(
+    const vector<string> &tokens) {
+  if (tokens.size() < 2) {
+    return "CLIENT_ERROR bad command line format\r\n";
+  }
+  const auto &key = tokens[1];
+  auto flags = metaFlagsOf(tokens, 2);
+  string token;
+  auto item = lookup(key);
+  if (!item) {
+    int64_t vivifyTtl = 0;
+    if (!hasMetaFlag(flags, 'N', &token) || !parseSigned(token, vivifyTtl)) {
+      return "NF" + metaReturnFlags(flags, key, nullptr) + "\r\n";
+    }
+    uint64_t initial = 0;
+    if (hasMetaFlag(flags, 'J', &token)) {
+      parseUnsigned(token, initial);
+    }
+    Item created;
+    created.value = folly::to<string>(initial);
+    created.casUnique = nextCasUnique_++;
+    created.expiresAt = expiryOfExptime(vivifyTtl);
+    items_[key] = std::move(created);
+    item = &items_[key];
+  } else {
+    uint64_t current = 0, delta = 1;
+    if (!parseUnsigned(item->value, current)) {
+      return "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
+    }
+    if (hasMetaFlag(flags, 'D', &token) && !parseUnsigned(token, delta)) {
+      return "CLIENT_ERROR bad token in command line format\r\n";
+    }
+    string mode;
+    bool decrement = hasMetaFlag(flags, 'M', &mode) && !mode.empty() &&
+      (mode[0] == 'D' || mode[0] == 'd' || mode[0] == '-');
+    if (decrement) {
+      current = delta > current ? 0 : current - delta;
+    } else {
+      current += delta;
+    }
+    item->value = folly::to<string>(current);
+    item->casUnique = nextCasUnique_++;
+    int64_t exptime = 0;
+    if (hasMetaFlag(flags, 'T', &token) && parseSigned(token, exptime)) {
+      item->expiresAt = expiryOfExptime(exptime);
+    }
+  }
+  auto returned = metaReturnFlags(flags, key, item);
+  if (hasMetaFlag(flags, 'v')) {
+    return folly::to<fbstring>(
+      "VA ", item->value.size(), returned, "\r\n", item->value, "\r\n"
+    );
+  }
+  if (hasMetaFlag(flags, 'q')) {
+    return "";
+  }
+  return "HD" + returned + "\r\n";
+}
+
+}} // fredis::testing
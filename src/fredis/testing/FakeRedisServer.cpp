@@ -0,0 +1,1454 @@
+#include "fredis/testing/FakeRedisServer.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <folly/Conv.h>
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+
+namespace fredis { namespace testing {
+
+using args_t = FakeRedisServer::args_t;
+using Connection = FakeServer::Connection;
+using Kind = FakeRedisServer::Kind;
+
+namespace detail {
+
+static bool parseInt(StringPiece piece, int64_t &out) {
+  if (piece.empty()) {
+    return false;
+  }
+  bool negative = false;
+  size_t idx = 0;
+  if (piece[0] == '-' || piece[0] == '+') {
+    negative = piece[0] == '-';
+    idx++;
+  }
+  if (idx >= piece.size()) {
+    return false;
+  }
+  int64_t value = 0;
+  for (; idx < piece.size(); idx++) {
+    if (piece[idx] < '0' || piece[idx] > '9') {
+      return false;
+    }
+    value = value * 10 + (piece[idx] - '0');
+  }
+  out = negative ? -value : value;
+  return true;
+}
+
+int parseRespRequest(StringPiece input, size_t &consumed, args_t &args) {
+  args.clear();
+  if (input.empty()) {
+    return 0;
+  }
+  size_t pos = 0;
+  auto readLine = [&input, &pos](StringPiece &line) -> bool {
+    auto end = input.find("\r\n", pos);
+    if (end == StringPiece::npos) {
+      return false;
+    }
+    line = input.subpiece(pos, end - pos);
+    pos = end + 2;
+    return true;
+  };
+  StringPiece line;
+  if (input[0] != '*') {
+    // inline command, as typed into telnet.
+    if (!readLine(line)) {
+      return 0;
+    }
+    size_t start = 0;
+    while (start < line.size()) {
+      auto space = line.find(' ', start);
+      if (space == StringPiece::npos) {
+        space = line.size();
+      }
+      if (space > start) {
+        args.push_back(line.subpiece(start, space - start).str());
+      }
+      start = space + 1;
+    }
+    consumed = pos;
+    return 1;
+  }
+  if (!readLine(line)) {
+    return 0;
+  }
+  int64_t count = 0;
+  if (!parseInt(line.subpiece(1), count) || count < 0) {
+    return -1;
+  }
+  for (int64_t i = 0; i < count; i++) {
+    if (!readLine(line)) {
+      return 0;
+    }
+    int64_t len = 0;
+    if (line.empty() || line[0] != '$' || !parseInt(line.subpiece(1), len)
+        || len < 0) {
+      return -1;
+    }
+    if (pos + len + 2 > input.size()) {
+      return 0;
+    }
+    args.push_back(input.subpiece(pos, len).str());
+    pos += len + 2;
+  }
+  consumed = pos;
+  return 1;
+}
+
+fbstring respSimple(StringPiece status) {
+  return folly::to<fbstring>("+", status, "\r\n");
+}
+
+fbstring respError(StringPiece message) {
+  return folly::to<fbstring>("-", message, "\r\n");
+}
+
+fbstring respInteger(int64_t value) {
+  return folly::to<fbstring>(":", value, "\r\n");
+}
+
+fbstring respBulk(StringPiece value) {
+  return folly::to<fbstring>("$", value.size(), "\r\n", value, "\r\n");
+}
+
+fbstring respNil() {
+  return "$-1\r\n";
+}
+
+fbstring respArray(const vector<fbstring> &encodedItems) {
+  fbstring result = folly::to<fbstring>("*", encodedItems.size(), "\r\n");
+  for (const auto &item: encodedItems) {
+    result.append(item);
+  }
+  return result;
+}
+
+bool globMatch(StringPiece pattern, StringPiece text) {
+  if (pattern.empty()) {
+    return text.empty();
+  }
+  if (pattern[0] == '*') {
+    for (size_t skip = 0; skip <= text.size(); skip++) {
+      if (globMatch(pattern.subpiece(1), text.subpiece(skip))) {
+        return true;
+      }
+    }
+    return false;
+  }
+  if (text.empty()) {
+    return false;
+  }
+  if (pattern[0] == '?' || pattern[0] == text[0]) {
+    return globMatch(pattern.subpiece(1), text.subpiece(1));
+  }
+  return false;
+}
+
+} // detail
+
+using namespace detail;
+
+static const char* kWrongType =
+  "WRONGTYPE Operation against a key holding the wrong kind of value";
+static const char* kNotInteger = "ERR value is not an integer or out of range";
+
+static fbstring wrongArity(const string &command) {
+  return respError(folly::to<fbstring>(
+    "ERR wrong number of arguments for '", command, "' command"
+  ));
+}
+
+// clamps redis-style (possibly negative) start/end indices to [0, size).
+static bool normalizeRange(int64_t size, int64_t &start, int64_t &end) {
+  if (start < 0) {
+    start = std::max((int64_t) 0, size + start);
+  }
+  if (end < 0) {
+    end = size + end;
+  }
+  end = std::min(end, size - 1);
+  return start <= end && start < size;
+}
+
+static string upperCase(string text) {
+  std::transform(text.begin(), text.end(), text.begin(), ::toupper);
+  return text;
+}
+
+static const char* kBadTimeout = "ERR timeout is not a float or out of range";
+
+// a blocking list command's timeout, in (possibly fractional) seconds.
+static bool parseTimeout(StringPiece text, int64_t &timeoutMs) {
+  double seconds = 0;
+  try {
+    seconds = folly::to<double>(text);
+  } catch (const std::exception&) {
+    return false;
+  }
+  if (seconds < 0) {
+    return false;
+  }
+  timeoutMs = (int64_t) std::ceil(seconds * 1000);
+  return true;
+}
+
+using stream_id_t = std::pair<uint64_t, uint64_t>;
+
+static const char* kInvalidStreamId =
+  "ERR Invalid stream ID specified as stream command argument";
+
+// "<ms>-<seq>", or just "<ms>" for sequence 0.
+static bool parseStreamId(StringPiece text, stream_id_t &id) {
+  int64_t ms = 0;
+  int64_t seq = 0;
+  auto dash = text.find('-');
+  if (dash == StringPiece::npos) {
+    if (!parseInt(text, ms)) {
+      return false;
+    }
+  } else if (!parseInt(text.subpiece(0, dash), ms) ||
+      !parseInt(text.subpiece(dash + 1), seq)) {
+    return false;
+  }
+  if (ms < 0 || seq < 0) {
+    return false;
+  }
+  id = stream_id_t {(uint64_t) ms, (uint64_t) seq};
+  return true;
+}
+
+static fbstring formatStreamId(const stream_id_t &id) {
+  return folly::to<fbstring>(id.first, "-", id.second);
+}
+
+// [id, [field, value, ...]], with nil fields for a deleted entry.
+static fbstring respStreamEntry(const stream_id_t &id, const args_t *fields) {
+  if (!fields) {
+    return respArray({respBulk(formatStreamId(id)), respNil()});
+  }
+  vector<fbstring> encoded;
+  for (const auto &field: *fields) {
+    encoded.push_back(respBulk(field));
+  }
+  return respArray({respBulk(formatStreamId(id)), respArray(encoded)});
+}
+
+FakeRedisServer::FakeRedisServer(uint16_t port)
+  : FakeServer(port) {}
+
+shared_ptr<FakeRedisServer> FakeRedisServer::createShared(uint16_t port) {
+  return shared_ptr<FakeRedisServer> {new FakeRedisServer {port}};
+}
+
+void FakeRedisServer::handleInput(Connection &conn) {
+  auto &input = conn.input();
+  size_t offset = 0;
+  args_t args;
+  while (!conn.isClosed() && !blocked_.count(conn.getId())) {
+    size_t consumed = 0;
+    int rc = parseRespRequest(
+      StringPiece(input.data() + offset, input.size() - offset),
+      consumed, args
+    );
+    if (rc == 0) {
+      break;
+    }
+    if (rc < 0) {
+      conn.push(respError("ERR Protocol error"));
+      conn.close();
+      return;
+    }
+    offset += consumed;
+    if (args.empty()) {
+      continue;
+    }
+    auto response = execute(conn, args);
+    if (response.empty()) {
+      // a blocking read parked the connection.
+      continue;
+    }
+    conn.reply(args[0], std::move(response));
+  }
+  if (!conn.isClosed()) {
+    input.erase(0, offset);
+  }
+}
+
+void FakeRedisServer::handleClosed(Connection &conn) {
+  blocked_.erase(conn.getId());
+  transactions_.erase(conn.getId());
+  subscribers_.erase(conn.getId());
+  for (auto &channel: channels_) {
+    channel.second.erase(conn.getId());
+  }
+}
+
+FakeRedisServer::Entry* FakeRedisServer::lookup(const string &key) {
+  auto found = data_.find(key);
+  if (found == data_.end()) {
+    return nullptr;
+  }
+  auto &entry = found->second;
+  if (entry.expiresAt != time_point {} &&
+      std::chrono::steady_clock::now() >= entry.expiresAt) {
+    data_.erase(found);
+    return nullptr;
+  }
+  return &entry;
+}
+
+FakeRedisServer::Entry* FakeRedisServer::lookupOrCreate(const string &key,
+    Kind kind, fbstring &error) {
+  auto entry = lookup(key);
+  if (entry && entry->kind != kind) {
+    error = respError(kWrongType);
+    return nullptr;
+  }
+  if (!entry) {
+    entry = &data_[key];
+    entry->kind = kind;
+  }
+  return entry;
+}
+
+fbstring FakeRedisServer::incrementBy(const string &key, int64_t amount) {
+  auto entry = lookup(key);
+  int64_t current = 0;
+  if (entry) {
+    if (entry->kind != Kind::STRING) {
+      return respError(kWrongType);
+    }
+    if (!parseInt(entry->str, current)) {
+      return respError(kNotInteger);
+    }
+  } else {
+    entry = &data_[key];
+  }
+  current += amount;
+  entry->str = folly::to<string>(current);
+  return respInteger(current);
+}
+
+fbstring FakeRedisServer::execute(Connection &conn, const args_t &args) {
+  string cmd = args[0];
+  std::transform(cmd.begin(), cmd.end(), cmd.begin(), ::toupper);
+  size_t argc = args.size();
+
+  auto transaction = transactions_.find(conn.getId());
+  if (transaction != transactions_.end() &&
+      cmd != "MULTI" && cmd != "EXEC" && cmd != "DISCARD") {
+    transaction->second.push_back(args);
+    return respSimple("QUEUED");
+  }
+  if (cmd == "MULTI") {
+    if (transaction != transactions_.end()) {
+      return respError("ERR MULTI calls can not be nested");
+    }
+    transactions_[conn.getId()];
+    return respSimple("OK");
+  }
+  if (cmd == "EXEC" || cmd == "DISCARD") {
+    if (transaction == transactions_.end()) {
+      return respError(folly::to<fbstring>("ERR ", cmd, " without MULTI"));
+    }
+    auto queued = std::move(transaction->second);
+    transactions_.erase(transaction);
+    if (cmd == "DISCARD") {
+      return respSimple("OK");
+    }
+    // nothing else runs in between, which is all the atomicity we need.
+    vector<fbstring> replies;
+    for (const auto &queuedArgs: queued) {
+      replies.push_back(execute(conn, queuedArgs));
+    }
+    return respArray(replies);
+  }
+
+  if (cmd == "PING") {
+    return argc > 1 ? respBulk(args[1]) : respSimple("PONG");
+  }
+  if (cmd == "ECHO") {
+    return argc == 2 ? respBulk(args[1]) : wrongArity(cmd);
+  }
+  if (cmd == "FLUSHALL" || cmd == "FLUSHDB") {
+    data_.clear();
+    return respSimple("OK");
+  }
+  if (cmd == "GET") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry) {
+      return respNil();
+    }
+    if (entry->kind != Kind::STRING) {
+      return respError(kWrongType);
+    }
+    return respBulk(entry->str);
+  }
+  if (cmd == "SET") {
+    if (argc < 3) {
+      return wrongArity(cmd);
+    }
+    bool nx = false;
+    bool xx = false;
+    time_point expiresAt;
+    for (size_t i = 3; i < argc; i++) {
+      string opt = args[i];
+      std::transform(opt.begin(), opt.end(), opt.begin(), ::toupper);
+      int64_t amount = 0;
+      if (opt == "NX") {
+        nx = true;
+      } else if (opt == "XX") {
+        xx = true;
+      } else if ((opt == "EX" || opt == "PX") && i + 1 < argc
+          && parseInt(args[i + 1], amount)) {
+        auto ttl = opt == "EX"
+          ? std::chrono::milliseconds {amount * 1000}
+          : std::chrono::milliseconds {amount};
+        expiresAt = std::chrono::steady_clock::now() + ttl;
+        i++;
+      } else {
+        return respError("ERR syntax error");
+      }
+    }
+    bool exists = lookup(args[1]) != nullptr;
+    if ((nx && exists) || (xx && !exists)) {
+      return respNil();
+    }
+    Entry entry;
+    entry.str = args[2];
+    entry.expiresAt = expiresAt;
+    data_[args[1]] = std::move(entry);
+    return respSimple("OK");
+  }
+  if (cmd == "SETNX") {
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    if (lookup(args[1])) {
+      return respInteger(0);
+    }
+    data_[args[1]].str = args[2];
+    return respInteger(1);
+  }
+  if (cmd == "GETSET") {
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::STRING) {
+      return respError(kWrongType);
+    }
+    fbstring previous = entry ? respBulk(entry->str) : respNil();
+    Entry replacement;
+    replacement.str = args[2];
+    data_[args[1]] = std::move(replacement);
+    return previous;
+  }
+  if (cmd == "MGET") {
+    if (argc < 2) {
+      return wrongArity(cmd);
+    }
+    vector<fbstring> items;
+    for (size_t i = 1; i < argc; i++) {
+      auto entry = lookup(args[i]);
+      bool isString = entry && entry->kind == Kind::STRING;
+      items.push_back(isString ? respBulk(entry->str) : respNil());
+    }
+    return respArray(items);
+  }
+  if (cmd == "MSET") {
+    if (argc < 3 || argc % 2 == 0) {
+      return wrongArity(cmd);
+    }
+    for (size_t i = 1; i + 1 < argc; i += 2) {
+      Entry entry;
+      entry.str = args[i + 1];
+      data_[args[i]] = std::move(entry);
+    }
+    return respSimple("OK");
+  }
+  if (cmd == "DEL" || cmd == "EXISTS") {
+    if (argc < 2) {
+      return wrongArity(cmd);
+    }
+    int64_t count = 0;
+    for (size_t i = 1; i < argc; i++) {
+      if (lookup(args[i])) {
+        count++;
+        if (cmd == "DEL") {
+          data_.erase(args[i]);
+        }
+      }
+    }
+    return respInteger(count);
+  }
+  if (cmd == "STRLEN") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::STRING) {
+      return respError(kWrongType);
+    }
+    return respInteger(entry ? entry->str.size() : 0);
+  }
+  if (cmd == "APPEND") {
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::STRING) {
+      return respError(kWrongType);
+    }
+    if (!entry) {
+      entry = &data_[args[1]];
+    }
+    entry->str.append(args[2]);
+    return respInteger(entry->str.size());
+  }
+  if (cmd == "GETRANGE") {
+    int64_t start = 0;
+    int64_t end = 0;
+    if (argc != 4 || !parseInt(args[2], start) || !parseInt(args[3], end)) {
+      return argc != 4 ? wrongArity(cmd) : respError(kNotInteger);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::STRING) {
+      return respError(kWrongType);
+    }
+    if (!entry || !normalizeRange(entry->str.size(), start, end)) {
+      return respBulk("");
+    }
+    return respBulk(StringPiece(entry->str).subpiece(start, end - start + 1));
+  }
+  if (cmd == "INCR" || cmd == "DECR") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    return incrementBy(args[1], cmd == "INCR" ? 1 : -1);
+  }
+  if (cmd == "INCRBY" || cmd == "DECRBY") {
+    int64_t amount = 0;
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    if (!parseInt(args[2], amount)) {
+      return respError(kNotInteger);
+    }
+    return incrementBy(args[1], cmd == "INCRBY" ? amount : -amount);
+  }
+  if (cmd == "EXPIRE") {
+    int64_t seconds = 0;
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    if (!parseInt(args[2], seconds)) {
+      return respError(kNotInteger);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry) {
+      return respInteger(0);
+    }
+    entry->expiresAt = std::chrono::steady_clock::now()
+      + std::chrono::seconds {seconds};
+    return respInteger(1);
+  }
+  if (cmd == "PERSIST") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry || entry->expiresAt == time_point {}) {
+      return respInteger(0);
+    }
+    entry->expiresAt = time_point {};
+    return respInteger(1);
+  }
+  if (cmd == "RENAME") {
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry) {
+      return respError("ERR no such key");
+    }
+    Entry moved = std::move(*entry);
+    data_.erase(args[1]);
+    data_[args[2]] = std::move(moved);
+    return respSimple("OK");
+  }
+  if (cmd == "TTL") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry) {
+      return respInteger(-2);
+    }
+    if (entry->expiresAt == time_point {}) {
+      return respInteger(-1);
+    }
+    return respInteger(std::chrono::duration_cast<std::chrono::seconds>(
+      entry->expiresAt - std::chrono::steady_clock::now()
+    ).count());
+  }
+  if (cmd == "KEYS") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    vector<string> keys;
+    for (auto &entry: data_) {
+      keys.push_back(entry.first);
+    }
+    vector<fbstring> items;
+    for (auto &key: keys) {
+      if (lookup(key) && globMatch(args[1], key)) {
+        items.push_back(respBulk(key));
+      }
+    }
+    return respArray(items);
+  }
+  if (cmd == "LPUSH" || cmd == "RPUSH") {
+    if (argc < 3) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::LIST) {
+      return respError(kWrongType);
+    }
+    if (!entry) {
+      entry = &data_[args[1]];
+      entry->kind = Kind::LIST;
+    }
+    for (size_t i = 2; i < argc; i++) {
+      if (cmd == "LPUSH") {
+        entry->list.push_front(args[i]);
+      } else {
+        entry->list.push_back(args[i]);
+      }
+    }
+    auto length = entry->list.size();
+    wakeBlocked(args[1]);
+    return respInteger(length);
+  }
+  if (cmd == "LPOP" || cmd == "RPOP") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry) {
+      return respNil();
+    }
+    if (entry->kind != Kind::LIST) {
+      return respError(kWrongType);
+    }
+    string value;
+    if (cmd == "LPOP") {
+      value = entry->list.front();
+      entry->list.pop_front();
+    } else {
+      value = entry->list.back();
+      entry->list.pop_back();
+    }
+    if (entry->list.empty()) {
+      data_.erase(args[1]);
+    }
+    return respBulk(value);
+  }
+  if (cmd == "LLEN") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::LIST) {
+      return respError(kWrongType);
+    }
+    return respInteger(entry ? entry->list.size() : 0);
+  }
+  if (cmd == "LREM") {
+    int64_t count = 0;
+    if (argc != 4) {
+      return wrongArity(cmd);
+    }
+    if (!parseInt(args[2], count)) {
+      return respError(kNotInteger);
+    }
+    auto entry = lookup(args[1]);
+    if (!entry) {
+      return respInteger(0);
+    }
+    if (entry->kind != Kind::LIST) {
+      return respError(kWrongType);
+    }
+    // count > 0 removes from the head, < 0 from the tail, 0 all of them.
+    auto &list = entry->list;
+    size_t limit = count == 0 ? list.size() : std::abs(count);
+    size_t removed = 0;
+    if (count >= 0) {
+      for (auto it = list.begin(); it != list.end() && removed < limit;) {
+        if (*it == args[3]) {
+          it = list.erase(it);
+          removed++;
+        } else {
+          ++it;
+        }
+      }
+    } else {
+      for (auto it = list.end(); it != list.begin() && removed < limit;) {
+        --it;
+        if (*it == args[3]) {
+          it = list.erase(it);
+          removed++;
+        }
+      }
+    }
+    if (list.empty()) {
+      data_.erase(args[1]);
+    }
+    return respInteger(removed);
+  }
+  if (cmd == "LRANGE" || cmd == "LINDEX") {
+    int64_t start = 0;
+    int64_t end = 0;
+    size_t expectedArgc = cmd == "LRANGE" ? 4 : 3;
+    if (argc != expectedArgc) {
+      return wrongArity(cmd);
+    }
+    if (!parseInt(args[2], start) ||
+        (cmd == "LRANGE" && !parseInt(args[3], end))) {
+      return respError(kNotInteger);
+    }
+    if (cmd == "LINDEX") {
+      end = start;
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::LIST) {
+      return respError(kWrongType);
+    }
+    bool inRange = entry && normalizeRange(entry->list.size(), start, end);
+    if (cmd == "LINDEX") {
+      return inRange ? respBulk(entry->list[start]) : respNil();
+    }
+    vector<fbstring> items;
+    if (inRange) {
+      for (int64_t i = start; i <= end; i++) {
+        items.push_back(respBulk(entry->list[i]));
+      }
+    }
+    return respArray(items);
+  }
+  if (cmd == "HSET" || cmd == "HMSET") {
+    if (argc < 4 || argc % 2 != 0) {
+      return wrongArity(cmd);
+    }
+    fbstring error;
+    auto entry = lookupOrCreate(args[1], Kind::HASH, error);
+    if (!entry) {
+      return error;
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i + 1 < argc; i += 2) {
+      added += entry->hash.count(args[i]) ? 0 : 1;
+      entry->hash[args[i]] = args[i + 1];
+    }
+    return cmd == "HSET" ? respInteger(added) : respSimple("OK");
+  }
+  if (cmd == "HGET" || cmd == "HMGET") {
+    if (argc < 3 || (cmd == "HGET" && argc != 3)) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::HASH) {
+      return respError(kWrongType);
+    }
+    vector<fbstring> items;
+    for (size_t i = 2; i < argc; i++) {
+      if (!entry || !entry->hash.count(args[i])) {
+        items.push_back(respNil());
+      } else {
+        items.push_back(respBulk(entry->hash[args[i]]));
+      }
+    }
+    return cmd == "HGET" ? items.front() : respArray(items);
+  }
+  if (cmd == "HGETALL") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::HASH) {
+      return respError(kWrongType);
+    }
+    vector<fbstring> items;
+    if (entry) {
+      for (const auto &field: entry->hash) {
+        items.push_back(respBulk(field.first));
+        items.push_back(respBulk(field.second));
+      }
+    }
+    return respArray(items);
+  }
+  if (cmd == "HLEN") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::HASH) {
+      return respError(kWrongType);
+    }
+    return respInteger(entry ? entry->hash.size() : 0);
+  }
+  if (cmd == "SADD") {
+    if (argc < 3) {
+      return wrongArity(cmd);
+    }
+    fbstring error;
+    auto entry = lookupOrCreate(args[1], Kind::SET, error);
+    if (!entry) {
+      return error;
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < argc; i++) {
+      added += entry->members.insert(args[i]).second ? 1 : 0;
+    }
+    return respInteger(added);
+  }
+  if (cmd == "SMEMBERS" || cmd == "SCARD") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::SET) {
+      return respError(kWrongType);
+    }
+    if (cmd == "SCARD") {
+      return respInteger(entry ? entry->members.size() : 0);
+    }
+    vector<fbstring> items;
+    if (entry) {
+      for (const auto &member: entry->members) {
+        items.push_back(respBulk(member));
+      }
+    }
+    return respArray(items);
+  }
+  if (cmd == "ZADD") {
+    if (argc < 4 || argc % 2 != 0) {
+      return wrongArity(cmd);
+    }
+    vector<pair<double, string>> scored;
+    for (size_t i = 2; i + 1 < argc; i += 2) {
+      try {
+        scored.emplace_back(folly::to<double>(args[i]), args[i + 1]);
+      } catch (const std::exception&) {
+        return respError("ERR value is not a valid float");
+      }
+    }
+    fbstring error;
+    auto entry = lookupOrCreate(args[1], Kind::ZSET, error);
+    if (!entry) {
+      return error;
+    }
+    int64_t added = 0;
+    for (const auto &item: scored) {
+      added += entry->scores.count(item.second) ? 0 : 1;
+      entry->scores[item.second] = item.first;
+    }
+    return respInteger(added);
+  }
+  if (cmd == "ZCARD") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::ZSET) {
+      return respError(kWrongType);
+    }
+    return respInteger(entry ? entry->scores.size() : 0);
+  }
+  if (cmd == "ZRANGE") {
+    int64_t start = 0;
+    int64_t end = 0;
+    if (argc < 4 || argc > 5) {
+      return wrongArity(cmd);
+    }
+    if (!parseInt(args[2], start) || !parseInt(args[3], end)) {
+      return respError(kNotInteger);
+    }
+    string option = argc == 5 ? args[4] : "";
+    std::transform(option.begin(), option.end(), option.begin(), ::toupper);
+    if (argc == 5 && option != "WITHSCORES") {
+      return respError("ERR syntax error");
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::ZSET) {
+      return respError(kWrongType);
+    }
+    vector<pair<double, string>> ordered;
+    if (entry) {
+      for (const auto &member: entry->scores) {
+        ordered.emplace_back(member.second, member.first);
+      }
+    }
+    std::sort(ordered.begin(), ordered.end());
+    vector<fbstring> items;
+    if (normalizeRange(ordered.size(), start, end)) {
+      for (int64_t i = start; i <= end; i++) {
+        items.push_back(respBulk(ordered[i].second));
+        if (argc == 5) {
+          items.push_back(respBulk(folly::to<string>(ordered[i].first)));
+        }
+      }
+    }
+    return respArray(items);
+  }
+  if (cmd == "SUBSCRIBE" || cmd == "UNSUBSCRIBE") {
+    if (cmd == "SUBSCRIBE" && argc < 2) {
+      return wrongArity(cmd);
+    }
+    bool subscribing = cmd == "SUBSCRIBE";
+    vector<string> targets {args.begin() + 1, args.end()};
+    if (!subscribing && targets.empty()) {
+      for (auto &channel: channels_) {
+        if (channel.second.count(conn.getId())) {
+          targets.push_back(channel.first);
+        }
+      }
+    }
+    fbstring response;
+    for (auto &channel: targets) {
+      if (subscribing) {
+        channels_[channel].insert(conn.getId());
+        subscribers_[conn.getId()] = &conn;
+      } else {
+        channels_[channel].erase(conn.getId());
+      }
+      int64_t count = 0;
+      for (auto &entry: channels_) {
+        count += entry.second.count(conn.getId());
+      }
+      response.append(respArray({
+        respBulk(subscribing ? "subscribe" : "unsubscribe"),
+        respBulk(channel),
+        respInteger(count)
+      }));
+    }
+    return response;
+  }
+  if (cmd == "PUBLISH") {
+    if (argc != 3) {
+      return wrongArity(cmd);
+    }
+    int64_t receivers = 0;
+    auto found = channels_.find(args[1]);
+    if (found != channels_.end()) {
+      for (auto subscriberId: found->second) {
+        auto subscriber = subscribers_.find(subscriberId);
+        if (subscriber == subscribers_.end()) {
+          continue;
+        }
+        subscriber->second->push(respArray({
+          respBulk("message"), respBulk(args[1]), respBulk(args[2])
+        }));
+        receivers++;
+      }
+    }
+    return respInteger(receivers);
+  }
+  if (cmd == "LMPOP" || cmd == "BLMPOP" || cmd == "LMOVE" ||
+      cmd == "BLMOVE" || cmd == "BLPOP" || cmd == "BRPOP") {
+    return executeBlockingPop(conn, cmd, args);
+  }
+  if (cmd.size() > 1 && cmd[0] == 'X') {
+    return executeStream(conn, cmd, args);
+  }
+  return respError(folly::to<fbstring>("ERR unknown command '", args[0], "'"));
+}
+
+fbstring FakeRedisServer::executeBlockingPop(Connection &conn,
+    const string &cmd, const args_t &args, bool park) {
+  size_t argc = args.size();
+  bool blocking = cmd[0] == 'B';
+  int64_t timeoutMs = 0;
+  vector<string> keys;
+  auto popOne = [this](const string &key, bool left) {
+    auto &list = data_[key].list;
+    string value;
+    if (left) {
+      value = list.front();
+      list.pop_front();
+    } else {
+      value = list.back();
+      list.pop_back();
+    }
+    if (list.empty()) {
+      data_.erase(key);
+    }
+    return value;
+  };
+
+  if (cmd == "LMPOP" || cmd == "BLMPOP") {
+    size_t idx = blocking ? 2 : 1;
+    int64_t numKeys = 0;
+    int64_t count = 1;
+    if (argc < idx + 3) {
+      return wrongArity(cmd);
+    }
+    if (blocking && !parseTimeout(args[1], timeoutMs)) {
+      return respError(kBadTimeout);
+    }
+    if (!parseInt(args[idx], numKeys) || numKeys <= 0 ||
+        idx + 1 + numKeys >= argc) {
+      return respError("ERR numkeys should be greater than 0");
+    }
+    keys.assign(args.begin() + idx + 1, args.begin() + idx + 1 + numKeys);
+    idx += 1 + numKeys;
+    string where = upperCase(args[idx++]);
+    bool countOk = idx == argc || (idx + 2 == argc &&
+      upperCase(args[idx]) == "COUNT" && parseInt(args[idx + 1], count) &&
+      count > 0);
+    if ((where != "LEFT" && where != "RIGHT") || !countOk) {
+      return respError("ERR syntax error");
+    }
+    for (const auto &key: keys) {
+      auto entry = lookup(key);
+      if (!entry) {
+        continue;
+      }
+      if (entry->kind != Kind::LIST) {
+        return respError(kWrongType);
+      }
+      vector<fbstring> popped;
+      while (popped.size() < (size_t) count && data_.count(key)) {
+        popped.push_back(respBulk(popOne(key, where == "LEFT")));
+      }
+      return respArray({respBulk(key), respArray(popped)});
+    }
+  } else if (cmd == "LMOVE" || cmd == "BLMOVE") {
+    if (argc != (blocking ? 6 : 5)) {
+      return wrongArity(cmd);
+    }
+    if (blocking && !parseTimeout(args[5], timeoutMs)) {
+      return respError(kBadTimeout);
+    }
+    string from = upperCase(args[3]);
+    string to = upperCase(args[4]);
+    if ((from != "LEFT" && from != "RIGHT") ||
+        (to != "LEFT" && to != "RIGHT")) {
+      return respError("ERR syntax error");
+    }
+    auto source = lookup(args[1]);
+    auto destination = lookup(args[2]);
+    if ((source && source->kind != Kind::LIST) ||
+        (destination && destination->kind != Kind::LIST)) {
+      return respError(kWrongType);
+    }
+    keys.push_back(args[1]);
+    if (source) {
+      string value = popOne(args[1], from == "LEFT");
+      auto &target = data_[args[2]];
+      target.kind = Kind::LIST;
+      if (to == "LEFT") {
+        target.list.push_front(value);
+      } else {
+        target.list.push_back(value);
+      }
+      wakeBlocked(args[2]);
+      return respBulk(value);
+    }
+  } else {
+    // BLPOP / BRPOP key [key ...] timeout
+    if (argc < 3) {
+      return wrongArity(cmd);
+    }
+    if (!parseTimeout(args.back(), timeoutMs)) {
+      return respError(kBadTimeout);
+    }
+    keys.assign(args.begin() + 1, args.end() - 1);
+    for (const auto &key: keys) {
+      auto entry = lookup(key);
+      if (!entry) {
+        continue;
+      }
+      if (entry->kind != Kind::LIST) {
+        return respError(kWrongType);
+      }
+      return respArray({respBulk(key), respBulk(popOne(key, cmd == "BLPOP"))});
+    }
+  }
+  if (!blocking) {
+    return respNil();
+  }
+  if (park) {
+    blockOn(conn, args, std::move(keys), timeoutMs);
+  }
+  return fbstring {};
+}
+
+fbstring FakeRedisServer::executeStream(Connection &conn, const string &cmd,
+    const args_t &args, bool park) {
+  size_t argc = args.size();
+  auto now = std::chrono::steady_clock::now();
+  auto groupOf = [this](const string &key,
+      const string &name) -> StreamGroup* {
+    auto entry = lookup(key);
+    if (!entry || entry->kind != Kind::STREAM) {
+      return nullptr;
+    }
+    auto found = entry->groups.find(name);
+    return found == entry->groups.end() ? nullptr : &found->second;
+  };
+  auto noGroup = [&cmd](const string &key, const string &name) {
+    return respError(folly::to<fbstring>("NOGROUP No such key '", key,
+      "' or consumer group '", name, "' in ", cmd));
+  };
+
+  if (cmd == "XADD") {
+    if (argc < 5) {
+      return wrongArity(cmd);
+    }
+    size_t idx = 2;
+    bool makeStream = true;
+    int64_t maxLen = -1;
+    for (;;) {
+      string opt = upperCase(args[idx]);
+      if (opt == "NOMKSTREAM") {
+        makeStream = false;
+        idx++;
+      } else if (opt == "MAXLEN") {
+        idx++;
+        if (idx < argc && (args[idx] == "~" || args[idx] == "=")) {
+          idx++;
+        }
+        if (idx >= argc || !parseInt(args[idx], maxLen) || maxLen < 0) {
+          return respError(kNotInteger);
+        }
+        idx++;
+      } else {
+        break;
+      }
+      if (idx >= argc) {
+        return wrongArity(cmd);
+      }
+    }
+    if (argc - idx < 3 || (argc - idx) % 2 != 1) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::STREAM) {
+      return respError(kWrongType);
+    }
+    if (!entry && !makeStream) {
+      return respNil();
+    }
+    fbstring error;
+    entry = lookupOrCreate(args[1], Kind::STREAM, error);
+    stream_id_t id;
+    if (args[idx] == "*") {
+      uint64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()
+      ).count();
+      const auto &last = entry->lastStreamId;
+      id = ms > last.first ? stream_id_t {ms, 0}
+        : stream_id_t {last.first, last.second + 1};
+    } else if (!parseStreamId(args[idx], id)) {
+      return respError(kInvalidStreamId);
+    } else if (id <= entry->lastStreamId) {
+      return respError("ERR The ID specified in XADD is equal or smaller "
+        "than the target stream top item");
+    }
+    entry->lastStreamId = id;
+    entry->stream[id] = args_t(args.begin() + idx + 1, args.end());
+    while (maxLen >= 0 && entry->stream.size() > (size_t) maxLen) {
+      entry->stream.erase(entry->stream.begin());
+    }
+    wakeBlocked(args[1]);
+    return respBulk(formatStreamId(id));
+  }
+  if (cmd == "XLEN") {
+    if (argc != 2) {
+      return wrongArity(cmd);
+    }
+    auto entry = lookup(args[1]);
+    if (entry && entry->kind != Kind::STREAM) {
+      return respError(kWrongType);
+    }
+    return respInteger(entry ? entry->stream.size() : 0);
+  }
+  if (cmd == "XGROUP") {
+    if (argc < 2 || upperCase(args[1]) != "CREATE") {
+      return respError("ERR the fake server only supports XGROUP CREATE");
+    }
+    if (argc < 5 || argc > 6) {
+      return wrongArity(cmd);
+    }
+    bool makeStream = argc == 6 && upperCase(args[5]) == "MKSTREAM";
+    auto entry = lookup(args[2]);
+    if (entry && entry->kind != Kind::STREAM) {
+      return respError(kWrongType);
+    }
+    if (!entry && !makeStream) {
+      return respError("ERR The XGROUP subcommand requires the key to exist");
+    }
+    fbstring error;
+    entry = lookupOrCreate(args[2], Kind::STREAM, error);
+    if (entry->groups.count(args[3])) {
+      return respError("BUSYGROUP Consumer Group name already exists");
+    }
+    stream_id_t start;
+    if (args[4] == "$") {
+      start = entry->lastStreamId;
+    } else if (!parseStreamId(args[4], start)) {
+      return respError(kInvalidStreamId);
+    }
+    entry->groups[args[3]].lastDelivered = start;
+    return respSimple("OK");
+  }
+  if (cmd == "XREADGROUP") {
+    if (argc < 7 || upperCase(args[1]) != "GROUP") {
+      return respError("ERR syntax error");
+    }
+    const string &groupName = args[2];
+    const string &consumer = args[3];
+    int64_t count = 0;
+    int64_t block = -1;
+    bool noAck = false;
+    size_t idx = 4;
+    for (; idx < argc; idx++) {
+      string opt = upperCase(args[idx]);
+      if (opt == "STREAMS") {
+        break;
+      } else if (opt == "NOACK") {
+        noAck = true;
+      } else if ((opt == "COUNT" || opt == "BLOCK") && idx + 1 < argc) {
+        int64_t &target = opt == "COUNT" ? count : block;
+        if (!parseInt(args[++idx], target) || target < 0) {
+          return respError(kNotInteger);
+        }
+      } else {
+        return respError("ERR syntax error");
+      }
+    }
+    if (idx + 3 != argc) {
+      return respError(idx + 3 > argc ? "ERR syntax error"
+        : "ERR the fake server reads one stream per XREADGROUP");
+    }
+    const string &key = args[idx + 1];
+    auto group = groupOf(key, groupName);
+    if (!group) {
+      return noGroup(key, groupName);
+    }
+    auto entry = lookup(key);
+    size_t limit = count > 0 ? count : entry->stream.size();
+    vector<fbstring> items;
+    if (args[idx + 2] == ">") {
+      auto it = entry->stream.upper_bound(group->lastDelivered);
+      for (; it != entry->stream.end() && items.size() < limit; ++it) {
+        items.push_back(respStreamEntry(it->first, &it->second));
+        group->lastDelivered = it->first;
+        if (!noAck) {
+          auto &pending = group->pending[it->first];
+          pending.consumer = consumer;
+          pending.deliveredAt = now;
+          pending.deliveries = 1;
+        }
+      }
+      if (items.empty()) {
+        if (block < 0) {
+          return respNil();
+        }
+        if (park) {
+          blockOn(conn, args, {key}, block);
+        }
+        return fbstring {};
+      }
+    } else {
+      // this consumer's pending entries after the given ID.
+      stream_id_t after;
+      if (!parseStreamId(args[idx + 2], after)) {
+        return respError(kInvalidStreamId);
+      }
+      auto it = group->pending.upper_bound(after);
+      for (; it != group->pending.end() && items.size() < limit; ++it) {
+        if (it->second.consumer != consumer) {
+          continue;
+        }
+        auto found = entry->stream.find(it->first);
+        bool deleted = found == entry->stream.end();
+        items.push_back(respStreamEntry(it->first,
+          deleted ? nullptr : &found->second));
+      }
+    }
+    return respArray({respArray({respBulk(key), respArray(items)})});
+  }
+  if (cmd == "XACK") {
+    if (argc < 4) {
+      return wrongArity(cmd);
+    }
+    auto group = groupOf(args[1], args[2]);
+    int64_t acked = 0;
+    for (size_t i = 3; i < argc; i++) {
+      stream_id_t id;
+      if (!parseStreamId(args[i], id)) {
+        return respError(kInvalidStreamId);
+      }
+      acked += group ? group->pending.erase(id) : 0;
+    }
+    return respInteger(acked);
+  }
+  if (cmd == "XAUTOCLAIM") {
+    int64_t minIdle = 0;
+    int64_t count = 100;
+    stream_id_t start;
+    if (argc != 6 && argc != 8) {
+      return wrongArity(cmd);
+    }
+    if (!parseInt(args[4], minIdle) || (argc == 8 &&
+        (upperCase(args[6]) != "COUNT" || !parseInt(args[7], count)))) {
+      return respError(kNotInteger);
+    }
+    if (!parseStreamId(args[5], start)) {
+      return respError(kInvalidStreamId);
+    }
+    auto group = groupOf(args[1], args[2]);
+    if (!group) {
+      return noGroup(args[1], args[2]);
+    }
+    auto entry = lookup(args[1]);
+    vector<fbstring> claimed;
+    vector<fbstring> deleted;
+    auto it = group->pending.lower_bound(start);
+    while (it != group->pending.end() &&
+        (int64_t) (claimed.size() + deleted.size()) < count) {
+      if (now - it->second.deliveredAt < std::chrono::milliseconds {minIdle}) {
+        ++it;
+        continue;
+      }
+      auto found = entry->stream.find(it->first);
+      if (found == entry->stream.end()) {
+        deleted.push_back(respBulk(formatStreamId(it->first)));
+        it = group->pending.erase(it);
+        continue;
+      }
+      it->second.consumer = args[3];
+      it->second.deliveredAt = now;
+      it->second.deliveries++;
+      claimed.push_back(respStreamEntry(it->first, &found->second));
+      ++it;
+    }
+    fbstring cursor = it == group->pending.end() ? "0-0"
+      : formatStreamId(it->first);
+    return respArray({
+      respBulk(cursor), respArray(claimed), respArray(deleted)
+    });
+  }
+  if (cmd == "XPENDING") {
+    if (argc != 3) {
+      return respError("ERR the fake server only supports the summary "
+        "form of XPENDING");
+    }
+    auto group = groupOf(args[1], args[2]);
+    if (!group) {
+      return noGroup(args[1], args[2]);
+    }
+    if (group->pending.empty()) {
+      return respArray({respInteger(0), respNil(), respNil(), respNil()});
+    }
+    map<string, int64_t> perConsumer;
+    for (const auto &pending: group->pending) {
+      perConsumer[pending.second.consumer]++;
+    }
+    vector<fbstring> consumers;
+    for (const auto &consumer: perConsumer) {
+      consumers.push_back(respArray({
+        respBulk(consumer.first),
+        respBulk(folly::to<fbstring>(consumer.second))
+      }));
+    }
+    return respArray({
+      respInteger(group->pending.size()),
+      respBulk(formatStreamId(group->pending.begin()->first)),
+      respBulk(formatStreamId(group->pending.rbegin()->first)),
+      respArray(consumers)
+    });
+  }
+  return respError(folly::to<fbstring>("ERR unknown command '", args[0], "'"));
+}
+
+void FakeRedisServer::blockOn(Connection &conn, const args_t &args,
+    vector<string> keys, int64_t timeoutMs) {
+  uint64_t id = conn.getId();
+  uint64_t generation = nextBlockGeneration_++;
+  auto &blocked = blocked_[id];
+  blocked.args = args;
+  blocked.keys = std::move(keys);
+  blocked.generation = generation;
+  if (timeoutMs == 0) {
+    // a zero timeout waits for as long as it takes.
+    return;
+  }
+  std::weak_ptr<bool> alive = aliveToken_;
+  getEventBase()->runAfterDelay([this, alive, id, generation]() {
+    if (alive.expired()) {
+      return;
+    }
+    auto found = blocked_.find(id);
+    if (found != blocked_.end() && found->second.generation == generation) {
+      unblock(id, respNil());
+    }
+  }, timeoutMs);
+}
+
+void FakeRedisServer::wakeBlocked(const string &key) {
+  vector<uint64_t> waiting;
+  for (const auto &blocked: blocked_) {
+    const auto &keys = blocked.second.keys;
+    if (std::find(keys.begin(), keys.end(), key) != keys.end()) {
+      waiting.push_back(blocked.first);
+    }
+  }
+  for (auto id: waiting) {
+    auto blocked = blocked_.find(id);
+    auto conn = connections_.find(id);
+    if (blocked == blocked_.end() || conn == connections_.end()) {
+      continue;
+    }
+    auto args = blocked->second.args;
+    string cmd = upperCase(args[0]);
+    auto reply = cmd == "XREADGROUP"
+      ? executeStream(*conn->second, cmd, args, false)
+      : executeBlockingPop(*conn->second, cmd, args, false);
+    if (!reply.empty()) {
+      unblock(id, std::move(reply));
+    }
+  }
+}
+
+void FakeRedisServer::unblock(uint64_t connectionId, fbstring &&reply) {
+  auto blocked = blocked_.find(connectionId);
+  if (blocked == blocked_.end()) {
+    return;
+  }
+  string cmd = blocked->second.args[0];
+  blocked_.erase(blocked);
+  auto found = connections_.find(connectionId);
+  if (found == connections_.end() || found->second->isClosed()) {
+    return;
+  }
+  auto &conn = *found->second;
+  conn.reply(cmd, std::move(reply));
+  // anything pipelined behind the blocked command.
+  handleInput(conn);
+}
+
+}} // fredis::testing
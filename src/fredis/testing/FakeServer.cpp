@@ -0,0 +1,276 @@
+#include "fredis/testing/FakeServer.h"
+#include <algorithm>
+#include <atomic>
+#include <folly/Baton.h>
+#include <folly/io/IOBuf.h>
+#include <glog/logging.h>
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using fredis::folly_util::EBThread;
+
+namespace fredis { namespace testing {
+
+using Connection = FakeServer::Connection;
+using time_point = std::chrono::steady_clock::time_point;
+
+Connection::Connection(FakeServer *server, uint64_t id,
+    folly::AsyncSocket::UniquePtr socket)
+  : server_(server), id_(id), socket_(std::move(socket)) {
+  evtimer_assign(&timer_, server_->getEventBase()->getLibeventBase(),
+    &Connection::onTimer, this);
+  socket_->setNoDelay(true);
+  socket_->setReadCB(this);
+}
+
+Connection::~Connection() {
+  evtimer_del(&timer_);
+  if (socket_ && !closed_) {
+    socket_->setReadCB(nullptr);
+    socket_->closeNow();
+  }
+}
+
+uint64_t Connection::getId() const {
+  return id_;
+}
+
+bool Connection::isClosed() const {
+  return closed_;
+}
+
+std::string& Connection::input() {
+  return input_;
+}
+
+void Connection::enqueue(time_point readyAt, fbstring &&data) {
+  lastReadyAt_ = readyAt;
+  pending_.push_back(PendingReply {readyAt, std::move(data)});
+}
+
+void Connection::reply(StringPiece command, fbstring &&data) {
+  if (closed_) {
+    return;
+  }
+  auto decision = server_->faults_.decide(command);
+  if (decision.disconnect) {
+    close();
+    return;
+  }
+  // replies leave in order, and each one's service time starts when the
+  // previous one finished, like a single-threaded server.
+  auto readyAt = std::max(std::chrono::steady_clock::now(), lastReadyAt_)
+    + decision.delay;
+  if (decision.partialWrite && data.size() > 1) {
+    size_t half = data.size() / 2;
+    enqueue(readyAt, data.substr(0, half));
+    enqueue(readyAt + decision.partialWriteGap, data.substr(half));
+  } else {
+    enqueue(readyAt, std::move(data));
+  }
+  armTimer();
+}
+
+void Connection::push(fbstring &&data) {
+  if (closed_) {
+    return;
+  }
+  enqueue(std::max(std::chrono::steady_clock::now(), lastReadyAt_),
+    std::move(data));
+  armTimer();
+}
+
+void Connection::armTimer() {
+  if (pending_.empty()) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (pending_.front().readyAt <= now) {
+    flushReady();
+    return;
+  }
+  auto wait = std::chrono::duration_cast<std::chrono::microseconds>(
+    pending_.front().readyAt - now
+  );
+  struct timeval tv;
+  tv.tv_sec = wait.count() / 1000000;
+  tv.tv_usec = wait.count() % 1000000;
+  evtimer_add(&timer_, &tv);
+  timerArmed_ = true;
+}
+
+void Connection::flushReady() {
+  timerArmed_ = false;
+  auto now = std::chrono::steady_clock::now();
+  while (!closed_ && !pending_.empty() && pending_.front().readyAt <= now) {
+    auto &front = pending_.front();
+    socket_->writeChain(nullptr,
+      folly::IOBuf::copyBuffer(front.data.data(), front.data.size()));
+    pending_.pop_front();
+  }
+  if (!closed_ && !pending_.empty()) {
+    armTimer();
+  }
+}
+
+void Connection::onTimer(int, short, void *arg) {
+  auto conn = (Connection*) arg;
+  conn->flushReady();
+}
+
+void Connection::close() {
+  if (closed_) {
+    return;
+  }
+  closed_ = true;
+  evtimer_del(&timer_);
+  pending_.clear();
+  socket_->setReadCB(nullptr);
+  socket_->closeNow();
+  server_->handleClosed(*this);
+
+  // we may be inside one of our own callbacks, so the actual
+  // delete happens on the next loop iteration.
+  auto server = server_;
+  auto id = id_;
+  std::weak_ptr<bool> alive = server_->aliveToken_;
+  server_->getEventBase()->runInLoop([server, id, alive]() {
+    if (alive.lock()) {
+      server->removeConnection(id);
+    }
+  });
+}
+
+void Connection::getReadBuffer(void **bufReturn, size_t *lenReturn) {
+  *bufReturn = (void*) readBuffer_;
+  *lenReturn = sizeof(readBuffer_);
+}
+
+void Connection::readDataAvailable(size_t len) noexcept {
+  input_.append(readBuffer_, len);
+  server_->handleInput(*this);
+}
+
+void Connection::readEOF() noexcept {
+  close();
+}
+
+void Connection::readErr(const folly::AsyncSocketException &ex) noexcept {
+  VLOG(1) << "fake server connection " << id_ << " read error: " << ex.what();
+  close();
+}
+
+FakeServer::FakeServer(uint16_t port)
+  : ebt_(EBThread::createShared()),
+    requestedPort_(port),
+    aliveToken_(std::make_shared<bool>(true)) {}
+
+FakeServer::~FakeServer() {
+  if (ebt_->isRunning()) {
+    stop();
+  }
+}
+
+folly::EventBase* FakeServer::getEventBase() {
+  return ebt_->getBase();
+}
+
+void FakeServer::start() {
+  ebt_->start();
+  folly::Baton<std::atomic> listening;
+  std::string failure;
+  ebt_->runInEventBaseThread([this, &listening, &failure]() {
+    try {
+      serverSocket_ = folly::AsyncServerSocket::newSocket(getEventBase());
+      serverSocket_->bind(folly::SocketAddress("127.0.0.1", requestedPort_));
+      serverSocket_->listen(128);
+      serverSocket_->addAcceptCallback(this, nullptr);
+      serverSocket_->startAccepting();
+      serverSocket_->getAddress(&address_);
+    } catch (const std::exception &ex) {
+      failure = ex.what();
+    }
+    listening.post();
+  });
+  listening.wait();
+  if (!failure.empty()) {
+    stop();
+    throw FakeServerError(failure);
+  }
+}
+
+void FakeServer::stop() {
+  folly::Baton<std::atomic> stopped;
+  ebt_->runInEventBaseThread([this, &stopped]() {
+    if (serverSocket_) {
+      serverSocket_->stopAccepting();
+      serverSocket_.reset();
+    }
+    aliveToken_.reset();
+    connections_.clear();
+    stopped.post();
+  });
+  stopped.wait();
+  ebt_->stop();
+  ebt_->join();
+}
+
+uint16_t FakeServer::getPort() const {
+  return address_.getPort();
+}
+
+const folly::SocketAddress& FakeServer::getAddress() const {
+  return address_;
+}
+
+FaultInjector& FakeServer::getFaultInjector() {
+  return faults_;
+}
+
+void FakeServer::dropConnections() {
+  folly::Baton<std::atomic> dropped;
+  ebt_->runInEventBaseThread([this, &dropped]() {
+    for (auto &entry: connections_) {
+      entry.second->close();
+    }
+    dropped.post();
+  });
+  dropped.wait();
+}
+
+size_t FakeServer::getConnectionCount() {
+  folly::Baton<std::atomic> counted;
+  size_t count = 0;
+  ebt_->runInEventBaseThread([this, &counted, &count]() {
+    for (auto &entry: connections_) {
+      if (!entry.second->isClosed()) {
+        count++;
+      }
+    }
+    counted.post();
+  });
+  counted.wait();
+  return count;
+}
+
+void FakeServer::handleClosed(Connection&) {}
+
+void FakeServer::removeConnection(uint64_t id) {
+  connections_.erase(id);
+}
+
+void FakeServer::connectionAccepted(int fd,
+    const folly::SocketAddress&) noexcept {
+  folly::AsyncSocket::UniquePtr socket {
+    new folly::AsyncSocket(getEventBase(), fd)
+  };
+  auto id = nextConnectionId_++;
+  connections_[id].reset(new Connection {this, id, std::move(socket)});
+}
+
+void FakeServer::acceptError(const std::exception &ex) noexcept {
+  LOG(WARNING) << "fake server accept error: " << ex.what();
+}
+
+}} // fredis::testing
@@ -0,0 +1,90 @@
+#include "fredis/testing/FaultInjector.h"
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+using folly::StringPiece;
+
+namespace fredis { namespace testing {
+
+ServiceTime ServiceTime::constant(micros_t value) {
+  ServiceTime result;
+  result.kind = Kind::CONSTANT;
+  result.low = value;
+  result.high = value;
+  return result;
+}
+
+ServiceTime ServiceTime::uniform(micros_t low, micros_t high) {
+  ServiceTime result;
+  result.kind = Kind::UNIFORM;
+  result.low = std::min(low, high);
+  result.high = std::max(low, high);
+  return result;
+}
+
+ServiceTime ServiceTime::exponential(micros_t mean) {
+  ServiceTime result;
+  result.kind = Kind::EXPONENTIAL;
+  result.low = mean;
+  result.high = mean;
+  return result;
+}
+
+static std::string upperCase(StringPiece piece) {
+  std::string result = piece.str();
+  std::transform(result.begin(), result.end(), result.begin(), ::toupper);
+  return result;
+}
+
+FaultInjector::FaultInjector(uint64_t seed)
+  : engine_(seed) {}
+
+void FaultInjector::setSeed(uint64_t seed) {
+  std::lock_guard<std::mutex> guard {mutex_};
+  engine_.seed(seed);
+}
+
+void FaultInjector::setDefaultProfile(const FaultProfile &profile) {
+  std::lock_guard<std::mutex> guard {mutex_};
+  defaultProfile_ = profile;
+}
+
+void FaultInjector::setCommandProfile(StringPiece command,
+    const FaultProfile &profile) {
+  std::lock_guard<std::mutex> guard {mutex_};
+  commandProfiles_[upperCase(command)] = profile;
+}
+
+void FaultInjector::clear() {
+  std::lock_guard<std::mutex> guard {mutex_};
+  defaultProfile_ = FaultProfile {};
+  commandProfiles_.clear();
+}
+
+FaultDecision FaultInjector::decide(StringPiece command) {
+  std::lock_guard<std::mutex> guard {mutex_};
+  const FaultProfile *profile = &defaultProfile_;
+  auto found = commandProfiles_.find(upperCase(command));
+  if (found != commandProfiles_.end()) {
+    profile = &found->second;
+  }
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  FaultDecision decision;
+  decision.delay = profile->serviceTime.sample(engine_);
+  if (profile->stallProbability > 0 && unit(engine_) < profile->stallProbability) {
+    decision.delay += profile->stallDuration;
+  }
+  if (profile->partialWriteProbability > 0 &&
+      unit(engine_) < profile->partialWriteProbability) {
+    decision.partialWrite = true;
+    decision.partialWriteGap = profile->partialWriteGap;
+  }
+  if (profile->disconnectProbability > 0 &&
+      unit(engine_) < profile->disconnectProbability) {
+    decision.disconnect = true;
+  }
+  return decision;
+}
+
+}} // fredis::testing
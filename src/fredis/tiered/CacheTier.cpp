@@ -0,0 +1,110 @@
+#include "fredis/tiered/CacheTier.h"
+#include <folly/Conv.h>
+#include "fredis/redis/RedisError.h"
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Optional;
+using folly::Unit;
+using fredis::redis::RedisClient;
+using fredis::redis::RedisDynamicResponse;
+using fredis::redis::RedisError;
+
+namespace fredis { namespace tiered {
+
+namespace {
+
+void throwIfError(RedisDynamicResponse &response) {
+  if (response.isType(RedisDynamicResponse::ResponseType::ERROR)) {
+    throw RedisError(response.getErrorString().value().str());
+  }
+}
+
+} // anonymous namespace
+
+CacheTier::CacheTier(const string &name, time_t maxTtl)
+  : name_(name), maxTtl_(maxTtl) {}
+
+const string& CacheTier::getName() const {
+  return name_;
+}
+
+time_t CacheTier::getMaxTtl() const {
+  return maxTtl_;
+}
+
+time_t CacheTier::capTtl(time_t ttl) const {
+  if (maxTtl_ > 0 && (ttl == 0 || ttl > maxTtl_)) {
+    return maxTtl_;
+  }
+  return ttl;
+}
+
+MemcachedTier::MemcachedTier(
+    shared_ptr<memcached::MemcachedAsyncClient> client, const string &name,
+    time_t maxTtl)
+  : CacheTier(name, maxTtl), client_(std::move(client)) {}
+
+shared_ptr<MemcachedTier> MemcachedTier::createShared(
+    shared_ptr<memcached::MemcachedAsyncClient> client, time_t maxTtl,
+    const string &name) {
+  return shared_ptr<MemcachedTier> {
+    new MemcachedTier {std::move(client), name, maxTtl}
+  };
+}
+
+folly::Future<Optional<fbstring>> MemcachedTier::get(StringPiece key) {
+  return client_->get(key);
+}
+
+folly::Future<Unit> MemcachedTier::set(StringPiece key, StringPiece value,
+    time_t ttl) {
+  return client_->set(key, value, ttl);
+}
+
+folly::Future<Unit> MemcachedTier::del(StringPiece key) {
+  return client_->del(key).then([](bool) {});
+}
+
+RedisTier::RedisTier(shared_ptr<RedisClient> client, const string &name,
+    time_t maxTtl)
+  : CacheTier(name, maxTtl), client_(std::move(client)) {}
+
+shared_ptr<RedisTier> RedisTier::createShared(
+    shared_ptr<RedisClient> client, time_t maxTtl, const string &name) {
+  return shared_ptr<RedisTier> {
+    new RedisTier {std::move(client), name, maxTtl}
+  };
+}
+
+folly::Future<Optional<fbstring>> RedisTier::get(StringPiece key) {
+  return client_->get<fbstring>(key.str());
+}
+
+folly::Future<Unit> RedisTier::set(StringPiece key, StringPiece value,
+    time_t ttl) {
+  fbstring encoded;
+  auto compressor = client_->getValueCompressor();
+  if (compressor) {
+    encoded = compressor->encode(key, value);
+    value = encoded;
+  }
+  std::vector<StringPiece> args {"SET", key, value};
+  auto ttlStr = folly::to<fbstring>(ttl);
+  if (ttl > 0) {
+    args.push_back("EX");
+    args.push_back(ttlStr);
+  }
+  return client_->commandArgv(args).then([](RedisDynamicResponse response) {
+    throwIfError(response);
+  });
+}
+
+folly::Future<Unit> RedisTier::del(StringPiece key) {
+  return client_->del(key.str()).then([](RedisDynamicResponse response) {
+    throwIfError(response);
+  });
+}
+
+}} // fredis::tiered
@@ -0,0 +1,332 @@
+#include "fredis/tiered/TieredCache.h"
+#include <chrono>
+#include <folly/Conv.h>
+#include <glog/logging.h>
+
+using namespace std;
+using folly::fbstring;
+using folly::StringPiece;
+using folly::Optional;
+using folly::Try;
+using folly::Unit;
+using folly::makeFuture;
+
+namespace fredis { namespace tiered {
+
+using steady_clock_t = std::chrono::steady_clock;
+using get_future_t = folly::Future<Optional<fbstring>>;
+
+namespace {
+
+uint64_t microsSince(steady_clock_t::time_point startedAt) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    steady_clock_t::now() - startedAt
+  ).count();
+}
+
+double ratio(uint64_t part, uint64_t whole) {
+  return whole == 0 ? 0 : (double) part / (double) whole;
+}
+
+} // anonymous namespace
+
+double TierStats::getHitRatio() const {
+  return ratio(hits, lookups);
+}
+
+double TieredCacheStats::getHitRatio() const {
+  return ratio(hits, hits + misses);
+}
+
+// every tier's answer to a parallel get, in tier order, each unset until
+// it arrives.
+struct TieredCache::ParallelLookup {
+  std::vector<Optional<Try<Optional<fbstring>>>> answers;
+  folly::Promise<Optional<fbstring>> promise;
+  uint64_t writesSeen {0};
+  bool settled {false};
+};
+
+TieredCache::TieredCache(vector<shared_ptr<CacheTier>> tiers,
+    const TieredCacheOptions &options)
+  : tiers_(std::move(tiers)), options_(options),
+    counters_(new TierCounters[tiers_.size()]) {
+  DCHECK(!tiers_.empty());
+}
+
+shared_ptr<TieredCache> TieredCache::createShared(
+    vector<shared_ptr<CacheTier>> tiers, const TieredCacheOptions &options) {
+  if (tiers.empty()) {
+    throw TieredCacheError("a tiered cache needs at least one tier");
+  }
+  for (size_t i = 0; i + 1 < tiers.size(); i++) {
+    if (tiers[i]->getMaxTtl() <= 0) {
+      throw TieredCacheError(folly::to<std::string>("tier '",
+        tiers[i]->getName(), "' is above another tier, so it needs a max ttl"
+      ));
+    }
+  }
+  return shared_ptr<TieredCache> {
+    new TieredCache {std::move(tiers), options}
+  };
+}
+
+const TieredCacheOptions& TieredCache::getOptions() const {
+  return options_;
+}
+
+get_future_t TieredCache::lookup(size_t index, const fbstring &key) {
+  counters_[index].lookups.fetch_add(1, std::memory_order_relaxed);
+  auto startedAt = steady_clock_t::now();
+  auto self = shared_from_this();
+  return tiers_[index]->get(key).then([self, index, startedAt](
+      Try<Optional<fbstring>> result) {
+    auto &counters = self->counters_[index];
+    counters.latency.record(microsSince(startedAt));
+    if (result.hasException()) {
+      counters.errors.fetch_add(1, std::memory_order_relaxed);
+    } else if (result.value().hasValue()) {
+      counters.hits.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      counters.misses.fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::move(result.value());
+  });
+}
+
+get_future_t TieredCache::getSequential(const fbstring &key,
+    uint64_t writesSeen, size_t index, size_t failures,
+    folly::exception_wrapper lastError) {
+  if (index == tiers_.size()) {
+    if (failures == tiers_.size()) {
+      return makeFuture<Optional<fbstring>>(std::move(lastError));
+    }
+    return makeFuture(Optional<fbstring> {});
+  }
+  auto self = shared_from_this();
+  return lookup(index, key).then([self, key, writesSeen, index, failures,
+      lastError](Try<Optional<fbstring>> result) {
+    if (result.hasException()) {
+      return self->getSequential(key, writesSeen, index + 1, failures + 1,
+        result.exception());
+    }
+    if (!result.value().hasValue()) {
+      return self->getSequential(key, writesSeen, index + 1, failures,
+        lastError);
+    }
+    self->backfill(key, result.value().value(), index, writesSeen);
+    return makeFuture(std::move(result.value()));
+  });
+}
+
+get_future_t TieredCache::getParallel(const fbstring &key,
+    uint64_t writesSeen) {
+  auto state = std::make_shared<ParallelLookup>();
+  state->answers.resize(tiers_.size());
+  state->writesSeen = writesSeen;
+  auto future = state->promise.getFuture();
+  auto self = shared_from_this();
+  for (size_t i = 0; i < tiers_.size(); i++) {
+    lookup(i, key).then([self, state, key, i](
+        Try<Optional<fbstring>> result) {
+      state->answers[i] = std::move(result);
+      self->settle(key, *state);
+    });
+  }
+  return future;
+}
+
+void TieredCache::settle(const fbstring &key, ParallelLookup &state) {
+  if (state.settled) {
+    return;
+  }
+  size_t failures = 0;
+  folly::exception_wrapper lastError;
+  for (size_t i = 0; i < state.answers.size(); i++) {
+    auto &answer = state.answers[i];
+    if (!answer.hasValue()) {
+      // a faster tier's hit would still win.
+      return;
+    }
+    if (answer.value().hasException()) {
+      failures++;
+      lastError = answer.value().exception();
+      continue;
+    }
+    auto &found = answer.value().value();
+    if (found.hasValue()) {
+      state.settled = true;
+      backfill(key, found.value(), i, state.writesSeen);
+      state.promise.setValue(found);
+      return;
+    }
+  }
+  state.settled = true;
+  if (failures == state.answers.size()) {
+    state.promise.setException(lastError);
+  } else {
+    state.promise.setValue(Optional<fbstring> {});
+  }
+}
+
+uint64_t TieredCache::beginRead(const fbstring &key) {
+  auto &activity = activity_[key];
+  activity.reads++;
+  return activity.writes;
+}
+
+void TieredCache::endRead(const fbstring &key) {
+  activity_[key].reads--;
+  forgetIfIdle(key);
+}
+
+void TieredCache::beginWrite(const fbstring &key) {
+  auto &activity = activity_[key];
+  activity.writesInFlight++;
+  activity.writes++;
+}
+
+void TieredCache::endWrite(const fbstring &key) {
+  auto &activity = activity_[key];
+  activity.writesInFlight--;
+  activity.writes++;
+  forgetIfIdle(key);
+}
+
+void TieredCache::forgetIfIdle(const fbstring &key) {
+  auto found = activity_.find(key);
+  if (found != activity_.end() && found->second.reads == 0 &&
+      found->second.writesInFlight == 0) {
+    activity_.erase(found);
+  }
+}
+
+folly::Future<Unit> TieredCache::endWriteAfter(const fbstring &key,
+    folly::Future<Unit> write) {
+  auto self = shared_from_this();
+  return write.then([self, key](Try<Unit> result) {
+    self->endWrite(key);
+    return std::move(result.value());
+  });
+}
+
+void TieredCache::backfill(const fbstring &key, const fbstring &value,
+    size_t found, uint64_t writesSeen) {
+  if (!options_.backfill || found == 0) {
+    return;
+  }
+  // the value may predate a write that has since replaced or deleted it
+  // below, and copying it up would outlive that write.
+  auto activity = activity_.find(key);
+  if (activity != activity_.end() && (activity->second.writesInFlight > 0 ||
+      activity->second.writes != writesSeen)) {
+    backfillsSkipped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  auto self = shared_from_this();
+  for (size_t i = 0; i < found; i++) {
+    auto &tier = tiers_[i];
+    auto stored = tier->set(key, value, tier->getMaxTtl());
+    stored.then([self, i](Try<Unit> result) {
+      auto &counters = self->counters_[i];
+      if (result.hasException()) {
+        counters.backfillErrors.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        counters.backfills.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+  }
+}
+
+get_future_t TieredCache::get(StringPiece key) {
+  gets_.fetch_add(1, std::memory_order_relaxed);
+  auto startedAt = steady_clock_t::now();
+  fbstring ownedKey {key.data(), key.size()};
+  auto writesSeen = beginRead(ownedKey);
+  auto found = options_.lookupMode == LookupMode::PARALLEL
+    ? getParallel(ownedKey, writesSeen)
+    : getSequential(ownedKey, writesSeen, 0, 0, folly::exception_wrapper {});
+  auto self = shared_from_this();
+  return found.then([self, ownedKey, startedAt](
+      Try<Optional<fbstring>> result) {
+    self->endRead(ownedKey);
+    self->latency_.record(microsSince(startedAt));
+    if (result.hasValue()) {
+      auto &counter = result.value().hasValue() ? self->hits_ : self->misses_;
+      counter.fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::move(result.value());
+  });
+}
+
+folly::Future<Unit> TieredCache::set(StringPiece key, StringPiece value,
+    time_t ttl) {
+  size_t lowest = tiers_.size() - 1;
+  fbstring ownedKey {key.data(), key.size()};
+  beginWrite(ownedKey);
+  if (options_.writePolicy == WritePolicy::WRITE_THROUGH) {
+    vector<folly::Future<Unit>> writes;
+    for (size_t i = 0; i <= lowest; i++) {
+      writes.push_back(tiers_[i]->set(key, value, tiers_[i]->capTtl(ttl)));
+    }
+    return endWriteAfter(ownedKey,
+      folly::collect(writes).then([](vector<Unit>) {}));
+  }
+  // the upper tiers' copies go only once the new value is in place below
+  // them. a get that read the old value first won't backfill it: the
+  // write counts as in flight from set() until the deletes are done.
+  auto self = shared_from_this();
+  auto &tier = tiers_[lowest];
+  auto stored = tier->set(key, value, tier->capTtl(ttl));
+  return endWriteAfter(ownedKey, stored.then([self, ownedKey, lowest]() {
+    vector<folly::Future<Unit>> deletes;
+    for (size_t i = 0; i < lowest; i++) {
+      deletes.push_back(self->tiers_[i]->del(ownedKey));
+    }
+    return folly::collect(deletes).then([](vector<Unit>) {});
+  }));
+}
+
+folly::Future<Unit> TieredCache::del(StringPiece key) {
+  fbstring ownedKey {key.data(), key.size()};
+  beginWrite(ownedKey);
+  vector<folly::Future<Unit>> deletes;
+  for (auto &tier: tiers_) {
+    deletes.push_back(tier->del(key));
+  }
+  return endWriteAfter(ownedKey,
+    folly::collect(deletes).then([](vector<Unit>) {}));
+}
+
+TieredCacheStats TieredCache::getStats() const {
+  TieredCacheStats result;
+  result.gets = gets_.load();
+  result.hits = hits_.load();
+  result.misses = misses_.load();
+  result.backfillsSkipped = backfillsSkipped_.load();
+  latency_.mergeInto(result.latency);
+  double totalMicros = 0;
+  for (size_t i = 0; i < tiers_.size(); i++) {
+    auto &counters = counters_[i];
+    TierStats tier;
+    tier.name = tiers_[i]->getName();
+    tier.lookups = counters.lookups.load();
+    tier.hits = counters.hits.load();
+    tier.misses = counters.misses.load();
+    tier.errors = counters.errors.load();
+    tier.backfills = counters.backfills.load();
+    tier.backfillErrors = counters.backfillErrors.load();
+    counters.latency.mergeInto(tier.latency);
+    totalMicros += tier.latency.getMean() * tier.latency.getCount();
+    result.tiers.push_back(std::move(tier));
+  }
+  for (auto &tier: result.tiers) {
+    if (totalMicros > 0) {
+      tier.latencyShare =
+        tier.latency.getMean() * tier.latency.getCount() / totalMicros;
+    }
+  }
+  return result;
+}
+
+}} // fredis::tiered